@@ -0,0 +1,477 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <engine.h>
+#include <internal/convert.h>
+#include <internal/upload.h>
+#include "fake_producer.h"
+#include "fake_v4l2.h"
+
+/*
+ * Benchmark application, runs instead of src/main.c. Every combination of format, size & buffer count
+ * is a scenario, results are printed as one JSON object per line. Run it with ENGINE_DISPLAY_DRIVER=headless.
+ * The CPU fallback (every conversion kernel & the PBO upload) is measured once per format & size.
+ * Each scenario runs twice: with frames handed straight to the texture if udmabuf is there, then through
+ * engine_v4l_texture_create & the capture thread from an emulated camera, prefixed v4l_dmabuf_ or v4l_cpu_
+ * depending on whether its buffers could be imported. Without udmabuf, only the latter get numbers.
+ *   --frames=300 --sizes=640x480,1920x1080 --formats=YUYV,NV12 --buffers=2,4,8 --output=file
+ */
+
+#define MAX_SCENARIOS 256
+#define STALL_NS 5000000000u // The emulated camera is given up on if no frame arrives for this long
+
+struct scenario {
+  const char* format;
+  uint32_t fourcc;
+  unsigned width, height;
+  unsigned buffers;
+};
+
+enum source {
+  SOURCE_PRODUCER, // fake_producer, frames are published on the render thread
+  SOURCE_V4L, // fake_v4l2, frames come through the capture thread
+};
+
+enum phase {
+  PHASE_START,
+  PHASE_IMPORT, // Until the import thread delivered the images
+  PHASE_COST, // Update & draw cost, every frame waits for the GPU
+  PHASE_FPS,  // Throughput, nothing waits except for the swap
+};
+
+struct bench {
+  FILE* out;
+  unsigned frames;
+  struct engine_quad_batch* batch;
+
+  size_t scenario_count, current;
+  struct scenario scenario[MAX_SCENARIOS];
+
+  enum source source;
+  const char* prefix; // Of the benchmark names
+  bool cpu; // The texture is converted on the CPU, it has no images to import
+  enum phase phase;
+  unsigned frame;
+  struct fake_producer producer;
+  struct dma_gl_texture* camera;
+  bool pending; // A frame of the emulated camera wasn't bound yet
+  uint64_t update_ns, draw_ns, start_ns, progress_ns;
+};
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void result_begin(struct bench* bench, const char* name){
+  const struct scenario* s = &bench->scenario[bench->current];
+  fprintf(bench->out, "{\"benchmark\":\"%s%s\",\"format\":\"%s\",\"width\":%u,\"height\":%u,\"buffers\":%u",
+    bench->prefix, name, s->format, s->width, s->height, s->buffers);
+}
+
+static void result_unsupported(struct bench* bench, const char* name, const char* reason){
+  result_begin(bench, name);
+  fprintf(bench->out, ",\"status\":\"unsupported\",\"reason\":\"%s\"}\n", reason);
+  fflush(bench->out);
+}
+
+static void result_failed(struct bench* bench, const char* name, const char* reason){
+  result_begin(bench, name);
+  fprintf(bench->out, ",\"status\":\"failed\",\"reason\":\"%s\"}\n", reason);
+  fflush(bench->out);
+}
+
+static void result_ns(struct bench* bench, const char* name, uint64_t total, unsigned count){
+  result_begin(bench, name);
+  fprintf(bench->out, ",\"status\":\"ok\",\"count\":%u,\"ns_per_op\":%.0f}\n", count, (double)total / count);
+  fflush(bench->out);
+}
+
+static struct {
+  char* formats;
+  char* sizes;
+  char* buffers;
+} option;
+
+static int build_scenarios(struct bench* bench){
+  static const struct { const char* name; uint32_t fourcc; } format_list[] = {
+    { "YUYV", ENGINE_FOURCC('Y','U','Y','V') },
+    { "NV12", ENGINE_FOURCC('N','V','1','2') },
+  };
+  for(char* f=strtok(option.formats, ","); f; f=strtok(0, ",")){
+    const char* name = 0;
+    uint32_t fourcc = 0;
+    for(size_t i=0; i<sizeof(format_list)/sizeof(*format_list); i++)
+      if(!strcmp(format_list[i].name, f)){
+        name = format_list[i].name;
+        fourcc = format_list[i].fourcc;
+      }
+    if(!name){
+      fprintf(stderr, "unknown format %s\n", f);
+      return -1;
+    }
+    for(const char* s=option.sizes; s && *s; s=strchr(s, ',') ? strchr(s, ',') + 1 : 0){
+      unsigned width, height;
+      if(sscanf(s, "%ux%u", &width, &height) != 2 || !width || !height || width % 2 || height % 2){
+        fprintf(stderr, "invalid size in %s\n", s);
+        return -1;
+      }
+      for(const char* b=option.buffers; b && *b; b=strchr(b, ',') ? strchr(b, ',') + 1 : 0){
+        unsigned buffers;
+        if(sscanf(b, "%u", &buffers) != 1){
+          fprintf(stderr, "invalid buffer count in %s\n", b);
+          return -1;
+        }
+        if(bench->scenario_count >= MAX_SCENARIOS){
+          fprintf(stderr, "too many scenarios\n");
+          return -1;
+        }
+        bench->scenario[bench->scenario_count++] = (struct scenario){
+          .format = name,
+          .fourcc = fourcc,
+          .width = width,
+          .height = height,
+          .buffers = buffers
+        };
+      }
+    }
+  }
+  return 0;
+}
+
+int engine_init(struct engine* engine, int argc, char* argv[]){
+  struct bench* bench = calloc(1, sizeof(struct bench));
+  if(!bench){
+    perror("calloc failed");
+    goto error;
+  }
+  engine_private_set(engine, bench);
+
+  bench->out = stdout;
+  bench->prefix = "";
+  bench->frames = 300;
+  static char formats[] = "YUYV,NV12";
+  static char sizes[] = "640x480,1920x1080,3840x2160";
+  static char buffers[] = "2,4,8";
+  option.formats = formats;
+  option.sizes = sizes;
+  option.buffers = buffers;
+  for(int i=1; i<argc; i++){
+    if(!strncmp(argv[i], "--frames=", 9)){
+      bench->frames = atoi(argv[i] + 9);
+    }else if(!strncmp(argv[i], "--formats=", 10)){
+      option.formats = argv[i] + 10;
+    }else if(!strncmp(argv[i], "--sizes=", 8)){
+      option.sizes = argv[i] + 8;
+    }else if(!strncmp(argv[i], "--buffers=", 10)){
+      option.buffers = argv[i] + 10;
+    }else if(!strncmp(argv[i], "--output=", 9)){
+      bench->out = fopen(argv[i] + 9, "w");
+      if(!bench->out){
+        perror("fopen");
+        goto error_after_calloc;
+      }
+    }else{
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      goto error_after_calloc;
+    }
+  }
+  if(!bench->frames){
+    fprintf(stderr, "--frames must be at least 1\n");
+    goto error_after_calloc;
+  }
+  if(build_scenarios(bench) == -1)
+    goto error_after_calloc;
+
+  bench->batch = engine_quad_batch_create(engine);
+  if(!bench->batch){
+    fprintf(stderr, "engine_quad_batch_create failed\n");
+    goto error_after_calloc;
+  }
+
+  return 0;
+
+error_after_calloc:
+  if(bench->out && bench->out != stdout)
+    fclose(bench->out);
+  free(bench);
+error:
+  return -1;
+}
+
+static void draw(struct bench* bench){
+  glClear(GL_COLOR_BUFFER_BIT);
+  engine_quad_batch_add(bench->batch, .texture = bench->camera, .x = -1, .y = -1, .width = 2, .height = 2);
+  engine_quad_batch_flush(bench->batch);
+}
+
+static void v4l_start(struct bench* bench, struct engine* engine);
+
+static void scenario_next(struct bench* bench){
+  bench->current++;
+  bench->phase = PHASE_START;
+}
+
+// After the fake producer, the same scenario is run from the emulated camera
+static void scenario_end(struct bench* bench, struct engine* engine){
+  engine_dma_texture_destroy(bench->camera);
+  bench->camera = 0;
+  if(bench->source == SOURCE_PRODUCER){
+    fake_producer_destroy(&bench->producer);
+    v4l_start(bench, engine);
+  }else{
+    fake_v4l2_destroy();
+    scenario_next(bench);
+  }
+}
+
+static uint64_t convert(const struct engine_i_convert_kernel* kernel, const struct engine_i_convert_coefficients* c, const struct scenario* s, const uint8_t* src, uint8_t* dst, size_t dst_pitch){
+  bool yuyv = s->fourcc == ENGINE_FOURCC('Y','U','Y','V');
+  const uint8_t* plane[] = { src, src + s->width * s->height };
+  const uint32_t pitch[] = { yuyv ? s->width * 2 : s->width, s->width };
+  uint64_t start = now_ns();
+  engine_i_convert_frame(kernel, c, s->fourcc, s->width, s->height, plane, pitch, dst, dst_pitch);
+  return now_ns() - start;
+}
+
+static void bench_cpu_fallback(struct bench* bench, struct engine* engine){
+  const struct scenario* s = &bench->scenario[bench->current];
+  unsigned count = bench->frames < 60 ? bench->frames : 60;
+  size_t size = s->fourcc == ENGINE_FOURCC('Y','U','Y','V') ? (size_t)s->width * s->height * 2 : (size_t)s->width * s->height * 3 / 2;
+  size_t dst_pitch = (size_t)s->width * 4;
+  uint8_t* src = malloc(size);
+  uint8_t* reference = malloc(dst_pitch * s->height);
+  uint8_t* dst = malloc(dst_pitch * s->height);
+  if(!src || !reference || !dst){
+    perror("malloc failed");
+    goto end;
+  }
+  uint32_t x = 0x12345678; // xorshift, any noise does
+  for(size_t i=0; i<size; i++){
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    src[i] = x;
+  }
+
+  struct engine_i_convert_coefficients c;
+  engine_i_convert_coefficients(&c, ENGINE_YUV_COLOR_SPACE_BT601, ENGINE_YUV_RANGE_NARROW);
+  const struct engine_i_convert_kernel* kernel[8];
+  size_t kernel_count = engine_i_convert_kernels(kernel, 8);
+  convert(kernel[0], &c, s, src, reference, dst_pitch);
+  for(size_t k=0; k<kernel_count; k++){
+    char name[32];
+    snprintf(name, sizeof(name), "convert_%s", kernel[k]->name);
+    uint64_t total = 0;
+    for(unsigned i=0; i<count; i++)
+      total += convert(kernel[k], &c, s, src, dst, dst_pitch);
+    if(memcmp(reference, dst, dst_pitch * s->height)){
+      result_failed(bench, name, "differs from the scalar kernel");
+      continue;
+    }
+    result_ns(bench, name, total, count);
+  }
+
+  // Conversion straight into the mapped buffer plus starting the copy, like the CPU fallback does every frame
+  struct engine_upload* upload = engine_i_upload_create(engine, s->width, s->height);
+  if(!upload){
+    result_unsupported(bench, "upload", "no pixel buffer objects");
+    goto end;
+  }
+  uint64_t start = now_ns();
+  unsigned i;
+  for(i=0; i<count; i++){
+    size_t pitch;
+    uint8_t* map = engine_i_upload_map(upload, &pitch);
+    if(!map)
+      break;
+    convert(kernel[kernel_count-1], &c, s, src, map, pitch);
+    if(!engine_i_upload_unmap(upload))
+      break;
+  }
+  glFinish();
+  uint64_t end = now_ns();
+  if(i == count){
+    result_ns(bench, "upload", end - start, count);
+  }else{
+    result_failed(bench, "upload", "mapping or unmapping the pixel buffer failed");
+  }
+  engine_i_upload_destroy(upload);
+
+end:
+  free(dst);
+  free(reference);
+  free(src);
+}
+
+static void scenario_start(struct bench* bench, struct engine* engine){
+  const struct scenario* s = &bench->scenario[bench->current];
+  const char* reason = 0;
+  const struct scenario* previous = bench->current ? s - 1 : 0;
+  bench->source = SOURCE_PRODUCER;
+  bench->prefix = "";
+  bench->cpu = false;
+  if(!previous || previous->fourcc != s->fourcc || previous->width != s->width || previous->height != s->height)
+    bench_cpu_fallback(bench, engine);
+  if(fake_producer_init(&bench->producer, s->fourcc, s->width, s->height, s->buffers, &reason) == -1){
+    result_unsupported(bench, "import", reason);
+    v4l_start(bench, engine);
+    return;
+  }
+  bench->start_ns = now_ns();
+  bench->camera = fake_producer_texture_create(engine, &bench->producer);
+  if(!bench->camera){
+    result_unsupported(bench, "import", "EGL can't import these dmabufs");
+    fake_producer_destroy(&bench->producer);
+    v4l_start(bench, engine);
+    return;
+  }
+  engine_dma_texture_pause(bench->camera); // Updates are driven & timed here, not by the main loop
+  bench->phase = PHASE_IMPORT;
+}
+
+// Creating the texture is timed along with importing its buffers, or mapping them for the CPU fallback
+static void v4l_start(struct bench* bench, struct engine* engine){
+  const struct scenario* s = &bench->scenario[bench->current];
+  const char* reason = 0;
+  bench->source = SOURCE_V4L;
+  bench->prefix = "v4l_";
+  bench->pending = false;
+  int fd = fake_v4l2_open(s->fourcc, s->width, s->height, &reason);
+  if(fd == -1){
+    result_unsupported(bench, "create", reason);
+    scenario_next(bench);
+    return;
+  }
+  char device[32];
+  snprintf(device, sizeof(device), "fd:%d", fd);
+  bench->start_ns = now_ns();
+  bench->camera = engine_v4l_texture_create(engine, .device = device, .buffer_count = s->buffers);
+  if(!bench->camera){
+    result_failed(bench, "create", "engine_v4l_texture_create failed");
+    fake_v4l2_destroy();
+    scenario_next(bench);
+    return;
+  }
+  engine_dma_texture_pause(bench->camera);
+  bench->cpu = !bench->camera->import && !bench->camera->image_count;
+  bench->prefix = bench->cpu ? "v4l_cpu_" : "v4l_dmabuf_";
+  bench->progress_ns = now_ns();
+  bench->phase = PHASE_IMPORT;
+}
+
+// The import may happen on another thread, it's timed until the render thread can use the images
+static void import_wait(struct bench* bench, struct engine* engine){
+  glFinish();
+  engine_dma_texture_update(bench->camera);
+  if(bench->camera->import)
+    return;
+  if(!bench->cpu && !bench->camera->image_count){
+    result_failed(bench, "import", "importing the buffers failed");
+    scenario_end(bench, engine);
+    return;
+  }
+  const struct scenario* s = &bench->scenario[bench->current];
+  result_ns(bench, bench->cpu ? "create" : "import", now_ns() - bench->start_ns, s->buffers);
+  bench->phase = PHASE_COST;
+  bench->frame = 0;
+  bench->update_ns = 0;
+  bench->draw_ns = 0;
+}
+
+static void produce(struct bench* bench){
+  if(bench->source == SOURCE_PRODUCER){
+    fake_producer_frame(&bench->producer);
+  }else if(!bench->pending){
+    bench->pending = fake_v4l2_frame();
+  }
+}
+
+// The fake producer's frames are there right away. The emulated camera's go through the capture thread,
+// only updates which bound one are counted.
+static bool update(struct bench* bench){
+  int ret = engine_dma_texture_update(bench->camera);
+  if(bench->source == SOURCE_PRODUCER)
+    return true;
+  if(ret > 0){
+    bench->pending = false;
+    bench->progress_ns = now_ns();
+  }
+  return ret > 0;
+}
+
+bool engine_main_loop(struct engine* engine){
+  struct bench* bench = engine_private_get(engine);
+
+  if(bench->phase == PHASE_START){
+    if(bench->current >= bench->scenario_count)
+      return false;
+    scenario_start(bench, engine);
+    return true;
+  }
+
+  if(bench->phase == PHASE_IMPORT){
+    import_wait(bench, engine);
+    return true;
+  }
+
+  produce(bench);
+
+  if(bench->source == SOURCE_V4L && now_ns() - bench->progress_ns > STALL_NS){
+    result_failed(bench, bench->phase == PHASE_COST ? "update" : "fps", "the camera stopped delivering frames");
+    scenario_end(bench, engine);
+    return true;
+  }
+
+  if(bench->phase == PHASE_COST){
+    uint64_t t0 = now_ns();
+    if(!update(bench))
+      return true;
+    uint64_t t1 = now_ns();
+    draw(bench);
+    glFinish();
+    uint64_t t2 = now_ns();
+    bench->update_ns += t1 - t0;
+    bench->draw_ns += t2 - t1;
+    if(++bench->frame == bench->frames){
+      result_ns(bench, "update", bench->update_ns, bench->frames);
+      result_ns(bench, "draw", bench->draw_ns, bench->frames);
+      bench->phase = PHASE_FPS;
+      bench->frame = 0;
+      bench->start_ns = now_ns();
+    }
+  }else{
+    if(!update(bench))
+      return true;
+    draw(bench);
+    if(++bench->frame == bench->frames){
+      glFinish();
+      double seconds = (now_ns() - bench->start_ns) / 1e9;
+      result_begin(bench, "fps");
+      fprintf(bench->out, ",\"status\":\"ok\",\"count\":%u,\"fps\":%.1f}\n", bench->frames, bench->frames / seconds);
+      fflush(bench->out);
+      scenario_end(bench, engine);
+    }
+  }
+
+  return true;
+}
+
+void engine_cleanup(struct engine* engine){
+  struct bench* bench = engine_private_get(engine);
+  if(!bench)
+    return;
+  if(bench->camera){
+    engine_dma_texture_destroy(bench->camera);
+    if(bench->source == SOURCE_PRODUCER){
+      fake_producer_destroy(&bench->producer);
+    }else{
+      fake_v4l2_destroy();
+    }
+  }
+  if(bench->out != stdout)
+    fclose(bench->out);
+  engine_quad_batch_destroy(bench->batch);
+  free(bench);
+}
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <linux/udmabuf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <internal/trace.h>
+#include "fake_producer.h"
+
+static size_t page_align(size_t size){
+  long page = sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+// Some recognisable content: luma ramps, chroma at mid level
+static void fill(struct fake_producer* fp, void* mem, unsigned index){
+  const struct engine_dmabuf* b = &fp->buffer[index];
+  unsigned char* p = mem;
+  if(fp->fourcc == ENGINE_FOURCC('Y','U','Y','V')){
+    for(unsigned y=0; y<fp->height; y++)
+      for(unsigned x=0; x<fp->width; x++){
+        p[y*b->plane[0].pitch + x*2] = x + y + index * 32;
+        p[y*b->plane[0].pitch + x*2 + 1] = 128;
+      }
+  }else{
+    for(unsigned y=0; y<fp->height; y++)
+      memset(p + y*b->plane[0].pitch, (y + index * 32) & 0xFF, fp->width);
+    memset(p + b->plane[1].offset, 128, b->plane[1].pitch * (fp->height / 2));
+  }
+}
+
+int fake_producer_init(struct fake_producer* fp, uint32_t fourcc, unsigned width, unsigned height, unsigned count, const char** reason){
+  memset(fp, 0, sizeof(*fp));
+  for(unsigned i=0; i<ENGINE_MAX_BUFFERS; i++)
+    fp->memfd[i] = fp->dmabuf[i] = -1;
+  if(count < 1 || count > ENGINE_MAX_BUFFERS){
+    *reason = "invalid buffer count";
+    return -1;
+  }
+  fp->fourcc = fourcc;
+  fp->width = width;
+  fp->height = height;
+
+  struct engine_dmabuf layout = {
+    .fourcc = fourcc,
+    .width = width,
+    .height = height,
+    .modifier = ENGINE_DRM_FORMAT_MOD_LINEAR,
+    .color_space = ENGINE_YUV_COLOR_SPACE_BT601,
+    .range = ENGINE_YUV_RANGE_NARROW
+  };
+  if(fourcc == ENGINE_FOURCC('Y','U','Y','V')){
+    layout.plane_count = 1;
+    layout.plane[0].pitch = width * 2;
+    fp->size = page_align(width * 2 * height);
+  }else if(fourcc == ENGINE_FOURCC('N','V','1','2')){
+    layout.plane_count = 2;
+    layout.plane[0].pitch = width;
+    layout.plane[1].offset = width * height;
+    layout.plane[1].pitch = width;
+    fp->size = page_align(width * height * 3 / 2);
+  }else{
+    *reason = "format not supported by the fake producer";
+    return -1;
+  }
+
+  int dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+  if(dev == -1){
+    *reason = "/dev/udmabuf not available";
+    return -1;
+  }
+
+  for(unsigned i=0; i<count; i++){
+    fp->count = i + 1;
+    fp->memfd[i] = memfd_create("fake-frame", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+    if(fp->memfd[i] == -1 || ftruncate(fp->memfd[i], fp->size) == -1 || fcntl(fp->memfd[i], F_ADD_SEALS, F_SEAL_SHRINK) == -1){
+      *reason = "creating memfd failed";
+      goto error;
+    }
+    fp->dmabuf[i] = ioctl(dev, UDMABUF_CREATE, &(struct udmabuf_create){
+      .memfd = fp->memfd[i],
+      .flags = UDMABUF_FLAGS_CLOEXEC,
+      .offset = 0,
+      .size = fp->size
+    });
+    if(fp->dmabuf[i] == -1){
+      *reason = "UDMABUF_CREATE failed";
+      goto error;
+    }
+    fp->buffer[i] = layout;
+    for(unsigned j=0; j<layout.plane_count; j++)
+      fp->buffer[i].plane[j].fd = fp->dmabuf[i];
+    void* mem = mmap(0, fp->size, PROT_READ | PROT_WRITE, MAP_SHARED, fp->memfd[i], 0);
+    if(mem == MAP_FAILED){
+      *reason = "mmap failed";
+      goto error;
+    }
+    fill(fp, mem, i);
+    munmap(mem, fp->size);
+  }
+
+  close(dev);
+  fp->stream.fd = -1;
+  fp->stream.count = count;
+  for(unsigned i=0; i<count; i++){
+    fp->stream.dmabuf[i] = -1; // Nobody writes to them while the GPU reads, implicit sync isn't needed
+    fp->stream.fence_fd[i] = -1;
+    fp->stream.fence[i] = EGL_NO_SYNC_KHR;
+  }
+  return 0;
+
+error:
+  close(dev);
+  fake_producer_destroy(fp);
+  return -1;
+}
+
+struct dma_gl_texture* fake_producer_texture_create(struct engine* engine, struct fake_producer* fp){
+  struct dma_gl_texture* dgt = engine_dma_texture_create(engine, fp->count, fp->buffer);
+  if(!dgt)
+    return 0;
+  atomic_init(&fp->stream.ready, 0);
+  atomic_init(&fp->stream.released, 0);
+  atomic_init(&fp->stream.starving, false);
+  fp->stream.out = 0;
+  fp->releasing = 0;
+  fp->next = 0;
+  fp->engine = engine;
+  dgt->update_callback = engine_i_capture_texture_update;
+  dgt->release_callback = engine_i_capture_texture_release;
+  dgt->update_param.vptr = &fp->stream;
+  return dgt;
+}
+
+void fake_producer_frame(struct fake_producer* fp){
+  struct capture_stream* stream = &fp->stream;
+  // Like the capture thread, only reuse buffers once the GPU is done with them
+  fp->releasing |= atomic_exchange(&stream->released, 0);
+  for(unsigned i=0; i<fp->count; i++){
+    if(!(fp->releasing & (1u << i)) || !engine_i_capture_fence_signaled(fp->engine->display, stream, i))
+      continue;
+    fp->releasing &= ~(1u << i);
+    stream->out &= ~(1u << i);
+  }
+  // Like the driver, fill the next buffer that isn't in use
+  for(unsigned i=0; i<fp->count; i++){
+    unsigned index = (fp->next + i) % fp->count;
+    if(stream->out & (1u << index))
+      continue;
+    fp->next = index + 1;
+    stream->out |= 1u << index;
+    uint64_t now = engine_i_time_ns();
+    stream->frame[index] = (struct engine_frame_info){
+      .sensor_ns = now,
+      .dequeue_ns = now,
+      .sequence = fp->sequence++
+    };
+    unsigned previous = atomic_exchange(&stream->ready, index + 1);
+    if(previous && previous - 1 != index)
+      stream->out &= ~(1u << (previous - 1));
+    return;
+  }
+}
+
+void fake_producer_destroy(struct fake_producer* fp){
+  if(fp->engine)
+    engine_i_capture_fences_destroy(fp->engine->display, &fp->stream);
+  fp->engine = 0;
+  for(unsigned i=0; i<fp->count; i++){
+    if(fp->dmabuf[i] != -1)
+      close(fp->dmabuf[i]);
+    if(fp->memfd[i] != -1)
+      close(fp->memfd[i]);
+    fp->dmabuf[i] = fp->memfd[i] = -1;
+  }
+  fp->count = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef DENG_BENCH_FAKE_PRODUCER_H
+#define DENG_BENCH_FAKE_PRODUCER_H
+
+#include <engine.h>
+#include <internal/engine.h>
+#include <internal/capture.h>
+
+/*
+ * Stands in for a V4L2 device & the capture thread: frames live in memfds turned into dmabufs with udmabuf,
+ * and are handed to the texture through a capture_stream, so updates go through the same code as a camera.
+ * Everything happens synchronously on the calling thread, to keep runs deterministic.
+ */
+struct fake_producer {
+  uint32_t fourcc;
+  unsigned width, height;
+  unsigned count;
+  size_t size;
+  int memfd[ENGINE_MAX_BUFFERS];
+  int dmabuf[ENGINE_MAX_BUFFERS];
+  struct engine_dmabuf buffer[ENGINE_MAX_BUFFERS];
+  struct engine* engine;
+  struct capture_stream stream;
+  uint32_t releasing; // Released, but the GPU may still be reading them
+  unsigned next;
+  uint32_t sequence;
+};
+
+// Returns -1 & sets reason if this machine can't provide dmabufs
+int fake_producer_init(struct fake_producer* fp, uint32_t fourcc, unsigned width, unsigned height, unsigned count, const char** reason);
+struct dma_gl_texture* fake_producer_texture_create(struct engine* engine, struct fake_producer* fp);
+void fake_producer_frame(struct fake_producer* fp); // Publishes the next frame, like the capture thread would
+void fake_producer_destroy(struct fake_producer* fp);
+
+#endif
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <linux/videodev2.h>
+#include <linux/udmabuf.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <engine.h>
+#include "fake_v4l2.h"
+
+int __real_ioctl(int fd, unsigned long request, ...);
+void* __real_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_fstat(int fd, struct stat* st);
+int __real_close(int fd);
+
+enum {
+  BUFFER_QUEUED = 1, // Waiting to be filled
+  BUFFER_DONE = 2 // Filled, waiting to be dequeued
+};
+
+static struct {
+  pthread_mutex_t lock;
+  atomic_int fd; // eventfd standing in for the device, readable while buffers are done. -1 if closed.
+  int memfd; // All buffers, one after the other. -1 without buffers.
+  int udmabuf; // -1 if buffers can't be exported
+  uint32_t pixelformat;
+  unsigned width, height, pitch;
+  size_t frame_size, size; // size is page aligned, it's the distance between buffers
+  unsigned count;
+  bool streaming;
+  unsigned state[VIDEO_MAX_FRAME];
+  struct timeval timestamp[VIDEO_MAX_FRAME];
+  uint32_t buffer_sequence[VIDEO_MAX_FRAME];
+  unsigned queue[VIDEO_MAX_FRAME], queued; // Oldest first
+  unsigned done[VIDEO_MAX_FRAME], filled;
+  uint32_t sequence;
+} dev = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .memfd = -1, .udmabuf = -1 };
+
+// Some recognisable content: luma ramps, chroma at mid level
+static void fill(unsigned char* p, unsigned index){
+  if(dev.pixelformat == V4L2_PIX_FMT_YUYV){
+    for(unsigned y=0; y<dev.height; y++)
+      for(unsigned x=0; x<dev.width; x++){
+        p[y*dev.pitch + x*2] = x + y + index * 32;
+        p[y*dev.pitch + x*2 + 1] = 128;
+      }
+  }else{
+    for(unsigned y=0; y<dev.height; y++)
+      memset(p + y*dev.pitch, (y + index * 32) & 0xFF, dev.width);
+    memset(p + dev.pitch * dev.height, 128, dev.pitch * (dev.height / 2));
+  }
+}
+
+static void buffers_free(void){
+  if(dev.memfd != -1)
+    __real_close(dev.memfd); // Mappings the engine still has stay valid
+  dev.memfd = -1;
+  dev.count = 0;
+}
+
+static int buffers_alloc(unsigned count){
+  dev.memfd = memfd_create("fake-v4l2", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+  if(dev.memfd == -1)
+    return -1;
+  if(ftruncate(dev.memfd, dev.size * count) == -1 || fcntl(dev.memfd, F_ADD_SEALS, F_SEAL_SHRINK) == -1)
+    goto error;
+  unsigned char* mem = __real_mmap(0, dev.size * count, PROT_READ | PROT_WRITE, MAP_SHARED, dev.memfd, 0);
+  if(mem == MAP_FAILED)
+    goto error;
+  for(unsigned i=0; i<count; i++)
+    fill(mem + dev.size * i, i);
+  munmap(mem, dev.size * count);
+  dev.count = count;
+  memset(dev.state, 0, sizeof(dev.state));
+  return 0;
+
+error:
+  buffers_free();
+  return -1;
+}
+
+static void drain(void){
+  uint64_t value;
+  while(read(dev.fd, &value, sizeof(value)) > 0);
+}
+
+static void format(struct v4l2_format* fmt){
+  struct v4l2_pix_format* pix = &fmt->fmt.pix;
+  memset(&fmt->fmt, 0, sizeof(fmt->fmt));
+  pix->width = dev.width;
+  pix->height = dev.height;
+  pix->pixelformat = dev.pixelformat;
+  pix->field = V4L2_FIELD_NONE;
+  pix->bytesperline = dev.pitch;
+  pix->sizeimage = dev.frame_size;
+  pix->colorspace = V4L2_COLORSPACE_SMPTE170M;
+  pix->quantization = V4L2_QUANTIZATION_LIM_RANGE;
+}
+
+static int buffer_check(const struct v4l2_buffer* buf){
+  if(buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->memory != V4L2_MEMORY_MMAP || buf->index >= dev.count){
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+static void buffer_describe(struct v4l2_buffer* buf){
+  unsigned i = buf->index;
+  buf->length = dev.frame_size;
+  buf->m.offset = dev.size * i;
+  buf->field = V4L2_FIELD_NONE;
+  buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+  if(dev.state[i] == BUFFER_QUEUED)
+    buf->flags |= V4L2_BUF_FLAG_QUEUED;
+  if(dev.state[i] == BUFFER_DONE)
+    buf->flags |= V4L2_BUF_FLAG_DONE;
+}
+
+// Like a driver supporting one format & size, without cropping, frame intervals or events
+static int device_ioctl(unsigned long request, void* arg){
+  switch(request){
+    case VIDIOC_QUERYCAP: {
+      struct v4l2_capability* cap = arg;
+      memset(cap, 0, sizeof(*cap));
+      strcpy((char*)cap->driver, "fake_v4l2");
+      strcpy((char*)cap->card, "Benchmark camera");
+      cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+      cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+      return 0;
+    }
+    case VIDIOC_ENUM_FMT: {
+      struct v4l2_fmtdesc* desc = arg;
+      if(desc->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || desc->index)
+        break;
+      desc->pixelformat = dev.pixelformat;
+      return 0;
+    }
+    case VIDIOC_ENUM_FRAMESIZES: {
+      struct v4l2_frmsizeenum* size = arg;
+      if(size->index || size->pixel_format != dev.pixelformat)
+        break;
+      size->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+      size->discrete.width = dev.width;
+      size->discrete.height = dev.height;
+      return 0;
+    }
+    case VIDIOC_G_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT: {
+      struct v4l2_format* fmt = arg;
+      if(fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        break;
+      if(request == VIDIOC_S_FMT && dev.count){
+        errno = EBUSY;
+        return -1;
+      }
+      format(fmt); // Whatever was asked for, this is what the driver can do
+      return 0;
+    }
+    case VIDIOC_REQBUFS: {
+      struct v4l2_requestbuffers* reqbuf = arg;
+      if(reqbuf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || reqbuf->memory != V4L2_MEMORY_MMAP)
+        break;
+      if(dev.streaming){
+        errno = EBUSY;
+        return -1;
+      }
+      buffers_free();
+      if(reqbuf->count > VIDEO_MAX_FRAME)
+        reqbuf->count = VIDEO_MAX_FRAME;
+      if(reqbuf->count && buffers_alloc(reqbuf->count) == -1){
+        errno = ENOMEM;
+        return -1;
+      }
+      return 0;
+    }
+    case VIDIOC_QUERYBUF: {
+      struct v4l2_buffer* buf = arg;
+      if(buffer_check(buf) == -1)
+        return -1;
+      buffer_describe(buf);
+      return 0;
+    }
+    case VIDIOC_EXPBUF: {
+      struct v4l2_exportbuffer* expbuf = arg;
+      if(dev.udmabuf == -1){
+        errno = ENOTTY;
+        return -1;
+      }
+      if(expbuf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || expbuf->index >= dev.count || expbuf->plane)
+        break;
+      int fd = __real_ioctl(dev.udmabuf, UDMABUF_CREATE, &(struct udmabuf_create){
+        .memfd = dev.memfd,
+        .flags = UDMABUF_FLAGS_CLOEXEC,
+        .offset = dev.size * expbuf->index,
+        .size = dev.size
+      });
+      if(fd == -1)
+        return -1;
+      expbuf->fd = fd;
+      return 0;
+    }
+    case VIDIOC_QBUF: {
+      struct v4l2_buffer* buf = arg;
+      if(buffer_check(buf) == -1)
+        return -1;
+      if(dev.state[buf->index])
+        break;
+      dev.state[buf->index] = BUFFER_QUEUED;
+      dev.queue[dev.queued++] = buf->index;
+      return 0;
+    }
+    case VIDIOC_DQBUF: {
+      struct v4l2_buffer* buf = arg;
+      if(buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        break;
+      if(!dev.filled){
+        errno = EAGAIN;
+        return -1;
+      }
+      uint64_t value;
+      if(read(dev.fd, &value, sizeof(value)) == -1)
+        return -1;
+      buf->index = dev.done[0];
+      memmove(dev.done, dev.done + 1, --dev.filled * sizeof(*dev.done));
+      dev.state[buf->index] = 0;
+      buffer_describe(buf);
+      buf->bytesused = dev.frame_size;
+      buf->timestamp = dev.timestamp[buf->index];
+      buf->sequence = dev.buffer_sequence[buf->index];
+      return 0;
+    }
+    case VIDIOC_STREAMON:
+      dev.streaming = true;
+      return 0;
+    case VIDIOC_STREAMOFF:
+      // All buffers are dequeued, done or not
+      dev.streaming = false;
+      dev.queued = dev.filled = 0;
+      memset(dev.state, 0, sizeof(dev.state));
+      drain();
+      return 0;
+    default:
+      errno = ENOTTY;
+      return -1;
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...){
+  va_list args;
+  va_start(args, request);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+  if(fd == -1 || fd != atomic_load(&dev.fd))
+    return __real_ioctl(fd, request, arg);
+  pthread_mutex_lock(&dev.lock);
+  int ret = device_ioctl(request, arg);
+  pthread_mutex_unlock(&dev.lock);
+  return ret;
+}
+
+void* __wrap_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset){
+  if(fd == -1 || fd != atomic_load(&dev.fd))
+    return __real_mmap(addr, length, prot, flags, fd, offset);
+  pthread_mutex_lock(&dev.lock);
+  int memfd = dev.memfd;
+  bool valid = offset >= 0 && (size_t)offset + length <= dev.size * dev.count;
+  pthread_mutex_unlock(&dev.lock);
+  if(memfd == -1 || !valid){
+    errno = EINVAL;
+    return MAP_FAILED;
+  }
+  return __real_mmap(addr, length, prot, flags, memfd, offset);
+}
+
+int __wrap_fstat(int fd, struct stat* st){
+  if(fd == -1 || fd != atomic_load(&dev.fd))
+    return __real_fstat(fd, st);
+  memset(st, 0, sizeof(*st));
+  st->st_mode = S_IFCHR | 0660;
+  st->st_rdev = makedev(81, 0);
+  return 0;
+}
+
+int __wrap_close(int fd){
+  int expected = fd;
+  if(fd != -1)
+    atomic_compare_exchange_strong(&dev.fd, &expected, -1);
+  return __real_close(fd);
+}
+
+int fake_v4l2_open(uint32_t fourcc, unsigned width, unsigned height, const char** reason){
+  fake_v4l2_destroy();
+  if(fourcc == V4L2_PIX_FMT_YUYV){
+    dev.pitch = width * 2;
+    dev.frame_size = (size_t)dev.pitch * height;
+  }else if(fourcc == V4L2_PIX_FMT_NV12){
+    dev.pitch = width;
+    dev.frame_size = (size_t)dev.pitch * height * 3 / 2;
+  }else{
+    *reason = "format not supported by the fake V4L2 device";
+    return -1;
+  }
+  long page = sysconf(_SC_PAGESIZE);
+  dev.size = (dev.frame_size + page - 1) / page * page;
+  dev.pixelformat = fourcc;
+  dev.width = width;
+  dev.height = height;
+  dev.streaming = false;
+  dev.queued = dev.filled = 0;
+  dev.sequence = 0;
+  int fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+  if(fd == -1){
+    *reason = "creating eventfd failed";
+    return -1;
+  }
+  dev.udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+  atomic_store(&dev.fd, fd);
+  return fd;
+}
+
+bool fake_v4l2_frame(void){
+  pthread_mutex_lock(&dev.lock);
+  bool filled = dev.streaming && dev.queued && atomic_load(&dev.fd) != -1;
+  if(filled){
+    unsigned index = dev.queue[0];
+    memmove(dev.queue, dev.queue + 1, --dev.queued * sizeof(*dev.queue));
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    dev.timestamp[index] = (struct timeval){ .tv_sec = ts.tv_sec, .tv_usec = ts.tv_nsec / 1000 };
+    dev.buffer_sequence[index] = dev.sequence++;
+    dev.state[index] = BUFFER_DONE;
+    dev.done[dev.filled++] = index;
+    if(write(dev.fd, &(uint64_t){1}, sizeof(uint64_t)) == -1)
+      filled = false;
+  }
+  pthread_mutex_unlock(&dev.lock);
+  return filled;
+}
+
+void fake_v4l2_destroy(void){
+  pthread_mutex_lock(&dev.lock);
+  int fd = atomic_exchange(&dev.fd, -1);
+  if(fd != -1)
+    __real_close(fd);
+  buffers_free();
+  if(dev.udmabuf != -1)
+    __real_close(dev.udmabuf);
+  dev.udmabuf = -1;
+  pthread_mutex_unlock(&dev.lock);
+}
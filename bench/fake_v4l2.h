@@ -0,0 +1,20 @@
+#ifndef DENG_BENCH_FAKE_V4L2_H
+#define DENG_BENCH_FAKE_V4L2_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A V4L2 capture device emulated in process, so engine_v4l_texture_create & the capture thread can be measured
+ * without a camera. The binary is linked with --wrap for ioctl, mmap, fstat & close, calls on the device fd end up here.
+ * Buffers live in one memfd. They are exported with udmabuf if it's there, otherwise VIDIOC_EXPBUF fails
+ * & the engine converts them on the CPU. There is one device at a time.
+ */
+
+// Returns the fd to open as "fd:<n>", the engine closes it. Returns -1 & sets reason on failure.
+int fake_v4l2_open(uint32_t fourcc, unsigned width, unsigned height, const char** reason);
+// Fills the oldest queued buffer, like the driver would. Returns false if none is queued.
+bool fake_v4l2_frame(void);
+void fake_v4l2_destroy(void);
+
+#endif
@@ -2,8 +2,14 @@
 #define DENG_ENGINE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <GLES2/gl2.h>
 
+#define ENGINE_FOURCC(A,B,C,D) ((uint32_t)(A) | ((uint32_t)(B) << 8) | ((uint32_t)(C) << 16) | ((uint32_t)(D) << 24))
+#define ENGINE_DMABUF_MAX_PLANES 4
+#define ENGINE_DRM_FORMAT_MOD_LINEAR 0ull
+#define ENGINE_DRM_FORMAT_MOD_INVALID 0x00ffffffffffffffull // Let the driver figure out the layout
+
 struct engine;
 struct dma_gl_texture;
 
@@ -16,6 +22,7 @@ struct shader {
 struct engine_load_create_shader_program_params {
   const char* fragment_shader;
   const char* vertex_shader;
+  const char* defines; // Inserted after the #version line of both shaders, like "#define SAMPLER sampler2D\n"
 };
 
 int engine_init(struct engine* engine, int argc, char* argv[]);
@@ -25,12 +32,175 @@ void engine_cleanup(struct engine* engine);
 void engine_private_set(struct engine* engine, void* x);
 void* engine_private_get(struct engine* engine);
 
+enum engine_redraw_policy {
+  ENGINE_REDRAW_ALWAYS, // engine_main_loop is called for every frame (the default)
+  ENGINE_REDRAW_ON_CHANGE // The frame only depends on the textures, drawing is skipped until one of them changes
+};
+
+void engine_redraw_policy_set(struct engine* engine, enum engine_redraw_policy policy);
+void engine_redraw_request(struct engine* engine); // Draw the next frame even if no texture changed
+// Adds a rectangle of the surface that changed this frame, in pixels, origin at the bottom left.
+// Only used with ENGINE_REDRAW_ON_CHANGE, where it limits what the compositor has to recompose.
+void engine_damage_add(struct engine* engine, int x, int y, int width, int height);
+// Called from engine_main_loop instead of drawing, when the frame is nothing but this texture, unmodified.
+// x, y, width & height are like in struct engine_quad. Display drivers which can hand the buffer straight to the
+// compositor do so, then nothing is drawn or swapped. Otherwise, the engine draws it on black.
+void engine_passthrough(struct engine* engine, struct dma_gl_texture* texture, float x, float y, float width, float height);
+// Measures how long the GPU takes for the commands between begin & end, shown per name on the statistics page
+// (ENGINE_STATS). Scopes can't nest, inner ones are ignored. Results arrive a few frames later, nothing waits for
+// the GPU. Does nothing without statistics. The name has to stay valid until engine_cleanup.
+void engine_gpu_scope_begin(struct engine* engine, const char* name);
+void engine_gpu_scope_end(struct engine* engine);
+
 GLuint engine_load_shader(const char* path);
 GLuint engine_create_shader_program(GLuint shaders[]);
 int engine_load_create_shader_program(struct shader* result, struct engine_load_create_shader_program_params); // Convinience function
 #define engine_load_create_shader_program(X,...) engine_load_create_shader_program(X,(struct engine_load_create_shader_program_params){__VA_ARGS__})
 
-struct dma_gl_texture* engine_v4l_texture_create(struct engine* engine, const char* v4l_device);
+/*
+ * GL state cache of the render context. The engine binds programs, textures, vertex arrays & array buffers, sets
+ * vertex attributes, sampler & crop uniforms & the clear color through these, calls which wouldn't change anything
+ * are skipped. State is left as it is after drawing. Code which changes any of it with GL directly has to call
+ * engine_gl_state_invalidate afterwards, or use these too. Objects which may be bound have to be deleted through
+ * these as well, otherwise a new object reusing the name would look bound already.
+ */
+void engine_gl_state_invalidate(struct engine* engine);
+void engine_gl_use_program(struct engine* engine, GLuint program);
+void engine_gl_bind_texture(struct engine* engine, unsigned unit, GLenum target, GLuint texture); // To GL_TEXTURE0 + unit
+void engine_gl_bind_vertex_array(struct engine* engine, GLuint vertex_array);
+void engine_gl_bind_array_buffer(struct engine* engine, GLuint buffer);
+// Only vertex array 0 is tracked. The pointer goes with the bound array buffer.
+void engine_gl_vertex_attrib_pointer(struct engine* engine, GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer);
+// Enables attribute N if bit N is set, disables the ones it enabled before which aren't set anymore
+void engine_gl_vertex_attrib_arrays(struct engine* engine, uint32_t enabled);
+// Of the program in use
+void engine_gl_uniform1i(struct engine* engine, GLint location, GLint value);
+void engine_gl_uniform4fv(struct engine* engine, GLint location, const GLfloat value[4]);
+void engine_gl_clear_color(struct engine* engine, GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha);
+void engine_gl_delete_textures(struct engine* engine, GLsizei count, const GLuint* textures);
+void engine_gl_delete_buffers(struct engine* engine, GLsizei count, const GLuint* buffers);
+void engine_gl_delete_vertex_arrays(struct engine* engine, GLsizei count, const GLuint* vertex_arrays);
+void engine_gl_delete_program(struct engine* engine, GLuint program);
+
+/*
+ * Render graph of offscreen passes. Each pass draws a quad with its shader into a texture, sampling
+ * camera textures or the results of earlier passes. engine_graph_run only renders the passes whose inputs
+ * changed & whose result is needed by an output pass. Intermediate textures come from a pool keyed by size
+ * & format, and go back to it once the last pass reading them is done.
+ */
+struct engine_graph;
+struct engine_graph_pass;
+
+struct engine_graph_pass_params {
+  struct shader* shader; // The vertex shader gets the corners in a "position" attribute, see shader/graph_pass.vs
+  unsigned width, height; // Of the result, 0 for the size of the first input
+  GLenum format; // Sized internal format of the result, GL_RGBA8 by default
+  bool output; // The result is used outside of the graph, engine_graph_pass_get_texture returns it after a run
+  void (*prepare)(struct engine_graph_pass* pass, void* param); // Called with the program in use, to set uniforms
+  void* param;
+};
+
+struct engine_graph* engine_graph_create(struct engine* engine);
+void engine_graph_destroy(struct engine_graph* graph);
+struct engine_graph_pass* engine_graph_pass_add(struct engine_graph* graph, struct engine_graph_pass_params params);
+#define engine_graph_pass_add(X,...) engine_graph_pass_add(X,(struct engine_graph_pass_params){__VA_ARGS__})
+// Inputs are bound to the named sampler uniform. Passes can only read passes which were added before them.
+int engine_graph_pass_add_texture_input(struct engine_graph_pass* pass, const char* sampler, struct dma_gl_texture* texture);
+int engine_graph_pass_add_pass_input(struct engine_graph_pass* pass, const char* sampler, struct engine_graph_pass* input);
+void engine_graph_pass_invalidate(struct engine_graph_pass* pass); // Render again on the next run, after changing uniforms
+GLuint engine_graph_pass_get_texture(struct engine_graph_pass* pass); // GL_TEXTURE_2D, only valid for output passes
+int engine_graph_run(struct engine_graph* graph);
+
+/*
+ * Analysis tap: hands small copies of a textures frames to a callback on a thread of its own. Frames are
+ * scaled down on the GPU & read back asynchronously, the render loop never waits for them. Frames are skipped
+ * to stay below max_fps, and dropped while the callback is still busy with an earlier one.
+ */
+struct engine_tap;
+
+enum engine_tap_format {
+  ENGINE_TAP_GRAY, // 1 byte per pixel, BT.601 luma
+  ENGINE_TAP_RGBA  // 4 bytes per pixel
+};
+
+struct engine_tap_frame {
+  const uint8_t* data; // Top row first, only valid until the callback returns
+  unsigned width, height;
+  uint32_t pitch; // Bytes between rows
+  enum engine_tap_format format;
+  uint32_t sequence; // Of the camera frame
+  uint64_t sensor_ns; // CLOCK_MONOTONIC, 0 if unknown
+  unsigned dropped; // Frames lost since the previous callback, because it or the readback was too slow
+};
+
+struct engine_tap_create_params {
+  struct dma_gl_texture* texture; // Has to outlive the tap
+  unsigned width, height; // Of the copies, 0 for the size of the texture
+  enum engine_tap_format format;
+  float max_fps; // 0 for every frame
+  void (*callback)(const struct engine_tap_frame* frame, void* param);
+  void* param;
+};
+
+struct engine_tap* engine_tap_create(struct engine* engine, struct engine_tap_create_params params);
+#define engine_tap_create(X,...) engine_tap_create(X,(struct engine_tap_create_params){__VA_ARGS__})
+void engine_tap_destroy(struct engine_tap* tap); // Waits for a running callback to return
+
+struct engine_v4l_texture_create_params {
+  const char* device; // Device path, "fd:<n>" for an open one, "broker:<socket>" for a camera another process shares
+  unsigned buffer_count; // 2 to 16, 0 for the default. The driver may grant fewer, but not less than 2.
+  // Shares the camera with other processes connecting to this socket path, see export_protocol.h.
+  // Each of them may hold up to ENGINE_EXPORT_MAX_HELD buffers, buffer_count should account for that.
+  const char* broker;
+  // The cheapest format meeting these is picked, preferring ones EGL can import over converting on the CPU
+  unsigned width, height; // Minimum frame size, 0 for at least what the device is set to
+  float fps; // Minimum frame rate, 0 to leave it as it is
+};
+
+enum engine_yuv_color_space {
+  ENGINE_YUV_COLOR_SPACE_DEFAULT,
+  ENGINE_YUV_COLOR_SPACE_BT601,
+  ENGINE_YUV_COLOR_SPACE_BT709,
+  ENGINE_YUV_COLOR_SPACE_BT2020
+};
+
+enum engine_yuv_range {
+  ENGINE_YUV_RANGE_DEFAULT,
+  ENGINE_YUV_RANGE_NARROW,
+  ENGINE_YUV_RANGE_FULL
+};
+
+struct engine_dmabuf_plane {
+  int fd; // Stays owned by the caller, it can be closed once the texture was created
+  uint32_t offset;
+  uint32_t pitch;
+};
+
+struct engine_dmabuf {
+  uint32_t fourcc; // DRM fourcc
+  uint32_t width, height;
+  unsigned plane_count;
+  struct engine_dmabuf_plane plane[ENGINE_DMABUF_MAX_PLANES];
+  uint64_t modifier; // DRM format modifier, ENGINE_DRM_FORMAT_MOD_INVALID for an implicit one
+  enum engine_yuv_color_space color_space;
+  enum engine_yuv_range range;
+};
+
+bool engine_dmabuf_format_supported(struct engine* engine, uint32_t fourcc, uint64_t modifier);
+
+// Imports count buffers of the same format, selectable with engine_dma_texture_set_buffer. This happens in the
+// background if possible, the texture is empty & engine_dma_texture_set_buffer fails until an engine_dma_texture_update
+// finds them imported. Buffer 0 is bound initially. If the import fails there, the texture stays empty for good &
+// engine_dma_texture_update returns -1 from then on, the texture should be destroyed.
+struct dma_gl_texture* engine_dma_texture_create(struct engine* engine, unsigned count, const struct engine_dmabuf buffer[]);
+int engine_dma_texture_set_buffer(struct dma_gl_texture* dgt, unsigned index);
+
+struct dma_gl_texture* engine_v4l_texture_create(struct engine* engine, struct engine_v4l_texture_create_params);
+#define engine_v4l_texture_create(X,...) engine_v4l_texture_create(X,(struct engine_v4l_texture_create_params){__VA_ARGS__})
+// Switches a camera texture to the cheapest format meeting the new constraints, like at creation. The last frame stays
+// visible until the first one in the new format arrives. The region of interest is reset, broker clients get the new buffers.
+// Formats also get set up again whenever the camera reports having switched on its own.
+int engine_v4l_texture_set_format(struct dma_gl_texture* texture, unsigned width, unsigned height, float fps);
 void engine_dma_texture_destroy(struct dma_gl_texture* dgt);
 GLuint engine_dma_texture_get_gl_texture(struct dma_gl_texture* dgt);
 GLenum engine_dma_texture_get_gl_type(struct dma_gl_texture* dgt);
@@ -38,5 +208,29 @@ void engine_dma_texture_bind(struct dma_gl_texture* dgt);
 void engine_dma_texture_play(struct dma_gl_texture* texture);
 void engine_dma_texture_pause(struct dma_gl_texture* texture);
 int engine_dma_texture_update(struct dma_gl_texture* texture);
+bool engine_dma_texture_changed(struct dma_gl_texture* texture); // Whether a new buffer was bound during this frame
+// Only shows a part of the frame, x, y, width & height are fractions of the full frame from its top left corner.
+// Cameras crop on the sensor if the driver can do it while streaming, which saves readout & memory bandwidth.
+// Otherwise, and for what the sensor couldn't crop exactly, the texture coordinates are adjusted.
+int engine_dma_texture_set_roi(struct dma_gl_texture* texture, float x, float y, float width, float height);
+// The part of the texture to sample, x, y, width & height in texture coordinates. The quad batch applies it.
+void engine_dma_texture_get_crop(struct dma_gl_texture* texture, float crop[4]);
+
+/*
+ * Draws many textured quads with as few draw calls as the texture units allow.
+ * Quads are collected by engine_quad_batch_add & drawn in order by engine_quad_batch_flush.
+ */
+struct engine_quad_batch;
+
+struct engine_quad {
+  struct dma_gl_texture* texture;
+  float x, y, width, height; // In normalized device coordinates, x & y are the bottom left corner
+};
+
+struct engine_quad_batch* engine_quad_batch_create(struct engine* engine);
+void engine_quad_batch_destroy(struct engine_quad_batch* batch);
+int engine_quad_batch_add(struct engine_quad_batch* batch, struct engine_quad quad); // May flush if out of texture units
+#define engine_quad_batch_add(X,...) engine_quad_batch_add(X,(struct engine_quad){__VA_ARGS__})
+void engine_quad_batch_flush(struct engine_quad_batch* batch);
 
 #endif
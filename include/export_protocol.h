@@ -0,0 +1,52 @@
+#ifndef DENG_EXPORT_PROTOCOL_H
+#define DENG_EXPORT_PROTOCOL_H
+
+#include <stdint.h>
+
+/*
+ * Protocol between the engine exporting its rendered frames (ENGINE_EXPORT=<socket path>) & consumer processes.
+ * SOCK_SEQPACKET unix socket, one struct engine_export_message per packet, fds are passed with SCM_RIGHTS.
+ *  1. After connecting, the consumer gets an ENGINE_EXPORT_BUFFER message for every buffer of the ring,
+ *     carrying one dmabuf fd per plane.
+ *  2. For every frame it gets an ENGINE_EXPORT_FRAME message. If has_fence is set, a sync_file fd is attached,
+ *     the buffer must not be read before it signaled. Otherwise, the dmabufs implicit fences have to be waited for.
+ *  3. Once the consumer is done with the buffer, it sends ENGINE_EXPORT_RELEASE. Until then, the engine doesn't
+ *     render into it. A consumer holding ENGINE_EXPORT_MAX_HELD buffers misses frames until it releases one.
+ *  4. The buffers may be replaced by a new set, sent like in 1. with the next generation. Buffers of the old set
+ *     don't have to be released, releases are only taken for the generation the frame was sent with.
+ * A camera shared with engine_v4l_texture_create(.broker = <socket path>) speaks the same protocol, its buffers
+ * are the cameras V4L2 buffers. FRAME messages never have a fence there, the timestamp is the sensors & a
+ * consumer holding ENGINE_EXPORT_MAX_HELD buffers only gets the newest frame once it released one.
+ */
+
+#define ENGINE_EXPORT_PROTOCOL_VERSION 3
+#define ENGINE_EXPORT_MAX_PLANES 4
+#define ENGINE_EXPORT_MAX_HELD 2
+
+enum engine_export_message_type {
+  ENGINE_EXPORT_BUFFER = 1, // engine -> consumer
+  ENGINE_EXPORT_FRAME,      // engine -> consumer
+  ENGINE_EXPORT_RELEASE     // consumer -> engine
+};
+
+struct engine_export_message {
+  uint32_t version;
+  uint32_t type;
+  uint32_t buffer; // Index in the ring
+  uint32_t has_fence; // FRAME
+  uint64_t sequence; // FRAME & RELEASE
+  uint64_t timestamp_ns; // FRAME, CLOCK_MONOTONIC when rendering was submitted or the sensor captured it, 0 if unknown
+  /* BUFFER only */
+  uint32_t buffer_count;
+  uint32_t fourcc; // DRM fourcc
+  uint32_t width, height;
+  uint32_t plane_count;
+  uint64_t modifier;
+  uint32_t offset[ENGINE_EXPORT_MAX_PLANES];
+  uint32_t pitch[ENGINE_EXPORT_MAX_PLANES];
+  uint32_t color_space; // enum engine_yuv_color_space
+  uint32_t range; // enum engine_yuv_range
+  uint32_t generation; // BUFFER, FRAME & RELEASE: of the set of buffers meant, see 4.
+};
+
+#endif
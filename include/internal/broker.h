@@ -0,0 +1,39 @@
+#ifndef DENG_I_BROKER_H
+#define DENG_I_BROKER_H
+
+#include <poll.h>
+#include <engine.h>
+
+struct engine;
+struct capture_stream;
+struct engine_broker;
+
+/*
+ * Camera broker: shares the V4L2 buffers of a capture stream with other processes over a unix socket, see
+ * export_protocol.h. Every dequeued buffer is sent to all clients & only requeued once all of them released it.
+ * A client already holding ENGINE_EXPORT_MAX_HELD buffers only gets the newest frame once it releases one,
+ * older ones are dropped, so a slow client can't stall the camera.
+ */
+
+// The fds are duplicated, buffer stays owned by the caller
+struct engine_broker* engine_i_broker_create(const char* path, unsigned count, const struct engine_dmabuf buffer[]);
+// For a new format. Clients stay connected & get the new buffers like new ones, what they held is forgotten.
+// The stream must have been removed from the capture thread, like for engine_i_broker_destroy.
+int engine_i_broker_set_buffers(struct engine_broker* broker, unsigned count, const struct engine_dmabuf buffer[]);
+// The stream must have been removed from the capture thread already
+void engine_i_broker_destroy(struct engine_broker* broker);
+
+/* Capture thread side, for the stream the broker was set on */
+unsigned engine_i_broker_poll_count(struct engine_broker* broker);
+unsigned engine_i_broker_poll_fds(struct engine_broker* broker, struct pollfd pfd[]); // Returns how many were set
+void engine_i_broker_dispatch(struct capture_stream* stream); // Accepts clients & takes back what they released
+void engine_i_broker_publish(struct capture_stream* stream, unsigned index); // Hands a dequeued buffer to the clients
+void engine_i_broker_drop_pending(struct capture_stream* stream); // Drops the frames slow clients didn't get yet
+
+/* Remote streams, fed by a broker in another process */
+// Connects to the broker listening at path & imports its buffers
+struct dma_gl_texture* engine_i_broker_texture_create(struct engine* engine, const char* path);
+int engine_i_broker_client_receive(struct capture_stream* stream); // Index of the next frame, -1 if there is none
+int engine_i_broker_client_release(struct capture_stream* stream, unsigned index);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef DENG_I_CAPTURE_H
+#define DENG_I_CAPTURE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <internal/engine.h>
+
+struct engine;
+struct engine_broker;
+
+/*
+ * A V4L2 stream serviced by the capture thread. The capture thread owns dequeuing & requeuing,
+ * the render thread only takes the newest ready buffer & hands back the ones it's done with.
+ * Both directions are single producer / single consumer and lock free.
+ */
+struct capture_stream {
+  int fd; // V4L2 device, or the socket to the broker for remote streams
+  bool remote; // Buffers come from a broker in another process, see broker.c
+  uint32_t generation; // Of the broker's buffers, for remote streams
+  struct engine_broker* broker; // Shares the buffers with other processes, set by the creator of the stream
+  unsigned type; // V4L2_BUF_TYPE_VIDEO_CAPTURE or V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+  unsigned mem_planes;
+  unsigned count;
+  atomic_uint ready; // capture -> render: index+1 of the newest filled buffer, 0 if none
+  atomic_uint released; // render -> capture: bitmask of buffers the render thread is done with
+  atomic_bool starving; // set by the capture thread while no buffer is queued at the driver
+  struct engine_frame_info frame[ENGINE_MAX_BUFFERS]; // Written before a buffer is published as ready
+  // Written by the render thread before a buffer is released, the buffer can't be reused before they signal
+  int fence_fd[ENGINE_MAX_BUFFERS]; // sync_file, -1 if none
+  EGLSyncKHR fence[ENGINE_MAX_BUFFERS]; // EGL_NO_SYNC_KHR if none
+  int dmabuf[ENGINE_MAX_BUFFERS]; // Set by the creator of the stream, for implicit sync. -1 if unknown.
+  int32_t crop_default[4]; // Sensor area of the full frame: left, top, width, height. Width 0 if the driver can't crop.
+  bool events; // Subscribed to V4L2_EVENT_SOURCE_CHANGE, set by the creator of the stream
+  struct engine_stats_texture* stats; // Of the texture the stream feeds, set by the creator of the stream. 0 if none.
+  atomic_bool source_changed; // capture -> render: the source switched formats or buffers, the stream has to be set up again
+  /* Capture thread private */
+  uint32_t out; // bitmask of buffers currently not queued at the driver
+  uint32_t waiting; // bitmask of released buffers whose fence didn't signal yet
+  uint8_t refs[ENGINE_MAX_BUFFERS]; // holders of dequeued buffers: the render thread & broker clients
+  bool no_sync_file; // DMA_BUF_IOCTL_EXPORT_SYNC_FILE isn't supported
+  uint32_t sequence; // Of the last frame received, to tell how many were dropped
+  bool sequenced; // sequence is set
+  bool failed;
+  struct capture_stream* next;
+};
+
+// Queues all buffers of the stream & starts streaming
+int engine_i_capture_add(struct engine* engine, struct capture_stream* stream);
+// Stops streaming. The caller still owns the fd.
+void engine_i_capture_remove(struct engine* engine, struct capture_stream* stream);
+void engine_i_capture_destroy(struct engine* engine);
+// Blocks until a stream published a new buffer since the last call, or fd gets readable. -1 for no fd.
+// Returns -1 if there is nothing to wait for.
+int engine_i_capture_wait(struct engine* engine, int fd);
+
+/* Render thread side */
+int engine_i_capture_acquire(struct capture_stream* stream);
+// Fences the buffer after all GL commands so far & hands it back
+void engine_i_capture_release(struct engine* engine, struct capture_stream* stream, unsigned index);
+// For buffers the GPU never touched, like ones converted on the CPU
+void engine_i_capture_release_unfenced(struct engine* engine, struct capture_stream* stream, unsigned index);
+// Update callback of textures fed by a capture_stream in update_param.vptr
+int engine_i_capture_texture_update(struct dma_gl_texture* dgt);
+// Release callback of textures fed by a capture_stream in update_param.vptr
+void engine_i_capture_texture_release(struct dma_gl_texture* dgt, unsigned index);
+// Binds the newest image of the stream to the texture, like engine_i_capture_texture_update
+int engine_i_capture_bind(struct dma_gl_texture* dgt, struct capture_stream* stream);
+
+/* Capture thread side */
+// Drops a reference to a dequeued buffer, it's requeued once nobody holds it anymore
+void engine_i_capture_unref(struct capture_stream* stream, unsigned index);
+
+/* Producer side, the capture thread or anything emulating it */
+// Whether the fence of a released buffer signaled, never blocks. Cleans up the fence if so.
+bool engine_i_capture_fence_signaled(EGLDisplay display, struct capture_stream* stream, unsigned index);
+// Drops all fences, for streams which are going away
+void engine_i_capture_fences_destroy(EGLDisplay display, struct capture_stream* stream);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef DENG_I_CONVERT_H
+#define DENG_I_CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <engine.h>
+
+/*
+ * YUV to RGBA conversion on the CPU, for GPUs which can't import the camera buffers. The SIMD kernels produce
+ * exactly what the scalar reference does: coefficients with 6 fractional bits & 16 bit saturating arithmetic.
+ */
+
+struct engine_i_convert_coefficients {
+  int16_t y, y_offset; // Luma: (Y - y_offset) * y
+  int16_t rv, gu, gv, bu; // Chroma, multiplied with U-128 & V-128
+};
+
+struct engine_i_convert_kernel {
+  const char* name;
+  // Convert one row of width pixels to RGBA
+  void (*yuyv)(const uint8_t* src, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c);
+  void (*nv12)(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c);
+};
+
+void engine_i_convert_coefficients(struct engine_i_convert_coefficients* c, enum engine_yuv_color_space color_space, enum engine_yuv_range range);
+bool engine_i_convert_supported(uint32_t fourcc); // DRM fourcc
+// The kernels this CPU can run, the scalar reference first & the fastest last. Returns how many there are.
+size_t engine_i_convert_kernels(const struct engine_i_convert_kernel* list[], size_t max);
+// The fastest kernel, or the one named in $ENGINE_CONVERT (scalar, sse2, avx2 or neon)
+const struct engine_i_convert_kernel* engine_i_convert_kernel(void);
+// Converts a whole frame, plane & pitch like in struct engine_dmabuf. dst is RGBA.
+void engine_i_convert_frame(
+  const struct engine_i_convert_kernel* kernel, const struct engine_i_convert_coefficients* c,
+  uint32_t fourcc, unsigned width, unsigned height,
+  const uint8_t* const plane[], const uint32_t pitch[], uint8_t* dst, size_t dst_pitch
+);
+
+#endif
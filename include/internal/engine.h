@@ -9,6 +9,9 @@
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <engine.h>
+#include <internal/gl_state.h>
 
 #ifndef CONCAT
 #define CONCAT(A,B) A ## B
@@ -18,6 +21,10 @@
 #define CONCAT_EVAL(A,B) CONCAT(A,B)
 #endif
 
+#define ENGINE_MAX_BUFFERS 16
+#define ENGINE_DEFAULT_BUFFER_COUNT 4
+#define ENGINE_MAX_DAMAGE 64
+
 #define ENGINE_REGISTER_DISPLAY_DRIVER(X) \
   static void CONCAT_EVAL(erdd_reg_,__LINE__)(void) __attribute__((constructor)); \
   static void CONCAT_EVAL(erdd_reg_,__LINE__)(void){ \
@@ -32,14 +39,54 @@ struct engine {
   EGLContext context;
   EGLSurface surface;
   struct dma_gl_texture* textures;
+  struct engine_capture* capture;
+  struct engine_trace* trace; // 0 unless tracing is enabled
+  struct engine_stats* stats; // 0 unless statistics are enabled
+  struct engine_gl_state gl_state; // See engine_gl_state_invalidate
+  struct engine_profile* profile; // Times GPU scopes for the statistics, created by the first one
+  struct engine_export* export; // 0 unless exporting is enabled
+  struct engine_tap* taps;
+  struct engine_import* import; // Imports buffers on another thread, created on demand
+  struct dma_gl_texture* passthrough; // Set by engine_passthrough during this frame, 0 if engine_main_loop drew it
+  float passthrough_rect[4]; // Where, x, y, width & height like in struct engine_quad
+  struct engine_quad_batch* passthrough_batch; // Draws it if the display driver can't show it, created on demand
+  uint64_t direct_frames; // Shown by the display driver without drawing
+  uint32_t texture_ids; // Handed out so far, see dma_gl_texture.id
+  EGLint dmabuf_format_count; // -1 if the formats couldn't be queried
+  EGLint* dmabuf_format;
+  PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swap_buffers_with_damage; // 0 if unsupported
+  bool fence_sync; // EGL_KHR_fence_sync
+  bool native_fence_sync; // EGL_ANDROID_native_fence_sync, fences can be exported as sync_file fds
+  enum engine_redraw_policy redraw_policy;
+  bool redraw_requested;
+  bool quit_requested; // The window was closed, set by the display driver. The main loop ends instead of drawing.
+  bool damage_full; // The whole surface has to be presented, the damage list is ignored
+  unsigned damage_count;
+  EGLint damage[ENGINE_MAX_DAMAGE][4]; // x, y, width, height, origin at the bottom left
   void* private;
 };
 
+struct engine_frame_info {
+  uint64_t sensor_ns; // When the sensor captured the frame, CLOCK_MONOTONIC, 0 if unknown
+  uint64_t dequeue_ns; // When it was dequeued from the driver, 0 if unknown
+  uint32_t sequence;
+};
+
 struct dma_gl_texture {
   struct engine* engine;
+  uint32_t id; // Stays the same while the GL texture changes with every buffer, starts at 1
   GLuint texture;
-  EGLImageKHR image[2];
-  bool current;
+  GLenum target; // GL_TEXTURE_EXTERNAL_OES for imported dmabufs, GL_TEXTURE_2D for ones converted on the CPU
+  unsigned width, height;
+  unsigned image_count;
+  EGLImageKHR image[ENGINE_MAX_BUFFERS]; // Created once, indexed like the buffers of the source
+  GLuint image_texture[ENGINE_MAX_BUFFERS]; // Each image is bound to its own, binding a buffer just picks one of them
+  EGLImageKHR retired; // Of buffers which were replaced, still shown until the next bind. EGL_NO_IMAGE_KHR if none.
+  GLuint retired_texture;
+  struct engine_i_import_job* import; // New buffers the import thread is still working on, 0 if none
+  bool import_failed; // Importing failed on the import thread with nothing shown yet, the texture stays empty
+  int current; // Index of the image shown by texture, -1 if it doesn't belong to the source yet
+  struct engine_frame_info frame; // Of the currently bound image
   int (*update_callback)(struct dma_gl_texture*);
   void (*destroy_callback)(struct dma_gl_texture*);
   union {
@@ -47,19 +94,55 @@ struct dma_gl_texture {
     void* vptr;
   } update_param;
   bool autoupdate;
+  bool changed; // A new buffer was bound during this main loop iteration
+  uint64_t generation; // Incremented whenever a new buffer is bound
+  float crop[4]; // Part of the texture to show, x, y, width, height in texture coordinates
+  // Tries to crop the source to roi, fractions of the full frame. Sets done to what the source delivers afterwards.
+  void (*roi_callback)(struct dma_gl_texture*, const float roi[4], float done[4]);
+  void* display_buffer[ENGINE_MAX_BUFFERS]; // From the display driver's buffer_import, 0 if it can't show it
+  uint32_t held; // Buffers the compositor got directly, the source gets them back once it let go of them
+  void (*release_callback)(struct dma_gl_texture*, unsigned index); // Hands a buffer which isn't bound back to the source
+  struct engine_stats_texture* stats; // Its slot on the statistics page, 0 if none
   struct dma_gl_texture *next, *last;
 };
 
 struct engine_display_driver {
   const char* name;
+  bool fallback; // Only tried if no other driver works, unless selected by name
   struct engine_display_driver* next;
   int(*init)(struct engine* engine);
   void(*before_drawing)(struct engine* engine);
   void(*after_drawing)(struct engine* engine);
+  void(*dispatch)(struct engine* engine); // Handles pending window system events without blocking, may request a redraw
+  int(*get_fd)(struct engine* engine); // Readable when there are events to dispatch, the main loop wakes up for them
+  // For engine_passthrough. Wraps an imported buffer for the compositor, 0 if it can't take it.
+  void*(*buffer_import)(struct engine* engine, struct dma_gl_texture* dgt, unsigned index, const struct engine_dmabuf* buffer);
+  void(*buffer_destroy)(struct engine* engine, void* buffer);
+  // Shows the bound buffer of the texture without drawing, holding it. Returns false if it can't.
+  bool(*present)(struct engine* engine, struct dma_gl_texture* dgt, const float rect[4]);
   void(*destroy)(struct engine* engine);
 };
 
 void engine_i_register_display_driver(struct engine_display_driver* driver);
+bool engine_i_egl_has_extension(struct engine* engine, const char* name);
+// For textures not created by engine_dma_texture_create, makes the main loop update them & cleanup destroy them.
+// Also sets the defaults of fields a calloc doesn't get right.
+void engine_i_dma_texture_register(struct engine* engine, struct dma_gl_texture* dgt);
+// For sources whose buffers change, like cameras switching formats. Destroys all images, keep_bound keeps the one
+// bound to the texture as retired, so it shows the last frame until the first image of the new buffers is bound.
+void engine_i_dma_texture_retire_images(struct dma_gl_texture* dgt, bool keep_bound);
+// engine_dma_texture_create, unless background is false: then the buffers are imported right away & 0 is returned
+// if that fails, so the caller can still get its frames another way.
+struct dma_gl_texture* engine_i_dma_texture_create(struct engine* engine, unsigned count, const struct engine_dmabuf buffer[], bool background);
+// Imports the new buffers, after engine_i_dma_texture_retire_images. This happens in the background if possible,
+// the new images show up in a later engine_dma_texture_update. Frames until then can't be bound, see image_count.
+int engine_i_dma_texture_import(struct dma_gl_texture* dgt, unsigned count, const struct engine_dmabuf buffer[]);
+// Creates the image of a buffer & a texture for it, in the current context
+int engine_i_dma_image_create(struct engine* engine, const struct engine_dmabuf* buffer, EGLImageKHR* image, GLuint* texture);
+// Checks whether the buffers can be imported, before anything is created
+int engine_i_dmabuf_validate(struct engine* engine, unsigned count, const struct engine_dmabuf buffer[]);
+// The compositor let go of a held buffer. Unless it's still bound, the source gets it back.
+void engine_i_dma_texture_unhold(struct dma_gl_texture* dgt, unsigned index);
 int engine_i_egl_x11_init(struct engine* engine);
 
 #endif
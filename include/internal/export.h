@@ -0,0 +1,24 @@
+#ifndef DENG_I_EXPORT_H
+#define DENG_I_EXPORT_H
+
+#include <stdbool.h>
+
+struct engine;
+struct engine_export;
+
+/*
+ * Renders frames into a ring of images exported with EGL_MESA_image_dma_buf_export & hands them to consumer
+ * processes connected to the socket in ENGINE_EXPORT, see export_protocol.h. The frame is blitted to the
+ * surface afterwards, so it's still shown as usual. The ring is created again when the surface is resized.
+ */
+
+int engine_i_export_init(struct engine* engine); // Needs a current context, does nothing if ENGINE_EXPORT isn't set
+void engine_i_export_destroy(struct engine* engine);
+
+/* Render thread side, only called if engine->export is set */
+// Redirects drawing into a free buffer of the ring. False if there is nothing to export to.
+bool engine_i_export_begin(struct engine_export* export);
+// Hands the buffer to the consumers & copies it to the surface
+void engine_i_export_end(struct engine_export* export);
+
+#endif
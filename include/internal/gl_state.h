@@ -0,0 +1,56 @@
+#ifndef DENG_I_GL_STATE_H
+#define DENG_I_GL_STATE_H
+
+#include <GLES2/gl2.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ENGINE_GL_STATE_UNITS 16 // Texture units tracked, others are always set
+#define ENGINE_GL_STATE_ATTRIBS 32 // Vertex attributes tracked, one bit each
+#define ENGINE_GL_STATE_UNIFORMS 64 // Uniform values remembered, a direct mapped cache
+#define ENGINE_GL_STATE_UNKNOWN 0xFFFFFFFFu // Not known, the next call is never skipped
+
+enum {
+  ENGINE_GL_STATE_TARGET_2D,
+  ENGINE_GL_STATE_TARGET_EXTERNAL,
+  ENGINE_GL_STATE_TARGET_COUNT
+};
+
+struct engine_gl_attrib {
+  bool known;
+  GLuint buffer;
+  GLint size;
+  GLenum type;
+  GLboolean normalized;
+  GLsizei stride;
+  const void* pointer;
+};
+
+struct engine_gl_uniform {
+  GLuint program; // 0 if the entry is unused
+  GLint location;
+  GLenum type; // GL_INT or GL_FLOAT_VEC4
+  union {
+    GLint i;
+    GLfloat f[4];
+  } value;
+};
+
+// What the render context has bound, as far as the engine_gl_* helpers know. See engine_gl_state_invalidate.
+struct engine_gl_state {
+  GLuint program;
+  GLuint active_unit; // Index, not GL_TEXTURE0 + index
+  GLuint texture[ENGINE_GL_STATE_UNITS][ENGINE_GL_STATE_TARGET_COUNT];
+  GLuint vertex_array;
+  GLuint array_buffer;
+  // Of vertex array 0, only tracked while that's bound
+  uint32_t attrib_known, attrib_enabled;
+  struct engine_gl_attrib attrib[ENGINE_GL_STATE_ATTRIBS];
+  GLfloat clear_color[4];
+  bool clear_color_known;
+  struct engine_gl_uniform uniform[ENGINE_GL_STATE_UNIFORMS];
+  uint64_t calls; // Made to GL through the helpers
+  uint64_t elided; // Skipped because they wouldn't have changed anything
+};
+
+#endif
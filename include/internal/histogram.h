@@ -0,0 +1,53 @@
+#ifndef DENG_I_HISTOGRAM_H
+#define DENG_I_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram: exact below 8, above that 8 buckets per power of two (~12% resolution).
+ * Values are usually microseconds.
+ */
+
+#define HISTOGRAM_BUCKETS 256
+
+struct histogram {
+  uint64_t count;
+  uint32_t bucket[HISTOGRAM_BUCKETS];
+};
+
+static inline unsigned histogram_bucket(uint64_t value){
+  if(value < 8)
+    return value;
+  unsigned msb = 63 - __builtin_clzll(value);
+  unsigned index = (msb - 2) * 8 + ((value >> (msb - 3)) & 7);
+  return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+static inline uint64_t histogram_bucket_value(unsigned index){
+  if(index < 8)
+    return index;
+  return (uint64_t)(8 + index % 8) << (index / 8 - 1);
+}
+
+static inline void histogram_add(struct histogram* histogram, uint64_t value){
+  histogram->bucket[histogram_bucket(value)]++;
+  histogram->count++;
+}
+
+// p between 0 and 1. Returns the lower bound of the bucket the percentile falls into.
+static inline uint64_t histogram_percentile(const uint32_t bucket[HISTOGRAM_BUCKETS], uint64_t count, double p){
+  if(!count)
+    return 0;
+  uint64_t rank = p * count;
+  if(rank >= count)
+    rank = count - 1;
+  uint64_t sum = 0;
+  for(unsigned i=0; i<HISTOGRAM_BUCKETS; i++){
+    sum += bucket[i];
+    if(sum > rank)
+      return histogram_bucket_value(i);
+  }
+  return histogram_bucket_value(HISTOGRAM_BUCKETS - 1);
+}
+
+#endif
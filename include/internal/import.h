@@ -0,0 +1,33 @@
+#ifndef DENG_I_IMPORT_H
+#define DENG_I_IMPORT_H
+
+#include <stdbool.h>
+#include <internal/engine.h>
+
+/*
+ * Creates the EGLImages & textures of new buffers on a thread with its own context, sharing textures with the
+ * render context. The render thread only polls a fence, so buffers coming & going don't stall frames.
+ */
+struct engine_i_import_job {
+  unsigned count;
+  struct engine_dmabuf buffer[ENGINE_MAX_BUFFERS]; // The fds are duplicates owned by the job
+  // Once done, whatever the render thread takes over has to be cleared here, the rest is destroyed with the job
+  EGLImageKHR image[ENGINE_MAX_BUFFERS];
+  GLuint texture[ENGINE_MAX_BUFFERS];
+  /* Private */
+  EGLSyncKHR fence; // Signals once the textures can be used by the render context, EGL_NO_SYNC_KHR if finished already
+  int state;
+  bool canceled;
+  struct engine_i_import_job* next;
+};
+
+// Queues the import of validated buffers. Returns 0 if there is no import thread, the caller has to import them itself.
+struct engine_i_import_job* engine_i_import_submit(struct engine* engine, unsigned count, const struct engine_dmabuf buffer[]);
+// 1 once the images & textures can be used, 0 while they can't yet, -1 if the import failed. Never blocks.
+int engine_i_import_poll(struct engine* engine, struct engine_i_import_job* job);
+// Cancels the job if it's still running, or destroys whatever the render thread didn't take over
+void engine_i_import_free(struct engine* engine, struct engine_i_import_job* job);
+// After all jobs were freed
+void engine_i_import_destroy(struct engine* engine);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef DENG_I_PROFILE_H
+#define DENG_I_PROFILE_H
+
+struct engine;
+
+/*
+ * GPU time of the scopes of engine_gpu_scope_begin & end, for the statistics page. Measured with
+ * GL_EXT_disjoint_timer_query if possible. Otherwise, a thread notes when fences before & after the scope signal.
+ * Results are collected once they are there, a few frames later, nothing waits for the GPU.
+ */
+
+// Once per frame, before drawing. Flushes the fences of the scopes before, unless the swap did.
+// Only called if engine->profile is set.
+void engine_i_profile_collect(struct engine* engine);
+void engine_i_profile_destroy(struct engine* engine);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef DENG_I_PROGRAM_CACHE_H
+#define DENG_I_PROGRAM_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <GLES2/gl2.h>
+
+/*
+ * On-disk cache of linked program binaries (GL_OES_get_program_binary), so startup doesn't pay for
+ * compiling & linking every time. Stored in $ENGINE_SHADER_CACHE, $XDG_CACHE_HOME/deng or ~/.cache/deng.
+ * Setting ENGINE_SHADER_CACHE to an empty string disables it. Needs a current GL context.
+ */
+
+struct engine_i_program_cache_source {
+  const void* data;
+  size_t size;
+};
+
+// Hash of the sources together with the GL vendor, renderer & version, a driver update invalidates the entry
+uint64_t engine_i_program_cache_key(const struct engine_i_program_cache_source source[], size_t count);
+// Returns a linked program, or 0 on a miss. Entries the driver rejects are removed.
+GLuint engine_i_program_cache_load(uint64_t key);
+void engine_i_program_cache_store(uint64_t key, GLuint program);
+
+#endif
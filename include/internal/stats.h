@@ -0,0 +1,53 @@
+#ifndef DENG_I_STATS_H
+#define DENG_I_STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stats_protocol.h>
+#include <internal/histogram.h>
+
+struct engine;
+struct dma_gl_texture;
+
+/*
+ * Live statistics in shared memory, enabled with ENGINE_STATS=<name>. See include/stats_protocol.h for the layout.
+ * Writers only do relaxed loads & stores of their own blocks, plus a release fence, free on x86, per sequence bump.
+ */
+
+int engine_i_stats_init(struct engine* engine);
+void engine_i_stats_destroy(struct engine* engine);
+
+/* Render thread side, only called if engine->stats is set */
+// Gives the texture a slot, dgt->stats stays 0 if none is free
+void engine_i_stats_texture_add(struct engine* engine, struct dma_gl_texture* dgt);
+void engine_i_stats_texture_remove(struct engine* engine, struct dma_gl_texture* dgt);
+void engine_i_stats_frame(struct engine* engine, uint64_t start_ns, uint64_t swap_ns, uint64_t end_ns);
+void engine_i_stats_direct_frame(struct engine* engine);
+void engine_i_stats_rebind(struct dma_gl_texture* dgt);
+// Returns the index of the scope, -1 if there is no room for another one
+int engine_i_stats_scope_add(struct engine* engine, const char* name);
+// dropped measurements only count, ns is ignored then
+void engine_i_stats_scope_time(struct engine* engine, unsigned scope, enum engine_stats_gpu_timing timing, uint64_t ns, bool dropped);
+
+/* Writers of a block */
+static inline void stats_write_begin(_Atomic uint32_t* seq){
+  atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void stats_write_end(_Atomic uint32_t* seq){
+  atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+static inline void stats_add(_Atomic uint64_t* counter, uint64_t value){
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void stats_histogram_add(struct engine_stats_histogram* histogram, uint64_t value){
+  _Atomic uint32_t* bucket = &histogram->bucket[histogram_bucket(value)];
+  atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+  stats_add(&histogram->count, 1);
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef DENG_I_TAP_H
+#define DENG_I_TAP_H
+
+#include <stdbool.h>
+
+struct engine;
+
+// Called by the main loop after the textures were updated. Starts readbacks of new frames & hands finished ones over.
+// Returns true while readbacks are still in flight, they are only collected by the next call.
+bool engine_i_tap_run(struct engine* engine);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef DENG_I_TRACE_H
+#define DENG_I_TRACE_H
+
+#include <stdint.h>
+
+struct engine;
+struct engine_trace;
+struct dma_gl_texture;
+
+/*
+ * Per frame capture-to-photon latency tracing, enabled with ENGINE_TRACE=<file.json>.
+ * Completed frames go into a lock free ring, which is dumped as Chrome trace-event JSON at exit.
+ * p50/p99 of each stage are printed once per second while running.
+ */
+
+uint64_t engine_i_time_ns(void); // CLOCK_MONOTONIC, the clock V4L2 timestamps usually use
+
+int engine_i_trace_init(struct engine* engine);
+void engine_i_trace_destroy(struct engine* engine);
+
+/* Render thread side, only called if engine->trace is set */
+void engine_i_trace_rebind(struct engine_trace* trace, const struct dma_gl_texture* dgt);
+void engine_i_trace_draw(struct engine_trace* trace);
+void engine_i_trace_swap(struct engine_trace* trace);
+
+#endif
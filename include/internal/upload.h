@@ -0,0 +1,23 @@
+#ifndef DENG_I_UPLOAD_H
+#define DENG_I_UPLOAD_H
+
+#include <stddef.h>
+#include <GLES3/gl3.h>
+
+struct engine;
+struct engine_upload;
+
+/*
+ * Streams RGBA frames into GL_TEXTURE_2D textures through a ring of pixel unpack buffers. Each frame goes to
+ * the texture which isn't shown, so neither the CPU writing nor the copy waits for draws using the other one.
+ * Needs a current GLES 3 context.
+ */
+
+struct engine_upload* engine_i_upload_create(struct engine* engine, unsigned width, unsigned height);
+void engine_i_upload_destroy(struct engine_upload* upload);
+// Returns where to write the next frame, rows are *pitch bytes apart. 0 on failure.
+void* engine_i_upload_map(struct engine_upload* upload, size_t* pitch);
+// Starts copying the frame to a texture & returns it, 0 on failure
+GLuint engine_i_upload_unmap(struct engine_upload* upload);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef DENG_IPC_H
+#define DENG_IPC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Helpers for message based unix sockets (SOCK_SEQPACKET), which pass file descriptors along with a message.
+ * Shared by the engine & the processes talking to it.
+ */
+
+#define ENGINE_IPC_MAX_FDS 8
+
+// Nonblocking listening socket, replaces a stale socket file at path. Prints why on failure.
+int engine_ipc_listen(const char* path);
+// Blocking connection. Returns -1 & sets errno on failure, without printing anything, so callers can retry.
+int engine_ipc_connect(const char* path);
+// Returns -1 & sets errno on failure. Never raises SIGPIPE.
+int engine_ipc_send(int socket, const void* data, size_t size, const int fd[], unsigned fd_count);
+// Receives one message & up to *fd_count fds, *fd_count is set to the number received. Excess fds are closed.
+// Returns the size of the message, 0 if the peer hung up, -1 & sets errno on failure.
+ssize_t engine_ipc_recv(int socket, void* data, size_t size, int fd[], unsigned* fd_count, int flags);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef DENG_STATS_PROTOCOL_H
+#define DENG_STATS_PROTOCOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Layout of the live statistics the engine keeps in /dev/shm/<name> with ENGINE_STATS=<name>, see tools/stats_reader.c.
+ * Every block has a single writer & a sequence number, odd while the block is written. A reader copies the block
+ * & retries if the sequence number was odd or changed meanwhile. Counters only grow, rates & histograms over an
+ * interval are the difference of two copies. The page is ready once magic is set.
+ */
+
+#define ENGINE_STATS_MAGIC 0x53474e45 // "ENGS"
+#define ENGINE_STATS_VERSION 3
+#define ENGINE_STATS_MAX_TEXTURES 16
+#define ENGINE_STATS_MAX_SCOPES 16
+#define ENGINE_STATS_SCOPE_NAME 32
+#define ENGINE_STATS_HISTOGRAM_BUCKETS 256 // Buckets of include/internal/histogram.h, values in microseconds
+
+struct engine_stats_histogram {
+  _Atomic uint64_t count;
+  _Atomic uint32_t bucket[ENGINE_STATS_HISTOGRAM_BUCKETS];
+};
+
+// Written by the capture thread
+struct engine_stats_capture {
+  _Atomic uint32_t seq;
+  _Atomic uint64_t frames; // Received from the camera or broker
+  _Atomic uint64_t dropped; // Missing from the sequence numbers, never received at all
+  _Atomic uint64_t superseded; // Received, but a newer frame arrived before the render thread took it
+  _Atomic uint64_t ioctls;
+  _Atomic uint64_t ioctl_errors;
+};
+
+struct engine_stats_texture {
+  /* Written by the render thread */
+  _Atomic uint32_t seq;
+  _Atomic uint32_t active; // Odd while the slot belongs to a texture, incremented when it's taken & freed
+  _Atomic uint32_t width, height;
+  _Atomic uint64_t rebinds; // New frames bound to the texture
+  struct engine_stats_capture capture; // Stays 0 for textures without a capture stream
+};
+
+enum engine_stats_gpu_timing {
+  ENGINE_STATS_GPU_TIMING_NONE, // No scope was measured yet, or there are neither timer queries nor fences
+  ENGINE_STATS_GPU_TIMING_TIMER_QUERY, // GL_EXT_disjoint_timer_query
+  ENGINE_STATS_GPU_TIMING_FENCE // From when the fences before & after the scope signaled, includes some CPU wakeup latency
+};
+
+// A named part of the GPU work of a frame, see engine_gpu_scope_begin. Written by the render thread.
+struct engine_stats_scope {
+  _Atomic uint32_t seq;
+  char name[ENGINE_STATS_SCOPE_NAME]; // Empty if the scope is unused
+  _Atomic uint64_t dropped; // Measurements which were lost, too many were in flight or the GPU timer was disjoint
+  struct engine_stats_histogram gpu_time;
+};
+
+struct engine_stats_page {
+  _Atomic uint32_t magic;
+  uint32_t version;
+  uint32_t size; // Of the whole page
+  uint32_t pid;
+  /* Written by the render thread */
+  _Atomic uint32_t seq;
+  _Atomic uint64_t frames; // Drawn & swapped
+  _Atomic uint64_t direct_frames; // Shown by the display driver without drawing
+  struct engine_stats_histogram frame_time; // From the decision to draw until the swap
+  struct engine_stats_histogram swap_time;
+  _Atomic uint32_t gpu_timing; // enum engine_stats_gpu_timing, how the scopes are measured
+  _Atomic uint64_t gl_calls; // State changes made through the engine_gl_* helpers
+  _Atomic uint64_t gl_calls_elided; // Skipped by them, the state was already like that
+  struct engine_stats_texture texture[ENGINE_STATS_MAX_TEXTURES];
+  struct engine_stats_scope scope[ENGINE_STATS_MAX_SCOPES];
+};
+
+#endif
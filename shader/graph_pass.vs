@@ -0,0 +1,12 @@
+#version 300 es
+
+precision highp float;
+
+in vec2 position; // Corners of the output, in normalized device coordinates
+
+out vec2 f_texture_coordinate;
+
+void main(){
+  f_texture_coordinate = position * 0.5 + 0.5;
+  gl_Position = vec4(position, 0.0, 1.0);
+}
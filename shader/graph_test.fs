@@ -0,0 +1,21 @@
+#version 300 es
+// Passes of tools/graph_test.c. With FILL, the output is scale, otherwise it's the source scaled.
+
+precision highp float;
+
+#ifndef FILL
+uniform sampler2D source;
+#endif
+uniform vec4 scale;
+
+in vec2 f_texture_coordinate;
+
+out vec4 color;
+
+void main(){
+#ifdef FILL
+  color = scale;
+#else
+  color = texture(source, f_texture_coordinate) * scale;
+#endif
+}
@@ -0,0 +1,30 @@
+#version 300 es
+// Defined as sampler2D for textures converted on the CPU
+#ifndef SAMPLER
+#extension GL_OES_EGL_image_external_essl3 : require
+#define SAMPLER samplerExternalOES
+#endif
+
+precision mediump float;
+
+// Must match QUAD_BATCH_MAX_SLOTS. 16 is the least GLES 3.0 guarantees for fragment shaders.
+uniform SAMPLER textures[16];
+
+in vec2 f_texture_coordinate;
+flat in int f_slot;
+
+out vec4 color;
+
+// Sampler arrays can only be indexed with constant expressions
+#define SAMPLE(N) case N: color = texture(textures[N], f_texture_coordinate); break;
+
+void main(){
+  switch(f_slot){
+    SAMPLE(0) SAMPLE(1) SAMPLE(2) SAMPLE(3)
+    SAMPLE(4) SAMPLE(5) SAMPLE(6) SAMPLE(7)
+    SAMPLE(8) SAMPLE(9) SAMPLE(10) SAMPLE(11)
+    SAMPLE(12) SAMPLE(13) SAMPLE(14) SAMPLE(15)
+    default: color = vec4(0.0);
+  }
+  color = vec4(color.rgb, 1.0);
+}
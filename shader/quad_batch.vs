@@ -0,0 +1,18 @@
+#version 300 es
+
+precision highp float;
+
+// Fixed locations, so both sampler variants of the batch program share one vertex array
+layout(location = 0) in vec2 corner; // Static unit quad
+layout(location = 1) in vec4 rect;   // Per quad: x, y, width, height in normalized device coordinates
+layout(location = 2) in float slot;  // Per quad: which of the textures to sample
+layout(location = 3) in vec4 crop;   // Per quad: part of the texture to show, x, y, width, height
+
+out vec2 f_texture_coordinate;
+flat out int f_slot;
+
+void main(){
+  f_texture_coordinate = crop.xy + (vec2(1.0) - corner) * crop.zw; // Turned by 180 degrees, cameras have always been drawn that way
+  f_slot = int(slot);
+  gl_Position = vec4(rect.xy + corner * rect.zw, 0.0, 1.0);
+}
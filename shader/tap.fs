@@ -0,0 +1,43 @@
+#version 300 es
+// SAMPLER is sampler2D for textures converted on the CPU. GRAY packs the luma of 4 adjacent pixels into each texel.
+#ifndef SAMPLER
+#extension GL_OES_EGL_image_external_essl3 : require
+#define SAMPLER samplerExternalOES
+#endif
+
+precision highp float;
+
+uniform SAMPLER source;
+uniform vec2 step; // One output pixel, in texture coordinates
+uniform vec4 crop; // Part of the texture to copy, x, y, width, height
+
+in vec2 f_texture_coordinate;
+
+out vec4 color;
+
+// 4 bilinear taps spread over the output pixel, a box filter over up to 4x4 source pixels
+vec3 pixel(vec2 position){
+  vec2 center = crop.xy + position * crop.zw;
+  vec2 d = step * crop.zw * 0.25;
+  return (
+    texture(source, center + vec2(-d.x, -d.y)).rgb +
+    texture(source, center + vec2( d.x, -d.y)).rgb +
+    texture(source, center + vec2(-d.x,  d.y)).rgb +
+    texture(source, center + vec2( d.x,  d.y)).rgb
+  ) * 0.25;
+}
+
+#ifdef GRAY
+float luma(float x){
+  return dot(pixel(vec2((x + 0.5) * step.x, f_texture_coordinate.y)), vec3(0.299, 0.587, 0.114));
+}
+#endif
+
+void main(){
+#ifdef GRAY
+  float x = floor(gl_FragCoord.x) * 4.0;
+  color = vec4(luma(x), luma(x + 1.0), luma(x + 2.0), luma(x + 3.0));
+#else
+  color = vec4(pixel(f_texture_coordinate), 1.0);
+#endif
+}
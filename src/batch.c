@@ -0,0 +1,253 @@
+#include <engine.h>
+#include <internal/engine.h>
+#include <GLES3/gl3.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <math.h>
+
+#undef engine_quad_batch_add
+
+#define QUAD_BATCH_MAX_SLOTS 16 // Size of the sampler array in shader/quad_batch.fs
+#define QUAD_BATCH_INITIAL_CAPACITY 64
+
+// Imported camera buffers are external textures, ones converted on the CPU are plain 2D textures
+enum quad_batch_kind {
+  QUAD_BATCH_EXTERNAL,
+  QUAD_BATCH_2D,
+  QUAD_BATCH_KIND_COUNT
+};
+
+// Attribute locations, fixed in shader/quad_batch.vs
+enum {
+  QUAD_BATCH_CORNER,
+  QUAD_BATCH_RECT,
+  QUAD_BATCH_SLOT,
+  QUAD_BATCH_CROP
+};
+
+struct quad_instance {
+  GLfloat rect[4];
+  GLfloat slot;
+  GLfloat crop[4];
+};
+
+struct engine_quad_batch {
+  struct engine* engine;
+  struct shader shader[QUAD_BATCH_KIND_COUNT];
+  enum quad_batch_kind kind; // Of the textures in the current batch
+  GLuint vao;
+  GLuint geometry; // Static unit quad, uploaded once
+  GLuint instances; // Per quad data, refilled on every flush
+  GLuint instance_capacity; // Size of the instances buffer, in quads
+  unsigned slot_count;
+  unsigned texture_count;
+  struct dma_gl_texture* texture[QUAD_BATCH_MAX_SLOTS];
+  size_t count, capacity;
+  struct quad_instance* quad;
+};
+
+static void delete_programs(struct engine_quad_batch* batch){
+  for(unsigned kind=0; kind<QUAD_BATCH_KIND_COUNT; kind++){
+    struct shader* shader = &batch->shader[kind];
+    if(shader->program)
+      engine_gl_delete_program(batch->engine, shader->program);
+    if(shader->vertex)
+      glDeleteShader(shader->vertex);
+    if(shader->fragment)
+      glDeleteShader(shader->fragment);
+  }
+}
+
+struct engine_quad_batch* engine_quad_batch_create(struct engine* engine){
+  struct engine_quad_batch* batch = calloc(1, sizeof(*batch));
+  if(!batch){
+    perror("calloc failed");
+    goto error;
+  }
+  batch->engine = engine;
+
+  batch->capacity = QUAD_BATCH_INITIAL_CAPACITY;
+  batch->quad = malloc(batch->capacity * sizeof(*batch->quad));
+  if(!batch->quad){
+    perror("malloc failed");
+    goto error_after_calloc;
+  }
+
+  GLint units = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &units);
+  batch->slot_count = units < QUAD_BATCH_MAX_SLOTS ? (units > 0 ? units : 1) : QUAD_BATCH_MAX_SLOTS;
+
+  static const char* const defines[QUAD_BATCH_KIND_COUNT] = {
+    [QUAD_BATCH_EXTERNAL] = 0,
+    [QUAD_BATCH_2D] = "#define SAMPLER sampler2D\n"
+  };
+  for(unsigned kind=0; kind<QUAD_BATCH_KIND_COUNT; kind++){
+    if(engine_load_create_shader_program(
+      &batch->shader[kind],
+      .vertex_shader = "shader/quad_batch.vs",
+      .fragment_shader = "shader/quad_batch.fs",
+      .defines = defines[kind]
+    ) == -1){
+      fprintf(stderr, "engine_load_create_shader_program failed\n");
+      goto error_after_program;
+    }
+    GLuint program = batch->shader[kind].program;
+    GLint textures = glGetUniformLocation(program, "textures");
+    if(textures == -1){
+      fprintf(stderr, "quad_batch shader is missing the textures uniform\n");
+      goto error_after_program;
+    }
+    // Slot N always samples texture unit N, only the bindings change
+    engine_gl_use_program(engine, program);
+    GLint unit[QUAD_BATCH_MAX_SLOTS];
+    for(unsigned i=0; i<QUAD_BATCH_MAX_SLOTS; i++)
+      unit[i] = i < batch->slot_count ? i : 0;
+    glUniform1iv(textures, QUAD_BATCH_MAX_SLOTS, unit);
+  }
+
+  static const GLfloat quad[][2] = { {0, 0}, {1, 0}, {0, 1}, {1, 1} };
+  while(glGetError() != GL_NO_ERROR); // Clear previouse errors
+  glGenVertexArrays(1, &batch->vao);
+  glGenBuffers(1, &batch->geometry);
+  glGenBuffers(1, &batch->instances);
+  engine_gl_bind_vertex_array(engine, batch->vao);
+
+  engine_gl_bind_array_buffer(engine, batch->geometry);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+  glVertexAttribPointer(QUAD_BATCH_CORNER, 2, GL_FLOAT, false, 0, 0);
+  glEnableVertexAttribArray(QUAD_BATCH_CORNER);
+
+  engine_gl_bind_array_buffer(engine, batch->instances);
+  glVertexAttribPointer(QUAD_BATCH_RECT, 4, GL_FLOAT, false, sizeof(struct quad_instance), (void*)offsetof(struct quad_instance, rect));
+  glVertexAttribDivisor(QUAD_BATCH_RECT, 1);
+  glEnableVertexAttribArray(QUAD_BATCH_RECT);
+  glVertexAttribPointer(QUAD_BATCH_SLOT, 1, GL_FLOAT, false, sizeof(struct quad_instance), (void*)offsetof(struct quad_instance, slot));
+  glVertexAttribDivisor(QUAD_BATCH_SLOT, 1);
+  glEnableVertexAttribArray(QUAD_BATCH_SLOT);
+  glVertexAttribPointer(QUAD_BATCH_CROP, 4, GL_FLOAT, false, sizeof(struct quad_instance), (void*)offsetof(struct quad_instance, crop));
+  glVertexAttribDivisor(QUAD_BATCH_CROP, 1);
+  glEnableVertexAttribArray(QUAD_BATCH_CROP);
+
+  if(glGetError() != GL_NO_ERROR){
+    fprintf(stderr, "Failed to set up the quad batch vertex buffers\n");
+    goto error_after_buffers;
+  }
+
+  return batch;
+
+error_after_buffers:
+  engine_gl_delete_buffers(engine, 1, &batch->instances);
+  engine_gl_delete_buffers(engine, 1, &batch->geometry);
+  engine_gl_delete_vertex_arrays(engine, 1, &batch->vao);
+error_after_program:
+  delete_programs(batch);
+  free(batch->quad);
+error_after_calloc:
+  free(batch);
+error:
+  return 0;
+}
+
+void engine_quad_batch_destroy(struct engine_quad_batch* batch){
+  if(!batch)
+    return;
+  engine_gl_delete_buffers(batch->engine, 1, &batch->instances);
+  engine_gl_delete_buffers(batch->engine, 1, &batch->geometry);
+  engine_gl_delete_vertex_arrays(batch->engine, 1, &batch->vao);
+  delete_programs(batch);
+  free(batch->quad);
+  free(batch);
+}
+
+// Only the quads showing a new frame have to be recomposed
+static void add_damage(struct engine_quad_batch* batch){
+  struct engine* engine = batch->engine;
+  if(engine->redraw_policy != ENGINE_REDRAW_ON_CHANGE || engine->damage_full)
+    return;
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  for(size_t i=0; i<batch->count; i++){
+    const struct quad_instance* quad = &batch->quad[i];
+    if(!engine_dma_texture_changed(batch->texture[(unsigned)quad->slot]))
+      continue;
+    // Round outwards, so the edges are always included
+    int x0 = viewport[0] + floorf((quad->rect[0] + 1) / 2 * viewport[2]);
+    int y0 = viewport[1] + floorf((quad->rect[1] + 1) / 2 * viewport[3]);
+    int x1 = viewport[0] + ceilf((quad->rect[0] + quad->rect[2] + 1) / 2 * viewport[2]);
+    int y1 = viewport[1] + ceilf((quad->rect[1] + quad->rect[3] + 1) / 2 * viewport[3]);
+    engine_damage_add(engine, x0, y0, x1 - x0, y1 - y0);
+  }
+}
+
+void engine_quad_batch_flush(struct engine_quad_batch* batch){
+  if(!batch->count)
+    return;
+
+  add_damage(batch);
+
+  struct engine* engine = batch->engine;
+  engine_gl_use_program(engine, batch->shader[batch->kind].program);
+  for(unsigned i=0; i<batch->texture_count; i++)
+    engine_gl_bind_texture(engine, i, engine_dma_texture_get_gl_type(batch->texture[i]), engine_dma_texture_get_gl_texture(batch->texture[i]));
+
+  engine_gl_bind_vertex_array(engine, batch->vao);
+  engine_gl_bind_array_buffer(engine, batch->instances);
+  size_t size = batch->count * sizeof(*batch->quad);
+  if(batch->count > batch->instance_capacity){
+    glBufferData(GL_ARRAY_BUFFER, batch->capacity * sizeof(*batch->quad), 0, GL_STREAM_DRAW);
+    batch->instance_capacity = batch->capacity;
+  }else{
+    // Orphan the old storage, so we don't have to wait for the previous draw to finish reading it
+    glBufferData(GL_ARRAY_BUFFER, batch->instance_capacity * sizeof(*batch->quad), 0, GL_STREAM_DRAW);
+  }
+  glBufferSubData(GL_ARRAY_BUFFER, 0, size, batch->quad);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, batch->count);
+
+  batch->count = 0;
+  batch->texture_count = 0;
+}
+
+int engine_quad_batch_add(struct engine_quad_batch* batch, struct engine_quad quad){
+  if(!quad.texture){
+    fprintf(stderr, "engine_quad_batch_add: no texture\n");
+    return -1;
+  }
+
+  // A sampler array has one type, a batch can't mix external & 2D textures
+  enum quad_batch_kind kind = engine_dma_texture_get_gl_type(quad.texture) == GL_TEXTURE_2D ? QUAD_BATCH_2D : QUAD_BATCH_EXTERNAL;
+  if(kind != batch->kind){
+    engine_quad_batch_flush(batch);
+    batch->kind = kind;
+  }
+
+  unsigned slot = 0;
+  while(slot < batch->texture_count && batch->texture[slot] != quad.texture)
+    slot++;
+  if(slot == batch->slot_count){
+    // Out of texture units, draw what we have & start over
+    engine_quad_batch_flush(batch);
+    slot = 0;
+  }
+  if(slot == batch->texture_count)
+    batch->texture[batch->texture_count++] = quad.texture;
+
+  if(batch->count == batch->capacity){
+    size_t capacity = batch->capacity * 2;
+    struct quad_instance* tmp = realloc(batch->quad, capacity * sizeof(*batch->quad));
+    if(!tmp){
+      perror("realloc failed");
+      return -1;
+    }
+    batch->quad = tmp;
+    batch->capacity = capacity;
+  }
+
+  struct quad_instance* instance = &batch->quad[batch->count++];
+  *instance = (struct quad_instance){
+    .rect = { quad.x, quad.y, quad.width, quad.height },
+    .slot = slot
+  };
+  engine_dma_texture_get_crop(quad.texture, instance->crop);
+  return 0;
+}
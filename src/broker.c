@@ -0,0 +1,536 @@
+#define _GNU_SOURCE // accept4
+#include <sys/socket.h>
+#include <internal/engine.h>
+#include <internal/capture.h>
+#include <internal/broker.h>
+#include <internal/trace.h>
+#include <export_protocol.h>
+#include <ipc.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#define BROKER_MAX_CLIENTS 16 // Keeps the buffer reference counts well within a uint8_t
+#define BROKER_CONNECT_TIMEOUT_MS 2000
+
+struct broker_client {
+  int fd;
+  uint32_t held; // Bitmask of buffers sent & not released yet
+  int pending; // Newest frame it didn't get yet because it holds too many, -1 if none
+  struct broker_client* next;
+};
+
+struct engine_broker {
+  char* path;
+  int listen_fd;
+  unsigned count;
+  uint32_t generation; // Of the buffers, counts engine_i_broker_set_buffers
+  struct engine_export_message buffer[ENGINE_MAX_BUFFERS]; // The ENGINE_EXPORT_BUFFER messages
+  int fd[ENGINE_MAX_BUFFERS][ENGINE_EXPORT_MAX_PLANES];
+  unsigned client_count;
+  struct broker_client* clients;
+};
+
+static void buffers_close(struct engine_broker* broker){
+  for(unsigned i=0; i<broker->count; i++)
+    for(unsigned j=0; j<ENGINE_EXPORT_MAX_PLANES; j++)
+      if(broker->fd[i][j] != -1)
+        close(broker->fd[i][j]);
+}
+
+// Replaces the ENGINE_EXPORT_BUFFER messages & their fds. On failure, buffers_close cleans up what was set.
+static int buffers_set(struct engine_broker* broker, unsigned count, const struct engine_dmabuf buffer[]){
+  buffers_close(broker);
+  broker->count = count;
+  for(unsigned i=0; i<count; i++)
+    for(unsigned j=0; j<ENGINE_EXPORT_MAX_PLANES; j++)
+      broker->fd[i][j] = -1;
+
+  for(unsigned i=0; i<count; i++){
+    const struct engine_dmabuf* b = &buffer[i];
+    if(b->plane_count > ENGINE_EXPORT_MAX_PLANES){
+      fprintf(stderr, "Can't share buffers with %u planes\n", b->plane_count);
+      return -1;
+    }
+    broker->buffer[i] = (struct engine_export_message){
+      .version = ENGINE_EXPORT_PROTOCOL_VERSION,
+      .type = ENGINE_EXPORT_BUFFER,
+      .buffer = i,
+      .buffer_count = count,
+      .fourcc = b->fourcc,
+      .width = b->width,
+      .height = b->height,
+      .plane_count = b->plane_count,
+      .modifier = b->modifier,
+      .color_space = b->color_space,
+      .range = b->range,
+      .generation = broker->generation
+    };
+    for(unsigned j=0; j<b->plane_count; j++){
+      broker->buffer[i].offset[j] = b->plane[j].offset;
+      broker->buffer[i].pitch[j] = b->plane[j].pitch;
+      broker->fd[i][j] = fcntl(b->plane[j].fd, F_DUPFD_CLOEXEC, 0);
+      if(broker->fd[i][j] == -1){
+        perror("fcntl F_DUPFD_CLOEXEC");
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int send_buffers(struct engine_broker* broker, int fd){
+  for(unsigned i=0; i<broker->count; i++){
+    if(engine_ipc_send(fd, &broker->buffer[i], sizeof(broker->buffer[i]), broker->fd[i], broker->buffer[i].plane_count) == -1){
+      fprintf(stderr, "Failed to send the camera buffers to a broker client: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+struct engine_broker* engine_i_broker_create(const char* path, unsigned count, const struct engine_dmabuf buffer[]){
+  struct engine_broker* broker = calloc(1, sizeof(*broker));
+  if(!broker){
+    perror("calloc failed");
+    goto error;
+  }
+  if(buffers_set(broker, count, buffer) == -1)
+    goto error_after_calloc;
+
+  broker->path = strdup(path);
+  if(!broker->path){
+    perror("strdup failed");
+    goto error_after_calloc;
+  }
+  broker->listen_fd = engine_ipc_listen(path);
+  if(broker->listen_fd == -1)
+    goto error_after_path;
+
+  return broker;
+
+error_after_path:
+  free(broker->path);
+error_after_calloc:
+  buffers_close(broker);
+  free(broker);
+error:
+  return 0;
+}
+
+// Everything the client held can be reused
+static void client_drop(struct capture_stream* stream, struct broker_client* client){
+  struct engine_broker* broker = stream->broker;
+  for(struct broker_client** it=&broker->clients; *it; it=&(*it)->next){
+    if(*it == client){
+      *it = client->next;
+      broker->client_count--;
+      break;
+    }
+  }
+  for(unsigned i=0; i<stream->count; i++)
+    if(client->held & (1u << i))
+      engine_i_capture_unref(stream, i);
+  if(client->pending != -1)
+    engine_i_capture_unref(stream, client->pending);
+  close(client->fd);
+  free(client);
+}
+
+int engine_i_broker_set_buffers(struct engine_broker* broker, unsigned count, const struct engine_dmabuf buffer[]){
+  broker->generation++;
+  if(buffers_set(broker, count, buffer) == -1)
+    return -1;
+  for(struct broker_client** it=&broker->clients; *it; ){
+    struct broker_client* client = *it;
+    client->held = 0; // Went away with the old buffers, releases of them are ignored
+    client->pending = -1;
+    if(send_buffers(broker, client->fd) == -1){
+      *it = client->next;
+      broker->client_count--;
+      close(client->fd);
+      free(client);
+      continue;
+    }
+    it = &client->next;
+  }
+  return 0;
+}
+
+void engine_i_broker_destroy(struct engine_broker* broker){
+  if(!broker)
+    return;
+  while(broker->clients){ // Not streaming anymore, so there is nothing to requeue
+    struct broker_client* client = broker->clients;
+    broker->clients = client->next;
+    close(client->fd);
+    free(client);
+  }
+  close(broker->listen_fd);
+  unlink(broker->path);
+  free(broker->path);
+  buffers_close(broker);
+  free(broker);
+}
+
+unsigned engine_i_broker_poll_count(struct engine_broker* broker){
+  return 1 + broker->client_count;
+}
+
+unsigned engine_i_broker_poll_fds(struct engine_broker* broker, struct pollfd pfd[]){
+  unsigned n = 0;
+  pfd[n++] = (struct pollfd){ .fd = broker->listen_fd, .events = POLLIN };
+  for(struct broker_client* it=broker->clients; it; it=it->next)
+    pfd[n++] = (struct pollfd){ .fd = it->fd, .events = POLLIN };
+  return n;
+}
+
+// Takes a reference which the client gives back with ENGINE_EXPORT_RELEASE
+static int client_send(struct capture_stream* stream, struct broker_client* client, unsigned index){
+  const struct engine_frame_info* frame = &stream->frame[index];
+  struct engine_export_message message = {
+    .version = ENGINE_EXPORT_PROTOCOL_VERSION,
+    .type = ENGINE_EXPORT_FRAME,
+    .buffer = index,
+    .sequence = frame->sequence,
+    .timestamp_ns = frame->sensor_ns,
+    .generation = stream->broker->generation
+  };
+  stream->refs[index]++;
+  client->held |= 1u << index;
+  if(engine_ipc_send(client->fd, &message, sizeof(message), 0, 0) == -1){
+    if(errno != EPIPE && errno != ECONNRESET)
+      fprintf(stderr, "Failed to send a frame to a broker client: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void accept_clients(struct capture_stream* stream){
+  struct engine_broker* broker = stream->broker;
+  while(true){
+    int fd = accept4(broker->listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd == -1){
+      if(errno != EAGAIN && errno != EINTR)
+        perror("accept4");
+      return;
+    }
+    if(broker->client_count >= BROKER_MAX_CLIENTS){
+      fprintf(stderr, "The camera is already shared with %d clients\n", BROKER_MAX_CLIENTS);
+      close(fd);
+      continue;
+    }
+    struct broker_client* client = calloc(1, sizeof(*client));
+    if(!client){
+      perror("calloc failed");
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->pending = -1;
+    client->next = broker->clients;
+    broker->clients = client;
+    broker->client_count++;
+    if(send_buffers(broker, fd) == -1)
+      client_drop(stream, client);
+  }
+}
+
+void engine_i_broker_dispatch(struct capture_stream* stream){
+  struct engine_broker* broker = stream->broker;
+  accept_clients(stream);
+  for(struct broker_client *it=broker->clients, *next; it; it=next){
+    next = it->next;
+    while(true){
+      struct engine_export_message message;
+      ssize_t size = engine_ipc_recv(it->fd, &message, sizeof(message), 0, 0, MSG_DONTWAIT);
+      if(size == -1 && errno == EAGAIN)
+        break;
+      if(size <= 0){ // Hung up or broken, everything it held can be reused
+        client_drop(stream, it);
+        break;
+      }
+      if((size_t)size != sizeof(message) || message.type != ENGINE_EXPORT_RELEASE || message.buffer >= stream->count)
+        continue;
+      if(message.generation != broker->generation)
+        continue; // Of buffers which are gone
+      if(!(it->held & (1u << message.buffer)))
+        continue;
+      it->held &= ~(1u << message.buffer);
+      engine_i_capture_unref(stream, message.buffer);
+      if(it->pending != -1){ // Its reference moves along with it
+        unsigned pending = it->pending;
+        it->pending = -1;
+        stream->refs[pending]--;
+        if(client_send(stream, it, pending) == -1){
+          client_drop(stream, it);
+          break;
+        }
+      }
+    }
+  }
+}
+
+void engine_i_broker_publish(struct capture_stream* stream, unsigned index){
+  struct engine_broker* broker = stream->broker;
+  for(struct broker_client *it=broker->clients, *next; it; it=next){
+    next = it->next;
+    if(__builtin_popcount(it->held) < ENGINE_EXPORT_MAX_HELD){
+      if(client_send(stream, it, index) == -1)
+        client_drop(stream, it);
+      continue;
+    }
+    // Drop oldest: the client gets the newest frame once it releases one
+    stream->refs[index]++;
+    if(it->pending != -1)
+      engine_i_capture_unref(stream, it->pending);
+    it->pending = index;
+  }
+}
+
+void engine_i_broker_drop_pending(struct capture_stream* stream){
+  for(struct broker_client* it=stream->broker->clients; it; it=it->next){
+    if(it->pending == -1)
+      continue;
+    unsigned pending = it->pending;
+    it->pending = -1;
+    engine_i_capture_unref(stream, pending);
+  }
+}
+
+static void remote_destroy(struct dma_gl_texture* dgt){
+  struct capture_stream* stream = dgt->update_param.vptr;
+  engine_i_capture_remove(dgt->engine, stream);
+  for(unsigned i=0; i<stream->count; i++)
+    close(stream->dmabuf[i]);
+  close(stream->fd);
+  free(stream);
+}
+
+// Receives the ENGINE_EXPORT_BUFFER messages sent after connecting & for new formats, returns the number of buffers
+static int receive_buffers(int fd, struct engine_dmabuf buffer[ENGINE_MAX_BUFFERS], uint32_t* generation){
+  unsigned count = 0, buffer_count = 1;
+  while(count < buffer_count){
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if(poll(&pfd, 1, BROKER_CONNECT_TIMEOUT_MS) != 1){
+      fprintf(stderr, "The camera broker didn't send its buffers\n");
+      goto error;
+    }
+    struct engine_export_message message;
+    int fds[ENGINE_IPC_MAX_FDS];
+    unsigned fd_count = ENGINE_IPC_MAX_FDS;
+    ssize_t size = engine_ipc_recv(fd, &message, sizeof(message), fds, &fd_count, 0);
+    if(size <= 0){
+      fprintf(stderr, "The camera broker hung up\n");
+      goto error;
+    }
+    if( (size_t)size != sizeof(message)
+     || message.version != ENGINE_EXPORT_PROTOCOL_VERSION
+     || message.type != ENGINE_EXPORT_BUFFER
+     || message.buffer != count
+     || !message.buffer_count || message.buffer_count > ENGINE_MAX_BUFFERS
+     || (count && (message.buffer_count != buffer_count || message.generation != *generation))
+     || !message.plane_count || message.plane_count > ENGINE_DMABUF_MAX_PLANES
+     || message.plane_count != fd_count
+    ){
+      fprintf(stderr, "Unexpected message from the camera broker\n");
+      for(unsigned i=0; i<fd_count; i++)
+        close(fds[i]);
+      goto error;
+    }
+    buffer_count = message.buffer_count;
+    *generation = message.generation;
+    buffer[count] = (struct engine_dmabuf){
+      .fourcc = message.fourcc,
+      .width = message.width,
+      .height = message.height,
+      .plane_count = message.plane_count,
+      .modifier = message.modifier,
+      .color_space = message.color_space,
+      .range = message.range
+    };
+    for(unsigned i=0; i<message.plane_count; i++)
+      buffer[count].plane[i] = (struct engine_dmabuf_plane){
+        .fd = fds[i],
+        .offset = message.offset[i],
+        .pitch = message.pitch[i]
+      };
+    count++;
+  }
+  return count;
+
+error:
+  for(unsigned i=0; i<count; i++)
+    for(unsigned j=0; j<buffer[i].plane_count; j++)
+      close(buffer[i].plane[j].fd);
+  return -1;
+}
+
+// Takes the buffers the broker sent for its new format, the last frame stays until one of them is bound
+static int remote_rebuffer(struct dma_gl_texture* dgt, struct capture_stream* stream){
+  struct engine_dmabuf buffer[ENGINE_MAX_BUFFERS];
+  engine_i_capture_remove(dgt->engine, stream);
+  for(unsigned i=0; i<stream->count; i++)
+    close(stream->dmabuf[i]);
+  stream->count = 0;
+  engine_i_dma_texture_retire_images(dgt, true);
+
+  int count = receive_buffers(stream->fd, buffer, &stream->generation);
+  if(count == -1)
+    return -1;
+  if(engine_i_dma_texture_import(dgt, count, buffer) == -1){
+    for(int i=0; i<count; i++)
+      for(unsigned j=0; j<buffer[i].plane_count; j++)
+        close(buffer[i].plane[j].fd);
+    return -1;
+  }
+  dgt->width = buffer[0].width;
+  dgt->height = buffer[0].height;
+  stream->count = count;
+  for(int i=0; i<count; i++){
+    stream->dmabuf[i] = buffer[i].plane[0].fd;
+    for(unsigned j=1; j<buffer[i].plane_count; j++)
+      close(buffer[i].plane[j].fd);
+  }
+  if(engine_i_capture_add(dgt->engine, stream) == -1)
+    return -1;
+  dgt->generation++;
+  dgt->engine->redraw_requested = true;
+  return 0;
+}
+
+static int remote_update(struct dma_gl_texture* dgt){
+  struct capture_stream* stream = dgt->update_param.vptr;
+  if(atomic_exchange(&stream->source_changed, false)){
+    if(remote_rebuffer(dgt, stream) == -1)
+      fprintf(stderr, "Taking the new buffers of the camera broker failed, the camera is stopped\n");
+    return 0;
+  }
+  return engine_i_capture_bind(dgt, stream);
+}
+
+struct dma_gl_texture* engine_i_broker_texture_create(struct engine* engine, const char* path){
+  struct dma_gl_texture* result = 0;
+  struct capture_stream* stream = 0;
+  struct engine_dmabuf buffer[ENGINE_MAX_BUFFERS];
+  uint32_t generation = 0;
+  int count = 0;
+
+  int fd = engine_ipc_connect(path);
+  if(fd == -1){
+    fprintf(stderr, "Failed to connect to the camera broker at %s: %s\n", path, strerror(errno));
+    goto error;
+  }
+
+  count = receive_buffers(fd, buffer, &generation);
+  if(count == -1)
+    goto error_after_connect;
+
+  result = engine_dma_texture_create(engine, count, buffer);
+  if(!result){
+    fprintf(stderr, "failed to create texture from the brokers buffers\n");
+    goto error_after_buffers;
+  }
+
+  stream = calloc(1, sizeof(*stream));
+  if(!stream){
+    perror("calloc failed");
+    goto error_after_texture;
+  }
+  // Releases must never block the capture thread
+  if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1){
+    perror("fcntl O_NONBLOCK");
+    goto error_after_stream;
+  }
+  stream->fd = fd;
+  stream->remote = true;
+  stream->generation = generation;
+  stream->count = count;
+  // Kept for implicit sync, the first plane is enough to wait for the GPU
+  for(int i=0; i<count; i++){
+    stream->dmabuf[i] = buffer[i].plane[0].fd;
+    for(unsigned j=1; j<buffer[i].plane_count; j++)
+      close(buffer[i].plane[j].fd);
+  }
+  count = 0;
+
+  stream->stats = result->stats;
+  if(engine_i_capture_add(engine, stream) == -1){
+    fprintf(stderr, "failed to start receiving frames from the camera broker\n");
+    goto error_after_stream;
+  }
+
+  result->update_callback = remote_update;
+  result->release_callback = engine_i_capture_texture_release;
+  result->destroy_callback = remote_destroy;
+  result->update_param.vptr = stream;
+
+  return result;
+
+error_after_stream:
+  for(unsigned i=0; i<stream->count; i++)
+    close(stream->dmabuf[i]);
+  free(stream);
+error_after_texture:
+  engine_dma_texture_destroy(result);
+error_after_buffers:
+  for(int i=0; i<count; i++)
+    for(unsigned j=0; j<buffer[i].plane_count; j++)
+      close(buffer[i].plane[j].fd);
+error_after_connect:
+  close(fd);
+error:
+  return 0;
+}
+
+int engine_i_broker_client_receive(struct capture_stream* stream){
+  while(true){
+    struct engine_export_message message;
+    // New buffers are taken by the render thread, the stream isn't polled until then. See remote_update.
+    if(recv(stream->fd, &message, sizeof(message), MSG_PEEK | MSG_DONTWAIT) == sizeof(message) && message.type == ENGINE_EXPORT_BUFFER){
+      atomic_store(&stream->source_changed, true);
+      return -1;
+    }
+    int fd[ENGINE_IPC_MAX_FDS];
+    unsigned fd_count = ENGINE_IPC_MAX_FDS;
+    ssize_t size = engine_ipc_recv(stream->fd, &message, sizeof(message), fd, &fd_count, MSG_DONTWAIT);
+    if(size == -1 && errno == EAGAIN)
+      return -1;
+    if(size <= 0){
+      fprintf(stderr, "The camera broker hung up\n");
+      stream->failed = true;
+      return -1;
+    }
+    for(unsigned i=0; i<fd_count; i++)
+      close(fd[i]); // The broker doesn't send fences, the camera is done with a buffer once it's dequeued
+    if((size_t)size != sizeof(message) || message.type != ENGINE_EXPORT_FRAME || message.buffer >= stream->count)
+      continue;
+    if(stream->out & (1u << message.buffer))
+      continue; // We still have it, the broker is confused
+    struct engine_frame_info* frame = &stream->frame[message.buffer];
+    frame->dequeue_ns = engine_i_time_ns();
+    frame->sequence = message.sequence;
+    frame->sensor_ns = message.timestamp_ns;
+    return message.buffer;
+  }
+}
+
+int engine_i_broker_client_release(struct capture_stream* stream, unsigned index){
+  struct engine_export_message message = {
+    .version = ENGINE_EXPORT_PROTOCOL_VERSION,
+    .type = ENGINE_EXPORT_RELEASE,
+    .buffer = index,
+    .sequence = stream->frame[index].sequence,
+    .generation = stream->generation
+  };
+  if(engine_ipc_send(stream->fd, &message, sizeof(message), 0, 0) == -1){
+    if(!stream->failed)
+      perror("Failed to release a buffer to the camera broker");
+    return -1;
+  }
+  return 0;
+}
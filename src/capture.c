@@ -0,0 +1,643 @@
+#include <time.h>
+#include <linux/videodev2.h>
+#include <linux/dma-buf.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <internal/engine.h>
+#include <internal/capture.h>
+#include <internal/broker.h>
+#include <internal/trace.h>
+#include <internal/stats.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+
+struct engine_capture {
+  EGLDisplay display;
+  pthread_t thread;
+  pthread_t fence_thread; // Waits for EGL fences without an fd, they can't be polled
+  pthread_mutex_t lock;
+  pthread_cond_t fence_cond; // Signaled when fence_wait is set, or the fence thread is done with it
+  EGLSyncKHR fence_wait; // Fence the fence thread waits for, EGL_NO_SYNC_KHR if none. Not destroyed until it's done.
+  int wake; // eventfd, used to interrupt poll
+  int notify; // eventfd, signaled whenever a new buffer is ready for the render thread
+  atomic_bool stop;
+  unsigned generation; // changes whenever the stream list does
+  struct capture_stream* streams;
+};
+
+struct poll_source {
+  struct capture_stream* stream;
+  int buffer; // Index of the buffer whose fence_fd is polled, -1 for the device, -2 for a broker socket
+};
+
+static void signal_eventfd(int fd){
+  uint64_t one = 1;
+  if(write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    perror("write eventfd");
+}
+
+static void wake(struct engine_capture* capture){
+  signal_eventfd(capture->wake);
+}
+
+static void buffer_init(struct capture_stream* stream, struct v4l2_buffer* buf, struct v4l2_plane planes[VIDEO_MAX_PLANES]){
+  memset(buf, 0, sizeof(*buf));
+  buf->type = stream->type;
+  buf->memory = V4L2_MEMORY_MMAP;
+  if(stream->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE){
+    memset(planes, 0, sizeof(*planes) * VIDEO_MAX_PLANES);
+    buf->m.planes = planes;
+    buf->length = stream->mem_planes;
+  }
+}
+
+// ioctl on one of the streams fds, counted on the statistics page. Running out of buffers or events isn't an error.
+static int stream_ioctl(struct capture_stream* stream, int fd, unsigned long request, void* arg){
+  int ret = ioctl(fd, request, arg);
+  if(stream->stats){
+    struct engine_stats_capture* stats = &stream->stats->capture;
+    stats_write_begin(&stats->seq);
+    stats_add(&stats->ioctls, 1);
+    if(ret == -1 && errno != EAGAIN && errno != ENOENT)
+      stats_add(&stats->ioctl_errors, 1);
+    stats_write_end(&stats->seq);
+  }
+  return ret;
+}
+
+static int queue_buffer(struct capture_stream* stream, unsigned index){
+  if(stream->remote){
+    if(engine_i_broker_client_release(stream, index) == -1)
+      return -1;
+  }else{
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    buffer_init(stream, &buf, planes);
+    buf.index = index;
+    if(stream_ioctl(stream, stream->fd, VIDIOC_QBUF, &buf) == -1){
+      perror("VIDIOC_QBUF");
+      return -1;
+    }
+  }
+  stream->out &= ~(1u << index);
+  return 0;
+}
+
+void engine_i_capture_unref(struct capture_stream* stream, unsigned index){
+  if(stream->refs[index] && --stream->refs[index])
+    return;
+  queue_buffer(stream, index);
+}
+
+// Implicit sync fallback: a sync_file which signals once everything accessing the buffer, like the GPU, is done
+static int export_sync_file(struct capture_stream* stream, unsigned index){
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+  if(stream->no_sync_file || stream->dmabuf[index] == -1)
+    return -1;
+  struct dma_buf_export_sync_file data = {
+    .flags = DMA_BUF_SYNC_WRITE, // The camera is going to write, so wait for the readers too
+    .fd = -1
+  };
+  if(stream_ioctl(stream, stream->dmabuf[index], DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &data) == -1){
+    if(errno != EINTR)
+      stream->no_sync_file = true; // Kernel older than 6.0, or an exporter without reservation objects
+    return -1;
+  }
+  return data.fd;
+#else
+  (void)stream;
+  (void)index;
+  return -1;
+#endif
+}
+
+static void requeue_released(struct capture_stream* stream){
+  uint32_t released = atomic_exchange(&stream->released, 0);
+  for(unsigned i=0; released; i++, released >>= 1){
+    if(!(released & 1) || !(stream->out & (1u << i)))
+      continue;
+    if(stream->fence_fd[i] == -1 && stream->fence[i] == EGL_NO_SYNC_KHR)
+      stream->fence_fd[i] = export_sync_file(stream, i);
+    if(stream->fence_fd[i] != -1 || stream->fence[i] != EGL_NO_SYNC_KHR){
+      stream->waiting |= 1u << i;
+    }else{
+      engine_i_capture_unref(stream, i);
+    }
+  }
+}
+
+// Requeues the buffers whose fence signaled. Returns whether some still wait for an fd-less EGL fence.
+static bool requeue_signaled(struct engine_capture* capture, struct capture_stream* stream){
+  bool egl_pending = false;
+  for(unsigned i=0; i<stream->count; i++){
+    if(!(stream->waiting & (1u << i)))
+      continue;
+    if(stream->fence[i] != EGL_NO_SYNC_KHR && stream->fence[i] == capture->fence_wait){
+      egl_pending = true; // The fence thread still uses it, it wakes us once it's done
+    }else if(engine_i_capture_fence_signaled(capture->display, stream, i)){
+      stream->waiting &= ~(1u << i);
+      engine_i_capture_unref(stream, i);
+    }else if(stream->fence[i] != EGL_NO_SYNC_KHR){
+      egl_pending = true;
+    }
+  }
+  return egl_pending;
+}
+
+// Returns the index of the buffer, -1 if there is none
+static int dequeue_buffer(struct capture_stream* stream){
+  while(true){
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    buffer_init(stream, &buf, planes);
+    if(stream_ioctl(stream, stream->fd, VIDIOC_DQBUF, &buf) == -1){
+      if(errno != EAGAIN){
+        perror("VIDIOC_DQBUF");
+        stream->failed = true; // Don't spin on a stream that keeps reporting errors
+      }
+      return -1;
+    }
+    if(buf.index >= stream->count){
+      fprintf(stderr, "VIDIOC_DQBUF returned unknown buffer %u\n", buf.index);
+      continue;
+    }
+    struct engine_frame_info* frame = &stream->frame[buf.index];
+    frame->dequeue_ns = engine_i_time_ns();
+    frame->sequence = buf.sequence;
+    if((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC){
+      frame->sensor_ns = (uint64_t)buf.timestamp.tv_sec * 1000000000u + (uint64_t)buf.timestamp.tv_usec * 1000u;
+    }else{
+      frame->sensor_ns = 0;
+    }
+    return buf.index;
+  }
+}
+
+// For the statistics page, once per received frame
+static void count_frame(struct capture_stream* stream, unsigned index, bool superseded){
+  struct engine_stats_capture* stats = &stream->stats->capture;
+  uint32_t sequence = stream->frame[index].sequence;
+  int32_t gap = sequence - stream->sequence; // Negative if the source started over
+  stats_write_begin(&stats->seq);
+  stats_add(&stats->frames, 1);
+  if(stream->sequenced && gap > 1)
+    stats_add(&stats->dropped, gap - 1);
+  if(superseded)
+    stats_add(&stats->superseded, 1);
+  stats_write_end(&stats->seq);
+  stream->sequence = sequence;
+  stream->sequenced = true;
+}
+
+// Returns whether a new buffer was published
+static bool dequeue_ready(struct capture_stream* stream){
+  bool published = false;
+  while(true){
+    int index = stream->remote ? engine_i_broker_client_receive(stream) : dequeue_buffer(stream);
+    if(index == -1)
+      return published || atomic_load(&stream->source_changed); // A broker's new buffers, the render thread has to see it
+    stream->out |= 1u << index;
+    stream->refs[index] = 1; // The render threads, until it's done with it or it's superseded
+    if(stream->broker)
+      engine_i_broker_publish(stream, index);
+    // Publish the newest buffer. If the render thread didn't pick up the last one, it's dropped.
+    unsigned previous = atomic_exchange(&stream->ready, index + 1);
+    bool superseded = previous && previous - 1 != (unsigned)index;
+    if(superseded)
+      engine_i_capture_unref(stream, previous - 1);
+    if(stream->stats)
+      count_frame(stream, index, superseded);
+    published = true;
+  }
+}
+
+// Returns whether the source changed its format. The stream is stopped then, until the render thread set it up again.
+static bool dequeue_events(struct capture_stream* stream){
+  bool changed = false;
+  struct v4l2_event event;
+  while(stream_ioctl(stream, stream->fd, VIDIOC_DQEVENT, &event) == 0)
+    if(event.type == V4L2_EVENT_SOURCE_CHANGE && (event.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION))
+      changed = true;
+  if(changed)
+    atomic_store(&stream->source_changed, true);
+  return changed;
+}
+
+// Whether the driver has any buffer left to fill. If not, polling the fd would just report POLLERR.
+static bool can_capture(struct capture_stream* stream){
+  if(stream->failed || atomic_load(&stream->source_changed))
+    return false;
+  if(stream->remote) // The socket has to be watched for hangups either way
+    return true;
+  uint32_t all = stream->count < 32 ? (1u << stream->count) - 1 : ~0u;
+  if((stream->out & all) != all)
+    return true;
+  // Rather than stalling, take back the frames slow broker clients didn't get yet
+  if(stream->broker){
+    engine_i_broker_drop_pending(stream);
+    if((stream->out & all) != all)
+      return true;
+  }
+  atomic_store(&stream->starving, true);
+  // Pairs with engine_i_capture_release: either we see the release here, or it sees starving & wakes us
+  if(atomic_load(&stream->released)){
+    requeue_released(stream);
+    atomic_store(&stream->starving, false);
+    return (stream->out & all) != all;
+  }
+  return false;
+}
+
+// Hands the first fd-less EGL fence still pending to the fence thread, unless it's busy already
+static void fence_wait_start(struct engine_capture* capture){
+  if(capture->fence_wait != EGL_NO_SYNC_KHR)
+    return;
+  for(struct capture_stream* it=capture->streams; it; it=it->next){
+    for(unsigned i=0; i<it->count; i++){
+      if((it->waiting & (1u << i)) && it->fence[i] != EGL_NO_SYNC_KHR){
+        capture->fence_wait = it->fence[i];
+        pthread_cond_broadcast(&capture->fence_cond);
+        return;
+      }
+    }
+  }
+}
+
+static void* fence_thread(void* x){
+  struct engine_capture* capture = x;
+  pthread_mutex_lock(&capture->lock);
+  while(true){
+    while(!atomic_load(&capture->stop) && capture->fence_wait == EGL_NO_SYNC_KHR)
+      pthread_cond_wait(&capture->fence_cond, &capture->lock);
+    if(atomic_load(&capture->stop))
+      break;
+    EGLSyncKHR fence = capture->fence_wait;
+    pthread_mutex_unlock(&capture->lock);
+    // The render thread flushed after creating it, so it signals without further help
+    if(eglClientWaitSyncKHR(capture->display, fence, 0, EGL_FOREVER_KHR) == EGL_FALSE)
+      fprintf(stderr, "eglClientWaitSyncKHR failed (eglError: %d)\n", eglGetError());
+    pthread_mutex_lock(&capture->lock);
+    capture->fence_wait = EGL_NO_SYNC_KHR;
+    pthread_cond_broadcast(&capture->fence_cond);
+    wake(capture);
+  }
+  pthread_mutex_unlock(&capture->lock);
+  return 0;
+}
+
+static void* capture_thread(void* x){
+  struct engine_capture* capture = x;
+  size_t size = 0;
+  struct pollfd* pfd = 0;
+  struct poll_source* source = 0;
+
+  while(!atomic_load(&capture->stop)){
+    pthread_mutex_lock(&capture->lock);
+    unsigned generation = capture->generation;
+    size_t n = 1;
+    for(struct capture_stream* it=capture->streams; it; it=it->next)
+      n += 1 + it->count + (it->broker ? engine_i_broker_poll_count(it->broker) : 0);
+    if(n > size){
+      struct pollfd* npfd = realloc(pfd, n * sizeof(*pfd));
+      if(npfd) pfd = npfd;
+      struct poll_source* nsource = realloc(source, n * sizeof(*source));
+      if(nsource) source = nsource;
+      if(!npfd || !nsource){
+        pthread_mutex_unlock(&capture->lock);
+        perror("realloc failed");
+        break;
+      }
+      size = n;
+    }
+    pfd[0] = (struct pollfd){ .fd = capture->wake, .events = POLLIN };
+    n = 1;
+    for(struct capture_stream* it=capture->streams; it; it=it->next){
+      if(can_capture(it)){ // May also move released buffers to waiting
+        pfd[n] = (struct pollfd){ .fd = it->fd, .events = it->events ? POLLIN|POLLPRI : POLLIN };
+        source[n++] = (struct poll_source){ it, -1 };
+      }
+      for(unsigned i=0; i<it->count; i++){
+        if(!(it->waiting & (1u << i)) || it->fence_fd[i] == -1)
+          continue;
+        pfd[n] = (struct pollfd){ .fd = it->fence_fd[i], .events = POLLIN };
+        source[n++] = (struct poll_source){ it, i };
+      }
+      if(it->broker){
+        unsigned count = engine_i_broker_poll_fds(it->broker, &pfd[n]);
+        for(unsigned i=0; i<count; i++)
+          source[n++] = (struct poll_source){ it, -2 };
+      }
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    if(poll(pfd, n, -1) == -1){
+      if(errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    if(pfd[0].revents & POLLIN){
+      uint64_t value;
+      if(read(capture->wake, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        perror("read eventfd");
+    }
+
+    bool published = false;
+    bool egl_pending = false;
+    pthread_mutex_lock(&capture->lock);
+    for(struct capture_stream* it=capture->streams; it; it=it->next){
+      atomic_store(&it->starving, false);
+      requeue_released(it);
+      egl_pending |= requeue_signaled(capture, it);
+    }
+    if(egl_pending)
+      fence_wait_start(capture);
+    if(generation == capture->generation){ // Otherwise, the streams in source may be gone already
+      struct capture_stream* serviced = 0;
+      for(size_t i=1; i<n; i++){
+        if(source[i].buffer == -1 && (pfd[i].revents & POLLPRI))
+          published |= dequeue_events(source[i].stream); // The render thread has to see it
+        if(source[i].buffer == -1 && (pfd[i].revents & (POLLIN|POLLERR)) && !atomic_load(&source[i].stream->source_changed))
+          published |= dequeue_ready(source[i].stream);
+        if(source[i].buffer == -2 && pfd[i].revents && source[i].stream != serviced){
+          serviced = source[i].stream; // One call handles all sockets of the broker
+          engine_i_broker_dispatch(serviced);
+        }
+      }
+    }
+    pthread_mutex_unlock(&capture->lock);
+    if(published)
+      signal_eventfd(capture->notify);
+  }
+
+  free(pfd);
+  free(source);
+  return 0;
+}
+
+static void fence_thread_stop(struct engine_capture* capture){
+  pthread_mutex_lock(&capture->lock);
+  atomic_store(&capture->stop, true);
+  pthread_cond_broadcast(&capture->fence_cond);
+  pthread_mutex_unlock(&capture->lock);
+  pthread_join(capture->fence_thread, 0);
+}
+
+static struct engine_capture* capture_create(EGLDisplay display){
+  struct engine_capture* capture = calloc(1, sizeof(*capture));
+  if(!capture){
+    perror("calloc failed");
+    goto error;
+  }
+  capture->display = display;
+  capture->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(capture->wake == -1){
+    perror("eventfd");
+    goto error_after_calloc;
+  }
+  capture->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(capture->notify == -1){
+    perror("eventfd");
+    goto error_after_eventfd;
+  }
+  if(pthread_mutex_init(&capture->lock, 0)){
+    fprintf(stderr, "pthread_mutex_init failed\n");
+    goto error_after_notify;
+  }
+  if(pthread_cond_init(&capture->fence_cond, 0)){
+    fprintf(stderr, "pthread_cond_init failed\n");
+    goto error_after_mutex;
+  }
+  capture->fence_wait = EGL_NO_SYNC_KHR;
+  if(pthread_create(&capture->fence_thread, 0, fence_thread, capture)){
+    fprintf(stderr, "pthread_create failed\n");
+    goto error_after_cond;
+  }
+  if(pthread_create(&capture->thread, 0, capture_thread, capture)){
+    fprintf(stderr, "pthread_create failed\n");
+    goto error_after_fence_thread;
+  }
+  return capture;
+error_after_fence_thread:
+  fence_thread_stop(capture);
+error_after_cond:
+  pthread_cond_destroy(&capture->fence_cond);
+error_after_mutex:
+  pthread_mutex_destroy(&capture->lock);
+error_after_notify:
+  close(capture->notify);
+error_after_eventfd:
+  close(capture->wake);
+error_after_calloc:
+  free(capture);
+error:
+  return 0;
+}
+
+int engine_i_capture_add(struct engine* engine, struct capture_stream* stream){
+  if(stream->count > ENGINE_MAX_BUFFERS){
+    fprintf(stderr, "capture streams are limited to %d buffers\n", ENGINE_MAX_BUFFERS);
+    return -1;
+  }
+  if(!engine->capture){
+    engine->capture = capture_create(engine->display);
+    if(!engine->capture)
+      return -1;
+  }
+  struct engine_capture* capture = engine->capture;
+  atomic_init(&stream->ready, 0);
+  atomic_init(&stream->released, 0);
+  atomic_init(&stream->starving, false);
+  atomic_init(&stream->source_changed, false);
+  stream->out = stream->remote ? 0 : ~0u; // Remote buffers start out at the broker
+  stream->waiting = 0;
+  stream->no_sync_file = false;
+  stream->failed = false;
+  stream->sequenced = false;
+  for(unsigned i=0; i<stream->count; i++){
+    stream->fence_fd[i] = -1;
+    stream->fence[i] = EGL_NO_SYNC_KHR;
+    stream->refs[i] = 0;
+  }
+  if(!stream->remote){
+    for(unsigned i=0; i<stream->count; i++)
+      if(queue_buffer(stream, i) == -1)
+        return -1;
+    if(ioctl(stream->fd, VIDIOC_STREAMON, &(enum v4l2_buf_type){stream->type})){
+      perror("VIDIOC_STREAMON");
+      return -1;
+    }
+  }
+  pthread_mutex_lock(&capture->lock);
+  stream->next = capture->streams;
+  capture->streams = stream;
+  capture->generation++;
+  pthread_mutex_unlock(&capture->lock);
+  wake(capture);
+  return 0;
+}
+
+void engine_i_capture_remove(struct engine* engine, struct capture_stream* stream){
+  struct engine_capture* capture = engine->capture;
+  if(!capture)
+    return;
+  pthread_mutex_lock(&capture->lock);
+  for(struct capture_stream** it=&capture->streams; *it; it=&(*it)->next){
+    if(*it == stream){
+      *it = stream->next;
+      break;
+    }
+  }
+  capture->generation++;
+  // Its fences can't go away while the fence thread waits for one
+  for(unsigned i=0; i<stream->count; i++)
+    while(stream->fence[i] != EGL_NO_SYNC_KHR && stream->fence[i] == capture->fence_wait)
+      pthread_cond_wait(&capture->fence_cond, &capture->lock);
+  pthread_mutex_unlock(&capture->lock);
+  wake(capture);
+  if(!stream->remote)
+    ioctl(stream->fd, VIDIOC_STREAMOFF, &(enum v4l2_buf_type){stream->type});
+  engine_i_capture_fences_destroy(capture->display, stream);
+}
+
+void engine_i_capture_destroy(struct engine* engine){
+  struct engine_capture* capture = engine->capture;
+  if(!capture)
+    return;
+  fence_thread_stop(capture);
+  wake(capture);
+  pthread_join(capture->thread, 0);
+  pthread_cond_destroy(&capture->fence_cond);
+  pthread_mutex_destroy(&capture->lock);
+  close(capture->notify);
+  close(capture->wake);
+  free(capture);
+  engine->capture = 0;
+}
+
+int engine_i_capture_wait(struct engine* engine, int fd){
+  struct engine_capture* capture = engine->capture;
+  if(!capture)
+    return -1;
+  pthread_mutex_lock(&capture->lock);
+  bool streaming = capture->streams;
+  pthread_mutex_unlock(&capture->lock);
+  if(!streaming) // Nothing could ever wake us up
+    return -1;
+  struct pollfd pfd[2] = {
+    { .fd = capture->notify, .events = POLLIN },
+    { .fd = fd, .events = POLLIN }
+  };
+  while(poll(pfd, fd == -1 ? 1 : 2, -1) == -1){
+    if(errno != EINTR){
+      perror("poll");
+      return -1;
+    }
+  }
+  uint64_t value;
+  if((pfd[0].revents & POLLIN) && read(capture->notify, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    perror("read eventfd");
+  return 0;
+}
+
+int engine_i_capture_acquire(struct capture_stream* stream){
+  unsigned ready = atomic_exchange(&stream->ready, 0);
+  return (int)ready - 1;
+}
+
+void engine_i_capture_release(struct engine* engine, struct capture_stream* stream, unsigned index){
+  // Draws sampling the buffer may still be in flight, the producer must not reuse it before they finished
+  stream->fence_fd[index] = -1;
+  stream->fence[index] = EGL_NO_SYNC_KHR;
+  if(engine->native_fence_sync){
+    EGLSyncKHR sync = eglCreateSyncKHR(engine->display, EGL_SYNC_NATIVE_FENCE_ANDROID, (EGLint[]){
+      EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+      EGL_NONE
+    });
+    if(sync != EGL_NO_SYNC_KHR){
+      glFlush(); // The fence only gets an fd once it was submitted
+      stream->fence_fd[index] = eglDupNativeFenceFDANDROID(engine->display, sync);
+      eglDestroySyncKHR(engine->display, sync);
+    }
+  }
+  if(stream->fence_fd[index] == -1 && engine->fence_sync){
+    stream->fence[index] = eglCreateSyncKHR(engine->display, EGL_SYNC_FENCE_KHR, 0);
+    glFlush(); // Nobody else waits with EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, it would never signal otherwise
+  }
+  // If there are no fences at all, the producer falls back to implicit sync
+  engine_i_capture_release_unfenced(engine, stream, index);
+}
+
+void engine_i_capture_release_unfenced(struct engine* engine, struct capture_stream* stream, unsigned index){
+  atomic_fetch_or(&stream->released, 1u << index);
+  if(atomic_load(&stream->starving))
+    wake(engine->capture);
+}
+
+int engine_i_capture_texture_update(struct dma_gl_texture* dgt){
+  return engine_i_capture_bind(dgt, dgt->update_param.vptr);
+}
+
+int engine_i_capture_bind(struct dma_gl_texture* dgt, struct capture_stream* stream){
+  // The capture thread did all the dequeuing already, this is just an atomic exchange
+  int index = engine_i_capture_acquire(stream);
+  if(index == -1)
+    return 0;
+
+  if((unsigned)index >= dgt->image_count){ // The images of new buffers are still being imported
+    engine_i_capture_release_unfenced(dgt->engine, stream, index);
+    return 0;
+  }
+  dgt->texture = dgt->image_texture[index];
+  dgt->frame = stream->frame[index];
+
+  // The previous image isn't sampled from anymore, the camera can have it back. Unless the compositor still has it.
+  if(dgt->current != -1 && !(dgt->held & (1u << dgt->current)))
+    engine_i_capture_release(dgt->engine, stream, dgt->current);
+  dgt->current = index;
+
+  return 1;
+}
+
+void engine_i_capture_texture_release(struct dma_gl_texture* dgt, unsigned index){
+  // The compositor's reads are waited for through implicit sync, if the stream knows the dmabuf
+  engine_i_capture_release_unfenced(dgt->engine, dgt->update_param.vptr, index);
+}
+
+bool engine_i_capture_fence_signaled(EGLDisplay display, struct capture_stream* stream, unsigned index){
+  if(stream->fence_fd[index] != -1){
+    struct pollfd pfd = { .fd = stream->fence_fd[index], .events = POLLIN };
+    if(poll(&pfd, 1, 0) == 0)
+      return false;
+    close(stream->fence_fd[index]);
+    stream->fence_fd[index] = -1;
+  }
+  if(stream->fence[index] != EGL_NO_SYNC_KHR){
+    EGLint result = eglClientWaitSyncKHR(display, stream->fence[index], 0, 0);
+    if(result == EGL_TIMEOUT_EXPIRED_KHR)
+      return false;
+    if(result == EGL_FALSE)
+      fprintf(stderr, "eglClientWaitSyncKHR failed (eglError: %d)\n", eglGetError());
+    eglDestroySyncKHR(display, stream->fence[index]);
+    stream->fence[index] = EGL_NO_SYNC_KHR;
+  }
+  return true;
+}
+
+void engine_i_capture_fences_destroy(EGLDisplay display, struct capture_stream* stream){
+  for(unsigned i=0; i<stream->count; i++){
+    if(stream->fence_fd[i] != -1)
+      close(stream->fence_fd[i]);
+    if(stream->fence[i] != EGL_NO_SYNC_KHR)
+      eglDestroySyncKHR(display, stream->fence[i]);
+    stream->fence_fd[i] = -1;
+    stream->fence[i] = EGL_NO_SYNC_KHR;
+  }
+  stream->waiting = 0;
+}
@@ -0,0 +1,269 @@
+#include <internal/convert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+void engine_i_convert_coefficients(struct engine_i_convert_coefficients* c, enum engine_yuv_color_space color_space, enum engine_yuv_range range){
+  double kr = 0.299, kb = 0.114; // BT.601, also what cameras which don't say anything usually mean
+  if(color_space == ENGINE_YUV_COLOR_SPACE_BT709){
+    kr = 0.2126;
+    kb = 0.0722;
+  }else if(color_space == ENGINE_YUV_COLOR_SPACE_BT2020){
+    kr = 0.2627;
+    kb = 0.0593;
+  }
+  double kg = 1 - kr - kb;
+  bool full = range == ENGINE_YUV_RANGE_FULL;
+  double ys = full ? 1 : 255.0 / 219, cs = full ? 1 : 255.0 / 224;
+  c->y = ys * 64 + 0.5;
+  c->y_offset = full ? 0 : 16;
+  c->rv = 2 * (1 - kr) * cs * 64 + 0.5;
+  c->gu = 2 * kb * (1 - kb) / kg * cs * 64 + 0.5;
+  c->gv = 2 * kr * (1 - kr) / kg * cs * 64 + 0.5;
+  c->bu = 2 * (1 - kb) * cs * 64 + 0.5;
+}
+
+bool engine_i_convert_supported(uint32_t fourcc){
+  return fourcc == ENGINE_FOURCC('Y','U','Y','V') || fourcc == ENGINE_FOURCC('N','V','1','2');
+}
+
+/* Scalar reference */
+
+static inline uint8_t clamp8(int x){
+  return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static inline void pixel(uint8_t* dst, int y, int u, int v, const struct engine_i_convert_coefficients* c){
+  int l = (y - c->y_offset) * c->y + 32;
+  u -= 128;
+  v -= 128;
+  dst[0] = clamp8((l + v * c->rv) >> 6);
+  dst[1] = clamp8((l - u * c->gu - v * c->gv) >> 6);
+  dst[2] = clamp8((l + u * c->bu) >> 6);
+  dst[3] = 255;
+}
+
+static void scalar_yuyv(const uint8_t* src, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c){
+  for(unsigned x=0; x+1<width; x+=2, src+=4, dst+=8){
+    pixel(dst, src[0], src[1], src[3], c);
+    pixel(dst + 4, src[2], src[1], src[3], c);
+  }
+  if(width & 1)
+    pixel(dst, src[0], src[1], src[3], c);
+}
+
+static void scalar_nv12(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c){
+  for(unsigned x=0; x<width; x++)
+    pixel(dst + x * 4, y[x], uv[x & ~1u], uv[x | 1], c);
+}
+
+static const struct engine_i_convert_kernel scalar = { "scalar", scalar_yuyv, scalar_nv12 };
+
+#ifdef CONVERT_X86
+
+/* SSE2: 8 pixels at a time */
+
+// y has the luma of 8 pixels, uv the 4 chroma pairs shared by them, all as 16 bit values
+__attribute__((target("sse2")))
+static inline void sse2_pixels(__m128i y, __m128i uv, uint8_t* dst, const struct engine_i_convert_coefficients* c){
+  const __m128i low = _mm_set1_epi32(0xFFFF);
+  uv = _mm_sub_epi16(uv, _mm_set1_epi16(128));
+  __m128i u = _mm_and_si128(uv, low);
+  u = _mm_or_si128(u, _mm_slli_epi32(u, 16)); // U0 U0 U1 U1 ...
+  __m128i v = _mm_srli_epi32(uv, 16);
+  v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+  __m128i l = _mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(c->y_offset)), _mm_set1_epi16(c->y));
+  l = _mm_add_epi16(l, _mm_set1_epi16(32));
+  __m128i r = _mm_adds_epi16(l, _mm_mullo_epi16(v, _mm_set1_epi16(c->rv)));
+  __m128i g = _mm_subs_epi16(_mm_subs_epi16(l, _mm_mullo_epi16(u, _mm_set1_epi16(c->gu))), _mm_mullo_epi16(v, _mm_set1_epi16(c->gv)));
+  __m128i b = _mm_adds_epi16(l, _mm_mullo_epi16(u, _mm_set1_epi16(c->bu)));
+  r = _mm_packus_epi16(_mm_srai_epi16(r, 6), _mm_setzero_si128());
+  g = _mm_packus_epi16(_mm_srai_epi16(g, 6), _mm_setzero_si128());
+  b = _mm_packus_epi16(_mm_srai_epi16(b, 6), _mm_setzero_si128());
+  __m128i rg = _mm_unpacklo_epi8(r, g);
+  __m128i ba = _mm_unpacklo_epi8(b, _mm_set1_epi8(-1));
+  _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi16(rg, ba));
+  _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(rg, ba));
+}
+
+__attribute__((target("sse2")))
+static void sse2_yuyv(const uint8_t* src, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c){
+  unsigned x = 0;
+  for(; x+8<=width; x+=8){
+    __m128i p = _mm_loadu_si128((const __m128i*)(src + x * 2));
+    sse2_pixels(_mm_and_si128(p, _mm_set1_epi16(0xFF)), _mm_srli_epi16(p, 8), dst + x * 4, c);
+  }
+  scalar_yuyv(src + x * 2, dst + x * 4, width - x, c);
+}
+
+__attribute__((target("sse2")))
+static void sse2_nv12(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c){
+  unsigned x = 0;
+  for(; x+8<=width; x+=8){
+    __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + x)), _mm_setzero_si128());
+    __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(uv + x)), _mm_setzero_si128());
+    sse2_pixels(l, p, dst + x * 4, c);
+  }
+  scalar_nv12(y + x, uv + x, dst + x * 4, width - x, c);
+}
+
+static const struct engine_i_convert_kernel sse2 = { "sse2", sse2_yuyv, sse2_nv12 };
+
+/* AVX2: 16 pixels at a time, the same steps as SSE2 in both 128 bit lanes */
+
+__attribute__((target("avx2")))
+static inline void avx2_pixels(__m256i y, __m256i uv, uint8_t* dst, const struct engine_i_convert_coefficients* c){
+  const __m256i low = _mm256_set1_epi32(0xFFFF);
+  uv = _mm256_sub_epi16(uv, _mm256_set1_epi16(128));
+  __m256i u = _mm256_and_si256(uv, low);
+  u = _mm256_or_si256(u, _mm256_slli_epi32(u, 16));
+  __m256i v = _mm256_srli_epi32(uv, 16);
+  v = _mm256_or_si256(v, _mm256_slli_epi32(v, 16));
+  __m256i l = _mm256_mullo_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(c->y_offset)), _mm256_set1_epi16(c->y));
+  l = _mm256_add_epi16(l, _mm256_set1_epi16(32));
+  __m256i r = _mm256_adds_epi16(l, _mm256_mullo_epi16(v, _mm256_set1_epi16(c->rv)));
+  __m256i g = _mm256_subs_epi16(_mm256_subs_epi16(l, _mm256_mullo_epi16(u, _mm256_set1_epi16(c->gu))), _mm256_mullo_epi16(v, _mm256_set1_epi16(c->gv)));
+  __m256i b = _mm256_adds_epi16(l, _mm256_mullo_epi16(u, _mm256_set1_epi16(c->bu)));
+  r = _mm256_packus_epi16(_mm256_srai_epi16(r, 6), _mm256_setzero_si256());
+  g = _mm256_packus_epi16(_mm256_srai_epi16(g, 6), _mm256_setzero_si256());
+  b = _mm256_packus_epi16(_mm256_srai_epi16(b, 6), _mm256_setzero_si256());
+  __m256i rg = _mm256_unpacklo_epi8(r, g);
+  __m256i ba = _mm256_unpacklo_epi8(b, _mm256_set1_epi8(-1));
+  __m256i lo = _mm256_unpacklo_epi16(rg, ba); // Pixels 0-3 & 8-11
+  __m256i hi = _mm256_unpackhi_epi16(rg, ba); // Pixels 4-7 & 12-15
+  _mm256_storeu_si256((__m256i*)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+  _mm256_storeu_si256((__m256i*)(dst + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void avx2_yuyv(const uint8_t* src, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c){
+  unsigned x = 0;
+  for(; x+16<=width; x+=16){
+    __m256i p = _mm256_loadu_si256((const __m256i*)(src + x * 2));
+    avx2_pixels(_mm256_and_si256(p, _mm256_set1_epi16(0xFF)), _mm256_srli_epi16(p, 8), dst + x * 4, c);
+  }
+  sse2_yuyv(src + x * 2, dst + x * 4, width - x, c);
+}
+
+__attribute__((target("avx2")))
+static void avx2_nv12(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c){
+  unsigned x = 0;
+  for(; x+16<=width; x+=16){
+    __m256i l = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(y + x)));
+    __m256i p = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(uv + x)));
+    avx2_pixels(l, p, dst + x * 4, c);
+  }
+  sse2_nv12(y + x, uv + x, dst + x * 4, width - x, c);
+}
+
+static const struct engine_i_convert_kernel avx2 = { "avx2", avx2_yuyv, avx2_nv12 };
+
+#endif
+
+#ifdef __ARM_NEON
+
+/* NEON: 16 pixels at a time, split into the even & odd ones which share their chroma */
+
+static inline uint8x8_t neon_channel(int16x8_t x){
+  return vqmovun_s16(vshrq_n_s16(x, 6));
+}
+
+static inline void neon_pixels(uint8x8_t even, uint8x8_t odd, uint8x8_t u8, uint8x8_t v8, uint8_t* dst, const struct engine_i_convert_coefficients* c){
+  int16x8_t u = vreinterpretq_s16_u16(vsubl_u8(u8, vdup_n_u8(128)));
+  int16x8_t v = vreinterpretq_s16_u16(vsubl_u8(v8, vdup_n_u8(128)));
+  int16x8_t rv = vmulq_n_s16(v, c->rv);
+  int16x8_t guv = vaddq_s16(vmulq_n_s16(u, c->gu), vmulq_n_s16(v, c->gv)); // Can't overflow, both are small
+  int16x8_t bu = vmulq_n_s16(u, c->bu);
+  uint8x8_t r[2], g[2], b[2];
+  uint8x8_t y8[2] = { even, odd };
+  for(int i=0; i<2; i++){
+    int16x8_t l = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y8[i])), vdupq_n_s16(c->y_offset)), c->y);
+    l = vaddq_s16(l, vdupq_n_s16(32));
+    r[i] = neon_channel(vqaddq_s16(l, rv));
+    g[i] = neon_channel(vqsubq_s16(l, guv));
+    b[i] = neon_channel(vqaddq_s16(l, bu));
+  }
+  uint8x8x2_t rz = vzip_u8(r[0], r[1]), gz = vzip_u8(g[0], g[1]), bz = vzip_u8(b[0], b[1]);
+  uint8x16x4_t rgba = {{
+    vcombine_u8(rz.val[0], rz.val[1]),
+    vcombine_u8(gz.val[0], gz.val[1]),
+    vcombine_u8(bz.val[0], bz.val[1]),
+    vdupq_n_u8(255)
+  }};
+  vst4q_u8(dst, rgba);
+}
+
+static void neon_yuyv(const uint8_t* src, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c){
+  unsigned x = 0;
+  for(; x+16<=width; x+=16){
+    uint8x8x4_t p = vld4_u8(src + x * 2); // Y even, U, Y odd, V
+    neon_pixels(p.val[0], p.val[2], p.val[1], p.val[3], dst + x * 4, c);
+  }
+  scalar_yuyv(src + x * 2, dst + x * 4, width - x, c);
+}
+
+static void neon_nv12(const uint8_t* y, const uint8_t* uv, uint8_t* dst, unsigned width, const struct engine_i_convert_coefficients* c){
+  unsigned x = 0;
+  for(; x+16<=width; x+=16){
+    uint8x8x2_t l = vld2_u8(y + x);
+    uint8x8x2_t p = vld2_u8(uv + x);
+    neon_pixels(l.val[0], l.val[1], p.val[0], p.val[1], dst + x * 4, c);
+  }
+  scalar_nv12(y + x, uv + x, dst + x * 4, width - x, c);
+}
+
+static const struct engine_i_convert_kernel neon = { "neon", neon_yuyv, neon_nv12 };
+
+#endif
+
+size_t engine_i_convert_kernels(const struct engine_i_convert_kernel* list[], size_t max){
+  size_t count = 0;
+  if(count < max)
+    list[count++] = &scalar;
+#ifdef CONVERT_X86
+  __builtin_cpu_init();
+  if(count < max && __builtin_cpu_supports("sse2"))
+    list[count++] = &sse2;
+  if(count < max && __builtin_cpu_supports("sse2") && __builtin_cpu_supports("avx2"))
+    list[count++] = &avx2;
+#endif
+#ifdef __ARM_NEON
+  if(count < max)
+    list[count++] = &neon;
+#endif
+  return count;
+}
+
+const struct engine_i_convert_kernel* engine_i_convert_kernel(void){
+  const struct engine_i_convert_kernel* list[4];
+  size_t count = engine_i_convert_kernels(list, sizeof(list)/sizeof(*list));
+  const char* name = getenv("ENGINE_CONVERT");
+  if(name && *name){
+    for(size_t i=0; i<count; i++)
+      if(!strcmp(list[i]->name, name))
+        return list[i];
+    fprintf(stderr, "ENGINE_CONVERT: %s isn't available, using %s\n", name, list[count-1]->name);
+  }
+  return list[count-1];
+}
+
+void engine_i_convert_frame(
+  const struct engine_i_convert_kernel* kernel, const struct engine_i_convert_coefficients* c,
+  uint32_t fourcc, unsigned width, unsigned height,
+  const uint8_t* const plane[], const uint32_t pitch[], uint8_t* dst, size_t dst_pitch
+){
+  if(fourcc == ENGINE_FOURCC('Y','U','Y','V')){
+    for(unsigned y=0; y<height; y++)
+      kernel->yuyv(plane[0] + (size_t)y * pitch[0], dst + y * dst_pitch, width, c);
+  }else if(fourcc == ENGINE_FOURCC('N','V','1','2')){
+    for(unsigned y=0; y<height; y++)
+      kernel->nv12(plane[0] + (size_t)y * pitch[0], plane[1] + (size_t)(y / 2) * pitch[1], dst + y * dst_pitch, width, c);
+  }
+}
@@ -0,0 +1,141 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <internal/engine.h>
+
+struct headless {
+  EGLint width, height;
+};
+
+static EGLDisplay get_display(void){
+  const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if(client_extensions && strstr(client_extensions, "EGL_MESA_platform_surfaceless")){
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(getPlatformDisplay){
+      EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, 0);
+      if(display != EGL_NO_DISPLAY)
+        return display;
+    }
+  }
+  // Some implementations support pbuffers on the default display without any window system
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+static int init_egl(struct engine* engine, struct headless* hd){
+  engine->display = get_display();
+  if( engine->display == EGL_NO_DISPLAY ){
+    fprintf(stderr, "Got no EGL display.\n");
+    return -1;
+  }
+
+  if(!eglInitialize(engine->display, 0, 0)){
+    fprintf(stderr, "Unable to initialize EGL (eglError: %d)\n", eglGetError());
+    engine->display = EGL_NO_DISPLAY;
+    return -1;
+  }
+
+  EGLint attr[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_RENDERABLE_TYPE,
+    EGL_OPENGL_ES2_BIT,
+    EGL_NONE
+  };
+
+  EGLint num_config;
+  if( !eglChooseConfig(engine->display, attr, &engine->config, 1, &num_config) || num_config != 1 ){
+    fprintf(stderr, "Failed to choose a pbuffer config (eglError: %d)\n", eglGetError());
+    goto error;
+  }
+
+  engine->surface = eglCreatePbufferSurface(engine->display, engine->config, (EGLint[]){
+    EGL_WIDTH, hd->width,
+    EGL_HEIGHT, hd->height,
+    EGL_NONE
+  });
+  if( engine->surface == EGL_NO_SURFACE ){
+    fprintf(stderr, "Unable to create EGL pbuffer surface (eglError: %d)\n", eglGetError());
+    goto error;
+  }
+
+  EGLint ctxattr[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE
+  };
+  engine->context = eglCreateContext(engine->display, engine->config, EGL_NO_CONTEXT, ctxattr);
+  if( engine->context == EGL_NO_CONTEXT ){
+    fprintf(stderr, "Unable to create EGL context (eglError: %d)\n", eglGetError());
+    goto error_after_surface;
+  }
+
+  return 0;
+
+error_after_surface:
+  eglDestroySurface(engine->display, engine->surface);
+  engine->surface = EGL_NO_SURFACE;
+error:
+  eglTerminate(engine->display);
+  engine->display = EGL_NO_DISPLAY;
+  return -1;
+}
+
+static int init(struct engine* engine){
+  struct headless* hd = calloc(1, sizeof(struct headless));
+  if(!hd){
+    perror("calloc failed");
+    return -1;
+  }
+
+  hd->width = 800;
+  hd->height = 600;
+  const char* size = getenv("ENGINE_HEADLESS_SIZE");
+  if(size && (sscanf(size, "%dx%d", &hd->width, &hd->height) != 2 || hd->width <= 0 || hd->height <= 0)){
+    fprintf(stderr, "ENGINE_HEADLESS_SIZE must look like 1920x1080\n");
+    free(hd);
+    return -1;
+  }
+
+  if(init_egl(engine, hd) == -1){
+    // No usable GPU, retry with a software rasterizer like llvmpipe
+    const char* software = getenv("LIBGL_ALWAYS_SOFTWARE");
+    if(software && !strcmp(software, "1")){
+      free(hd);
+      return -1;
+    }
+    fprintf(stderr, "Retrying with a software renderer\n");
+    setenv("LIBGL_ALWAYS_SOFTWARE", "1", 1);
+    if(init_egl(engine, hd) == -1){
+      free(hd);
+      return -1;
+    }
+  }
+
+  engine->driver_private = hd;
+
+  // There is nothing to sync to, run as fast as the pipeline can
+  eglMakeCurrent(engine->display, engine->surface, engine->surface, engine->context);
+  eglSwapInterval(engine->display, 0);
+
+  return 0;
+}
+
+static void destroy(struct engine* engine){
+  free(engine->driver_private);
+}
+
+static void before_drawing(struct engine* engine){
+  struct headless* hd = engine->driver_private;
+  glViewport(0, 0, hd->width, hd->height);
+}
+
+static struct engine_display_driver display_driver = {
+  .name = "headless",
+  .fallback = true,
+  .init = init,
+  .destroy = destroy,
+  .before_drawing = before_drawing
+};
+ENGINE_REGISTER_DISPLAY_DRIVER(&display_driver)
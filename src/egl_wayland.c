@@ -0,0 +1,479 @@
+#define _POSIX_C_SOURCE 200809L
+#include <wayland-client.h>
+#include <wayland-egl.h>
+#include <xdg-shell-client-protocol.h>
+#include <viewporter-client-protocol.h>
+#include <linux-dmabuf-unstable-v1-client-protocol.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <internal/engine.h>
+
+/*
+ * Wayland display driver. Textures passed to engine_passthrough are shown without drawing: their dmabufs become
+ * wl_buffers through zwp_linux_dmabuf_v1 & are attached to a subsurface, scaled by wp_viewporter. The compositor
+ * may put them on a plane & scan them out directly. Everything else is drawn with EGL into the main surface.
+ */
+
+struct dmabuf_format {
+  uint32_t fourcc;
+  uint64_t modifier;
+};
+
+struct wayland {
+  struct wl_display* display;
+  struct wl_registry* registry;
+  struct wl_compositor* compositor;
+  struct wl_subcompositor* subcompositor;
+  struct xdg_wm_base* wm_base;
+  struct wp_viewporter* viewporter; // 0 if the compositor doesn't have it, nothing is shown directly then
+  struct zwp_linux_dmabuf_v1* dmabuf; // Likewise
+  struct dmabuf_format* format; // What the compositor can import
+  size_t format_count;
+  struct wl_surface* surface;
+  struct xdg_surface* xdg_surface;
+  struct xdg_toplevel* toplevel;
+  struct wl_egl_window* egl_window;
+  int width, height;
+  int pending_width, pending_height; // From the last xdg_toplevel.configure, 0 to keep the size
+  bool configured;
+  bool closed; // The compositor asked to close the window
+  // Directly shown buffers go here
+  struct wl_surface* video;
+  struct wl_subsurface* subsurface;
+  struct wp_viewport* viewport;
+  bool video_mapped;
+  int32_t position[2]; // Of the subsurface, applied with the next commit of the main surface
+};
+
+// A buffer of a texture, as the compositor knows it
+struct wayland_buffer {
+  struct wl_buffer* buffer;
+  struct dma_gl_texture* dgt;
+  unsigned index;
+};
+
+static void add_format(struct wayland* wl, uint32_t fourcc, uint64_t modifier){
+  struct dmabuf_format* format = realloc(wl->format, (wl->format_count + 1) * sizeof(*format));
+  if(!format){
+    perror("realloc failed");
+    return;
+  }
+  format[wl->format_count++] = (struct dmabuf_format){ fourcc, modifier };
+  wl->format = format;
+}
+
+static bool format_supported(struct wayland* wl, uint32_t fourcc, uint64_t modifier){
+  for(size_t i=0; i<wl->format_count; i++)
+    if(wl->format[i].fourcc == fourcc && wl->format[i].modifier == modifier)
+      return true;
+  return false;
+}
+
+static void dmabuf_format(void* data, struct zwp_linux_dmabuf_v1* dmabuf, uint32_t fourcc){
+  (void)dmabuf;
+  add_format(data, fourcc, ENGINE_DRM_FORMAT_MOD_INVALID); // Before version 3, only implicit modifiers
+}
+
+static void dmabuf_modifier(void* data, struct zwp_linux_dmabuf_v1* dmabuf, uint32_t fourcc, uint32_t hi, uint32_t lo){
+  (void)dmabuf;
+  uint64_t modifier = (uint64_t)hi << 32 | lo;
+  if(!format_supported(data, fourcc, modifier))
+    add_format(data, fourcc, modifier);
+}
+
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+  .format = dmabuf_format,
+  .modifier = dmabuf_modifier
+};
+
+static void wm_base_ping(void* data, struct xdg_wm_base* wm_base, uint32_t serial){
+  (void)data;
+  xdg_wm_base_pong(wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+  .ping = wm_base_ping
+};
+
+static void registry_global(void* data, struct wl_registry* registry, uint32_t name, const char* interface, uint32_t version){
+  struct wayland* wl = data;
+  if(!strcmp(interface, wl_compositor_interface.name)){
+    wl->compositor = wl_registry_bind(registry, name, &wl_compositor_interface, version < 4 ? version : 4);
+  }else if(!strcmp(interface, wl_subcompositor_interface.name)){
+    wl->subcompositor = wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
+  }else if(!strcmp(interface, xdg_wm_base_interface.name)){
+    wl->wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+    xdg_wm_base_add_listener(wl->wm_base, &wm_base_listener, wl);
+  }else if(!strcmp(interface, wp_viewporter_interface.name)){
+    wl->viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+  }else if(!strcmp(interface, zwp_linux_dmabuf_v1_interface.name) && version >= 2){
+    // Version 3 lists the modifiers, later ones only announce them through feedback objects
+    wl->dmabuf = wl_registry_bind(registry, name, &zwp_linux_dmabuf_v1_interface, version < 3 ? version : 3);
+    zwp_linux_dmabuf_v1_add_listener(wl->dmabuf, &dmabuf_listener, wl);
+  }
+}
+
+static void registry_global_remove(void* data, struct wl_registry* registry, uint32_t name){
+  (void)data;
+  (void)registry;
+  (void)name;
+}
+
+static const struct wl_registry_listener registry_listener = {
+  .global = registry_global,
+  .global_remove = registry_global_remove
+};
+
+static void toplevel_configure(void* data, struct xdg_toplevel* toplevel, int32_t width, int32_t height, struct wl_array* states){
+  (void)toplevel;
+  (void)states;
+  struct wayland* wl = data;
+  wl->pending_width = width;
+  wl->pending_height = height;
+}
+
+static void toplevel_close(void* data, struct xdg_toplevel* toplevel){
+  (void)toplevel;
+  struct wayland* wl = data;
+  wl->closed = true;
+}
+
+static const struct xdg_toplevel_listener toplevel_listener = {
+  .configure = toplevel_configure,
+  .close = toplevel_close
+};
+
+static void xdg_surface_configure(void* data, struct xdg_surface* xdg_surface, uint32_t serial){
+  struct wayland* wl = data;
+  xdg_surface_ack_configure(xdg_surface, serial);
+  wl->configured = true;
+  if(wl->pending_width <= 0 || wl->pending_height <= 0)
+    return; // Up to us
+  if(wl->pending_width == wl->width && wl->pending_height == wl->height)
+    return;
+  wl->width = wl->pending_width;
+  wl->height = wl->pending_height;
+  if(wl->egl_window)
+    wl_egl_window_resize(wl->egl_window, wl->width, wl->height, 0, 0);
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+  .configure = xdg_surface_configure
+};
+
+static int init_egl(struct engine* engine, struct wayland* wl){
+  engine->display = eglGetDisplay((EGLNativeDisplayType)wl->display);
+  if( engine->display == EGL_NO_DISPLAY ){
+    fprintf(stderr, "Got no EGL display.\n");
+    return -1;
+  }
+
+  if(!eglInitialize(engine->display, 0, 0)){
+    fprintf(stderr, "Unable to initialize EGL (eglError: %d)\n", eglGetError());
+    return -1;
+  }
+
+  EGLint attr[] = {
+    EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_RENDERABLE_TYPE,
+    EGL_OPENGL_ES2_BIT,
+    EGL_NONE
+  };
+
+  EGLint num_config;
+  if( !eglChooseConfig(engine->display, attr, &engine->config, 1, &num_config) || num_config != 1 ){
+    fprintf(stderr, "Failed to choose config (eglError: %d)\n", eglGetError());
+    goto error;
+  }
+
+  wl->egl_window = wl_egl_window_create(wl->surface, wl->width, wl->height);
+  if(!wl->egl_window){
+    fprintf(stderr, "wl_egl_window_create failed\n");
+    goto error;
+  }
+
+  engine->surface = eglCreateWindowSurface(engine->display, engine->config, (EGLNativeWindowType)wl->egl_window, 0);
+  if( engine->surface == EGL_NO_SURFACE ){
+    fprintf(stderr, "Unable to create EGL surface (eglError: %d)\n", eglGetError());
+    goto error_after_egl_window;
+  }
+
+  EGLint ctxattr[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE
+  };
+  engine->context = eglCreateContext(engine->display, engine->config, EGL_NO_CONTEXT, ctxattr);
+  if( engine->context == EGL_NO_CONTEXT ){
+    fprintf(stderr, "Unable to create EGL context (eglError: %d)\n", eglGetError());
+    goto error_after_surface;
+  }
+
+  return 0;
+
+error_after_surface:
+  eglDestroySurface(engine->display, engine->surface);
+  engine->surface = EGL_NO_SURFACE;
+error_after_egl_window:
+  wl_egl_window_destroy(wl->egl_window);
+  wl->egl_window = 0;
+error:
+  eglTerminate(engine->display);
+  engine->display = EGL_NO_DISPLAY;
+  return -1;
+}
+
+// The subsurface for buffers shown directly, it starts out unmapped
+static void init_video(struct wayland* wl){
+  if(!wl->subcompositor || !wl->viewporter || !wl->dmabuf){
+    fprintf(stderr, "The compositor lacks wl_subcompositor, wp_viewporter or zwp_linux_dmabuf_v1, frames are always drawn\n");
+    return;
+  }
+  wl->video = wl_compositor_create_surface(wl->compositor);
+  wl->subsurface = wl_subcompositor_get_subsurface(wl->subcompositor, wl->video, wl->surface);
+  wl->viewport = wp_viewporter_get_viewport(wl->viewporter, wl->video);
+  // Nothing may be drawn over it, input goes to the main surface
+  struct wl_region* region = wl_compositor_create_region(wl->compositor);
+  wl_surface_set_input_region(wl->video, region);
+  wl_region_destroy(region);
+}
+
+static void destroy(struct engine* engine);
+
+static int init(struct engine* engine){
+  struct wayland* wl = calloc(1, sizeof(struct wayland));
+  if(!wl){
+    perror("calloc failed");
+    return -1;
+  }
+  engine->driver_private = wl;
+  wl->width = 800;
+  wl->height = 600;
+
+  wl->display = wl_display_connect(0);
+  if(!wl->display){
+    fprintf(stderr, "Cannot connect to a Wayland compositor\n");
+    goto error;
+  }
+  wl->registry = wl_display_get_registry(wl->display);
+  wl_registry_add_listener(wl->registry, &registry_listener, wl);
+  // The first one gets the globals, the second one the formats of zwp_linux_dmabuf_v1
+  if(wl_display_roundtrip(wl->display) == -1 || wl_display_roundtrip(wl->display) == -1){
+    fprintf(stderr, "Wayland roundtrip failed\n");
+    goto error;
+  }
+  if(!wl->compositor || !wl->wm_base){
+    fprintf(stderr, "The compositor lacks wl_compositor or xdg_wm_base\n");
+    goto error;
+  }
+
+  wl->surface = wl_compositor_create_surface(wl->compositor);
+  wl->xdg_surface = xdg_wm_base_get_xdg_surface(wl->wm_base, wl->surface);
+  xdg_surface_add_listener(wl->xdg_surface, &xdg_surface_listener, wl);
+  wl->toplevel = xdg_surface_get_toplevel(wl->xdg_surface);
+  xdg_toplevel_add_listener(wl->toplevel, &toplevel_listener, wl);
+  xdg_toplevel_set_title(wl->toplevel, "camera");
+  wl_surface_commit(wl->surface);
+  // Nothing may be attached before the first configure
+  while(!wl->configured){
+    if(wl_display_dispatch(wl->display) == -1){
+      fprintf(stderr, "Wayland connection failed\n");
+      goto error;
+    }
+  }
+
+  init_video(wl);
+
+  if(init_egl(engine, wl) == -1)
+    goto error;
+
+  return 0;
+
+error:
+  destroy(engine);
+  engine->driver_private = 0;
+  return -1;
+}
+
+static void destroy(struct engine* engine){
+  struct wayland* wl = engine->driver_private;
+  if(!wl)
+    return;
+  if(wl->egl_window)
+    wl_egl_window_destroy(wl->egl_window);
+  if(wl->viewport)
+    wp_viewport_destroy(wl->viewport);
+  if(wl->subsurface)
+    wl_subsurface_destroy(wl->subsurface);
+  if(wl->video)
+    wl_surface_destroy(wl->video);
+  if(wl->toplevel)
+    xdg_toplevel_destroy(wl->toplevel);
+  if(wl->xdg_surface)
+    xdg_surface_destroy(wl->xdg_surface);
+  if(wl->surface)
+    wl_surface_destroy(wl->surface);
+  if(wl->dmabuf)
+    zwp_linux_dmabuf_v1_destroy(wl->dmabuf);
+  if(wl->viewporter)
+    wp_viewporter_destroy(wl->viewporter);
+  if(wl->wm_base)
+    xdg_wm_base_destroy(wl->wm_base);
+  if(wl->subcompositor)
+    wl_subcompositor_destroy(wl->subcompositor);
+  if(wl->compositor)
+    wl_compositor_destroy(wl->compositor);
+  if(wl->registry)
+    wl_registry_destroy(wl->registry);
+  if(wl->display)
+    wl_display_disconnect(wl->display);
+  free(wl->format);
+  free(wl);
+}
+
+static void before_drawing(struct engine* engine){
+  struct wayland* wl = engine->driver_private;
+  glViewport(0, 0, wl->width, wl->height);
+}
+
+// The frame was drawn, the subsurface would cover it
+static void after_drawing(struct engine* engine){
+  struct wayland* wl = engine->driver_private;
+  if(!wl->video_mapped)
+    return;
+  // Synchronized, the subsurface goes away along with the swap of the drawn frame
+  wl_subsurface_set_sync(wl->subsurface);
+  wl_surface_attach(wl->video, 0, 0, 0);
+  wl_surface_commit(wl->video);
+  wl->video_mapped = false;
+}
+
+// Like XPending, only reads what already arrived
+static void dispatch(struct engine* engine){
+  struct wayland* wl = engine->driver_private;
+  int width = wl->width, height = wl->height;
+  while(wl_display_prepare_read(wl->display) != 0)
+    wl_display_dispatch_pending(wl->display);
+  if(wl_display_flush(wl->display) == -1 && errno != EAGAIN)
+    perror("wl_display_flush");
+  struct pollfd pfd = { .fd = wl_display_get_fd(wl->display), .events = POLLIN };
+  if(poll(&pfd, 1, 0) > 0){
+    wl_display_read_events(wl->display);
+  }else{
+    wl_display_cancel_read(wl->display);
+  }
+  wl_display_dispatch_pending(wl->display);
+  if(width != wl->width || height != wl->height)
+    engine_redraw_request(engine);
+  if(wl->closed)
+    engine->quit_requested = true;
+}
+
+static int get_fd(struct engine* engine){
+  struct wayland* wl = engine->driver_private;
+  return wl_display_get_fd(wl->display);
+}
+
+static void buffer_release(void* data, struct wl_buffer* buffer){
+  (void)buffer;
+  struct wayland_buffer* wb = data;
+  engine_i_dma_texture_unhold(wb->dgt, wb->index);
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+  .release = buffer_release
+};
+
+static void* buffer_import(struct engine* engine, struct dma_gl_texture* dgt, unsigned index, const struct engine_dmabuf* buffer){
+  struct wayland* wl = engine->driver_private;
+  if(!wl->video || !format_supported(wl, buffer->fourcc, buffer->modifier))
+    return 0;
+  struct wayland_buffer* wb = calloc(1, sizeof(*wb));
+  if(!wb){
+    perror("calloc failed");
+    return 0;
+  }
+  wb->dgt = dgt;
+  wb->index = index;
+  // The fds are duplicated when the requests are marshalled, the caller may close them right after
+  struct zwp_linux_buffer_params_v1* params = zwp_linux_dmabuf_v1_create_params(wl->dmabuf);
+  for(unsigned i=0; i<buffer->plane_count; i++){
+    const struct engine_dmabuf_plane* plane = &buffer->plane[i];
+    zwp_linux_buffer_params_v1_add(params, plane->fd, i, plane->offset, plane->pitch, buffer->modifier >> 32, buffer->modifier & 0xFFFFFFFF);
+  }
+  // Only formats the compositor listed get here, so it's not expected to fail
+  wb->buffer = zwp_linux_buffer_params_v1_create_immed(params, buffer->width, buffer->height, buffer->fourcc, 0);
+  zwp_linux_buffer_params_v1_destroy(params);
+  wl_buffer_add_listener(wb->buffer, &buffer_listener, wb);
+  return wb;
+}
+
+static void buffer_destroy(struct engine* engine, void* buffer){
+  (void)engine;
+  struct wayland_buffer* wb = buffer;
+  wl_buffer_destroy(wb->buffer);
+  free(wb);
+}
+
+static bool present(struct engine* engine, struct dma_gl_texture* dgt, const float rect[4]){
+  struct wayland* wl = engine->driver_private;
+  if(!wl->video || dgt->current == -1 || !dgt->display_buffer[dgt->current])
+    return false;
+  struct wayland_buffer* wb = dgt->display_buffer[dgt->current];
+
+  // From normalized device coordinates to the top left based ones of the surface
+  int32_t x = (rect[0] + 1) / 2 * wl->width;
+  int32_t y = (1 - rect[1] - rect[3]) / 2 * wl->height;
+  int32_t width = rect[2] / 2 * wl->width;
+  int32_t height = rect[3] / 2 * wl->height;
+  if(width <= 0 || height <= 0)
+    return false;
+
+  const float* crop = dgt->crop;
+  wp_viewport_set_source(wl->viewport,
+    wl_fixed_from_double(crop[0] * dgt->width), wl_fixed_from_double(crop[1] * dgt->height),
+    wl_fixed_from_double(crop[2] * dgt->width), wl_fixed_from_double(crop[3] * dgt->height)
+  );
+  wp_viewport_set_destination(wl->viewport, width, height);
+  wl_surface_attach(wl->video, wb->buffer, 0, 0);
+  wl_surface_damage_buffer(wl->video, 0, 0, INT32_MAX, INT32_MAX);
+  dgt->held |= 1u << dgt->current;
+
+  bool moved = !wl->video_mapped || x != wl->position[0] || y != wl->position[1];
+  if(moved){
+    // The position is state of the main surface, the subsurface shows up with its next commit
+    wl_subsurface_set_sync(wl->subsurface);
+    wl_subsurface_set_position(wl->subsurface, x, y);
+    wl_surface_commit(wl->video);
+    wl_surface_commit(wl->surface);
+    wl_subsurface_set_desync(wl->subsurface);
+    wl->position[0] = x;
+    wl->position[1] = y;
+  }else{
+    wl_surface_commit(wl->video); // Desynchronized, so the main surface doesn't have to be touched
+  }
+  wl->video_mapped = true;
+
+  if(wl_display_flush(wl->display) == -1 && errno != EAGAIN)
+    perror("wl_display_flush");
+  return true;
+}
+
+static struct engine_display_driver display_driver = {
+  .name = "wayland",
+  .init = init,
+  .destroy = destroy,
+  .before_drawing = before_drawing,
+  .after_drawing = after_drawing,
+  .dispatch = dispatch,
+  .get_fd = get_fd,
+  .buffer_import = buffer_import,
+  .buffer_destroy = buffer_destroy,
+  .present = present
+};
+ENGINE_REGISTER_DISPLAY_DRIVER(&display_driver)
@@ -9,6 +9,8 @@
 struct xdisplay {
   Window window;
   Display* display;
+  int width, height; // Of the window, as of the last ConfigureNotify
+  Atom wm_delete_window; // Sent by the window manager when the window is closed
 };
 
 static int init(struct engine* engine){
@@ -18,30 +20,35 @@ static int init(struct engine* engine){
     perror("calloc failed");
     return -1;
   }
-  engine->driver_private = xd;
-
   /* Create window */
   xd->display = XOpenDisplay(0);
   if(!xd->display){
     fprintf(stderr, "Cannot open display\n");
-    return -1;
+    goto error;
   }
   int screen = DefaultScreen(xd->display);
-  xd->window = XCreateSimpleWindow(xd->display, RootWindow(xd->display, screen), 50, 50, 800, 600, true, BlackPixel(xd->display, screen), BlackPixel(xd->display, screen));
-  XSelectInput(xd->display, xd->window, ExposureMask | KeyPressMask);
+  xd->width = 800;
+  xd->height = 600;
+  xd->window = XCreateSimpleWindow(xd->display, RootWindow(xd->display, screen), 50, 50, xd->width, xd->height, true, BlackPixel(xd->display, screen), BlackPixel(xd->display, screen));
+  // The size is tracked from the events, so drawing never needs a round trip to the server
+  XSelectInput(xd->display, xd->window, ExposureMask | KeyPressMask | StructureNotifyMask);
+  // Otherwise the window manager kills the connection instead of asking
+  xd->wm_delete_window = XInternAtom(xd->display, "WM_DELETE_WINDOW", False);
+  XSetWMProtocols(xd->display, xd->window, &xd->wm_delete_window, 1);
   XMapWindow(xd->display, xd->window);
 
   /* initialise egl context */
 
   engine->display = eglGetDisplay((EGLNativeDisplayType)xd->display);
   if( engine->display == EGL_NO_DISPLAY ){
-    fprintf(stderr, "Got no EGL display.");
-    return -1;
+    fprintf(stderr, "Got no EGL display.\n");
+    goto error_after_window;
   }
 
   if(!eglInitialize(engine->display, 0, 0)){
-    fprintf(stderr, "Unable to initialize EGL");
-    return -1;
+    fprintf(stderr, "Unable to initialize EGL (eglError: %d)\n", eglGetError());
+    engine->display = EGL_NO_DISPLAY;
+    goto error_after_window;
   }
 
   EGLint attr[] = {
@@ -54,18 +61,18 @@ static int init(struct engine* engine){
   EGLint num_config;
   if( !eglChooseConfig(engine->display, attr, &engine->config, 1, &num_config) ){
     fprintf(stderr, "Failed to choose config (eglError: %d)\n", eglGetError());
-    return -1;
+    goto error_after_egl;
   }
 
   if(num_config != 1) {
     fprintf(stderr, "Didn't get exactly one config, but %d\n", num_config);
-    return -1;
+    goto error_after_egl;
   }
 
   engine->surface = eglCreateWindowSurface(engine->display, engine->config, xd->window, 0);
   if( engine->surface == EGL_NO_SURFACE ){
     fprintf(stderr, "Unable to create EGL surface (eglError: %d)\n", eglGetError());
-    return -1;
+    goto error_after_egl;
   }
 
   EGLint ctxattr[] = {
@@ -75,32 +82,76 @@ static int init(struct engine* engine){
   engine->context = eglCreateContext(engine->display, engine->config, EGL_NO_CONTEXT, ctxattr);
   if( engine->context == EGL_NO_CONTEXT ){
     fprintf(stderr, "Unable to create EGL context (eglError: %d)\n", eglGetError());
-    return -1;
+    goto error_after_surface;
   }
 
+  engine->driver_private = xd;
   return 0;
+
+error_after_surface:
+  eglDestroySurface(engine->display, engine->surface);
+  engine->surface = EGL_NO_SURFACE;
+error_after_egl:
+  eglTerminate(engine->display);
+  engine->display = EGL_NO_DISPLAY;
+error_after_window:
+  XDestroyWindow(xd->display, xd->window);
+  XCloseDisplay(xd->display);
+error:
+  free(xd);
+  return -1;
 }
 
 void destroy(struct engine* engine){
   struct xdisplay* xd = engine->driver_private;
   XDestroyWindow(xd->display, xd->window);
   XCloseDisplay(xd->display);
+  free(xd);
 }
 
 void before_drawing(struct engine* engine){
   struct xdisplay* xd = engine->driver_private;
-//  XEvent event;
-//  XNextEvent(xd->display, &event); // includes keyboard input
-  XWindowAttributes gwa;
-  XGetWindowAttributes(xd->display, xd->window, &gwa);
-  glViewport(0, 0, gwa.width, gwa.height);
-  // TODO
+  glViewport(0, 0, xd->width, xd->height);
+}
+
+// XPending only reads what already arrived, it never waits for the server
+static void dispatch(struct engine* engine){
+  struct xdisplay* xd = engine->driver_private;
+  while(XPending(xd->display)){
+    XEvent event;
+    XNextEvent(xd->display, &event);
+    switch(event.type){
+      case ConfigureNotify: {
+        if(event.xconfigure.width == xd->width && event.xconfigure.height == xd->height)
+          break; // Just moved
+        xd->width = event.xconfigure.width;
+        xd->height = event.xconfigure.height;
+        engine_redraw_request(engine);
+      } break;
+      case Expose: {
+        if(!event.xexpose.count) // Only the last one of a series
+          engine_redraw_request(engine);
+      } break;
+      case ClientMessage: {
+        if((Atom)event.xclient.data.l[0] == xd->wm_delete_window)
+          engine->quit_requested = true;
+      } break;
+      default: break; // Keyboard input isn't used yet, but has to be drained
+    }
+  }
+}
+
+static int get_fd(struct engine* engine){
+  struct xdisplay* xd = engine->driver_private;
+  return ConnectionNumber(xd->display);
 }
 
 static struct engine_display_driver display_driver = {
   .name = "X11",
   .init = init,
   .destroy = destroy,
-  .before_drawing = before_drawing
+  .before_drawing = before_drawing,
+  .dispatch = dispatch,
+  .get_fd = get_fd
 };
 ENGINE_REGISTER_DISPLAY_DRIVER(&display_driver)
@@ -1,12 +1,18 @@
 #include <time.h>
-#include <linux/videodev2.h>
-#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <engine.h>
 #include <internal/engine.h>
+#include <internal/capture.h>
+#include <internal/trace.h>
+#include <internal/program_cache.h>
+#include <internal/export.h>
+#include <internal/tap.h>
+#include <internal/import.h>
+#include <internal/stats.h>
+#include <internal/profile.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -36,6 +42,58 @@ EGLBoolean eglDestroyImageKHR(EGLDisplay dpy, EGLImageKHR image){
   return destroyImageProc(dpy, image);
 }
 
+EGLBoolean eglQueryDmaBufFormatsEXT(EGLDisplay dpy, EGLint max_formats, EGLint *formats, EGLint *num_formats) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
+EGLBoolean eglQueryDmaBufFormatsEXT(EGLDisplay dpy, EGLint max_formats, EGLint *formats, EGLint *num_formats){
+  static PFNEGLQUERYDMABUFFORMATSEXTPROC queryDmaBufFormatsProc = 0;
+  if(!queryDmaBufFormatsProc)
+    queryDmaBufFormatsProc = (PFNEGLQUERYDMABUFFORMATSEXTPROC)eglGetProcAddress("eglQueryDmaBufFormatsEXT");
+  if(!queryDmaBufFormatsProc)
+    return EGL_FALSE;
+  return queryDmaBufFormatsProc(dpy, max_formats, formats, num_formats);
+}
+
+EGLBoolean eglQueryDmaBufModifiersEXT(EGLDisplay dpy, EGLint format, EGLint max_modifiers, EGLuint64KHR *modifiers, EGLBoolean *external_only, EGLint *num_modifiers) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
+EGLBoolean eglQueryDmaBufModifiersEXT(EGLDisplay dpy, EGLint format, EGLint max_modifiers, EGLuint64KHR *modifiers, EGLBoolean *external_only, EGLint *num_modifiers){
+  static PFNEGLQUERYDMABUFMODIFIERSEXTPROC queryDmaBufModifiersProc = 0;
+  if(!queryDmaBufModifiersProc)
+    queryDmaBufModifiersProc = (PFNEGLQUERYDMABUFMODIFIERSEXTPROC)eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+  if(!queryDmaBufModifiersProc)
+    return EGL_FALSE;
+  return queryDmaBufModifiersProc(dpy, format, max_modifiers, modifiers, external_only, num_modifiers);
+}
+
+EGLSyncKHR eglCreateSyncKHR(EGLDisplay dpy, EGLenum type, const EGLint *attrib_list) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
+EGLSyncKHR eglCreateSyncKHR(EGLDisplay dpy, EGLenum type, const EGLint *attrib_list){
+  static PFNEGLCREATESYNCKHRPROC createSyncProc = 0;
+  if(!createSyncProc)
+    createSyncProc = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+  return createSyncProc(dpy, type, attrib_list);
+}
+
+EGLBoolean eglDestroySyncKHR(EGLDisplay dpy, EGLSyncKHR sync) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
+EGLBoolean eglDestroySyncKHR(EGLDisplay dpy, EGLSyncKHR sync){
+  static PFNEGLDESTROYSYNCKHRPROC destroySyncProc = 0;
+  if(!destroySyncProc)
+    destroySyncProc = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+  return destroySyncProc(dpy, sync);
+}
+
+EGLint eglClientWaitSyncKHR(EGLDisplay dpy, EGLSyncKHR sync, EGLint flags, EGLTimeKHR timeout) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
+EGLint eglClientWaitSyncKHR(EGLDisplay dpy, EGLSyncKHR sync, EGLint flags, EGLTimeKHR timeout){
+  static PFNEGLCLIENTWAITSYNCKHRPROC clientWaitSyncProc = 0;
+  if(!clientWaitSyncProc)
+    clientWaitSyncProc = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+  return clientWaitSyncProc(dpy, sync, flags, timeout);
+}
+
+EGLint eglDupNativeFenceFDANDROID(EGLDisplay dpy, EGLSyncKHR sync) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
+EGLint eglDupNativeFenceFDANDROID(EGLDisplay dpy, EGLSyncKHR sync){
+  static PFNEGLDUPNATIVEFENCEFDANDROIDPROC dupNativeFenceFDProc = 0;
+  if(!dupNativeFenceFDProc)
+    dupNativeFenceFDProc = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)eglGetProcAddress("eglDupNativeFenceFDANDROID");
+  return dupNativeFenceFDProc(dpy, sync);
+}
+
 void glDebugMessageCallbackKHR(GLDEBUGPROCKHR callback, const void *userParam) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
 void glDebugMessageCallbackKHR(GLDEBUGPROCKHR callback, const void *userParam){
   static PFNGLDEBUGMESSAGECALLBACKKHRPROC debugMessageCallbackProc = 0;
@@ -57,120 +115,128 @@ void engine_i_register_display_driver(struct engine_display_driver* driver){
   display_driver_list = driver;
 }
 
-int engine_load_create_shader_program(struct shader* shader, struct engine_load_create_shader_program_params params){
-  if(params.fragment_shader){
-    shader->fragment = engine_load_shader("shader/test.fs");
-    if(!shader->fragment){
-      fprintf(stderr, "engine_load_shader failed\n");
-      return -1;
-    }
-  }
-
-  if(params.vertex_shader){
-    shader->vertex = engine_load_shader("shader/test.vs");
-    if(!shader->vertex){
-      fprintf(stderr, "engine_load_shader failed\n");
-      return -1;
-    }
-  }
-
-  shader->program = engine_create_shader_program((GLuint[]){
-    shader->vertex,
-    shader->fragment,
-  0});
-  if(!shader->program){
-    fprintf(stderr,"engine_create_shader_program failed\n");
-    return -1;
-  }
-
-  return 0;
+bool engine_i_egl_has_extension(struct engine* engine, const char* name){
+  const char* extensions = eglQueryString(engine->display, EGL_EXTENSIONS);
+  size_t length = strlen(name);
+  for(const char* it=extensions; it && (it=strstr(it, name)); it+=length)
+    if((it == extensions || it[-1] == ' ') && (it[length] == ' ' || !it[length]))
+      return true;
+  return false;
 }
 
-static void print_info_log(GLuint shader, bool shader_or_program){
-  GLint length;
-  if(shader_or_program){
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
-  }else{
-    glGetProgramiv(shader, GL_INFO_LOG_LENGTH, &length);
-  }
-  if(!length)
-    return;
-  char* log = malloc(length+1);
-  if(!log) return;
-  if(shader_or_program){
-    glGetShaderInfoLog(shader, length+1, 0, log);
-  }else{
-    glGetProgramInfoLog(shader, length+1, 0, log);
-  }
-  log[length] = 0;
-  fputs(log , stderr);
-  fputs("\n", stderr);
-  free(log);
+struct shader_source {
+  GLenum type;
+  void* mem;
+  size_t size;
+};
+
+static void shader_source_unmap(struct shader_source* source){
+  if(source->mem)
+    munmap(source->mem, source->size);
+  source->mem = 0;
 }
 
-GLuint engine_load_shader(const char* path){
+static int shader_source_map(struct shader_source* source, const char* path){
   size_t path_length = path ? strlen(path) : 0;
   if(path_length < 3){
     fprintf(stderr, "engine_load_shader called with invalid path\n");
-    return 0;
+    return -1;
   }
-  GLenum type = 0;
   if(!strcmp(path+path_length-3,".vs")){
-    type = GL_VERTEX_SHADER;
+    source->type = GL_VERTEX_SHADER;
   }else if(!strcmp(path+path_length-3,".fs")){
-    type = GL_FRAGMENT_SHADER;
+    source->type = GL_FRAGMENT_SHADER;
   }else{
     fprintf(stderr, "Shader file has unknown extension. Currently supported are:  .vs - vertex shader,  .fs - fragment shader\n");
-    return 0;
+    return -1;
   }
 
-  void* mem = 0;
   int fd = open(path, O_RDONLY);
   if(fd == -1){
     fprintf(stderr,"Failed to open file %s: %s\n",path,strerror(errno));
-    return 0;
+    return -1;
   }
 
   struct stat s;
   if(fstat(fd, &s) != 0){
     fprintf(stderr,"Failed to fstat file %s: %s\n",path,strerror(errno));
     close(fd);
-    return 0;
+    return -1;
   }
 
   if(!s.st_size){
     fprintf(stderr,"Shader file appears to be empty\n");
     close(fd);
-    return 0;
+    return -1;
   }
 
-  mem = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if(mem == MAP_FAILED){
+  source->mem = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(source->mem == MAP_FAILED){
     fprintf(stderr, "mmap %s failed: %s\n", path, strerror(errno));
+    source->mem = 0;
     close(fd);
-    return 0;
+    return -1;
   }
+  source->size = s.st_size;
 
   close(fd);
+  return 0;
+}
+
+static void print_info_log(GLuint shader, bool shader_or_program){
+  GLint length;
+  if(shader_or_program){
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+  }else{
+    glGetProgramiv(shader, GL_INFO_LOG_LENGTH, &length);
+  }
+  if(!length)
+    return;
+  char* log = malloc(length+1);
+  if(!log) return;
+  if(shader_or_program){
+    glGetShaderInfoLog(shader, length+1, 0, log);
+  }else{
+    glGetProgramInfoLog(shader, length+1, 0, log);
+  }
+  log[length] = 0;
+  fputs(log , stderr);
+  fputs("\n", stderr);
+  free(log);
+}
 
+static GLuint compile_shader(const struct shader_source* source, const char* defines){
   while(glGetError() != GL_NO_ERROR); // Clear previouse errors
 
-  GLuint shader = glCreateShader(type);
+  GLuint shader = glCreateShader(source->type);
   if(!shader){
     fprintf(stderr, "glCreateShader failed\n");
-    munmap(mem, s.st_size);
     return 0;
   }
 
-  glShaderSource(shader, 1, &(const GLchar*){mem}, &(GLint){s.st_size});
+  // Nothing may come before #version, so the defines go right after it
+  const GLchar* part[3] = { source->mem, "", "" };
+  GLint length[3] = { source->size, 0, 0 };
+  const char* version_end = source->size > 8 && !memcmp(source->mem, "#version", 8) ? memchr(source->mem, '\n', source->size) : 0;
+  if(defines && version_end){
+    length[0] = version_end - (const char*)source->mem + 1;
+    part[1] = defines;
+    length[1] = strlen(defines);
+    part[2] = version_end + 1;
+    length[2] = source->size - length[0];
+  }else if(defines){
+    part[0] = defines;
+    length[0] = strlen(defines);
+    part[1] = source->mem;
+    length[1] = source->size;
+  }
+  glShaderSource(shader, 3, part, length);
   glCompileShader(shader);
-  print_info_log(shader, true);
-
-  munmap(mem, s.st_size);
 
   GLint result = 0;
   glGetShaderiv(shader, GL_COMPILE_STATUS, &result);
   if(result != GL_TRUE){
+    print_info_log(shader, true); // Only on failure, it's another round trip to the driver
     fprintf(stderr,"Compiling shader failed\n");
     glDeleteShader(shader);
     return 0;
@@ -179,6 +245,73 @@ GLuint engine_load_shader(const char* path){
   return shader;
 }
 
+int engine_load_create_shader_program(struct shader* shader, struct engine_load_create_shader_program_params params){
+  int ret = -1;
+  struct shader_source vertex = {0}, fragment = {0};
+  shader->vertex = 0;
+  shader->fragment = 0;
+
+  if(params.vertex_shader && shader_source_map(&vertex, params.vertex_shader) == -1)
+    goto error;
+  if(params.fragment_shader && shader_source_map(&fragment, params.fragment_shader) == -1)
+    goto error;
+
+  uint64_t key = engine_i_program_cache_key((const struct engine_i_program_cache_source[]){
+    { vertex.mem, vertex.size },
+    { fragment.mem, fragment.size },
+    { params.defines, params.defines ? strlen(params.defines) : 0 },
+  }, 3);
+
+  // A cached binary skips compiling & linking entirely, there are no shader objects in that case
+  shader->program = engine_i_program_cache_load(key);
+  if(shader->program){
+    ret = 0;
+    goto error;
+  }
+
+  if(vertex.mem){
+    shader->vertex = compile_shader(&vertex, params.defines);
+    if(!shader->vertex){
+      fprintf(stderr, "compiling %s failed\n", params.vertex_shader);
+      goto error;
+    }
+  }
+
+  if(fragment.mem){
+    shader->fragment = compile_shader(&fragment, params.defines);
+    if(!shader->fragment){
+      fprintf(stderr, "compiling %s failed\n", params.fragment_shader);
+      goto error;
+    }
+  }
+
+  shader->program = engine_create_shader_program((GLuint[]){
+    shader->vertex ? shader->vertex : shader->fragment,
+    shader->vertex ? shader->fragment : 0,
+  0});
+  if(!shader->program){
+    fprintf(stderr,"engine_create_shader_program failed\n");
+    goto error;
+  }
+
+  engine_i_program_cache_store(key, shader->program);
+
+  ret = 0;
+error:
+  shader_source_unmap(&vertex);
+  shader_source_unmap(&fragment);
+  return ret;
+}
+
+GLuint engine_load_shader(const char* path){
+  struct shader_source source;
+  if(shader_source_map(&source, path) == -1)
+    return 0;
+  GLuint shader = compile_shader(&source, 0);
+  shader_source_unmap(&source);
+  return shader;
+}
+
 GLuint engine_create_shader_program(GLuint shaders[]){
   GLuint shader_program = glCreateProgram();
 
@@ -191,11 +324,11 @@ GLuint engine_create_shader_program(GLuint shaders[]){
     glAttachShader(shader_program, *it);
 
   glLinkProgram(shader_program);
-  print_info_log(shader_program, false);
 
   GLint result = 0;
   glGetProgramiv(shader_program, GL_LINK_STATUS, &result);
   if(result != GL_TRUE){
+    print_info_log(shader_program, false);
     fprintf(stderr,"linking shader program failed\n");
     glDeleteProgram(shader_program);
     return 0;
@@ -205,392 +338,642 @@ GLuint engine_create_shader_program(GLuint shaders[]){
 }
 
 
-struct dma_buffers {
-  int fd[2];
-  struct v4l2_format fmt;
-};
+void engine_dma_texture_play(struct dma_gl_texture* texture){
+  texture->autoupdate = true;
+}
 
-static int device_init_get_dmabuf(int fd, struct dma_buffers* result){
+void engine_dma_texture_pause(struct dma_gl_texture* texture){
+  texture->autoupdate = false;
+}
 
-  {
-    struct v4l2_capability cap;
-    memset(&cap, 0, sizeof(cap));
-    if( ioctl(fd, VIDIOC_QUERYCAP, &cap) == -1){
-      if(EINVAL == errno){
-        fprintf(stderr, "This isn't a V4L2 device\n");
-      }else{
-        perror("VIDIOC_QUERYCAP");
-      }
-      return -1;
-    }
+GLenum engine_dma_texture_get_gl_type(struct dma_gl_texture* dgt){
+  return dgt->target;
+}
 
-    if(!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)){
-      fprintf(stderr, "This is no video capture device\n");
-      return -1;
-    }
+GLuint engine_dma_texture_get_gl_texture(struct dma_gl_texture* dgt){
+  return dgt->texture;
+}
 
-    if(!(cap.capabilities & V4L2_CAP_STREAMING)){
-      fprintf(stderr, "no streaming i/o support\n");
-      return -1;
-    }
+// Another image was bound, the retired one isn't needed anymore
+static void drop_retired(struct dma_gl_texture* dgt){
+  if(dgt->retired == EGL_NO_IMAGE_KHR)
+    return;
+  engine_gl_delete_textures(dgt->engine, 1, &dgt->retired_texture);
+  eglDestroyImageKHR(dgt->engine->display, dgt->retired);
+  dgt->retired = EGL_NO_IMAGE_KHR;
+  dgt->retired_texture = 0;
+}
 
-  }
+static void images_imported(struct engine* engine, struct dma_gl_texture* dgt, unsigned count, const struct engine_dmabuf buffer[]);
 
-  {
-    struct v4l2_cropcap cropcap;
-    memset(&cropcap, 0, sizeof(cropcap));
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if(ioctl(fd, VIDIOC_CROPCAP, &cropcap) == 0){
-      struct v4l2_crop crop;
-      memset(&crop, 0, sizeof(crop));
-      crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      crop.c = cropcap.defrect; /* reset to default */
-      ioctl(fd, VIDIOC_S_CROP, &crop);
+// Takes over the images once the import thread is done with them, never waits for it
+static void install_import(struct dma_gl_texture* dgt){
+  struct engine* engine = dgt->engine;
+  struct engine_i_import_job* job = dgt->import;
+  int ret = engine_i_import_poll(engine, job);
+  if(!ret)
+    return;
+  dgt->import = 0;
+  if(ret == -1){
+    if(dgt->texture){
+      fprintf(stderr,"importing the new buffers failed, the texture keeps showing the last frame\n");
+    }else{ // Nothing was shown yet
+      fprintf(stderr,"importing the buffers failed, the texture stays empty\n");
+      dgt->import_failed = true;
     }
+    engine_i_import_free(engine, job);
+    return;
   }
-
-  memset(&result->fmt,0,sizeof(result->fmt));
-  result->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-  if(ioctl(fd, VIDIOC_G_FMT, &result->fmt) == -1){
-    perror("VIDIOC_G_FMT failed (now trying VIDIOC_S_FMT)");
-    return -1;
+  for(unsigned i=0; i<job->count; i++){
+    dgt->image[i] = job->image[i];
+    dgt->image_texture[i] = job->texture[i];
+    job->image[i] = EGL_NO_IMAGE_KHR;
+    job->texture[i] = 0;
   }
+  images_imported(engine, dgt, job->count, job->buffer);
+  engine_i_import_free(engine, job);
+  // A new texture shows its first buffer, like one imported right away
+  if(!dgt->texture)
+    dgt->texture = dgt->image_texture[0];
+}
 
-  unsigned int min = result->fmt.fmt.pix.width * 2;
-  if(result->fmt.fmt.pix.bytesperline < min)
-    result->fmt.fmt.pix.bytesperline = min;
-  min = result->fmt.fmt.pix.bytesperline * result->fmt.fmt.pix.height;
-  if(result->fmt.fmt.pix.sizeimage < min)
-    result->fmt.fmt.pix.sizeimage = min;
-
-  int count = 0;
-  {
-    struct v4l2_requestbuffers reqbuf;
-    memset(&reqbuf, 0, sizeof(reqbuf));
-    reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    reqbuf.memory = V4L2_MEMORY_MMAP;
-    reqbuf.count = 2;
-    int res;
-    res = ioctl(fd, VIDIOC_REQBUFS, &reqbuf);
-    if(res == -1 && errno == EINVAL){
-      reqbuf.count = 1;
-      res = ioctl(fd, VIDIOC_REQBUFS, &reqbuf);
-    }
-    if(res == -1){
-      if(errno == EINVAL){
-        fprintf(stderr, "Video capturing or DMABUF streaming is not supported\n");
-      }else{
-        perror("VIDIOC_REQBUFS");
-      }
-      return -1;
-    }
-    count = reqbuf.count;
-  }
-  if(count > 2)
-    count = 2;
-
-  for(int i=0; i<count; i++){
-    struct v4l2_exportbuffer expbuf;
-    memset(&expbuf, 0, sizeof(expbuf));
-    expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    expbuf.index = i;
-    expbuf.flags = O_RDONLY;
-    if(ioctl(fd, VIDIOC_EXPBUF, &expbuf) == -1){
-      perror("VIDIOC_EXPBUF");
-      return -1;
-    }
-    result->fd[i] = expbuf.fd;
+int engine_dma_texture_update(struct dma_gl_texture* dgt){
+  if(dgt->import)
+    install_import(dgt);
+  if(dgt->import_failed)
+    return -1;
+  if(!dgt->update_callback)
+    return 0;
+  int ret = dgt->update_callback(dgt);
+  if(ret > 0){
+    dgt->changed = true;
+    dgt->generation++;
+    drop_retired(dgt);
+    if(dgt->stats)
+      engine_i_stats_rebind(dgt);
   }
+  return ret;
+}
 
-  return 0;
+bool engine_dma_texture_changed(struct dma_gl_texture* dgt){
+  return dgt->changed;
 }
 
-static int start_capturing(int fd){
-  if(ioctl(fd, VIDIOC_STREAMON, &(enum v4l2_buf_type){V4L2_BUF_TYPE_VIDEO_CAPTURE})){
-    perror("VIDIOC_STREAMON");
+int engine_dma_texture_set_roi(struct dma_gl_texture* dgt, float x, float y, float width, float height){
+  if(x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > 1.0001f || y + height > 1.0001f){
+    fprintf(stderr, "engine_dma_texture_set_roi: %g,%g %gx%g isn't within the frame\n", x, y, width, height);
     return -1;
   }
+  const float roi[4] = { x, y, width, height };
+  float done[4] = { 0, 0, 1, 1 };
+  if(dgt->roi_callback)
+    dgt->roi_callback(dgt, roi, done);
+  // The texture holds done now, whatever of roi is left is cut off by the texture coordinates
+  dgt->crop[0] = (x - done[0]) / done[2];
+  dgt->crop[1] = (y - done[1]) / done[3];
+  dgt->crop[2] = width / done[2];
+  dgt->crop[3] = height / done[3];
+  dgt->generation++;
+  dgt->engine->redraw_requested = true;
   return 0;
 }
 
-void engine_dma_texture_play(struct dma_gl_texture* texture){
-  texture->autoupdate = true;
+void engine_dma_texture_get_crop(struct dma_gl_texture* dgt, float crop[4]){
+  for(int i=0; i<4; i++)
+    crop[i] = dgt->crop[i];
 }
 
-void engine_dma_texture_pause(struct dma_gl_texture* texture){
-  texture->autoupdate = false;
+void engine_redraw_policy_set(struct engine* engine, enum engine_redraw_policy policy){
+  engine->redraw_policy = policy;
 }
 
-GLenum engine_dma_texture_get_gl_type(struct dma_gl_texture* dgt){
-  (void)dgt;
-  return GL_TEXTURE_EXTERNAL_OES;
+void engine_redraw_request(struct engine* engine){
+  engine->redraw_requested = true;
 }
 
-GLuint engine_dma_texture_get_gl_texture(struct dma_gl_texture* dgt){
-  return dgt->texture;
+void engine_passthrough(struct engine* engine, struct dma_gl_texture* texture, float x, float y, float width, float height){
+  engine->passthrough = texture;
+  engine->passthrough_rect[0] = x;
+  engine->passthrough_rect[1] = y;
+  engine->passthrough_rect[2] = width;
+  engine->passthrough_rect[3] = height;
 }
 
-int engine_dma_texture_update(struct dma_gl_texture* dgt){
-  if(dgt->update_callback)
-    return dgt->update_callback(dgt);
-  return 0;
+// The display driver couldn't show it, so it's drawn after all
+static void draw_passthrough(struct engine* engine){
+  if(!engine->passthrough_batch){
+    engine->passthrough_batch = engine_quad_batch_create(engine);
+    if(!engine->passthrough_batch)
+      return;
+  }
+  const float* rect = engine->passthrough_rect;
+  engine_gl_clear_color(engine, 0, 0, 0, 1);
+  glClear(GL_COLOR_BUFFER_BIT);
+  engine_quad_batch_add(engine->passthrough_batch,
+    .texture = engine->passthrough,
+    .x = rect[0],
+    .y = rect[1],
+    .width = rect[2],
+    .height = rect[3]
+  );
+  engine_quad_batch_flush(engine->passthrough_batch);
+}
+
+void engine_damage_add(struct engine* engine, int x, int y, int width, int height){
+  if(width <= 0 || height <= 0)
+    return;
+  if(engine->damage_count >= ENGINE_MAX_DAMAGE){
+    engine->damage_full = true;
+    return;
+  }
+  EGLint* rect = engine->damage[engine->damage_count++];
+  rect[0] = x;
+  rect[1] = y;
+  rect[2] = width;
+  rect[3] = height;
+}
+
+static bool init_driver(struct engine* engine, struct engine_display_driver* driver){
+  memset(engine, 0, sizeof(*engine));
+  if(!driver->init || driver->init(engine) == -1){
+    fprintf(stderr,"display driver %s failed to initialise\n", driver->name);
+    return false;
+  }
+  engine->driver = driver;
+  return true;
 }
 
 static int init(struct engine* engine, int argc, char* argv[]){
   (void)argc;
   (void)argv;
   memset(engine, 0, sizeof(*engine));
-  for(struct engine_display_driver* it=display_driver_list; it; it=it->next){
-    if(it->init && it->init(engine) != -1){
-      engine->driver = it;
-      break;
-    }
+  const char* name = getenv("ENGINE_DISPLAY_DRIVER");
+  if(name && *name){
+    for(struct engine_display_driver* it=display_driver_list; it; it=it->next)
+      if(!strcmp(it->name, name) && init_driver(engine, it))
+        break;
+  }else{
+    for(int fallback=0; fallback<2 && !engine->driver; fallback++)
+      for(struct engine_display_driver* it=display_driver_list; it; it=it->next)
+        if(it->fallback == fallback && init_driver(engine, it))
+          break;
   }
   if(!engine->driver){
-    fprintf(stderr,"failed to initialise any display driver");
+    fprintf(stderr,"failed to initialise any display driver\n");
     return -1;
   }
+  fprintf(stderr,"using display driver %s\n", engine->driver->name);
+  engine_gl_state_invalidate(engine); // Nothing is known about the new context
+  if(engine_i_egl_has_extension(engine, "EGL_KHR_swap_buffers_with_damage")){
+    engine->swap_buffers_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+  }else if(engine_i_egl_has_extension(engine, "EGL_EXT_swap_buffers_with_damage")){
+    engine->swap_buffers_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+  }
+  engine->fence_sync = engine_i_egl_has_extension(engine, "EGL_KHR_fence_sync");
+  engine->native_fence_sync = engine->fence_sync && engine_i_egl_has_extension(engine, "EGL_ANDROID_native_fence_sync");
+  if(engine_i_trace_init(engine) == -1)
+    fprintf(stderr,"failed to enable tracing, continuing without it\n");
+  if(engine_i_stats_init(engine) == -1)
+    fprintf(stderr,"failed to enable statistics, continuing without them\n");
   return 0;
 }
 
-// TODO: generalise format & make public
-static struct dma_gl_texture* engine_dma_texture_create(struct engine* engine, const struct dma_buffers* dma){
-  struct dma_gl_texture* dgt = calloc(1, sizeof(struct dma_gl_texture));
-  if(!dgt){
-    perror("calloc failed");
-    goto error;
+static void destroy_display_buffers(struct engine* engine, struct dma_gl_texture* dgt){
+  for(unsigned i=0; i<ENGINE_MAX_BUFFERS; i++)
+    if(dgt->display_buffer[i])
+      engine->driver->buffer_destroy(engine, dgt->display_buffer[i]);
+  memset(dgt->display_buffer, 0, sizeof(dgt->display_buffer));
+  dgt->held = 0; // Their source is going away too
+}
+
+static void destroy_images(struct engine* engine, struct dma_gl_texture* dgt){
+  engine_i_import_free(engine, dgt->import);
+  dgt->import = 0;
+  destroy_display_buffers(engine, dgt);
+  for(unsigned i=0; i<dgt->image_count; i++){
+    engine_gl_delete_textures(engine, 1, &dgt->image_texture[i]);
+    eglDestroyImageKHR(engine->display, dgt->image[i]);
   }
-  dgt->autoupdate = true;
-  dgt->image[0] = eglCreateImageKHR(engine->display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, (EGLClientBuffer)0, (EGLint[]){
-    EGL_WIDTH, dma->fmt.fmt.pix.width,
-    EGL_HEIGHT, dma->fmt.fmt.pix.height,
-    EGL_LINUX_DRM_FOURCC_EXT, dma->fmt.fmt.pix.pixelformat,
-    EGL_DMA_BUF_PLANE0_FD_EXT, dma->fd[0],
-    EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0, // No bound checks in drm intel driver in kernel (4.14.90) !?!
-    EGL_DMA_BUF_PLANE0_PITCH_EXT, dma->fmt.fmt.pix.bytesperline,
-    EGL_NONE
-  });
-  if( dgt->image[0] == EGL_NO_IMAGE_KHR ){
-    fprintf(stderr,"eglCreateImageKHR failed\n");
-    goto error_after_calloc;
+  dgt->image_count = 0;
+  dgt->current = -1;
+  if(dgt->retired != EGL_NO_IMAGE_KHR){
+    engine_gl_delete_textures(engine, 1, &dgt->retired_texture);
+    eglDestroyImageKHR(engine->display, dgt->retired);
   }
-  if(dma->fd[1] != -1){ // If this fails, we jus don't have double buffering, so not a big deal
-    dgt->image[1] = eglCreateImageKHR(engine->display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, (EGLClientBuffer)0, (EGLint[]){
-      EGL_WIDTH, dma->fmt.fmt.pix.width,
-      EGL_HEIGHT, dma->fmt.fmt.pix.height,
-      EGL_LINUX_DRM_FOURCC_EXT, dma->fmt.fmt.pix.pixelformat,
-      EGL_DMA_BUF_PLANE0_FD_EXT, dma->fd[1],
-      EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0, // No bound checks in drm intel driver in kernel (4.14.90) !?!
-      EGL_DMA_BUF_PLANE0_PITCH_EXT, dma->fmt.fmt.pix.bytesperline,
-      EGL_NONE
-    });
-  }else{
-    dgt->image[1] = EGL_NO_IMAGE_KHR;
+  dgt->retired = EGL_NO_IMAGE_KHR;
+  dgt->retired_texture = 0;
+}
+
+static void query_dmabuf_formats(struct engine* engine){
+  if(engine->dmabuf_format || engine->dmabuf_format_count == -1)
+    return;
+  engine->dmabuf_format_count = -1;
+  EGLint count = 0;
+  if(!engine_i_egl_has_extension(engine, "EGL_EXT_image_dma_buf_import_modifiers"))
+    return;
+  if(!eglQueryDmaBufFormatsEXT(engine->display, 0, 0, &count) || count <= 0)
+    return;
+  EGLint* format = calloc(count, sizeof(*format));
+  if(!format){
+    perror("calloc failed");
+    return;
   }
-  while(glGetError() != GL_NO_ERROR); // Clear error flags
-  glGenTextures(1, &dgt->texture);
-  if(glGetError() != GL_NO_ERROR)
-    goto error_after_create_image;
-  glEnable(GL_TEXTURE_EXTERNAL_OES);
-  glBindTexture(GL_TEXTURE_EXTERNAL_OES, dgt->texture);
-  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-/*  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);*/
-  glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, dgt->image[0]);
-  if(glGetError() != GL_NO_ERROR){
-    fprintf(stderr,"creating gl texture failed\n");
-    goto error_after_gen_textures;
+  if(!eglQueryDmaBufFormatsEXT(engine->display, count, format, &count)){
+    free(format);
+    return;
   }
-  dgt->engine = engine;
-  dgt->next = engine->textures;
-  dgt->last = 0;
-  engine->textures = dgt;
-  return dgt;
-error_after_gen_textures:
-  glDeleteTextures(1, &dgt->texture);
-error_after_create_image:
-  if(dgt->image[1] != EGL_NO_IMAGE_KHR)
-    eglDestroyImageKHR(engine->display, dgt->image[1]);
-  eglDestroyImageKHR(engine->display, dgt->image[0]);
-error_after_calloc:
-  free(dgt);
-error:
-  return 0;
+  engine->dmabuf_format = format;
+  engine->dmabuf_format_count = count;
 }
 
-void engine_dma_texture_destroy(struct dma_gl_texture* dgt){
-  if(!dgt)
-    return;
-  if(dgt->next)
-    dgt->next->last = dgt->last;
-  if(!dgt->last)
-    dgt->engine->textures = dgt->next;
-  if(dgt->last)
-    dgt->last->next = dgt->next;
-  if(dgt->destroy_callback)
-    dgt->destroy_callback(dgt);
-  glDeleteTextures(1, &dgt->texture);
-  if(dgt->image[1] != EGL_NO_IMAGE_KHR)
-    eglDestroyImageKHR(dgt->engine->display, dgt->image[1]);
-  eglDestroyImageKHR(dgt->engine->display, dgt->image[0]);
-  memset(dgt, 0, sizeof(*dgt));
-  free(dgt);
+bool engine_dmabuf_format_supported(struct engine* engine, uint32_t fourcc, uint64_t modifier){
+  query_dmabuf_formats(engine);
+  if(engine->dmabuf_format_count == -1) // Can't tell, only implicit & linear layouts may work
+    return modifier == ENGINE_DRM_FORMAT_MOD_INVALID || modifier == ENGINE_DRM_FORMAT_MOD_LINEAR;
+  bool found = false;
+  for(EGLint i=0; i<engine->dmabuf_format_count; i++)
+    if((uint32_t)engine->dmabuf_format[i] == fourcc)
+      found = true;
+  if(!found)
+    return false;
+  if(modifier == ENGINE_DRM_FORMAT_MOD_INVALID)
+    return true;
+  EGLint count = 0;
+  if(!eglQueryDmaBufModifiersEXT(engine->display, fourcc, 0, 0, 0, &count))
+    return false;
+  if(!count) // The driver only supports implicit modifiers for this format, linear is always fine
+    return modifier == ENGINE_DRM_FORMAT_MOD_LINEAR;
+  EGLuint64KHR* list = calloc(count, sizeof(*list));
+  if(!list){
+    perror("calloc failed");
+    return false;
+  }
+  found = false;
+  if(eglQueryDmaBufModifiersEXT(engine->display, fourcc, count, list, 0, &count))
+    for(EGLint i=0; i<count; i++)
+      if(list[i] == modifier)
+        found = true;
+  free(list);
+  return found;
 }
 
-static int open_device(const char* dev){
+static EGLImageKHR create_image(struct engine* engine, const struct engine_dmabuf* buffer){
+  static const EGLint plane_attr[ENGINE_DMABUF_MAX_PLANES][5] = {
+    { EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+    { EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+    { EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+    { EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT, EGL_DMA_BUF_PLANE3_PITCH_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT },
+  };
+  static const EGLint color_space[] = {
+    [ENGINE_YUV_COLOR_SPACE_BT601] = EGL_ITU_REC601_EXT,
+    [ENGINE_YUV_COLOR_SPACE_BT709] = EGL_ITU_REC709_EXT,
+    [ENGINE_YUV_COLOR_SPACE_BT2020] = EGL_ITU_REC2020_EXT,
+  };
+  static const EGLint range[] = {
+    [ENGINE_YUV_RANGE_NARROW] = EGL_YUV_NARROW_RANGE_EXT,
+    [ENGINE_YUV_RANGE_FULL] = EGL_YUV_FULL_RANGE_EXT,
+  };
+  // Drivers assume linear without a modifier too, so it's only passed explicitly if the driver knows about modifiers
+  bool explicit_modifier = buffer->modifier != ENGINE_DRM_FORMAT_MOD_INVALID
+    && (buffer->modifier != ENGINE_DRM_FORMAT_MOD_LINEAR || engine->dmabuf_format_count != -1);
+  EGLint attr[64];
+  size_t n = 0;
+  attr[n++] = EGL_WIDTH;
+  attr[n++] = buffer->width;
+  attr[n++] = EGL_HEIGHT;
+  attr[n++] = buffer->height;
+  attr[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+  attr[n++] = buffer->fourcc;
+  for(unsigned i=0; i<buffer->plane_count; i++){
+    attr[n++] = plane_attr[i][0];
+    attr[n++] = buffer->plane[i].fd;
+    attr[n++] = plane_attr[i][1];
+    attr[n++] = buffer->plane[i].offset; // No bound checks in drm intel driver in kernel (4.14.90) !?!
+    attr[n++] = plane_attr[i][2];
+    attr[n++] = buffer->plane[i].pitch;
+    if(explicit_modifier){
+      attr[n++] = plane_attr[i][3];
+      attr[n++] = buffer->modifier & 0xFFFFFFFF;
+      attr[n++] = plane_attr[i][4];
+      attr[n++] = buffer->modifier >> 32;
+    }
+  }
+  if(buffer->color_space != ENGINE_YUV_COLOR_SPACE_DEFAULT){
+    attr[n++] = EGL_YUV_COLOR_SPACE_HINT_EXT;
+    attr[n++] = color_space[buffer->color_space];
+  }
+  if(buffer->range != ENGINE_YUV_RANGE_DEFAULT){
+    attr[n++] = EGL_SAMPLE_RANGE_HINT_EXT;
+    attr[n++] = range[buffer->range];
+  }
+  attr[n++] = EGL_NONE;
+  return eglCreateImageKHR(engine->display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, (EGLClientBuffer)0, attr);
+}
 
-  int fd = -1;
-  if(strncmp(dev,"fd:",3) == 0){
-    if(sscanf(dev+3,"%d",&fd) != 1){
-      fprintf(stderr, "Cannot parse fd '%s'\n", dev);
+int engine_i_dmabuf_validate(struct engine* engine, unsigned count, const struct engine_dmabuf buffer[]){
+  if(!count || count > ENGINE_MAX_BUFFERS){
+    fprintf(stderr,"importing dmabufs: between 1 and %d buffers are supported, got %u\n", ENGINE_MAX_BUFFERS, count);
+    return -1;
+  }
+  for(unsigned i=0; i<count; i++){
+    if(!buffer[i].plane_count || buffer[i].plane_count > ENGINE_DMABUF_MAX_PLANES){
+      fprintf(stderr,"importing dmabufs: buffer %u has %u planes\n", i, buffer[i].plane_count);
       return -1;
     }
-  }else{
-     fd = open(dev, O_RDWR | O_NONBLOCK);
-    if(fd == -1){
-      fprintf(stderr, "Cannot open '%s': %d, %s\n", dev, errno, strerror(errno));
+    if(!engine_dmabuf_format_supported(engine, buffer[i].fourcc, buffer[i].modifier)){
+      fprintf(stderr,"importing dmabufs: format %.4s with modifier 0x%016llx can't be imported\n",
+        (const char*)&buffer[i].fourcc, (unsigned long long)buffer[i].modifier);
       return -1;
     }
   }
+  return 0;
+}
 
-  struct stat st;
-  if(fstat(fd, &st) == -1){
-    fprintf(stderr, "Cannot identify '%s': %d, %s\n", dev, errno, strerror(errno));
+int engine_i_dma_image_create(struct engine* engine, const struct engine_dmabuf* buffer, EGLImageKHR* image, GLuint* texture){
+  *image = create_image(engine, buffer);
+  if(*image == EGL_NO_IMAGE_KHR){
+    fprintf(stderr,"eglCreateImageKHR failed (eglError: %d)\n", eglGetError());
     return -1;
   }
-
-  if(!S_ISCHR(st.st_mode)){
-    fprintf(stderr, "%s isn't a device file\n", dev);
+  while(glGetError() != GL_NO_ERROR); // Clear error flags
+  glGenTextures(1, texture);
+  glBindTexture(GL_TEXTURE_EXTERNAL_OES, *texture);
+  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+/*  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);*/
+  // Usually the expensive part, the driver may have to map or relayout the buffer
+  glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, *image);
+  glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+  if(glGetError() != GL_NO_ERROR){
+    fprintf(stderr,"creating gl texture failed\n");
+    glDeleteTextures(1, texture);
+    eglDestroyImageKHR(engine->display, *image);
+    *image = EGL_NO_IMAGE_KHR;
+    *texture = 0;
     return -1;
   }
-
-  return fd;
+  return 0;
 }
 
-void v4l_dma_destroy(struct dma_gl_texture* dgt){
-  close(dgt->update_param.vlong);
+// The images of the buffers are in place, none of them is shown yet
+static void images_imported(struct engine* engine, struct dma_gl_texture* dgt, unsigned count, const struct engine_dmabuf buffer[]){
+  dgt->image_count = count;
+  dgt->current = -1;
+  dgt->width = buffer[0].width;
+  dgt->height = buffer[0].height;
+  // The display driver may be able to show them without drawing, see engine_passthrough
+  if(engine->driver && engine->driver->buffer_import)
+    for(unsigned i=0; i<count; i++)
+      dgt->display_buffer[i] = engine->driver->buffer_import(engine, dgt, i, &buffer[i]);
 }
 
-int v4l_dma_update(struct dma_gl_texture* dgt){
-  int ret = 0;
-  int dev = dgt->update_param.vlong;
-
-  struct v4l2_buffer buf;
-  memset(&buf, 0, sizeof(buf));
-  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buf.memory = V4L2_MEMORY_MMAP;
-  buf.index = dgt->image[1] != EGL_NO_IMAGE_KHR && !dgt->current;
-
-  if(ioctl(dev, VIDIOC_QUERYBUF, &buf) == -1){
-    perror("VIDIOC_QUERYBUF");
-    return -1;
-  }
-
-  bool swapped = false;
-  if(buf.flags & V4L2_BUF_FLAG_DONE){
-    if(dgt->image[1] != EGL_NO_IMAGE_KHR){
-      dgt->current = !dgt->current;
-      swapped = true;
-    }
-    if(ioctl(dev, VIDIOC_DQBUF, &buf) == -1){
-      perror("VIDIOC_DQBUF");
+// On the render thread, for validated buffers
+static int import_images(struct engine* engine, struct dma_gl_texture* dgt, unsigned count, const struct engine_dmabuf buffer[]){
+  // Every buffer gets its image & texture up front, so switching between them later is just picking another texture
+  for(unsigned i=0; i<count; i++){
+    if(engine_i_dma_image_create(engine, &buffer[i], &dgt->image[i], &dgt->image_texture[i]) == -1){
+      fprintf(stderr,"importing buffer %u failed\n", i);
+      for(unsigned j=0; j<i; j++){
+        engine_gl_delete_textures(engine, 1, &dgt->image_texture[j]);
+        eglDestroyImageKHR(engine->display, dgt->image[j]);
+      }
+      engine_gl_state_invalidate(engine);
       return -1;
     }
-    if(swapped)
-      glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, dgt->image[dgt->current]);
-    ret = 1;
   }
+  // Creating them bound textures behind the back of the state cache, it's rare enough to just start over
+  engine_gl_state_invalidate(engine);
+  images_imported(engine, dgt, count, buffer);
+  return 0;
+}
 
-  if(swapped){
-    buf.index = !dgt->current;
-    if(ioctl(dev, VIDIOC_QUERYBUF, &buf) == -1){
-      perror("VIDIOC_QUERYBUF");
-      return -1;
-    }
+void engine_i_dma_texture_retire_images(struct dma_gl_texture* dgt, bool keep_bound){
+  struct engine* engine = dgt->engine;
+  if(!keep_bound){
+    destroy_images(engine, dgt);
+    dgt->texture = 0;
+    return;
   }
-
-  if(!(buf.flags & V4L2_BUF_FLAG_QUEUED)){
-    if(ioctl(dev, VIDIOC_QBUF, &buf) == -1){
-      perror("VIDIOC_QBUF");
-      return -1;
+  engine_i_import_free(engine, dgt->import);
+  dgt->import = 0;
+  destroy_display_buffers(engine, dgt);
+  for(unsigned i=0; i<dgt->image_count; i++){
+    if(dgt->retired == EGL_NO_IMAGE_KHR && dgt->image_texture[i] == dgt->texture){
+      dgt->retired = dgt->image[i];
+      dgt->retired_texture = dgt->image_texture[i];
+      continue;
     }
+    engine_gl_delete_textures(engine, 1, &dgt->image_texture[i]);
+    eglDestroyImageKHR(engine->display, dgt->image[i]);
   }
-
-  return ret;
+  dgt->image_count = 0;
+  dgt->current = -1;
 }
 
-struct dma_gl_texture* engine_v4l_texture_create(struct engine* engine, const char* v4l_device){
-  struct dma_gl_texture* result = 0;
-  struct dma_buffers dma = {
-    .fd = {-1, -1}
-  };
-  int dev = -1;
+void engine_i_dma_texture_unhold(struct dma_gl_texture* dgt, unsigned index){
+  if(!(dgt->held & (1u << index)))
+    return;
+  dgt->held &= ~(1u << index);
+  if((int)index != dgt->current && dgt->release_callback)
+    dgt->release_callback(dgt, index);
+}
 
-  dev = open_device(v4l_device);
-  if(dev == -1){
-    fprintf(stderr,"failed to open v4l device\n");
-    goto error;
-  }
+int engine_i_dma_texture_import(struct dma_gl_texture* dgt, unsigned count, const struct engine_dmabuf buffer[]){
+  struct engine* engine = dgt->engine;
+  if(engine_i_dmabuf_validate(engine, count, buffer) == -1)
+    return -1;
+  dgt->import_failed = false;
+  // Creating the images can take milliseconds, the render loop shouldn't miss frames for it
+  dgt->import = engine_i_import_submit(engine, count, buffer);
+  if(dgt->import)
+    return 0;
+  return import_images(engine, dgt, count, buffer);
+}
 
-  if(device_init_get_dmabuf(dev, &dma) == -1){
-    fprintf(stderr,"device_init_get_dmabuf failed\n");
+struct dma_gl_texture* engine_i_dma_texture_create(struct engine* engine, unsigned count, const struct engine_dmabuf buffer[], bool background){
+  struct dma_gl_texture* dgt = calloc(1, sizeof(struct dma_gl_texture));
+  if(!dgt){
+    perror("calloc failed");
     goto error;
   }
-
-  if(start_capturing(dev) == -1){
-    fprintf(stderr,"failed to start video capturing\n");
-    goto error;
+  dgt->autoupdate = true;
+  dgt->target = GL_TEXTURE_EXTERNAL_OES;
+  dgt->retired = EGL_NO_IMAGE_KHR;
+  dgt->current = -1;
+  dgt->width = buffer[0].width;
+  dgt->height = buffer[0].height;
+  if(engine_i_dmabuf_validate(engine, count, buffer) == -1)
+    goto error_after_calloc;
+  // Cameras & producers showing up while running shouldn't stall frames either. Until the import thread is done,
+  // the texture is empty & frames are dropped, see engine_i_capture_bind.
+  if(background)
+    dgt->import = engine_i_import_submit(engine, count, buffer);
+  if(!dgt->import){
+    if(import_images(engine, dgt, count, buffer) == -1)
+      goto error_after_calloc;
+    dgt->texture = dgt->image_texture[0];
   }
+  engine_i_dma_texture_register(engine, dgt);
+  return dgt;
+error_after_calloc:
+  free(dgt);
+error:
+  return 0;
+}
 
-  result = engine_dma_texture_create(engine, &dma);
-  if(!result){
-    fprintf(stderr,"failed to create texture from dma buffer\n");
-    goto error;
-  }
+struct dma_gl_texture* engine_dma_texture_create(struct engine* engine, unsigned count, const struct engine_dmabuf buffer[]){
+  return engine_i_dma_texture_create(engine, count, buffer, true);
+}
 
-  result->update_callback = v4l_dma_update;
-  result->destroy_callback = v4l_dma_destroy;
-  result->update_param.vlong = dev;
+void engine_i_dma_texture_register(struct engine* engine, struct dma_gl_texture* dgt){
+  dgt->engine = engine;
+  dgt->id = ++engine->texture_ids;
+  dgt->crop[0] = dgt->crop[1] = 0;
+  dgt->crop[2] = dgt->crop[3] = 1;
+  dgt->next = engine->textures;
+  dgt->last = 0;
+  if(engine->textures)
+    engine->textures->last = dgt;
+  engine->textures = dgt;
+  if(engine->stats)
+    engine_i_stats_texture_add(engine, dgt);
+}
 
-  close(dma.fd[0]);
-  close(dma.fd[1]);
+int engine_dma_texture_set_buffer(struct dma_gl_texture* dgt, unsigned index){
+  if(dgt->import && !dgt->image_count) // Still being imported
+    return -1;
+  if(index >= dgt->image_count){
+    fprintf(stderr,"engine_dma_texture_set_buffer: no buffer %u\n", index);
+    return -1;
+  }
+  if(dgt->current == (int)index)
+    return 0;
+  dgt->texture = dgt->image_texture[index];
+  drop_retired(dgt);
+  dgt->current = index;
+  dgt->changed = true;
+  dgt->generation++;
+  if(dgt->stats)
+    engine_i_stats_rebind(dgt);
+  return 1;
+}
 
-  return result;
+void engine_dma_texture_destroy(struct dma_gl_texture* dgt){
+  if(!dgt)
+    return;
+  if(dgt->engine->passthrough == dgt)
+    dgt->engine->passthrough = 0;
+  if(dgt->next)
+    dgt->next->last = dgt->last;
+  if(!dgt->last)
+    dgt->engine->textures = dgt->next;
+  if(dgt->last)
+    dgt->last->next = dgt->next;
+  if(dgt->destroy_callback)
+    dgt->destroy_callback(dgt);
+  if(dgt->stats)
+    engine_i_stats_texture_remove(dgt->engine, dgt);
+  destroy_images(dgt->engine, dgt);
+  memset(dgt, 0, sizeof(*dgt));
+  free(dgt);
+}
 
-error:
-  close(dma.fd[0]);
-  close(dma.fd[1]);
-  close(dev);
-  engine_dma_texture_destroy(result);
-  return 0;
+static void swap(struct engine* engine){
+  if(engine->swap_buffers_with_damage && engine->damage_count && !engine->damage_full && engine->redraw_policy == ENGINE_REDRAW_ON_CHANGE){
+    engine->swap_buffers_with_damage(engine->display, engine->surface, *engine->damage, engine->damage_count);
+  }else{
+    eglSwapBuffers(engine->display, engine->surface);
+  }
 }
 
 void main_loop(struct engine* engine){
+  engine->redraw_requested = true; // There is nothing on the screen yet
   while(true){
+    if(engine->driver->dispatch)
+      engine->driver->dispatch(engine);
+    if(engine->quit_requested)
+      break;
     eglMakeCurrent(engine->display, engine->surface, engine->surface, engine->context);
+    bool redraw = engine->redraw_policy == ENGINE_REDRAW_ALWAYS || engine->redraw_requested;
+    engine->damage_full = redraw;
+    engine->damage_count = 0;
+    engine->redraw_requested = false;
+    for(struct dma_gl_texture* it=engine->textures; it; it=it->next){
+      it->changed = false;
+      if(it->autoupdate && engine_dma_texture_update(it) > 0){
+        redraw = true;
+        if(engine->trace)
+          engine_i_trace_rebind(engine->trace, it);
+      }
+    }
+    // GL fences can't be waited for together with the cameras, draw another frame to come back for the readbacks.
+    // Swapping paces that.
+    if(engine_i_tap_run(engine))
+      redraw = true;
+    // Nothing new to show, the last frame is still up to date. Sleep until a camera delivers the next one,
+    // or the window system has events. Those were all dispatched above, none can be queued already.
+    int fd = engine->driver->get_fd ? engine->driver->get_fd(engine) : -1;
+    if(!redraw && engine_i_capture_wait(engine, fd) == 0)
+      continue;
+    uint64_t start_ns = engine->stats ? engine_i_time_ns() : 0;
     if(engine->driver->before_drawing)
       engine->driver->before_drawing(engine);
-    for(struct dma_gl_texture* it=engine->textures; it; it=it->next)
-      if(it->autoupdate)
-        engine_dma_texture_update(it);
+    bool exporting = engine->export && engine_i_export_begin(engine->export);
+    engine->passthrough = 0;
+    if(engine->profile)
+      engine_i_profile_collect(engine);
     if(!engine_main_loop(engine))
       break;
+    // Whatever is exported or traced has to be drawn
+    if(engine->passthrough && !exporting && !engine->trace && engine->driver->present
+     && engine->driver->present(engine, engine->passthrough, engine->passthrough_rect)){
+      engine->direct_frames++;
+      if(engine->stats)
+        engine_i_stats_direct_frame(engine);
+      continue;
+    }
+    if(engine->passthrough){
+      engine_gpu_scope_begin(engine, "passthrough");
+      draw_passthrough(engine);
+      engine_gpu_scope_end(engine);
+    }
+    if(engine->trace)
+      engine_i_trace_draw(engine->trace);
+    if(exporting){
+      engine_i_export_end(engine->export);
+      engine->damage_full = true; // The damage was tracked in the export buffer, not the surface
+    }
     if(engine->driver->after_drawing)
       engine->driver->after_drawing(engine);
-    eglSwapBuffers(engine->display, engine->surface);
+    uint64_t swap_ns = engine->stats ? engine_i_time_ns() : 0;
+    swap(engine);
+    if(engine->stats)
+      engine_i_stats_frame(engine, start_ns, swap_ns, engine_i_time_ns());
+    if(engine->trace)
+      engine_i_trace_swap(engine->trace);
   }
 }
 
 void cleanup(struct engine* engine){
+  while(engine->taps)
+    engine_tap_destroy(engine->taps);
   while(engine->textures)
     engine_dma_texture_destroy(engine->textures);
-  if(engine->driver->destroy)
-    engine->driver->destroy(engine);
+  engine_quad_batch_destroy(engine->passthrough_batch);
+  engine_i_import_destroy(engine);
+  engine_i_capture_destroy(engine);
+  engine_i_export_destroy(engine);
+  engine_i_trace_destroy(engine);
+  engine_i_profile_destroy(engine);
+  engine_i_stats_destroy(engine);
+  free(engine->dmabuf_format);
   eglDestroyContext(engine->display, engine->context);
   eglDestroySurface(engine->display, engine->surface);
   eglTerminate(engine->display);
+  // The EGL display may use the window system connection until it's terminated
+  if(engine->driver->destroy)
+    engine->driver->destroy(engine);
 }
 
 void engine_private_set(struct engine* engine, void* x){
@@ -626,6 +1009,8 @@ int main(int argc, char* argv[]){
   eglMakeCurrent(engine.display, engine.surface, engine.surface, engine.context);
   glEnable(GL_DEBUG_OUTPUT_KHR);
   glDebugMessageCallbackKHR(gl_debug_callback, 0);
+  if(engine_i_export_init(&engine) == -1)
+    fprintf(stderr,"failed to enable exporting, continuing without it\n");
   if(engine_init(&engine, argc, argv) == -1)
     goto error_after_init;
   main_loop(&engine);
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE // accept4
+#include <sys/socket.h>
+#include <internal/engine.h>
+#include <internal/export.h>
+#include <internal/trace.h>
+#include <export_protocol.h>
+#include <ipc.h>
+#include <GLES3/gl3.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define EXPORT_BUFFER_COUNT 4
+
+struct export_buffer {
+  GLuint texture;
+  GLuint framebuffer;
+  EGLImageKHR image;
+  int fd[ENGINE_EXPORT_MAX_PLANES];
+  struct engine_export_message description; // The ENGINE_EXPORT_BUFFER message
+  unsigned holders; // Consumers which didn't release it yet
+};
+
+struct export_client {
+  int fd;
+  uint32_t held; // Bitmask of buffers it didn't release yet
+  struct export_client* next;
+};
+
+struct engine_export {
+  struct engine* engine;
+  char* path;
+  int listen_fd;
+  unsigned width, height; // Of the surface when the ring was created
+  uint32_t generation; // Of the ring, counts the times it was created again
+  unsigned count;
+  struct export_buffer buffer[EXPORT_BUFFER_COUNT];
+  int current; // Buffer being rendered into, -1 if none
+  unsigned next;
+  uint64_t sequence;
+  GLint viewport[4]; // Of the surface
+  struct export_client* clients;
+};
+
+EGLBoolean eglExportDMABUFImageQueryMESA(EGLDisplay dpy, EGLImageKHR image, int *fourcc, int *num_planes, EGLuint64KHR *modifiers) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
+EGLBoolean eglExportDMABUFImageQueryMESA(EGLDisplay dpy, EGLImageKHR image, int *fourcc, int *num_planes, EGLuint64KHR *modifiers){
+  static PFNEGLEXPORTDMABUFIMAGEQUERYMESAPROC exportQueryProc = 0;
+  if(!exportQueryProc)
+    exportQueryProc = (PFNEGLEXPORTDMABUFIMAGEQUERYMESAPROC)eglGetProcAddress("eglExportDMABUFImageQueryMESA");
+  return exportQueryProc(dpy, image, fourcc, num_planes, modifiers);
+}
+
+EGLBoolean eglExportDMABUFImageMESA(EGLDisplay dpy, EGLImageKHR image, int *fds, EGLint *strides, EGLint *offsets) __attribute__((weak)); // May not be in libEGL symbol table, resolve manually :(
+EGLBoolean eglExportDMABUFImageMESA(EGLDisplay dpy, EGLImageKHR image, int *fds, EGLint *strides, EGLint *offsets){
+  static PFNEGLEXPORTDMABUFIMAGEMESAPROC exportProc = 0;
+  if(!exportProc)
+    exportProc = (PFNEGLEXPORTDMABUFIMAGEMESAPROC)eglGetProcAddress("eglExportDMABUFImageMESA");
+  return exportProc(dpy, image, fds, strides, offsets);
+}
+
+static void buffer_destroy(struct engine_export* export, struct export_buffer* buffer){
+  for(unsigned i=0; i<ENGINE_EXPORT_MAX_PLANES; i++)
+    if(buffer->fd[i] != -1)
+      close(buffer->fd[i]);
+  if(buffer->image != EGL_NO_IMAGE_KHR)
+    eglDestroyImageKHR(export->engine->display, buffer->image);
+  glDeleteFramebuffers(1, &buffer->framebuffer);
+  engine_gl_delete_textures(export->engine, 1, &buffer->texture);
+}
+
+static int buffer_init(struct engine_export* export, struct export_buffer* buffer, unsigned index){
+  struct engine* engine = export->engine;
+  for(unsigned i=0; i<ENGINE_EXPORT_MAX_PLANES; i++)
+    buffer->fd[i] = -1;
+  buffer->image = EGL_NO_IMAGE_KHR;
+  buffer->holders = 0;
+
+  while(glGetError() != GL_NO_ERROR); // Clear previouse errors
+  glGenTextures(1, &buffer->texture);
+  engine_gl_bind_texture(engine, 0, GL_TEXTURE_2D, buffer->texture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, export->width, export->height);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glGenFramebuffers(1, &buffer->framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, buffer->framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, buffer->texture, 0);
+  bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if(glGetError() != GL_NO_ERROR || !complete){
+    fprintf(stderr, "Failed to create export render target\n");
+    goto error;
+  }
+
+  buffer->image = eglCreateImageKHR(engine->display, engine->context, EGL_GL_TEXTURE_2D_KHR, (EGLClientBuffer)(uintptr_t)buffer->texture, 0);
+  if(buffer->image == EGL_NO_IMAGE_KHR){
+    fprintf(stderr, "eglCreateImageKHR failed for export buffer (eglError: %d)\n", eglGetError());
+    goto error;
+  }
+
+  int fourcc = 0, plane_count = 0;
+  EGLuint64KHR modifier[ENGINE_EXPORT_MAX_PLANES] = {0};
+  if(!eglExportDMABUFImageQueryMESA(engine->display, buffer->image, &fourcc, &plane_count, 0)
+   || plane_count < 1 || plane_count > ENGINE_EXPORT_MAX_PLANES
+   || !eglExportDMABUFImageQueryMESA(engine->display, buffer->image, &fourcc, &plane_count, modifier)
+  ){
+    fprintf(stderr, "eglExportDMABUFImageQueryMESA failed (eglError: %d)\n", eglGetError());
+    goto error;
+  }
+  EGLint pitch[ENGINE_EXPORT_MAX_PLANES] = {0};
+  EGLint offset[ENGINE_EXPORT_MAX_PLANES] = {0};
+  if(!eglExportDMABUFImageMESA(engine->display, buffer->image, buffer->fd, pitch, offset)){
+    fprintf(stderr, "eglExportDMABUFImageMESA failed (eglError: %d)\n", eglGetError());
+    goto error;
+  }
+
+  buffer->description = (struct engine_export_message){
+    .version = ENGINE_EXPORT_PROTOCOL_VERSION,
+    .type = ENGINE_EXPORT_BUFFER,
+    .buffer = index,
+    .buffer_count = export->count,
+    .fourcc = fourcc,
+    .width = export->width,
+    .height = export->height,
+    .plane_count = plane_count,
+    .modifier = modifier[0],
+    .generation = export->generation
+  };
+  for(int i=0; i<plane_count; i++){
+    buffer->description.offset[i] = offset[i];
+    buffer->description.pitch[i] = pitch[i];
+  }
+  return 0;
+
+error:
+  buffer_destroy(export, buffer);
+  return -1;
+}
+
+int engine_i_export_init(struct engine* engine){
+  const char* path = getenv("ENGINE_EXPORT");
+  if(!path || !*path)
+    return 0;
+  if(!engine_i_egl_has_extension(engine, "EGL_MESA_image_dma_buf_export") || !engine_i_egl_has_extension(engine, "EGL_KHR_gl_texture_2D_image")){
+    fprintf(stderr, "exporting frames requires EGL_MESA_image_dma_buf_export & EGL_KHR_gl_texture_2D_image\n");
+    return -1;
+  }
+
+  struct engine_export* export = calloc(1, sizeof(*export));
+  if(!export){
+    perror("calloc failed");
+    goto error;
+  }
+  export->engine = engine;
+  export->current = -1;
+  export->path = strdup(path);
+  if(!export->path){
+    perror("strdup failed");
+    goto error_after_calloc;
+  }
+
+  EGLint width = 0, height = 0;
+  eglQuerySurface(engine->display, engine->surface, EGL_WIDTH, &width);
+  eglQuerySurface(engine->display, engine->surface, EGL_HEIGHT, &height);
+  if(width <= 0 || height <= 0){
+    fprintf(stderr, "Failed to query the surface size\n");
+    goto error_after_strdup;
+  }
+  export->width = width;
+  export->height = height;
+
+  export->count = EXPORT_BUFFER_COUNT;
+  for(unsigned i=0; i<export->count; i++){
+    if(buffer_init(export, &export->buffer[i], i) == -1){
+      export->count = i;
+      goto error_after_buffers;
+    }
+  }
+
+  export->listen_fd = engine_ipc_listen(path);
+  if(export->listen_fd == -1)
+    goto error_after_buffers;
+
+  fprintf(stderr, "exporting %ux%u frames on %s\n", export->width, export->height, path);
+  engine->export = export;
+  return 0;
+
+error_after_buffers:
+  for(unsigned i=0; i<export->count; i++)
+    buffer_destroy(export, &export->buffer[i]);
+error_after_strdup:
+  free(export->path);
+error_after_calloc:
+  free(export);
+error:
+  return -1;
+}
+
+static void client_drop(struct engine_export* export, struct export_client* client){
+  for(struct export_client** it=&export->clients; *it; it=&(*it)->next){
+    if(*it == client){
+      *it = client->next;
+      break;
+    }
+  }
+  for(unsigned i=0; i<export->count; i++)
+    if(client->held & (1u << i))
+      export->buffer[i].holders--;
+  close(client->fd);
+  free(client);
+}
+
+void engine_i_export_destroy(struct engine* engine){
+  struct engine_export* export = engine->export;
+  if(!export)
+    return;
+  while(export->clients)
+    client_drop(export, export->clients);
+  close(export->listen_fd);
+  unlink(export->path);
+  for(unsigned i=0; i<export->count; i++)
+    buffer_destroy(export, &export->buffer[i]);
+  free(export->path);
+  free(export);
+  engine->export = 0;
+}
+
+static int send_buffers(struct engine_export* export, int fd){
+  for(unsigned i=0; i<export->count; i++){
+    const struct export_buffer* buffer = &export->buffer[i];
+    if(engine_ipc_send(fd, &buffer->description, sizeof(buffer->description), buffer->fd, buffer->description.plane_count) == -1){
+      fprintf(stderr, "Failed to send export buffers to a consumer: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Creates the ring again at the new surface size & sends it to the consumers. What they held went away with the
+// old ring, releases of it are ignored. If that fails, nothing is exported anymore.
+static void resize(struct engine_export* export, unsigned width, unsigned height){
+  for(unsigned i=0; i<export->count; i++)
+    buffer_destroy(export, &export->buffer[i]);
+  export->width = width;
+  export->height = height;
+  export->generation++;
+  export->next = 0;
+  export->count = EXPORT_BUFFER_COUNT;
+  for(unsigned i=0; i<export->count; i++){
+    if(buffer_init(export, &export->buffer[i], i) == -1){
+      for(unsigned j=0; j<i; j++)
+        buffer_destroy(export, &export->buffer[j]);
+      export->count = 0;
+      fprintf(stderr, "Failed to create %ux%u export buffers, exporting stopped\n", width, height);
+      break;
+    }
+  }
+  for(struct export_client *it=export->clients, *next; it; it=next){
+    next = it->next;
+    it->held = 0;
+    if(!export->count || send_buffers(export, it->fd) == -1)
+      client_drop(export, it);
+  }
+  if(export->count)
+    fprintf(stderr, "exporting %ux%u frames now\n", width, height);
+}
+
+static void accept_clients(struct engine_export* export){
+  while(true){
+    int fd = accept4(export->listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd == -1){
+      if(errno != EAGAIN && errno != EINTR)
+        perror("accept4");
+      return;
+    }
+    struct export_client* client = calloc(1, sizeof(*client));
+    if(!client){
+      perror("calloc failed");
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->next = export->clients;
+    export->clients = client;
+    if(send_buffers(export, fd) == -1)
+      client_drop(export, client);
+  }
+}
+
+static void receive_releases(struct engine_export* export){
+  for(struct export_client *it=export->clients, *next; it; it=next){
+    next = it->next;
+    while(true){
+      struct engine_export_message message;
+      ssize_t size = engine_ipc_recv(it->fd, &message, sizeof(message), 0, 0, MSG_DONTWAIT);
+      if(size == -1 && errno == EAGAIN)
+        break;
+      if(size <= 0){ // Hung up or broken, everything it held is free again
+        client_drop(export, it);
+        break;
+      }
+      if((size_t)size != sizeof(message) || message.type != ENGINE_EXPORT_RELEASE || message.buffer >= export->count
+       || message.generation != export->generation)
+        continue;
+      if(it->held & (1u << message.buffer)){
+        it->held &= ~(1u << message.buffer);
+        export->buffer[message.buffer].holders--;
+      }
+    }
+  }
+}
+
+bool engine_i_export_begin(struct engine_export* export){
+  struct engine* engine = export->engine;
+  EGLint width = 0, height = 0;
+  eglQuerySurface(engine->display, engine->surface, EGL_WIDTH, &width);
+  eglQuerySurface(engine->display, engine->surface, EGL_HEIGHT, &height);
+  if(width > 0 && height > 0 && ((unsigned)width != export->width || (unsigned)height != export->height))
+    resize(export, width, height);
+  if(!export->count)
+    return false;
+  accept_clients(export);
+  receive_releases(export);
+  if(!export->clients)
+    return false; // Nobody is interested, draw to the surface directly
+  for(unsigned i=0; i<export->count; i++){
+    unsigned index = (export->next + i) % export->count;
+    if(export->buffer[index].holders)
+      continue;
+    export->current = index;
+    export->next = index + 1;
+    glGetIntegerv(GL_VIEWPORT, export->viewport);
+    glBindFramebuffer(GL_FRAMEBUFFER, export->buffer[index].framebuffer);
+    glViewport(0, 0, export->width, export->height);
+    return true;
+  }
+  return false; // Every buffer is still held by some consumer, skip exporting this frame
+}
+
+void engine_i_export_end(struct engine_export* export){
+  struct engine* engine = export->engine;
+  if(export->current == -1)
+    return;
+  struct export_buffer* buffer = &export->buffer[export->current];
+
+  // The frame still has to end up on the surface
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, buffer->framebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  GLint* viewport = export->viewport;
+  glBlitFramebuffer(0, 0, export->width, export->height, viewport[0], viewport[1], viewport[0] + viewport[2], viewport[1] + viewport[3], GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+  // Without native fences, consumers rely on the implicit fences of the dmabuf
+  int fence = -1;
+  if(engine->native_fence_sync){
+    EGLSyncKHR sync = eglCreateSyncKHR(engine->display, EGL_SYNC_NATIVE_FENCE_ANDROID, (EGLint[]){
+      EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+      EGL_NONE
+    });
+    if(sync != EGL_NO_SYNC_KHR){
+      glFlush();
+      fence = eglDupNativeFenceFDANDROID(engine->display, sync);
+      eglDestroySyncKHR(engine->display, sync);
+    }
+  }else{
+    glFlush();
+  }
+
+  struct engine_export_message message = {
+    .version = ENGINE_EXPORT_PROTOCOL_VERSION,
+    .type = ENGINE_EXPORT_FRAME,
+    .buffer = export->current,
+    .has_fence = fence != -1,
+    .sequence = export->sequence++,
+    .timestamp_ns = engine_i_time_ns(),
+    .generation = export->generation
+  };
+  for(struct export_client *it=export->clients, *next; it; it=next){
+    next = it->next;
+    if(__builtin_popcount(it->held) >= ENGINE_EXPORT_MAX_HELD)
+      continue; // It's falling behind, it only misses frames
+    if(engine_ipc_send(it->fd, &message, sizeof(message), &fence, fence != -1) == -1){
+      if(errno != EAGAIN){
+        client_drop(export, it);
+      }
+      continue;
+    }
+    it->held |= 1u << export->current;
+    buffer->holders++;
+  }
+  if(fence != -1)
+    close(fence);
+  export->current = -1;
+}
@@ -0,0 +1,221 @@
+#include <engine.h>
+#include <internal/engine.h>
+#include <GLES3/gl3.h>
+#include <string.h>
+
+// Counts the call either way, returns whether it can be skipped
+static bool skip(struct engine_gl_state* state, bool unchanged){
+  if(unchanged){
+    state->elided++;
+  }else{
+    state->calls++;
+  }
+  return unchanged;
+}
+
+static int target_index(GLenum target){
+  switch(target){
+    case GL_TEXTURE_2D: return ENGINE_GL_STATE_TARGET_2D;
+    case GL_TEXTURE_EXTERNAL_OES: return ENGINE_GL_STATE_TARGET_EXTERNAL;
+  }
+  return -1;
+}
+
+static struct engine_gl_uniform* uniform_entry(struct engine_gl_state* state, GLint location){
+  return &state->uniform[(state->program * 31u + (GLuint)location) % ENGINE_GL_STATE_UNIFORMS];
+}
+
+void engine_gl_state_invalidate(struct engine* engine){
+  struct engine_gl_state* state = &engine->gl_state;
+  state->program = ENGINE_GL_STATE_UNKNOWN;
+  state->active_unit = ENGINE_GL_STATE_UNKNOWN;
+  for(unsigned i=0; i<ENGINE_GL_STATE_UNITS; i++)
+    for(unsigned j=0; j<ENGINE_GL_STATE_TARGET_COUNT; j++)
+      state->texture[i][j] = ENGINE_GL_STATE_UNKNOWN;
+  state->vertex_array = ENGINE_GL_STATE_UNKNOWN;
+  state->array_buffer = ENGINE_GL_STATE_UNKNOWN;
+  state->attrib_known = 0;
+  for(unsigned i=0; i<ENGINE_GL_STATE_ATTRIBS; i++)
+    state->attrib[i].known = false;
+  state->clear_color_known = false;
+  // Uniforms belong to programs, which only change through GL, but it may have been used to set them
+  memset(state->uniform, 0, sizeof(state->uniform));
+}
+
+void engine_gl_use_program(struct engine* engine, GLuint program){
+  struct engine_gl_state* state = &engine->gl_state;
+  if(skip(state, state->program == program))
+    return;
+  glUseProgram(program);
+  state->program = program;
+}
+
+void engine_gl_bind_texture(struct engine* engine, unsigned unit, GLenum target, GLuint texture){
+  struct engine_gl_state* state = &engine->gl_state;
+  int index = target_index(target);
+  if(unit < ENGINE_GL_STATE_UNITS && index != -1 && skip(state, state->texture[unit][index] == texture))
+    return;
+  if(!skip(state, state->active_unit == unit)){
+    glActiveTexture(GL_TEXTURE0 + unit);
+    state->active_unit = unit;
+  }
+  glBindTexture(target, texture);
+  if(unit < ENGINE_GL_STATE_UNITS && index != -1){
+    state->texture[unit][index] = texture;
+  }else{
+    state->calls++;
+  }
+}
+
+void engine_gl_bind_vertex_array(struct engine* engine, GLuint vertex_array){
+  struct engine_gl_state* state = &engine->gl_state;
+  if(skip(state, state->vertex_array == vertex_array))
+    return;
+  glBindVertexArray(vertex_array);
+  state->vertex_array = vertex_array;
+}
+
+void engine_gl_bind_array_buffer(struct engine* engine, GLuint buffer){
+  struct engine_gl_state* state = &engine->gl_state;
+  if(skip(state, state->array_buffer == buffer))
+    return;
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  state->array_buffer = buffer;
+}
+
+void engine_gl_vertex_attrib_pointer(struct engine* engine, GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer){
+  struct engine_gl_state* state = &engine->gl_state;
+  // The pointer is only meaningful along with the buffer it points into
+  bool tracked = index < ENGINE_GL_STATE_ATTRIBS && state->vertex_array == 0 && state->array_buffer != ENGINE_GL_STATE_UNKNOWN;
+  struct engine_gl_attrib attrib = {
+    .known = true,
+    .buffer = state->array_buffer,
+    .size = size,
+    .type = type,
+    .normalized = normalized,
+    .stride = stride,
+    .pointer = pointer
+  };
+  if(tracked){
+    const struct engine_gl_attrib* known = &state->attrib[index];
+    if(skip(state, known->known && known->buffer == attrib.buffer && known->size == size && known->type == type
+     && known->normalized == normalized && known->stride == stride && known->pointer == pointer))
+      return;
+    state->attrib[index] = attrib;
+  }else{
+    state->calls++;
+  }
+  glVertexAttribPointer(index, size, type, normalized, stride, pointer);
+}
+
+void engine_gl_vertex_attrib_arrays(struct engine* engine, uint32_t enabled){
+  struct engine_gl_state* state = &engine->gl_state;
+  bool tracked = state->vertex_array == 0;
+  for(unsigned i=0; i<ENGINE_GL_STATE_ATTRIBS; i++){
+    uint32_t bit = 1u << i;
+    bool wanted = enabled & bit;
+    bool known = tracked && (state->attrib_known & bit);
+    // Ones not enabled through here are left alone, they may not even exist
+    if(!known && !wanted)
+      continue;
+    if(known && skip(state, !(state->attrib_enabled & bit) == !wanted))
+      continue;
+    if(!known)
+      state->calls++;
+    if(wanted){
+      glEnableVertexAttribArray(i);
+    }else{
+      glDisableVertexAttribArray(i);
+    }
+    if(tracked){
+      state->attrib_known |= bit;
+      state->attrib_enabled = (state->attrib_enabled & ~bit) | (enabled & bit);
+    }
+  }
+}
+
+void engine_gl_uniform1i(struct engine* engine, GLint location, GLint value){
+  struct engine_gl_state* state = &engine->gl_state;
+  if(location == -1)
+    return;
+  struct engine_gl_uniform* entry = uniform_entry(state, location);
+  bool tracked = state->program != ENGINE_GL_STATE_UNKNOWN && state->program != 0;
+  if(tracked && skip(state, entry->program == state->program && entry->location == location
+   && entry->type == GL_INT && entry->value.i == value))
+    return;
+  if(!tracked)
+    state->calls++;
+  glUniform1i(location, value);
+  if(tracked)
+    *entry = (struct engine_gl_uniform){ .program = state->program, .location = location, .type = GL_INT, .value.i = value };
+}
+
+void engine_gl_uniform4fv(struct engine* engine, GLint location, const GLfloat value[4]){
+  struct engine_gl_state* state = &engine->gl_state;
+  if(location == -1)
+    return;
+  struct engine_gl_uniform* entry = uniform_entry(state, location);
+  bool tracked = state->program != ENGINE_GL_STATE_UNKNOWN && state->program != 0;
+  if(tracked && skip(state, entry->program == state->program && entry->location == location
+   && entry->type == GL_FLOAT_VEC4 && !memcmp(entry->value.f, value, sizeof(entry->value.f))))
+    return;
+  if(!tracked)
+    state->calls++;
+  glUniform4fv(location, 1, value);
+  if(tracked){
+    *entry = (struct engine_gl_uniform){ .program = state->program, .location = location, .type = GL_FLOAT_VEC4 };
+    memcpy(entry->value.f, value, sizeof(entry->value.f));
+  }
+}
+
+void engine_gl_clear_color(struct engine* engine, GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha){
+  struct engine_gl_state* state = &engine->gl_state;
+  const GLfloat color[4] = { red, green, blue, alpha };
+  if(skip(state, state->clear_color_known && !memcmp(state->clear_color, color, sizeof(color))))
+    return;
+  glClearColor(red, green, blue, alpha);
+  memcpy(state->clear_color, color, sizeof(color));
+  state->clear_color_known = true;
+}
+
+// Deleting bound objects unbinds them, which the state has to reflect, or a new object reusing the name would look bound
+void engine_gl_delete_textures(struct engine* engine, GLsizei count, const GLuint* textures){
+  struct engine_gl_state* state = &engine->gl_state;
+  for(GLsizei n=0; n<count; n++)
+    for(unsigned i=0; i<ENGINE_GL_STATE_UNITS; i++)
+      for(unsigned j=0; j<ENGINE_GL_STATE_TARGET_COUNT; j++)
+        if(textures[n] && state->texture[i][j] == textures[n])
+          state->texture[i][j] = 0;
+  glDeleteTextures(count, textures);
+}
+
+void engine_gl_delete_buffers(struct engine* engine, GLsizei count, const GLuint* buffers){
+  struct engine_gl_state* state = &engine->gl_state;
+  for(GLsizei n=0; n<count; n++){
+    if(!buffers[n])
+      continue;
+    if(state->array_buffer == buffers[n])
+      state->array_buffer = 0;
+    for(unsigned i=0; i<ENGINE_GL_STATE_ATTRIBS; i++)
+      if(state->attrib[i].buffer == buffers[n])
+        state->attrib[i].known = false;
+  }
+  glDeleteBuffers(count, buffers);
+}
+
+void engine_gl_delete_vertex_arrays(struct engine* engine, GLsizei count, const GLuint* vertex_arrays){
+  struct engine_gl_state* state = &engine->gl_state;
+  for(GLsizei n=0; n<count; n++)
+    if(vertex_arrays[n] && state->vertex_array == vertex_arrays[n])
+      state->vertex_array = 0;
+  glDeleteVertexArrays(count, vertex_arrays);
+}
+
+// A program in use stays around until another one is used, only its uniforms are forgotten
+void engine_gl_delete_program(struct engine* engine, GLuint program){
+  struct engine_gl_state* state = &engine->gl_state;
+  for(unsigned i=0; i<ENGINE_GL_STATE_UNIFORMS; i++)
+    if(program && state->uniform[i].program == program)
+      state->uniform[i].program = 0;
+  glDeleteProgram(program);
+}
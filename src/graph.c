@@ -0,0 +1,365 @@
+#include <engine.h>
+#include <internal/engine.h>
+#include <GLES3/gl3.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#undef engine_graph_pass_add
+
+#define GRAPH_MAX_INPUTS 8
+#define GRAPH_POOL_MAX_IDLE 60 // Runs a pooled texture may stay unused before it's freed
+
+struct pool_entry {
+  GLuint texture;
+  GLuint framebuffer;
+  unsigned width, height;
+  GLenum format;
+  struct engine_graph_pass* owner; // Whose result it holds, may still be reused if nobody overwrote it
+  uint64_t generation; // Of the owners result it holds
+  bool in_use;
+  unsigned idle;
+  struct pool_entry* next;
+};
+
+struct graph_input {
+  GLint sampler;
+  struct dma_gl_texture* texture; // Either this
+  struct engine_graph_pass* pass; // or this is set
+  uint64_t seen; // Generation of the input the last time it was checked
+};
+
+struct engine_graph_pass {
+  struct engine_graph* graph;
+  struct engine_graph_pass_params params;
+  size_t index;
+  GLint position;
+  unsigned input_count;
+  struct graph_input input[GRAPH_MAX_INPUTS];
+  uint64_t generation; // Incremented whenever the result changes
+  bool invalid;
+  struct pool_entry* target; // Holds the result while it's needed, 0 otherwise
+  /* Only valid during a run */
+  bool wanted;
+  bool render;
+  unsigned readers; // Passes which still have to read the result
+};
+
+struct engine_graph {
+  struct engine* engine;
+  GLuint quad;
+  size_t pass_count;
+  struct engine_graph_pass** pass;
+  struct pool_entry* pool;
+};
+
+struct engine_graph* engine_graph_create(struct engine* engine){
+  struct engine_graph* graph = calloc(1, sizeof(*graph));
+  if(!graph){
+    perror("calloc failed");
+    return 0;
+  }
+  graph->engine = engine;
+  static const GLfloat quad[][2] = { {-1, -1}, {1, -1}, {-1, 1}, {1, 1} };
+  glGenBuffers(1, &graph->quad);
+  engine_gl_bind_array_buffer(engine, graph->quad);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+  return graph;
+}
+
+static void pool_entry_free(struct engine* engine, struct pool_entry* entry){
+  glDeleteFramebuffers(1, &entry->framebuffer);
+  engine_gl_delete_textures(engine, 1, &entry->texture);
+  free(entry);
+}
+
+void engine_graph_destroy(struct engine_graph* graph){
+  if(!graph)
+    return;
+  while(graph->pool){
+    struct pool_entry* entry = graph->pool;
+    graph->pool = entry->next;
+    pool_entry_free(graph->engine, entry);
+  }
+  for(size_t i=0; i<graph->pass_count; i++)
+    free(graph->pass[i]);
+  free(graph->pass);
+  engine_gl_delete_buffers(graph->engine, 1, &graph->quad);
+  free(graph);
+}
+
+struct engine_graph_pass* engine_graph_pass_add(struct engine_graph* graph, struct engine_graph_pass_params params){
+  if(!params.shader || !params.shader->program){
+    fprintf(stderr, "engine_graph_pass_add: a shader is required\n");
+    return 0;
+  }
+  GLint position = glGetAttribLocation(params.shader->program, "position");
+  if(position == -1){
+    fprintf(stderr, "engine_graph_pass_add: position attribute not found in shader program\n");
+    return 0;
+  }
+  struct engine_graph_pass** list = realloc(graph->pass, (graph->pass_count + 1) * sizeof(*list));
+  if(!list){
+    perror("realloc failed");
+    return 0;
+  }
+  graph->pass = list;
+  struct engine_graph_pass* pass = calloc(1, sizeof(*pass));
+  if(!pass){
+    perror("calloc failed");
+    return 0;
+  }
+  if(!params.format)
+    params.format = GL_RGBA8;
+  pass->graph = graph;
+  pass->params = params;
+  pass->index = graph->pass_count;
+  pass->position = position;
+  pass->generation = 1; // There is no result yet
+  graph->pass[graph->pass_count++] = pass;
+  return pass;
+}
+
+static struct graph_input* input_add(struct engine_graph_pass* pass, const char* sampler){
+  if(pass->input_count >= GRAPH_MAX_INPUTS){
+    fprintf(stderr, "graph passes are limited to %d inputs\n", GRAPH_MAX_INPUTS);
+    return 0;
+  }
+  GLint location = glGetUniformLocation(pass->params.shader->program, sampler);
+  if(location == -1){
+    fprintf(stderr, "%s uniform not found in shader program\n", sampler);
+    return 0;
+  }
+  struct graph_input* input = &pass->input[pass->input_count++];
+  *input = (struct graph_input){
+    .sampler = location,
+    .seen = ~(uint64_t)0
+  };
+  return input;
+}
+
+int engine_graph_pass_add_texture_input(struct engine_graph_pass* pass, const char* sampler, struct dma_gl_texture* texture){
+  struct graph_input* input = input_add(pass, sampler);
+  if(!input)
+    return -1;
+  input->texture = texture;
+  return 0;
+}
+
+int engine_graph_pass_add_pass_input(struct engine_graph_pass* pass, const char* sampler, struct engine_graph_pass* from){
+  // This keeps the passes in a valid execution order
+  if(from->graph != pass->graph || from->index >= pass->index){
+    fprintf(stderr, "engine_graph_pass_add_pass_input: the input must be an earlier pass of the same graph\n");
+    return -1;
+  }
+  struct graph_input* input = input_add(pass, sampler);
+  if(!input)
+    return -1;
+  input->pass = from;
+  return 0;
+}
+
+void engine_graph_pass_invalidate(struct engine_graph_pass* pass){
+  pass->invalid = true;
+}
+
+GLuint engine_graph_pass_get_texture(struct engine_graph_pass* pass){
+  return pass->target ? pass->target->texture : 0;
+}
+
+static void pass_size(const struct engine_graph_pass* pass, unsigned* width, unsigned* height){
+  *width = pass->params.width;
+  *height = pass->params.height;
+  if((*width && *height) || !pass->input_count)
+    return;
+  unsigned w, h;
+  const struct graph_input* input = &pass->input[0];
+  if(input->texture){
+    w = input->texture->width;
+    h = input->texture->height;
+  }else{
+    pass_size(input->pass, &w, &h);
+  }
+  if(!*width) *width = w;
+  if(!*height) *height = h;
+}
+
+static struct pool_entry* pool_acquire(struct engine_graph* graph, struct engine_graph_pass* pass){
+  unsigned width, height;
+  pass_size(pass, &width, &height);
+  // Prefer our own old texture, then the one which was unused the longest
+  struct pool_entry* best = 0;
+  for(struct pool_entry* it=graph->pool; it; it=it->next){
+    if(it->in_use || it->width != width || it->height != height || it->format != pass->params.format)
+      continue;
+    if(it->owner == pass){
+      best = it;
+      break;
+    }
+    if(!best || it->idle > best->idle)
+      best = it;
+  }
+  if(!best){
+    best = calloc(1, sizeof(*best));
+    if(!best){
+      perror("calloc failed");
+      return 0;
+    }
+    while(glGetError() != GL_NO_ERROR); // Clear previouse errors
+    glGenTextures(1, &best->texture);
+    engine_gl_bind_texture(graph->engine, 0, GL_TEXTURE_2D, best->texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, pass->params.format, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenFramebuffers(1, &best->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, best->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, best->texture, 0);
+    if(glGetError() != GL_NO_ERROR || glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+      fprintf(stderr, "Failed to create a %ux%u render target with format 0x%x\n", width, height, pass->params.format);
+      pool_entry_free(graph->engine, best);
+      return 0;
+    }
+    best->width = width;
+    best->height = height;
+    best->format = pass->params.format;
+    best->next = graph->pool;
+    graph->pool = best;
+  }
+  best->owner = pass;
+  best->generation = 0;
+  best->in_use = true;
+  best->idle = 0;
+  return best;
+}
+
+static void pool_release(struct engine_graph_pass* pass){
+  if(!pass->target)
+    return;
+  pass->target->in_use = false;
+  pass->target = 0;
+}
+
+// Whether the pass holds its current result, possibly reclaiming it from the pool
+static bool result_valid(struct engine_graph* graph, struct engine_graph_pass* pass){
+  if(pass->target)
+    return pass->target->generation == pass->generation;
+  for(struct pool_entry* it=graph->pool; it; it=it->next){
+    if(!it->in_use && it->owner == pass && it->generation == pass->generation){
+      it->in_use = true;
+      it->idle = 0;
+      pass->target = it;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int render(struct engine_graph* graph, struct engine_graph_pass* pass){
+  if(!pass->target){
+    pass->target = pool_acquire(graph, pass);
+    if(!pass->target)
+      return -1;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, pass->target->framebuffer);
+  glViewport(0, 0, pass->target->width, pass->target->height);
+  struct engine* engine = graph->engine;
+  engine_gl_use_program(engine, pass->params.shader->program);
+  for(unsigned i=0; i<pass->input_count; i++){
+    const struct graph_input* input = &pass->input[i];
+    if(input->texture){
+      engine_gl_bind_texture(engine, i, engine_dma_texture_get_gl_type(input->texture), engine_dma_texture_get_gl_texture(input->texture));
+    }else{
+      engine_gl_bind_texture(engine, i, GL_TEXTURE_2D, input->pass->target ? input->pass->target->texture : 0);
+    }
+    engine_gl_uniform1i(engine, input->sampler, i);
+  }
+  if(pass->params.prepare)
+    pass->params.prepare(pass, pass->params.param);
+  engine_gl_bind_vertex_array(engine, 0);
+  engine_gl_bind_array_buffer(engine, graph->quad);
+  engine_gl_vertex_attrib_pointer(engine, pass->position, 2, GL_FLOAT, false, 0, 0);
+  engine_gl_vertex_attrib_arrays(engine, 1u << pass->position);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  pass->target->generation = pass->generation;
+  return 0;
+}
+
+int engine_graph_run(struct engine_graph* graph){
+  int ret = 0;
+
+  // Find out which results are out of date. Passes only read earlier passes, so one forward sweep does it.
+  for(size_t i=0; i<graph->pass_count; i++){
+    struct engine_graph_pass* pass = graph->pass[i];
+    bool changed = pass->invalid;
+    pass->invalid = false;
+    for(unsigned j=0; j<pass->input_count; j++){
+      struct graph_input* input = &pass->input[j];
+      uint64_t generation = input->texture ? input->texture->generation : input->pass->generation;
+      if(input->seen != generation){
+        input->seen = generation;
+        changed = true;
+      }
+    }
+    if(changed)
+      pass->generation++;
+    pass->wanted = pass->params.output;
+    pass->render = false;
+    pass->readers = 0;
+  }
+
+  // Pull from the outputs backwards, only what they need gets rendered
+  for(size_t i=graph->pass_count; i--; ){
+    struct engine_graph_pass* pass = graph->pass[i];
+    if(!pass->wanted || result_valid(graph, pass))
+      continue;
+    pass->render = true;
+    for(unsigned j=0; j<pass->input_count; j++){
+      struct engine_graph_pass* from = pass->input[j].pass;
+      if(!from)
+        continue;
+      from->wanted = true;
+      from->readers++;
+    }
+  }
+
+  GLint viewport[4];
+  GLint framebuffer;
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+
+  for(size_t i=0; i<graph->pass_count; i++){
+    struct engine_graph_pass* pass = graph->pass[i];
+    if(pass->render && render(graph, pass) == -1){
+      ret = -1;
+      // Don't leave readers sampling garbage, they're rendered again on the next run
+      pass->generation++;
+    }
+    if(!pass->render)
+      continue;
+    for(unsigned j=0; j<pass->input_count; j++){
+      struct engine_graph_pass* from = pass->input[j].pass;
+      if(from && !--from->readers && !from->params.output)
+        pool_release(from);
+    }
+  }
+
+  // Results nobody read this time
+  for(size_t i=0; i<graph->pass_count; i++)
+    if(!graph->pass[i]->params.output && !graph->pass[i]->readers)
+      pool_release(graph->pass[i]);
+
+  for(struct pool_entry** it=&graph->pool; *it; ){
+    struct pool_entry* entry = *it;
+    if(!entry->in_use && ++entry->idle > GRAPH_POOL_MAX_IDLE){
+      *it = entry->next;
+      pool_entry_free(graph->engine, entry);
+    }else{
+      it = &entry->next;
+    }
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  return ret;
+}
@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L
+#include <engine.h>
+#include <internal/engine.h>
+#include <internal/import.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+enum import_state {
+  IMPORT_QUEUED,
+  IMPORT_RUNNING,
+  IMPORT_DONE,
+  IMPORT_FAILED
+};
+
+struct engine_import {
+  struct engine* engine;
+  bool failed; // There is no import thread, everything is imported on the render thread
+  EGLContext context; // Shares textures with engine->context
+  EGLSurface surface; // EGL_NO_SURFACE with EGL_KHR_surfaceless_context
+  /* Shared with the import thread, guarded by lock */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int started; // 1 once the context is current on the import thread, -1 if it couldn't be made current
+  bool quit;
+  struct engine_i_import_job *first, *last;
+};
+
+static void job_destroy(struct engine* engine, struct engine_i_import_job* job){
+  for(unsigned i=0; i<job->count; i++){
+    if(job->texture[i])
+      glDeleteTextures(1, &job->texture[i]);
+    if(job->image[i] != EGL_NO_IMAGE_KHR)
+      eglDestroyImageKHR(engine->display, job->image[i]);
+    for(unsigned j=0; j<job->buffer[i].plane_count; j++)
+      if(job->buffer[i].plane[j].fd != -1)
+        close(job->buffer[i].plane[j].fd);
+  }
+  if(job->fence != EGL_NO_SYNC_KHR)
+    eglDestroySyncKHR(engine->display, job->fence);
+  free(job);
+}
+
+// On the import thread
+static int import_run(struct engine* engine, struct engine_i_import_job* job){
+  for(unsigned i=0; i<job->count; i++){
+    if(engine_i_dma_image_create(engine, &job->buffer[i], &job->image[i], &job->texture[i]) == -1){
+      fprintf(stderr,"importing buffer %u failed\n", i);
+      return -1;
+    }
+  }
+  if(engine->fence_sync)
+    job->fence = eglCreateSyncKHR(engine->display, EGL_SYNC_FENCE_KHR, 0);
+  if(job->fence != EGL_NO_SYNC_KHR){
+    glFlush(); // Nobody waits with EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, it would never signal otherwise
+  }else{
+    glFinish();
+  }
+  return 0;
+}
+
+static void* import_thread(void* arg){
+  struct engine_import* import = arg;
+  struct engine* engine = import->engine;
+  bool current = eglMakeCurrent(engine->display, import->surface, import->surface, import->context);
+  if(!current)
+    fprintf(stderr, "eglMakeCurrent failed on the import thread (eglError: %d)\n", eglGetError());
+  pthread_mutex_lock(&import->lock);
+  import->started = current ? 1 : -1;
+  pthread_cond_broadcast(&import->wake);
+  while(current){
+    while(!import->quit && !import->first)
+      pthread_cond_wait(&import->wake, &import->lock);
+    if(import->quit)
+      break;
+    struct engine_i_import_job* job = import->first;
+    import->first = job->next;
+    if(!import->first)
+      import->last = 0;
+    job->state = IMPORT_RUNNING;
+    pthread_mutex_unlock(&import->lock);
+    int ret = import_run(engine, job);
+    pthread_mutex_lock(&import->lock);
+    if(job->canceled){
+      pthread_mutex_unlock(&import->lock);
+      job_destroy(engine, job);
+      pthread_mutex_lock(&import->lock);
+      continue;
+    }
+    job->state = ret == -1 ? IMPORT_FAILED : IMPORT_DONE;
+  }
+  pthread_mutex_unlock(&import->lock);
+  if(current)
+    eglMakeCurrent(engine->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglReleaseThread();
+  return 0;
+}
+
+static int import_start(struct engine* engine, struct engine_import* import){
+  EGLint version = 2;
+  eglQueryContext(engine->display, engine->context, EGL_CONTEXT_CLIENT_VERSION, &version);
+  EGLint ctxattr[] = {
+    EGL_CONTEXT_CLIENT_VERSION, version,
+    EGL_NONE
+  };
+  import->context = eglCreateContext(engine->display, engine->config, engine->context, ctxattr);
+  if(import->context == EGL_NO_CONTEXT){
+    fprintf(stderr, "Unable to create a shared EGL context (eglError: %d)\n", eglGetError());
+    goto error;
+  }
+  import->surface = EGL_NO_SURFACE;
+  if(!engine_i_egl_has_extension(engine, "EGL_KHR_surfaceless_context")){
+    import->surface = eglCreatePbufferSurface(engine->display, engine->config, (EGLint[]){
+      EGL_WIDTH, 1,
+      EGL_HEIGHT, 1,
+      EGL_NONE
+    });
+    if(import->surface == EGL_NO_SURFACE){
+      fprintf(stderr, "Unable to create EGL pbuffer surface (eglError: %d)\n", eglGetError());
+      goto error_after_context;
+    }
+  }
+  if(pthread_mutex_init(&import->lock, 0)){
+    fprintf(stderr, "pthread_mutex_init failed\n");
+    goto error_after_surface;
+  }
+  if(pthread_cond_init(&import->wake, 0)){
+    fprintf(stderr, "pthread_cond_init failed\n");
+    goto error_after_mutex;
+  }
+  if(pthread_create(&import->thread, 0, import_thread, import)){
+    fprintf(stderr, "pthread_create failed\n");
+    goto error_after_cond;
+  }
+  pthread_mutex_lock(&import->lock);
+  while(!import->started)
+    pthread_cond_wait(&import->wake, &import->lock);
+  pthread_mutex_unlock(&import->lock);
+  if(import->started == -1){
+    pthread_join(import->thread, 0);
+    goto error_after_cond;
+  }
+  return 0;
+
+error_after_cond:
+  pthread_cond_destroy(&import->wake);
+error_after_mutex:
+  pthread_mutex_destroy(&import->lock);
+error_after_surface:
+  if(import->surface != EGL_NO_SURFACE)
+    eglDestroySurface(engine->display, import->surface);
+error_after_context:
+  eglDestroyContext(engine->display, import->context);
+error:
+  return -1;
+}
+
+struct engine_i_import_job* engine_i_import_submit(struct engine* engine, unsigned count, const struct engine_dmabuf buffer[]){
+  if(!engine->import){
+    struct engine_import* import = calloc(1, sizeof(*import));
+    if(!import){
+      perror("calloc failed");
+      return 0;
+    }
+    import->engine = engine;
+    if(import_start(engine, import) == -1){
+      fprintf(stderr, "no import thread, buffers are imported on the render thread\n");
+      import->failed = true;
+    }
+    engine->import = import;
+  }
+  struct engine_import* import = engine->import;
+  if(import->failed)
+    return 0;
+
+  struct engine_i_import_job* job = calloc(1, sizeof(*job));
+  if(!job){
+    perror("calloc failed");
+    return 0;
+  }
+  job->count = count;
+  job->fence = EGL_NO_SYNC_KHR;
+  job->state = IMPORT_QUEUED;
+  for(unsigned i=0; i<count; i++){
+    job->image[i] = EGL_NO_IMAGE_KHR;
+    job->buffer[i] = buffer[i];
+    for(unsigned j=0; j<buffer[i].plane_count; j++)
+      job->buffer[i].plane[j].fd = -1;
+  }
+  // The caller may close its fds before the import thread gets to them
+  for(unsigned i=0; i<count; i++){
+    for(unsigned j=0; j<buffer[i].plane_count; j++){
+      job->buffer[i].plane[j].fd = fcntl(buffer[i].plane[j].fd, F_DUPFD_CLOEXEC, 0);
+      if(job->buffer[i].plane[j].fd == -1){
+        perror("fcntl F_DUPFD_CLOEXEC");
+        job_destroy(engine, job);
+        return 0;
+      }
+    }
+  }
+
+  pthread_mutex_lock(&import->lock);
+  if(import->last){
+    import->last->next = job;
+  }else{
+    import->first = job;
+  }
+  import->last = job;
+  pthread_cond_broadcast(&import->wake);
+  pthread_mutex_unlock(&import->lock);
+  return job;
+}
+
+int engine_i_import_poll(struct engine* engine, struct engine_i_import_job* job){
+  struct engine_import* import = engine->import;
+  pthread_mutex_lock(&import->lock);
+  int state = job->state;
+  pthread_mutex_unlock(&import->lock);
+  if(state == IMPORT_FAILED)
+    return -1;
+  if(state != IMPORT_DONE)
+    return 0;
+  // The import thread is done with the job, only the GPU may not be yet
+  if(job->fence != EGL_NO_SYNC_KHR){
+    EGLint result = eglClientWaitSyncKHR(engine->display, job->fence, 0, 0);
+    if(result == EGL_TIMEOUT_EXPIRED_KHR)
+      return 0;
+    if(result == EGL_FALSE)
+      fprintf(stderr, "eglClientWaitSyncKHR failed (eglError: %d)\n", eglGetError());
+    eglDestroySyncKHR(engine->display, job->fence);
+    job->fence = EGL_NO_SYNC_KHR;
+  }
+  return 1;
+}
+
+void engine_i_import_free(struct engine* engine, struct engine_i_import_job* job){
+  if(!job)
+    return;
+  struct engine_import* import = engine->import;
+  pthread_mutex_lock(&import->lock);
+  if(job->state == IMPORT_RUNNING){ // The import thread frees it once it's done
+    job->canceled = true;
+    pthread_mutex_unlock(&import->lock);
+    return;
+  }
+  if(job->state == IMPORT_QUEUED){
+    struct engine_i_import_job* previous = 0;
+    for(struct engine_i_import_job* it=import->first; it!=job; it=it->next)
+      previous = it;
+    if(previous){
+      previous->next = job->next;
+    }else{
+      import->first = job->next;
+    }
+    if(import->last == job)
+      import->last = previous;
+  }
+  pthread_mutex_unlock(&import->lock);
+  job_destroy(engine, job);
+}
+
+void engine_i_import_destroy(struct engine* engine){
+  struct engine_import* import = engine->import;
+  if(!import)
+    return;
+  if(!import->failed){
+    pthread_mutex_lock(&import->lock);
+    import->quit = true;
+    pthread_cond_broadcast(&import->wake);
+    pthread_mutex_unlock(&import->lock);
+    pthread_join(import->thread, 0);
+    while(import->first){
+      struct engine_i_import_job* job = import->first;
+      import->first = job->next;
+      job_destroy(engine, job);
+    }
+    pthread_cond_destroy(&import->wake);
+    pthread_mutex_destroy(&import->lock);
+    if(import->surface != EGL_NO_SURFACE)
+      eglDestroySurface(engine->display, import->surface);
+    eglDestroyContext(engine->display, import->context);
+  }
+  free(import);
+  engine->import = 0;
+}
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE // MSG_CMSG_CLOEXEC
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ipc.h>
+
+static int socket_address(struct sockaddr_un* address, const char* path){
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(address->sun_path)){
+    fprintf(stderr, "socket path %s is too long\n", path);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address->sun_path, path);
+  return 0;
+}
+
+int engine_ipc_listen(const char* path){
+  struct sockaddr_un address;
+  if(socket_address(&address, path) == -1)
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd == -1){
+    perror("socket");
+    return -1;
+  }
+  unlink(path); // Left over from an earlier run
+  if(bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(fd, 8) == -1){
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int engine_ipc_connect(const char* path){
+  struct sockaddr_un address;
+  if(socket_address(&address, path) == -1)
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if(fd == -1){
+    perror("socket");
+    return -1;
+  }
+  if(connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1){
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+int engine_ipc_send(int socket, const void* data, size_t size, const int fd[], unsigned fd_count){
+  if(fd_count > ENGINE_IPC_MAX_FDS){
+    errno = EINVAL;
+    return -1;
+  }
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * ENGINE_IPC_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = (void*)data, .iov_len = size };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1
+  };
+  if(fd_count){
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fd, sizeof(int) * fd_count);
+  }
+  ssize_t ret;
+  do {
+    ret = sendmsg(socket, &msg, MSG_NOSIGNAL);
+  } while(ret == -1 && errno == EINTR);
+  return ret == -1 ? -1 : 0;
+}
+
+ssize_t engine_ipc_recv(int socket, void* data, size_t size, int fd[], unsigned* fd_count, int flags){
+  unsigned max = fd_count ? *fd_count : 0;
+  if(fd_count)
+    *fd_count = 0;
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * ENGINE_IPC_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = data, .iov_len = size };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf)
+  };
+  ssize_t ret;
+  do {
+    ret = recvmsg(socket, &msg, flags | MSG_CMSG_CLOEXEC);
+  } while(ret == -1 && errno == EINTR);
+  if(ret == -1)
+    return -1;
+  for(struct cmsghdr* cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg)){
+    if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    unsigned count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for(unsigned i=0; i<count; i++){
+      int received;
+      memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if(fd_count && *fd_count < max){
+        fd[(*fd_count)++] = received;
+      }else{
+        close(received);
+      }
+    }
+  }
+  if(msg.msg_flags & MSG_TRUNC){
+    for(unsigned i=0; fd_count && i<*fd_count; i++)
+      close(fd[i]);
+    if(fd_count)
+      *fd_count = 0;
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return ret;
+}
@@ -1,29 +1,30 @@
 #include <engine.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <string.h>
 #include <GLES2/gl2.h>
 
-struct my_test_shader {
-  struct shader shader;
-  struct {
-    GLint position;
-    GLint texture_coordinate;
-  } attribut;
-  struct {
-    GLint texture;
-  } uniform;
-};
+#define MAX_CAMERAS 64
+#define TAP_WIDTH 64
+#define TAP_HEIGHT 36
 
 struct runtime {
-  struct dma_gl_texture* camera;
-  struct my_test_shader test_shader;
+  struct engine_quad_batch* batch;
+  unsigned camera_count;
+  struct dma_gl_texture* camera[MAX_CAMERAS];
 };
 
-int engine_init(struct engine* engine, int argc, char* argv[]){
-  (void)argc;
-  (void)argv;
+// Prints the mean brightness of a tapped camera, runs on the taps thread
+static void tap_callback(const struct engine_tap_frame* frame, void* param){
+  uint64_t sum = 0;
+  for(unsigned y=0; y<frame->height; y++)
+    for(unsigned x=0; x<frame->width; x++)
+      sum += frame->data[y * frame->pitch + x];
+  printf("%s: frame %u brightness %u, %u dropped\n", (const char*)param, (unsigned)frame->sequence,
+    (unsigned)(sum / (frame->width * frame->height)), frame->dropped);
+}
 
+int engine_init(struct engine* engine, int argc, char* argv[]){
   /* Allocate some private date to store everything in */
   struct runtime* runtime = calloc(1, sizeof(struct runtime));
   if(!runtime){
@@ -32,44 +33,87 @@ int engine_init(struct engine* engine, int argc, char* argv[]){
   }
   engine_private_set(engine, runtime);
 
-  /* Load & compile shaders */
-  if(engine_load_create_shader_program(
-    &runtime->test_shader.shader,
-    .vertex_shader = "shader/test.vs",
-    .fragment_shader = "shader/test.fs"
-  ) == -1){
-    fprintf(stderr, "engine_load_create_shader_program failed\n");
+  /* Load & compile shaders, set up the vertex buffers */
+  runtime->batch = engine_quad_batch_create(engine);
+  if(!runtime->batch){
+    fprintf(stderr, "engine_quad_batch_create failed\n");
     goto error_after_calloc;
   }
 
-  /* get shader attributes & uniforms */
-  runtime->test_shader.attribut.position = glGetAttribLocation(runtime->test_shader.shader.program, "position");
-  if(runtime->test_shader.attribut.position == -1){
-    fprintf(stderr,"position attribute not found in shader program\n");
-    goto error_after_calloc;
+  /*
+   * Create a texture for each v4l device, all of them make up a video wall.
+   * --broker=<socket> shares the next device with other processes, which show it with broker:<socket>.
+   * --size=<width>x<height> & --fps=<rate> are the least the devices after them have to deliver.
+   * --tap prints the brightness of the next device about once a second.
+   */
+  const char* broker = 0;
+  bool tap = false;
+  unsigned width = 0, height = 0;
+  float fps = 0;
+  for(int i=1; i<=argc; i++){
+    if(i < argc && !strncmp(argv[i], "--broker=", 9)){
+      broker = argv[i] + 9;
+      continue;
+    }
+    if(i < argc && !strncmp(argv[i], "--size=", 7)){
+      if(sscanf(argv[i] + 7, "%ux%u", &width, &height) != 2){
+        fprintf(stderr, "Invalid size %s\n", argv[i] + 7);
+        goto error_after_batch;
+      }
+      continue;
+    }
+    if(i < argc && !strcmp(argv[i], "--tap")){
+      tap = true;
+      continue;
+    }
+    if(i < argc && !strncmp(argv[i], "--fps=", 6)){
+      fps = atof(argv[i] + 6);
+      continue;
+    }
+    if(i == argc && runtime->camera_count)
+      break;
+    const char* device = i < argc ? argv[i] : "/dev/video0";
+    if(runtime->camera_count >= MAX_CAMERAS){
+      fprintf(stderr, "At most %d cameras are supported\n", MAX_CAMERAS);
+      goto error_after_batch;
+    }
+    struct dma_gl_texture* camera = engine_v4l_texture_create(engine,
+      .device = device,
+      .buffer_count = broker ? 8 : 4, // The clients hold some of them too
+      .broker = broker,
+      .width = width,
+      .height = height,
+      .fps = fps
+    );
+    if(!camera){
+      fprintf(stderr, "engine_v4l_texture_create failed for %s\n", device);
+      goto error_after_batch;
+    }
+    runtime->camera[runtime->camera_count++] = camera;
+    broker = 0;
+    // Destroyed by the engine
+    if(tap && !engine_tap_create(engine,
+      .texture = camera,
+      .width = TAP_WIDTH,
+      .height = TAP_HEIGHT,
+      .format = ENGINE_TAP_GRAY,
+      .max_fps = 1,
+      .callback = tap_callback,
+      .param = (void*)device
+    )){
+      fprintf(stderr, "engine_tap_create failed for %s\n", device);
+      goto error_after_batch;
+    }
+    tap = false;
   }
 
-  runtime->test_shader.attribut.texture_coordinate = glGetAttribLocation(runtime->test_shader.shader.program, "texture_coordinate");
-  if(runtime->test_shader.attribut.texture_coordinate == -1){
-    fprintf(stderr,"texture_coordinate attribute not found in shader program\n");
-    goto error_after_calloc;
-  }
-
-  runtime->test_shader.uniform.texture = glGetUniformLocation(runtime->test_shader.shader.program, "texture");
-  if(runtime->test_shader.uniform.texture == -1){
-    fprintf(stderr,"texture uniform not found in shader program\n");
-    goto error_after_calloc;
-  }
-
-  /* Create texture from v4l device */
-  runtime->camera = engine_v4l_texture_create(engine, "/dev/video0");
-  if(!runtime->camera){
-    fprintf(stderr, "engine_v4l_texture_create failed\n");
-    goto error_after_calloc;
-  }
+  /* Nothing but the cameras is shown, there is no point in redrawing until one of them has a new frame */
+  engine_redraw_policy_set(engine, ENGINE_REDRAW_ON_CHANGE);
 
   return 0;
 
+error_after_batch:
+  engine_quad_batch_destroy(runtime->batch);
 error_after_calloc:
   free(runtime);
 error:
@@ -79,41 +123,38 @@ error:
 bool engine_main_loop(struct engine* engine){
   struct runtime* runtime = engine_private_get(engine);
 
-  glUseProgram(runtime->test_shader.shader.program);
+  // A lone camera is shown as it is, the display driver may hand its buffers straight to the compositor
+  if(runtime->camera_count == 1){
+    engine_passthrough(engine, runtime->camera[0], -0.5f, -0.5f, 1, 1);
+    return true;
+  }
 
-  glClearColor(0.1,0.2,0.3,1);
+  engine_gpu_scope_begin(engine, "clear");
+  engine_gl_clear_color(engine, 0.1, 0.2, 0.3, 1);
   glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-
-  float position[][3][3] = {
-    { {-0.5, -0.5, 0.0}, { 0.5, -0.5, 0.0}, {-0.5, 0.5, 0.0} },
-    { {-0.5,  0.5, 0.0}, { 0.5, -0.5, 0.0}, { 0.5, 0.5, 0.0} }
-  };
-  size_t position_count = sizeof(position)/sizeof(**position);
-
-  float texture_coordinate[][3][2] = {
-    { { 1.0,  1.0}, { 0.0,  1.0}, { 1.0, 0.0} },
-    { { 1.0,  0.0}, { 0.0,  1.0}, { 0.0, 0.0} }
-  };
-  size_t texture_coordinate_count = sizeof(texture_coordinate)/sizeof(**texture_coordinate);
-
-  assert(texture_coordinate_count == position_count);
-  size_t vertex_count = position_count;
-
-  glVertexAttribPointer(runtime->test_shader.attribut.position, 3, GL_FLOAT, false, 0, position);
-  glEnableVertexAttribArray(runtime->test_shader.attribut.position);
-  glVertexAttribPointer(runtime->test_shader.attribut.texture_coordinate, 2, GL_FLOAT, false, 0, texture_coordinate);
-  glEnableVertexAttribArray(runtime->test_shader.attribut.texture_coordinate);
-
-  glActiveTexture(GL_TEXTURE0);
-//  glEnable(GL_TEXTURE_2D);
-//  glEnable(engine_dma_texture_get_gl_type(runtime->camera));
-  glBindTexture(
-    engine_dma_texture_get_gl_type(runtime->camera),
-    engine_dma_texture_get_gl_texture(runtime->camera)
-  );
-  glUniform1i(runtime->test_shader.uniform.texture, 0); // GL_TEXTURE0
-
-  glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+  engine_gpu_scope_end(engine);
+
+  // Smallest square grid that fits all cameras, each one takes a cell with a small gap
+  unsigned columns = 1;
+  while(columns * columns < runtime->camera_count)
+    columns++;
+  unsigned rows = (runtime->camera_count + columns - 1) / columns;
+  float width = 2.0f / columns, height = 2.0f / rows;
+  float scale = 0.95f;
+
+  engine_gpu_scope_begin(engine, "cameras");
+  for(unsigned i=0; i<runtime->camera_count; i++){
+    unsigned column = i % columns, row = i / columns;
+    engine_quad_batch_add(runtime->batch,
+      .texture = runtime->camera[i],
+      .x = -1 + width * (column + (1 - scale) / 2),
+      .y = 1 - height * (row + 1 - (1 - scale) / 2),
+      .width = width * scale,
+      .height = height * scale
+    );
+  }
+  engine_quad_batch_flush(runtime->batch);
+  engine_gpu_scope_end(engine);
 
   return true;
 }
@@ -122,5 +163,7 @@ void engine_cleanup(struct engine* engine){
   struct runtime* runtime = engine_private_get(engine);
   if(!runtime)
     return;
-  // TODO
+  engine_quad_batch_destroy(runtime->batch);
+  // The camera textures are destroyed by the engine
+  free(runtime);
 }
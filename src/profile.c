@@ -0,0 +1,306 @@
+#define _POSIX_C_SOURCE 200809L
+#include <engine.h>
+#include <internal/engine.h>
+#include <internal/profile.h>
+#include <internal/stats.h>
+#include <internal/trace.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define PROFILE_IN_FLIGHT 32 // Measurements not collected yet, more are dropped
+
+struct profile_measurement {
+  unsigned scope;
+  bool discarded; // The GPU timer was disjoint meanwhile
+  GLuint query; // With timer queries
+  EGLSyncKHR begin, end; // Without, EGL_NO_SYNC_KHR if they couldn't be created
+  uint64_t begin_ns, end_ns; // When they signaled, written by the fence thread
+};
+
+struct engine_profile {
+  struct engine* engine;
+  enum engine_stats_gpu_timing timing;
+  PFNGLGENQUERIESEXTPROC gen_queries;
+  PFNGLDELETEQUERIESEXTPROC delete_queries;
+  PFNGLBEGINQUERYEXTPROC begin_query;
+  PFNGLENDQUERYEXTPROC end_query;
+  PFNGLGETQUERYOBJECTUIVEXTPROC get_query_uiv;
+  PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_ui64v;
+  unsigned scope_count;
+  const char* scope_name[ENGINE_STATS_MAX_SCOPES];
+  int scope[ENGINE_STATS_MAX_SCOPES]; // On the statistics page
+  int open; // Scope being measured, -1 if none, -2 if it isn't measured
+  unsigned nested; // Scopes begun inside the open one, they are ignored
+  uint64_t head, tail; // Measurements in flight, in the order they were ended
+  struct profile_measurement measurement[PROFILE_IN_FLIGHT];
+  bool unflushed; // Fences were created since the last flush
+  /* Shared with the fence thread, guarded by lock */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool quit;
+  uint64_t submitted; // Measurements before this one were ended
+  uint64_t waited; // Measurements before this one have their times
+};
+
+static bool gl_has_extension(const char* name){
+  const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+  size_t length = strlen(name);
+  for(const char* it=extensions; it && (it=strstr(it, name)); it+=length)
+    if((it == extensions || it[-1] == ' ') && (it[length] == ' ' || !it[length]))
+      return true;
+  return false;
+}
+
+// Fences signal in the order they were created. The oldest one is waited for, then the others are looked at once:
+// those which signaled meanwhile get the same time, rather than one taken after waiting for each in turn.
+static void* fence_thread(void* arg){
+  struct engine_profile* profile = arg;
+  EGLDisplay display = profile->engine->display;
+  uint64_t fence = 0; // Fences before this one have their times, begin & end of each measurement
+  pthread_mutex_lock(&profile->lock);
+  while(true){
+    while(!profile->quit && profile->waited == profile->submitted)
+      pthread_cond_wait(&profile->wake, &profile->lock);
+    if(profile->waited == profile->submitted) // Only quits once everything was waited for, the fences are flushed
+      break;
+    uint64_t submitted = profile->submitted;
+    pthread_mutex_unlock(&profile->lock);
+    uint64_t ns = 0;
+    for(bool block=true; fence < submitted * 2; fence++){
+      struct profile_measurement* m = &profile->measurement[fence / 2 % PROFILE_IN_FLIGHT];
+      EGLSyncKHR sync = fence % 2 ? m->end : m->begin;
+      if(sync == EGL_NO_SYNC_KHR)
+        continue;
+      EGLint result = eglClientWaitSyncKHR(display, sync, 0, block ? EGL_FOREVER_KHR : 0);
+      if(result == EGL_TIMEOUT_EXPIRED_KHR)
+        break;
+      if(block){
+        ns = engine_i_time_ns();
+        block = false;
+      }
+      if(result != EGL_FALSE)
+        *(fence % 2 ? &m->end_ns : &m->begin_ns) = ns;
+    }
+    pthread_mutex_lock(&profile->lock);
+    profile->waited = fence / 2;
+  }
+  pthread_mutex_unlock(&profile->lock);
+  eglReleaseThread();
+  return 0;
+}
+
+static struct engine_profile* profile_create(struct engine* engine){
+  struct engine_profile* profile = calloc(1, sizeof(*profile));
+  if(!profile){
+    perror("calloc failed");
+    return 0;
+  }
+  profile->engine = engine;
+  profile->open = -1;
+  if(gl_has_extension("GL_EXT_disjoint_timer_query")){
+    profile->gen_queries = (PFNGLGENQUERIESEXTPROC)eglGetProcAddress("glGenQueriesEXT");
+    profile->delete_queries = (PFNGLDELETEQUERIESEXTPROC)eglGetProcAddress("glDeleteQueriesEXT");
+    profile->begin_query = (PFNGLBEGINQUERYEXTPROC)eglGetProcAddress("glBeginQueryEXT");
+    profile->end_query = (PFNGLENDQUERYEXTPROC)eglGetProcAddress("glEndQueryEXT");
+    profile->get_query_uiv = (PFNGLGETQUERYOBJECTUIVEXTPROC)eglGetProcAddress("glGetQueryObjectuivEXT");
+    profile->get_query_ui64v = (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+  }
+  if(profile->gen_queries && profile->delete_queries && profile->begin_query && profile->end_query
+   && profile->get_query_uiv && profile->get_query_ui64v){
+    GLuint query[PROFILE_IN_FLIGHT];
+    profile->gen_queries(PROFILE_IN_FLIGHT, query);
+    for(unsigned i=0; i<PROFILE_IN_FLIGHT; i++)
+      profile->measurement[i].query = query[i];
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &(GLint){0}); // Clears the flag
+    profile->timing = ENGINE_STATS_GPU_TIMING_TIMER_QUERY;
+    return profile;
+  }
+  if(!engine->fence_sync){
+    fprintf(stderr, "neither timer queries nor fences, GPU scopes aren't measured\n");
+    return profile;
+  }
+  if(pthread_mutex_init(&profile->lock, 0)){
+    fprintf(stderr, "pthread_mutex_init failed\n");
+    goto error;
+  }
+  if(pthread_cond_init(&profile->wake, 0)){
+    fprintf(stderr, "pthread_cond_init failed\n");
+    goto error_after_mutex;
+  }
+  if(pthread_create(&profile->thread, 0, fence_thread, profile)){
+    fprintf(stderr, "pthread_create failed\n");
+    goto error_after_cond;
+  }
+  profile->timing = ENGINE_STATS_GPU_TIMING_FENCE;
+  fprintf(stderr, "no GL_EXT_disjoint_timer_query, GPU scopes are timed with fences\n");
+  return profile;
+
+error_after_cond:
+  pthread_cond_destroy(&profile->wake);
+error_after_mutex:
+  pthread_mutex_destroy(&profile->lock);
+error:
+  free(profile);
+  return 0;
+}
+
+static int find_scope(struct engine_profile* profile, const char* name){
+  for(unsigned i=0; i<profile->scope_count; i++)
+    if(profile->scope_name[i] == name || !strcmp(profile->scope_name[i], name))
+      return profile->scope[i];
+  if(profile->scope_count >= ENGINE_STATS_MAX_SCOPES)
+    return -1;
+  int scope = engine_i_stats_scope_add(profile->engine, name);
+  if(scope == -1)
+    return -1;
+  profile->scope_name[profile->scope_count] = name;
+  profile->scope[profile->scope_count++] = scope;
+  return scope;
+}
+
+static void fence_destroy(EGLDisplay display, EGLSyncKHR* sync){
+  if(*sync != EGL_NO_SYNC_KHR)
+    eglDestroySyncKHR(display, *sync);
+  *sync = EGL_NO_SYNC_KHR;
+}
+
+static void collect(struct engine* engine){
+  struct engine_profile* profile = engine->profile;
+  if(profile->timing == ENGINE_STATS_GPU_TIMING_TIMER_QUERY){
+    GLint disjoint = 0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    if(disjoint) // The GPU clock jumped or was reset, whatever was in flight can't be trusted
+      for(uint64_t i=profile->tail; i<profile->head; i++)
+        profile->measurement[i % PROFILE_IN_FLIGHT].discarded = true;
+  }
+  uint64_t waited = 0;
+  if(profile->timing == ENGINE_STATS_GPU_TIMING_FENCE){
+    pthread_mutex_lock(&profile->lock);
+    waited = profile->waited;
+    pthread_mutex_unlock(&profile->lock);
+  }
+  for(; profile->tail < profile->head; profile->tail++){
+    struct profile_measurement* m = &profile->measurement[profile->tail % PROFILE_IN_FLIGHT];
+    uint64_t ns = 0;
+    if(profile->timing == ENGINE_STATS_GPU_TIMING_TIMER_QUERY){
+      GLuint available = 0;
+      profile->get_query_uiv(m->query, GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+      if(!available) // Results arrive in order
+        break;
+      GLuint64 elapsed = 0;
+      profile->get_query_ui64v(m->query, GL_QUERY_RESULT_EXT, &elapsed);
+      ns = elapsed;
+    }else{
+      if(profile->tail >= waited)
+        break;
+      if(!m->begin_ns || !m->end_ns || m->end_ns < m->begin_ns)
+        m->discarded = true;
+      ns = m->end_ns - m->begin_ns;
+      fence_destroy(engine->display, &m->begin);
+      fence_destroy(engine->display, &m->end);
+    }
+    engine_i_stats_scope_time(engine, m->scope, profile->timing, ns, m->discarded);
+  }
+}
+
+void engine_i_profile_collect(struct engine* engine){
+  struct engine_profile* profile = engine->profile;
+  // The fence thread has no context to flush them, they'd never signal otherwise. Usually the swap did already.
+  if(profile->unflushed){
+    glFlush();
+    profile->unflushed = false;
+  }
+  collect(engine);
+}
+
+void engine_gpu_scope_begin(struct engine* engine, const char* name){
+  if(!engine->stats) // Nowhere to report to
+    return;
+  if(!engine->profile)
+    engine->profile = profile_create(engine);
+  struct engine_profile* profile = engine->profile;
+  if(!profile || profile->timing == ENGINE_STATS_GPU_TIMING_NONE)
+    return;
+  if(profile->open != -1){
+    profile->nested++;
+    return;
+  }
+  profile->open = -2;
+  int scope = find_scope(profile, name);
+  if(scope == -1)
+    return;
+  collect(engine);
+  if(profile->head - profile->tail >= PROFILE_IN_FLIGHT){
+    engine_i_stats_scope_time(engine, scope, profile->timing, 0, true);
+    return;
+  }
+  profile->open = scope;
+  struct profile_measurement* m = &profile->measurement[profile->head % PROFILE_IN_FLIGHT];
+  m->scope = scope;
+  m->discarded = false;
+  if(profile->timing == ENGINE_STATS_GPU_TIMING_TIMER_QUERY){
+    profile->begin_query(GL_TIME_ELAPSED_EXT, m->query);
+  }else{
+    m->begin_ns = m->end_ns = 0;
+    m->begin = eglCreateSyncKHR(engine->display, EGL_SYNC_FENCE_KHR, 0);
+    profile->unflushed = true;
+  }
+}
+
+void engine_gpu_scope_end(struct engine* engine){
+  struct engine_profile* profile = engine->profile;
+  if(!profile || profile->open == -1)
+    return;
+  if(profile->nested){
+    profile->nested--;
+    return;
+  }
+  bool measured = profile->open != -2;
+  profile->open = -1;
+  if(!measured)
+    return;
+  struct profile_measurement* m = &profile->measurement[profile->head++ % PROFILE_IN_FLIGHT];
+  if(profile->timing == ENGINE_STATS_GPU_TIMING_TIMER_QUERY){
+    profile->end_query(GL_TIME_ELAPSED_EXT);
+    return;
+  }
+  m->end = eglCreateSyncKHR(engine->display, EGL_SYNC_FENCE_KHR, 0);
+  profile->unflushed = true;
+  pthread_mutex_lock(&profile->lock);
+  profile->submitted = profile->head;
+  pthread_cond_broadcast(&profile->wake);
+  pthread_mutex_unlock(&profile->lock);
+}
+
+void engine_i_profile_destroy(struct engine* engine){
+  struct engine_profile* profile = engine->profile;
+  if(!profile)
+    return;
+  engine_gpu_scope_end(engine); // Queries can't be deleted while they are active
+  if(profile->timing == ENGINE_STATS_GPU_TIMING_TIMER_QUERY){
+    GLuint query[PROFILE_IN_FLIGHT];
+    for(unsigned i=0; i<PROFILE_IN_FLIGHT; i++)
+      query[i] = profile->measurement[i].query;
+    profile->delete_queries(PROFILE_IN_FLIGHT, query);
+  }
+  if(profile->timing == ENGINE_STATS_GPU_TIMING_FENCE){
+    if(profile->unflushed)
+      glFlush(); // The fence thread only quits once every fence signaled
+    pthread_mutex_lock(&profile->lock);
+    profile->quit = true;
+    pthread_cond_broadcast(&profile->wake);
+    pthread_mutex_unlock(&profile->lock);
+    pthread_join(profile->thread, 0);
+    pthread_cond_destroy(&profile->wake);
+    pthread_mutex_destroy(&profile->lock);
+    for(unsigned i=0; i<PROFILE_IN_FLIGHT; i++){
+      fence_destroy(engine->display, &profile->measurement[i].begin);
+      fence_destroy(engine->display, &profile->measurement[i].end);
+    }
+  }
+  free(profile);
+  engine->profile = 0;
+}
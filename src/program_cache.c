@@ -0,0 +1,274 @@
+#define _POSIX_C_SOURCE 200809L
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <internal/engine.h>
+#include <internal/program_cache.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define PROGRAM_CACHE_MAGIC "DENGPB01"
+#define PROGRAM_CACHE_MAX_SIZE (16u << 20)
+
+struct program_cache_header {
+  char magic[8];
+  uint64_t key;
+  uint32_t format;
+  uint32_t size;
+};
+
+void glGetProgramBinaryOES(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary) __attribute__((weak)); // May not be in libGLESv2 symbol table, resolve manually :(
+void glGetProgramBinaryOES(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary){
+  static PFNGLGETPROGRAMBINARYOESPROC getProgramBinaryProc = 0;
+  if(!getProgramBinaryProc)
+    getProgramBinaryProc = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinaryOES");
+  getProgramBinaryProc(program, bufSize, length, binaryFormat, binary);
+}
+
+void glProgramBinaryOES(GLuint program, GLenum binaryFormat, const void *binary, GLint length) __attribute__((weak)); // May not be in libGLESv2 symbol table, resolve manually :(
+void glProgramBinaryOES(GLuint program, GLenum binaryFormat, const void *binary, GLint length){
+  static PFNGLPROGRAMBINARYOESPROC programBinaryProc = 0;
+  if(!programBinaryProc)
+    programBinaryProc = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinaryOES");
+  programBinaryProc(program, binaryFormat, binary, length);
+}
+
+static bool supported(void){
+  static int result = -1;
+  if(result == -1){
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    const char* name = "GL_OES_get_program_binary";
+    size_t length = strlen(name);
+    result = 0;
+    for(const char* it=extensions; it && (it=strstr(it, name)); it+=length)
+      if((it == extensions || it[-1] == ' ') && (!it[length] || it[length] == ' '))
+        result = 1;
+    GLint formats = 0;
+    if(result)
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+    if(!formats) // Drivers may advertise the extension with no usable format
+      result = 0;
+  }
+  return result;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size){
+  const unsigned char* it = data;
+  for(size_t i=0; i<size; i++){
+    hash ^= it[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+uint64_t engine_i_program_cache_key(const struct engine_i_program_cache_source source[], size_t count){
+  uint64_t hash = 0xcbf29ce484222325ull;
+  const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+  for(size_t i=0; i<sizeof(strings)/sizeof(*strings); i++){
+    const char* value = (const char*)glGetString(strings[i]);
+    if(value)
+      hash = fnv1a(hash, value, strlen(value) + 1);
+  }
+  for(size_t i=0; i<count; i++){
+    hash = fnv1a(hash, &source[i].size, sizeof(source[i].size)); // So moving text between sources changes the key
+    hash = fnv1a(hash, source[i].data, source[i].size);
+  }
+  return hash;
+}
+
+// Returns a malloced path, or 0 if the cache is disabled or there is nowhere to put it
+static char* entry_path(uint64_t key, bool create){
+  const char* dir = getenv("ENGINE_SHADER_CACHE");
+  const char* base = 0;
+  const char* suffix = "";
+  if(dir){
+    if(!*dir)
+      return 0;
+    base = dir;
+  }else if((base = getenv("XDG_CACHE_HOME")) && *base){
+    suffix = "/deng";
+  }else if((base = getenv("HOME")) && *base){
+    suffix = "/.cache/deng";
+  }else{
+    return 0;
+  }
+
+  size_t length = strlen(base) + strlen(suffix) + 32;
+  char* path = malloc(length);
+  if(!path){
+    perror("malloc failed");
+    return 0;
+  }
+  snprintf(path, length, "%s%s", base, suffix);
+
+  if(create){
+    // mkdir -p
+    for(char* it=path+1; ; it++){
+      if(*it && *it != '/')
+        continue;
+      char c = *it;
+      *it = 0;
+      if(mkdir(path, 0755) == -1 && errno != EEXIST){
+        fprintf(stderr, "Failed to create shader cache directory %s: %s\n", path, strerror(errno));
+        free(path);
+        return 0;
+      }
+      *it = c;
+      if(!c)
+        break;
+    }
+  }
+
+  size_t dir_length = strlen(path);
+  snprintf(path + dir_length, length - dir_length, "/%016llx.bin", (unsigned long long)key);
+  return path;
+}
+
+static int read_all(int fd, void* data, size_t size){
+  for(size_t done=0; done<size; ){
+    ssize_t n = read(fd, (char*)data + done, size - done);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+static int write_all(int fd, const void* data, size_t size){
+  for(size_t done=0; done<size; ){
+    ssize_t n = write(fd, (const char*)data + done, size - done);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+GLuint engine_i_program_cache_load(uint64_t key){
+  if(!supported())
+    return 0;
+  char* path = entry_path(key, false);
+  if(!path)
+    return 0;
+
+  GLuint program = 0;
+  void* binary = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1)
+    goto error; // Not cached yet
+
+  struct program_cache_header header;
+  if(read_all(fd, &header, sizeof(header)) == -1
+   || memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic))
+   || header.key != key
+   || !header.size || header.size > PROGRAM_CACHE_MAX_SIZE
+  ){
+    fprintf(stderr, "Ignoring invalid shader cache entry %s\n", path);
+    goto error_invalid;
+  }
+
+  binary = malloc(header.size);
+  if(!binary){
+    perror("malloc failed");
+    goto error_after_open;
+  }
+  if(read_all(fd, binary, header.size) == -1){
+    fprintf(stderr, "Ignoring truncated shader cache entry %s\n", path);
+    goto error_invalid;
+  }
+
+  while(glGetError() != GL_NO_ERROR); // Clear previouse errors
+  program = glCreateProgram();
+  if(!program)
+    goto error_after_open;
+  glProgramBinaryOES(program, header.format, binary, header.size);
+  GLint result = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &result);
+  if(glGetError() != GL_NO_ERROR || result != GL_TRUE){
+    // Not an error, drivers may reject binaries of other builds even if vendor & version didn't change
+    glDeleteProgram(program);
+    program = 0;
+    goto error_invalid;
+  }
+
+  goto error_after_open;
+
+error_invalid:
+  unlink(path);
+error_after_open:
+  close(fd);
+error:
+  free(binary);
+  free(path);
+  return program;
+}
+
+void engine_i_program_cache_store(uint64_t key, GLuint program){
+  if(!supported())
+    return;
+
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+  if(length <= 0 || (GLuint)length > PROGRAM_CACHE_MAX_SIZE)
+    return;
+  struct program_cache_header header = {
+    .magic = PROGRAM_CACHE_MAGIC,
+    .key = key,
+  };
+  void* binary = malloc(length);
+  if(!binary){
+    perror("malloc failed");
+    return;
+  }
+  GLenum format = 0;
+  GLsizei size = 0;
+  glGetProgramBinaryOES(program, length, &size, &format, binary);
+  if(size <= 0)
+    goto error_after_malloc;
+  header.format = format;
+  header.size = size;
+
+  char* path = entry_path(key, true);
+  if(!path)
+    goto error_after_malloc;
+  size_t tmp_length = strlen(path) + 24;
+  char* tmp = malloc(tmp_length);
+  if(!tmp){
+    perror("malloc failed");
+    goto error_after_path;
+  }
+  // Written next to the entry & renamed into place, so other processes never see a partial file
+  snprintf(tmp, tmp_length, "%s.%ld.tmp", path, (long)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if(fd == -1){
+    fprintf(stderr, "Failed to create shader cache entry %s: %s\n", tmp, strerror(errno));
+    goto error_after_tmp;
+  }
+  if(write_all(fd, &header, sizeof(header)) == -1 || write_all(fd, binary, size) == -1 || fsync(fd) == -1){
+    fprintf(stderr, "Failed to write shader cache entry %s: %s\n", tmp, strerror(errno));
+    close(fd);
+    goto error_after_create;
+  }
+  close(fd);
+  if(rename(tmp, path) == -1){
+    fprintf(stderr, "Failed to rename %s to %s: %s\n", tmp, path, strerror(errno));
+    goto error_after_create;
+  }
+  goto error_after_tmp;
+
+error_after_create:
+  unlink(tmp);
+error_after_tmp:
+  free(tmp);
+error_after_path:
+  free(path);
+error_after_malloc:
+  free(binary);
+}
@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200809L
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stddef.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <internal/engine.h>
+#include <internal/stats.h>
+
+_Static_assert(ENGINE_STATS_HISTOGRAM_BUCKETS == HISTOGRAM_BUCKETS, "the stats page uses the buckets of histogram.h");
+
+struct engine_stats {
+  char* name; // For shm_open, starts with a /
+  struct engine_stats_page* page;
+  unsigned scope_count;
+};
+
+// Whether the page was left behind by an engine which is gone. Pages still being set up count as in use.
+static bool page_stale(const char* name){
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if(fd == -1)
+    return errno == ENOENT; // Removed in the meantime
+  uint32_t magic, pid;
+  bool stale = pread(fd, &magic, sizeof(magic), offsetof(struct engine_stats_page, magic)) == sizeof(magic)
+    && pread(fd, &pid, sizeof(pid), offsetof(struct engine_stats_page, pid)) == sizeof(pid)
+    && magic == ENGINE_STATS_MAGIC && kill(pid, 0) == -1 && errno == ESRCH;
+  close(fd);
+  return stale;
+}
+
+int engine_i_stats_init(struct engine* engine){
+  const char* name = getenv("ENGINE_STATS");
+  if(!name || !*name)
+    return 0;
+  struct engine_stats* stats = calloc(1, sizeof(*stats));
+  if(!stats){
+    perror("calloc failed");
+    goto error;
+  }
+  stats->name = malloc(strlen(name) + 2);
+  if(!stats->name){
+    perror("malloc failed");
+    goto error_after_calloc;
+  }
+  strcpy(stats->name, "/");
+  strcat(stats->name, name + (*name == '/'));
+  int fd = shm_open(stats->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if(fd == -1 && errno == EEXIST){
+    if(!page_stale(stats->name)){
+      fprintf(stderr, "/dev/shm%s belongs to another engine, set ENGINE_STATS to another name\n", stats->name);
+      goto error_after_name;
+    }
+    // Left behind by an engine which crashed, started over
+    shm_unlink(stats->name);
+    fd = shm_open(stats->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  }
+  if(fd == -1){
+    fprintf(stderr, "shm_open %s failed: %s\n", stats->name, strerror(errno));
+    goto error_after_name;
+  }
+  if(ftruncate(fd, sizeof(*stats->page)) == -1){
+    perror("ftruncate");
+    goto error_after_open;
+  }
+  stats->page = mmap(0, sizeof(*stats->page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(stats->page == MAP_FAILED){
+    perror("mmap");
+    goto error_after_open;
+  }
+  close(fd);
+  stats->page->version = ENGINE_STATS_VERSION;
+  stats->page->size = sizeof(*stats->page);
+  stats->page->pid = getpid();
+  atomic_store_explicit(&stats->page->magic, ENGINE_STATS_MAGIC, memory_order_release);
+  fprintf(stderr, "Writing statistics to /dev/shm%s, see bin/stats_reader\n", stats->name);
+  engine->stats = stats;
+  return 0;
+
+error_after_open:
+  close(fd);
+  shm_unlink(stats->name);
+error_after_name:
+  free(stats->name);
+error_after_calloc:
+  free(stats);
+error:
+  return -1;
+}
+
+void engine_i_stats_destroy(struct engine* engine){
+  struct engine_stats* stats = engine->stats;
+  if(!stats)
+    return;
+  // Readers which have it mapped still see the final numbers
+  shm_unlink(stats->name);
+  munmap(stats->page, sizeof(*stats->page));
+  free(stats->name);
+  free(stats);
+  engine->stats = 0;
+}
+
+void engine_i_stats_texture_add(struct engine* engine, struct dma_gl_texture* dgt){
+  struct engine_stats_page* page = engine->stats->page;
+  for(unsigned i=0; i<ENGINE_STATS_MAX_TEXTURES; i++){
+    struct engine_stats_texture* slot = &page->texture[i];
+    uint32_t active = atomic_load_explicit(&slot->active, memory_order_relaxed);
+    if(active & 1)
+      continue;
+    // Nothing writes the capture block yet, the stream only gets it before it's added to the capture thread
+    stats_write_begin(&slot->seq);
+    stats_write_begin(&slot->capture.seq);
+    atomic_store_explicit(&slot->active, active + 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->width, dgt->width, memory_order_relaxed);
+    atomic_store_explicit(&slot->height, dgt->height, memory_order_relaxed);
+    atomic_store_explicit(&slot->rebinds, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->capture.frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->capture.dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->capture.superseded, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->capture.ioctls, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->capture.ioctl_errors, 0, memory_order_relaxed);
+    stats_write_end(&slot->capture.seq);
+    stats_write_end(&slot->seq);
+    dgt->stats = slot;
+    return;
+  }
+}
+
+void engine_i_stats_texture_remove(struct engine* engine, struct dma_gl_texture* dgt){
+  (void)engine;
+  struct engine_stats_texture* slot = dgt->stats;
+  stats_write_begin(&slot->seq);
+  atomic_store_explicit(&slot->active, atomic_load_explicit(&slot->active, memory_order_relaxed) + 1, memory_order_relaxed);
+  stats_write_end(&slot->seq);
+  dgt->stats = 0;
+}
+
+void engine_i_stats_rebind(struct dma_gl_texture* dgt){
+  struct engine_stats_texture* slot = dgt->stats;
+  stats_write_begin(&slot->seq);
+  stats_add(&slot->rebinds, 1);
+  atomic_store_explicit(&slot->width, dgt->width, memory_order_relaxed); // Changes along with the camera format
+  atomic_store_explicit(&slot->height, dgt->height, memory_order_relaxed);
+  stats_write_end(&slot->seq);
+}
+
+void engine_i_stats_frame(struct engine* engine, uint64_t start_ns, uint64_t swap_ns, uint64_t end_ns){
+  struct engine_stats_page* page = engine->stats->page;
+  stats_write_begin(&page->seq);
+  stats_add(&page->frames, 1);
+  stats_histogram_add(&page->frame_time, (swap_ns - start_ns) / 1000);
+  stats_histogram_add(&page->swap_time, (end_ns - swap_ns) / 1000);
+  atomic_store_explicit(&page->gl_calls, engine->gl_state.calls, memory_order_relaxed);
+  atomic_store_explicit(&page->gl_calls_elided, engine->gl_state.elided, memory_order_relaxed);
+  stats_write_end(&page->seq);
+}
+
+void engine_i_stats_direct_frame(struct engine* engine){
+  struct engine_stats_page* page = engine->stats->page;
+  stats_write_begin(&page->seq);
+  stats_add(&page->direct_frames, 1);
+  stats_write_end(&page->seq);
+}
+
+int engine_i_stats_scope_add(struct engine* engine, const char* name){
+  struct engine_stats* stats = engine->stats;
+  if(stats->scope_count >= ENGINE_STATS_MAX_SCOPES)
+    return -1;
+  struct engine_stats_scope* scope = &stats->page->scope[stats->scope_count];
+  stats_write_begin(&scope->seq);
+  strncpy(scope->name, name, sizeof(scope->name) - 1);
+  stats_write_end(&scope->seq);
+  return stats->scope_count++;
+}
+
+void engine_i_stats_scope_time(struct engine* engine, unsigned index, enum engine_stats_gpu_timing timing, uint64_t ns, bool dropped){
+  struct engine_stats_page* page = engine->stats->page;
+  struct engine_stats_scope* scope = &page->scope[index];
+  if(atomic_load_explicit(&page->gpu_timing, memory_order_relaxed) != timing){
+    stats_write_begin(&page->seq);
+    atomic_store_explicit(&page->gpu_timing, timing, memory_order_relaxed);
+    stats_write_end(&page->seq);
+  }
+  stats_write_begin(&scope->seq);
+  if(dropped){
+    stats_add(&scope->dropped, 1);
+  }else{
+    stats_histogram_add(&scope->gpu_time, ns / 1000);
+  }
+  stats_write_end(&scope->seq);
+}
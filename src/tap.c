@@ -0,0 +1,370 @@
+#define _POSIX_C_SOURCE 200809L
+#include <engine.h>
+#include <internal/engine.h>
+#include <internal/tap.h>
+#include <GLES3/gl3.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#undef engine_tap_create
+
+#define TAP_READBACK_COUNT 3 // Readbacks in flight, more are dropped
+
+struct tap_readback {
+  GLuint buffer; // GL_PIXEL_PACK_BUFFER
+  GLsync fence; // Signals once the copy into the buffer finished, 0 if the readback is free
+  struct engine_frame_info frame;
+};
+
+struct tap_image {
+  uint8_t* data;
+  struct engine_frame_info frame;
+};
+
+struct engine_tap {
+  struct engine* engine;
+  struct engine_tap_create_params params;
+  struct shader shader;
+  GLint position;
+  GLint crop;
+  GLuint quad;
+  GLuint texture, framebuffer; // The scaled down frame
+  unsigned texels; // Width of the texture, 4 gray pixels share a texel
+  uint32_t pitch;
+  size_t size;
+  uint64_t seen; // Generation of the texture the last time it was tapped
+  uint64_t next_ns; // When max_fps allows tapping again
+  unsigned oldest, pending; // Readbacks in flight, in the order they were started
+  struct tap_readback readback[TAP_READBACK_COUNT];
+  struct tap_image spare; // Filled by the render thread, swapped with next
+  /* Shared with the worker, guarded by lock */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool quit;
+  bool full; // next holds a frame the worker didn't take yet
+  struct tap_image next;
+  unsigned dropped;
+  /* Worker only */
+  struct tap_image current;
+  struct engine_tap *next_tap, *last_tap;
+};
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void* tap_thread(void* arg){
+  struct engine_tap* tap = arg;
+  pthread_mutex_lock(&tap->lock);
+  while(true){
+    while(!tap->quit && !tap->full)
+      pthread_cond_wait(&tap->wake, &tap->lock);
+    if(tap->quit)
+      break;
+    struct tap_image image = tap->current;
+    tap->current = tap->next;
+    tap->next = image;
+    tap->full = false;
+    unsigned dropped = tap->dropped;
+    tap->dropped = 0;
+    pthread_mutex_unlock(&tap->lock);
+    tap->params.callback(&(struct engine_tap_frame){
+      .data = tap->current.data,
+      .width = tap->params.width,
+      .height = tap->params.height,
+      .pitch = tap->pitch,
+      .format = tap->params.format,
+      .sequence = tap->current.frame.sequence,
+      .sensor_ns = tap->current.frame.sensor_ns,
+      .dropped = dropped
+    }, tap->params.param);
+    pthread_mutex_lock(&tap->lock);
+  }
+  pthread_mutex_unlock(&tap->lock);
+  return 0;
+}
+
+static void drop(struct engine_tap* tap){
+  pthread_mutex_lock(&tap->lock);
+  tap->dropped++;
+  pthread_mutex_unlock(&tap->lock);
+}
+
+// Hands the spare image to the worker, replacing a frame it didn't get to yet
+static void publish(struct engine_tap* tap){
+  pthread_mutex_lock(&tap->lock);
+  if(tap->full)
+    tap->dropped++;
+  struct tap_image image = tap->next;
+  tap->next = tap->spare;
+  tap->spare = image;
+  tap->full = true;
+  pthread_cond_signal(&tap->wake);
+  pthread_mutex_unlock(&tap->lock);
+}
+
+static int gl_objects_create(struct engine_tap* tap){
+  struct dma_gl_texture* texture = tap->params.texture;
+  char defines[64];
+  snprintf(defines, sizeof(defines), "%s%s",
+    texture->target == GL_TEXTURE_2D ? "#define SAMPLER sampler2D\n" : "",
+    tap->params.format == ENGINE_TAP_GRAY ? "#define GRAY\n" : ""
+  );
+  if(engine_load_create_shader_program(
+    &tap->shader,
+    .vertex_shader = "shader/graph_pass.vs",
+    .fragment_shader = "shader/tap.fs",
+    .defines = defines
+  ) == -1){
+    fprintf(stderr, "engine_load_create_shader_program failed\n");
+    return -1;
+  }
+  GLuint program = tap->shader.program;
+  tap->position = glGetAttribLocation(program, "position");
+  GLint source = glGetUniformLocation(program, "source");
+  GLint step = glGetUniformLocation(program, "step");
+  tap->crop = glGetUniformLocation(program, "crop");
+  if(tap->position == -1 || source == -1 || step == -1 || tap->crop == -1){
+    fprintf(stderr, "tap shader is missing attributes or uniforms\n");
+    return -1;
+  }
+  engine_gl_use_program(tap->engine, program);
+  glUniform1i(source, 0);
+  glUniform2f(step, 1.0f / tap->params.width, 1.0f / tap->params.height);
+
+  static const GLfloat quad[][2] = { {-1, -1}, {1, -1}, {-1, 1}, {1, 1} };
+  while(glGetError() != GL_NO_ERROR); // Clear previouse errors
+  glGenBuffers(1, &tap->quad);
+  engine_gl_bind_array_buffer(tap->engine, tap->quad);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+  glGenTextures(1, &tap->texture);
+  engine_gl_bind_texture(tap->engine, 0, GL_TEXTURE_2D, tap->texture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, tap->texels, tap->params.height);
+  GLint framebuffer;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+  glGenFramebuffers(1, &tap->framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, tap->framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tap->texture, 0);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+  for(unsigned i=0; i<TAP_READBACK_COUNT; i++){
+    glGenBuffers(1, &tap->readback[i].buffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, tap->readback[i].buffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, tap->size, 0, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  if(glGetError() != GL_NO_ERROR || status != GL_FRAMEBUFFER_COMPLETE){
+    fprintf(stderr, "Failed to create the %ux%u tap render target & readback buffers\n", tap->params.width, tap->params.height);
+    return -1;
+  }
+  return 0;
+}
+
+static void gl_objects_destroy(struct engine_tap* tap){
+  for(unsigned i=0; i<TAP_READBACK_COUNT; i++){
+    if(tap->readback[i].fence)
+      glDeleteSync(tap->readback[i].fence);
+    if(tap->readback[i].buffer)
+      glDeleteBuffers(1, &tap->readback[i].buffer);
+  }
+  if(tap->framebuffer)
+    glDeleteFramebuffers(1, &tap->framebuffer);
+  if(tap->texture)
+    engine_gl_delete_textures(tap->engine, 1, &tap->texture);
+  if(tap->quad)
+    engine_gl_delete_buffers(tap->engine, 1, &tap->quad);
+  if(tap->shader.program)
+    engine_gl_delete_program(tap->engine, tap->shader.program);
+  if(tap->shader.vertex)
+    glDeleteShader(tap->shader.vertex);
+  if(tap->shader.fragment)
+    glDeleteShader(tap->shader.fragment);
+}
+
+struct engine_tap* engine_tap_create(struct engine* engine, struct engine_tap_create_params params){
+  if(!params.texture || !params.callback){
+    fprintf(stderr, "engine_tap_create: a texture & a callback are required\n");
+    goto error;
+  }
+  if(!params.width)
+    params.width = params.texture->width;
+  if(!params.height)
+    params.height = params.texture->height;
+
+  struct engine_tap* tap = calloc(1, sizeof(*tap));
+  if(!tap){
+    perror("calloc failed");
+    goto error;
+  }
+  tap->engine = engine;
+  tap->params = params;
+  tap->texels = params.format == ENGINE_TAP_GRAY ? (params.width + 3) / 4 : params.width;
+  tap->pitch = tap->texels * 4;
+  tap->size = (size_t)tap->pitch * params.height;
+  tap->seen = params.texture->generation;
+
+  tap->spare.data = malloc(tap->size);
+  tap->next.data = malloc(tap->size);
+  tap->current.data = malloc(tap->size);
+  if(!tap->spare.data || !tap->next.data || !tap->current.data){
+    perror("malloc failed");
+    goto error_after_malloc;
+  }
+
+  if(gl_objects_create(tap) == -1)
+    goto error_after_gl_objects;
+
+  if(pthread_mutex_init(&tap->lock, 0)){
+    fprintf(stderr, "pthread_mutex_init failed\n");
+    goto error_after_gl_objects;
+  }
+  if(pthread_cond_init(&tap->wake, 0)){
+    fprintf(stderr, "pthread_cond_init failed\n");
+    goto error_after_mutex;
+  }
+  if(pthread_create(&tap->thread, 0, tap_thread, tap)){
+    fprintf(stderr, "pthread_create failed\n");
+    goto error_after_cond;
+  }
+
+  tap->next_tap = engine->taps;
+  if(engine->taps)
+    engine->taps->last_tap = tap;
+  engine->taps = tap;
+  return tap;
+
+error_after_cond:
+  pthread_cond_destroy(&tap->wake);
+error_after_mutex:
+  pthread_mutex_destroy(&tap->lock);
+error_after_gl_objects:
+  gl_objects_destroy(tap);
+error_after_malloc:
+  free(tap->current.data);
+  free(tap->next.data);
+  free(tap->spare.data);
+  free(tap);
+error:
+  return 0;
+}
+
+void engine_tap_destroy(struct engine_tap* tap){
+  if(!tap)
+    return;
+  if(tap->next_tap)
+    tap->next_tap->last_tap = tap->last_tap;
+  if(tap->last_tap){
+    tap->last_tap->next_tap = tap->next_tap;
+  }else{
+    tap->engine->taps = tap->next_tap;
+  }
+  pthread_mutex_lock(&tap->lock);
+  tap->quit = true;
+  pthread_cond_signal(&tap->wake);
+  pthread_mutex_unlock(&tap->lock);
+  pthread_join(tap->thread, 0);
+  pthread_cond_destroy(&tap->wake);
+  pthread_mutex_destroy(&tap->lock);
+  gl_objects_destroy(tap);
+  free(tap->current.data);
+  free(tap->next.data);
+  free(tap->spare.data);
+  free(tap);
+}
+
+// Copies out every readback which finished, oldest first
+static void collect(struct engine_tap* tap){
+  while(tap->pending){
+    struct tap_readback* readback = &tap->readback[tap->oldest];
+    if(glClientWaitSync(readback->fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+      return;
+    glDeleteSync(readback->fence);
+    readback->fence = 0;
+    tap->oldest = (tap->oldest + 1) % TAP_READBACK_COUNT;
+    tap->pending--;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+    const void* memory = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, tap->size, GL_MAP_READ_BIT);
+    if(memory){
+      memcpy(tap->spare.data, memory, tap->size);
+      tap->spare.frame = readback->frame;
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      publish(tap);
+    }else{
+      fprintf(stderr, "glMapBufferRange failed (glError: %d)\n", glGetError());
+      drop(tap);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+}
+
+// Scales the current frame down & starts copying it into a free readback buffer
+static void capture(struct engine_tap* tap){
+  struct dma_gl_texture* texture = tap->params.texture;
+  if(texture->generation == tap->seen)
+    return;
+  if(tap->params.max_fps > 0){
+    uint64_t now = now_ns();
+    uint64_t period = 1e9 / tap->params.max_fps;
+    // Some slack, or frame timing jitter would skip one frame more than necessary every now & then
+    if(now + period / 4 < tap->next_ns)
+      return; // Not a drop, the next new frame may be late enough
+    // Keeps the rate steady, unless the frames came too late to catch up
+    tap->next_ns = now < tap->next_ns + period ? tap->next_ns + period : now + period;
+  }
+  tap->seen = texture->generation;
+  if(tap->pending == TAP_READBACK_COUNT){
+    drop(tap); // The GPU is behind, don't queue up more work for it
+    return;
+  }
+
+  struct engine* engine = tap->engine;
+  GLint viewport[4];
+  GLint framebuffer;
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, tap->framebuffer);
+  glViewport(0, 0, tap->texels, tap->params.height);
+  engine_gl_use_program(engine, tap->shader.program);
+  GLfloat crop[4];
+  engine_dma_texture_get_crop(texture, crop);
+  engine_gl_uniform4fv(engine, tap->crop, crop);
+  engine_gl_bind_texture(engine, 0, engine_dma_texture_get_gl_type(texture), engine_dma_texture_get_gl_texture(texture));
+  engine_gl_bind_vertex_array(engine, 0);
+  engine_gl_bind_array_buffer(engine, tap->quad);
+  engine_gl_vertex_attrib_pointer(engine, tap->position, 2, GL_FLOAT, false, 0, 0);
+  engine_gl_vertex_attrib_arrays(engine, 1u << tap->position);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+  struct tap_readback* readback = &tap->readback[(tap->oldest + tap->pending) % TAP_READBACK_COUNT];
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, tap->texels, tap->params.height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  readback->frame = texture->frame;
+  tap->pending++;
+  glFlush(); // Otherwise the fence may not signal until the next swap, which could be a while without redraws
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+bool engine_i_tap_run(struct engine* engine){
+  bool pending = false;
+  for(struct engine_tap* it=engine->taps; it; it=it->next_tap){
+    collect(it);
+    capture(it);
+    pending |= it->pending;
+  }
+  return pending;
+}
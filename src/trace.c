@@ -0,0 +1,188 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <internal/engine.h>
+#include <internal/trace.h>
+#include <internal/histogram.h>
+
+#define TRACE_RING_SIZE 4096
+#define TRACE_MAX_PENDING 64
+
+enum trace_stage {
+  TRACE_STAGE_CAPTURE, // sensor -> dequeue
+  TRACE_STAGE_HANDOFF, // dequeue -> rebind
+  TRACE_STAGE_DRAW,    // rebind -> draw submitted
+  TRACE_STAGE_PRESENT, // draw submitted -> eglSwapBuffers returned
+  TRACE_STAGE_TOTAL,   // first known timestamp -> eglSwapBuffers returned
+  TRACE_STAGE_COUNT
+};
+
+static const char* const stage_name[] = {
+  [TRACE_STAGE_CAPTURE] = "capture",
+  [TRACE_STAGE_HANDOFF] = "handoff",
+  [TRACE_STAGE_DRAW] = "draw",
+  [TRACE_STAGE_PRESENT] = "present",
+  [TRACE_STAGE_TOTAL] = "total",
+};
+
+struct trace_record {
+  uint32_t texture; // dma_gl_texture.id, one track per texture
+  uint32_t sequence;
+  uint64_t sensor, dequeue, rebind, draw, swap; // ns, 0 if unknown
+};
+
+struct trace_slot {
+  atomic_uint_fast64_t stamp; // Position in the ring + 1 once the record is complete, 0 while it's written
+  struct trace_record record;
+};
+
+struct engine_trace {
+  char* path;
+  atomic_uint_fast64_t head;
+  struct trace_slot ring[TRACE_RING_SIZE];
+  /* Render thread only */
+  unsigned pending_count;
+  struct trace_record pending[TRACE_MAX_PENDING]; // Rebound this frame, but not presented yet
+  struct histogram histogram[TRACE_STAGE_COUNT];
+  uint64_t report_ns;
+};
+
+uint64_t engine_i_time_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+int engine_i_trace_init(struct engine* engine){
+  const char* path = getenv("ENGINE_TRACE");
+  if(!path || !*path)
+    return 0;
+  struct engine_trace* trace = calloc(1, sizeof(*trace));
+  if(!trace){
+    perror("calloc failed");
+    return -1;
+  }
+  trace->path = strdup(path);
+  if(!trace->path){
+    perror("strdup failed");
+    free(trace);
+    return -1;
+  }
+  trace->report_ns = engine_i_time_ns();
+  engine->trace = trace;
+  return 0;
+}
+
+void engine_i_trace_rebind(struct engine_trace* trace, const struct dma_gl_texture* dgt){
+  if(trace->pending_count >= TRACE_MAX_PENDING)
+    return;
+  trace->pending[trace->pending_count++] = (struct trace_record){
+    .texture = dgt->id,
+    .sequence = dgt->frame.sequence,
+    .sensor = dgt->frame.sensor_ns,
+    .dequeue = dgt->frame.dequeue_ns,
+    .rebind = engine_i_time_ns()
+  };
+}
+
+void engine_i_trace_draw(struct engine_trace* trace){
+  uint64_t now = engine_i_time_ns();
+  for(unsigned i=0; i<trace->pending_count; i++)
+    trace->pending[i].draw = now;
+}
+
+static void add_sample(struct engine_trace* trace, enum trace_stage stage, uint64_t start, uint64_t end){
+  if(start && end >= start)
+    histogram_add(&trace->histogram[stage], (end - start) / 1000);
+}
+
+static void report(struct engine_trace* trace){
+  fprintf(stderr, "latency p50/p99 (ms):");
+  for(int i=0; i<TRACE_STAGE_COUNT; i++){
+    const struct histogram* h = &trace->histogram[i];
+    fprintf(stderr, " %s %.2f/%.2f", stage_name[i],
+      histogram_percentile(h->bucket, h->count, 0.5) / 1000.0,
+      histogram_percentile(h->bucket, h->count, 0.99) / 1000.0
+    );
+  }
+  fprintf(stderr, " over %llu frames\n", (unsigned long long)trace->histogram[TRACE_STAGE_TOTAL].count);
+  memset(trace->histogram, 0, sizeof(trace->histogram));
+}
+
+void engine_i_trace_swap(struct engine_trace* trace){
+  uint64_t now = engine_i_time_ns();
+  for(unsigned i=0; i<trace->pending_count; i++){
+    struct trace_record* record = &trace->pending[i];
+    record->swap = now;
+    add_sample(trace, TRACE_STAGE_CAPTURE, record->sensor, record->dequeue);
+    add_sample(trace, TRACE_STAGE_HANDOFF, record->dequeue, record->rebind);
+    add_sample(trace, TRACE_STAGE_DRAW, record->rebind, record->draw);
+    add_sample(trace, TRACE_STAGE_PRESENT, record->draw, record->swap);
+    add_sample(trace, TRACE_STAGE_TOTAL, record->sensor ? record->sensor : record->dequeue ? record->dequeue : record->rebind, record->swap);
+    uint_fast64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    struct trace_slot* slot = &trace->ring[head % TRACE_RING_SIZE];
+    atomic_store_explicit(&slot->stamp, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->record = *record;
+    atomic_store_explicit(&slot->stamp, head + 1, memory_order_release);
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+  }
+  trace->pending_count = 0;
+  if(now - trace->report_ns >= 1000000000u){
+    report(trace);
+    trace->report_ns = now;
+  }
+}
+
+static void dump_stage(FILE* f, bool* first, const char* name, const struct trace_record* record, uint64_t start, uint64_t end){
+  if(!start || end < start)
+    return;
+  fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"sequence\":%u}}",
+    *first ? "" : ",", name, record->texture, start / 1000.0, (end - start) / 1000.0, record->sequence);
+  *first = false;
+}
+
+// Can run concurrently with the writer, records overwritten while being read are skipped
+static int dump(struct engine_trace* trace){
+  FILE* f = fopen(trace->path, "w");
+  if(!f){
+    fprintf(stderr, "Failed to open trace file %s\n", trace->path);
+    return -1;
+  }
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+  bool first = true;
+  uint_fast64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+  for(uint_fast64_t i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i < head; i++){
+    struct trace_slot* slot = &trace->ring[i % TRACE_RING_SIZE];
+    if(atomic_load_explicit(&slot->stamp, memory_order_acquire) != i + 1)
+      continue;
+    struct trace_record record = slot->record;
+    atomic_thread_fence(memory_order_acquire);
+    if(atomic_load_explicit(&slot->stamp, memory_order_relaxed) != i + 1)
+      continue;
+    dump_stage(f, &first, stage_name[TRACE_STAGE_CAPTURE], &record, record.sensor, record.dequeue);
+    dump_stage(f, &first, stage_name[TRACE_STAGE_HANDOFF], &record, record.dequeue, record.rebind);
+    dump_stage(f, &first, stage_name[TRACE_STAGE_DRAW], &record, record.rebind, record.draw);
+    dump_stage(f, &first, stage_name[TRACE_STAGE_PRESENT], &record, record.draw, record.swap);
+  }
+  fputs("\n]}\n", f);
+  if(fclose(f)){
+    fprintf(stderr, "Failed to write trace file %s\n", trace->path);
+    return -1;
+  }
+  fprintf(stderr, "Wrote trace to %s\n", trace->path);
+  return 0;
+}
+
+void engine_i_trace_destroy(struct engine* engine){
+  struct engine_trace* trace = engine->trace;
+  if(!trace)
+    return;
+  dump(trace);
+  free(trace->path);
+  free(trace);
+  engine->trace = 0;
+}
@@ -0,0 +1,114 @@
+#include <engine.h>
+#include <internal/upload.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define UPLOAD_BUFFER_COUNT 3
+
+struct engine_upload {
+  struct engine* engine;
+  unsigned width, height;
+  size_t size;
+  GLuint buffer[UPLOAD_BUFFER_COUNT];
+  GLsync fence[UPLOAD_BUFFER_COUNT]; // Signals once the copy out of the buffer finished, 0 if there is none
+  unsigned next;
+  GLuint texture[2];
+  unsigned back; // Texture the next frame goes to
+};
+
+struct engine_upload* engine_i_upload_create(struct engine* engine, unsigned width, unsigned height){
+  struct engine_upload* upload = calloc(1, sizeof(*upload));
+  if(!upload){
+    perror("calloc failed");
+    goto error;
+  }
+  upload->engine = engine;
+  upload->width = width;
+  upload->height = height;
+  upload->size = (size_t)width * height * 4;
+
+  while(glGetError() != GL_NO_ERROR); // Clear previouse errors
+  glGenBuffers(UPLOAD_BUFFER_COUNT, upload->buffer);
+  for(unsigned i=0; i<UPLOAD_BUFFER_COUNT; i++){
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->buffer[i]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, upload->size, 0, GL_STREAM_DRAW);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  glGenTextures(2, upload->texture);
+  for(unsigned i=0; i<2; i++){
+    engine_gl_bind_texture(engine, 0, GL_TEXTURE_2D, upload->texture[i]);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+
+  if(glGetError() != GL_NO_ERROR){
+    fprintf(stderr, "Failed to create the upload buffers & textures\n");
+    goto error_after_objects;
+  }
+
+  return upload;
+
+error_after_objects:
+  engine_gl_delete_textures(engine, 2, upload->texture);
+  glDeleteBuffers(UPLOAD_BUFFER_COUNT, upload->buffer);
+  free(upload);
+error:
+  return 0;
+}
+
+void engine_i_upload_destroy(struct engine_upload* upload){
+  if(!upload)
+    return;
+  for(unsigned i=0; i<UPLOAD_BUFFER_COUNT; i++)
+    if(upload->fence[i])
+      glDeleteSync(upload->fence[i]);
+  engine_gl_delete_textures(upload->engine, 2, upload->texture);
+  glDeleteBuffers(UPLOAD_BUFFER_COUNT, upload->buffer);
+  free(upload);
+}
+
+void* engine_i_upload_map(struct engine_upload* upload, size_t* pitch){
+  unsigned i = upload->next;
+  GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT;
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->buffer[i]);
+  if(upload->fence[i]){
+    if(glClientWaitSync(upload->fence[i], 0, 0) == GL_TIMEOUT_EXPIRED){
+      // Still being copied from, orphan it. The driver hands out new storage instead of waiting.
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, upload->size, 0, GL_STREAM_DRAW);
+    }else{
+      access |= GL_MAP_UNSYNCHRONIZED_BIT; // Nothing reads it anymore, no need for the driver to check
+    }
+    glDeleteSync(upload->fence[i]);
+    upload->fence[i] = 0;
+  }
+  void* memory = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, upload->size, access);
+  if(!memory){
+    fprintf(stderr, "glMapBufferRange failed (glError: %d)\n", glGetError());
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return 0;
+  }
+  *pitch = (size_t)upload->width * 4;
+  return memory;
+}
+
+GLuint engine_i_upload_unmap(struct engine_upload* upload){
+  unsigned i = upload->next;
+  bool valid = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER); // False if the contents got lost, like on a mode switch
+  GLuint texture = 0;
+  if(valid){
+    texture = upload->texture[upload->back];
+    engine_gl_bind_texture(upload->engine, 0, GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, upload->width, upload->height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    upload->fence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    upload->back ^= 1;
+    upload->next = (i + 1) % UPLOAD_BUFFER_COUNT;
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  return texture;
+}
@@ -0,0 +1,1048 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <engine.h>
+#include <internal/engine.h>
+#include <internal/capture.h>
+#include <internal/broker.h>
+#include <internal/convert.h>
+#include <internal/upload.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+
+#undef engine_v4l_texture_create
+
+struct pixel_format {
+  uint32_t v4l2; // V4L2 pixel format
+  uint32_t drm; // DRM fourcc of the same layout
+  unsigned char planes; // Number of colour planes
+  unsigned char mem_planes; // Number of separate buffers (V4L2 'M' formats)
+  unsigned char cpp; // Bytes per pixel in the first plane
+  unsigned char hsub, vsub; // Chroma subsampling
+  bool yuv;
+};
+
+static const struct pixel_format pixel_format_list[] = {
+  { V4L2_PIX_FMT_YUYV,    ENGINE_FOURCC('Y','U','Y','V'), 1, 1, 2, 1, 1, true },
+  { V4L2_PIX_FMT_YVYU,    ENGINE_FOURCC('Y','V','Y','U'), 1, 1, 2, 1, 1, true },
+  { V4L2_PIX_FMT_UYVY,    ENGINE_FOURCC('U','Y','V','Y'), 1, 1, 2, 1, 1, true },
+  { V4L2_PIX_FMT_VYUY,    ENGINE_FOURCC('V','Y','U','Y'), 1, 1, 2, 1, 1, true },
+  { V4L2_PIX_FMT_NV12,    ENGINE_FOURCC('N','V','1','2'), 2, 1, 1, 2, 2, true },
+  { V4L2_PIX_FMT_NV21,    ENGINE_FOURCC('N','V','2','1'), 2, 1, 1, 2, 2, true },
+  { V4L2_PIX_FMT_NV16,    ENGINE_FOURCC('N','V','1','6'), 2, 1, 1, 2, 1, true },
+  { V4L2_PIX_FMT_NV61,    ENGINE_FOURCC('N','V','6','1'), 2, 1, 1, 2, 1, true },
+  { V4L2_PIX_FMT_YUV420,  ENGINE_FOURCC('Y','U','1','2'), 3, 1, 1, 2, 2, true },
+  { V4L2_PIX_FMT_YVU420,  ENGINE_FOURCC('Y','V','1','2'), 3, 1, 1, 2, 2, true },
+  { V4L2_PIX_FMT_NV12M,   ENGINE_FOURCC('N','V','1','2'), 2, 2, 1, 2, 2, true },
+  { V4L2_PIX_FMT_NV21M,   ENGINE_FOURCC('N','V','2','1'), 2, 2, 1, 2, 2, true },
+  { V4L2_PIX_FMT_NV16M,   ENGINE_FOURCC('N','V','1','6'), 2, 2, 1, 2, 1, true },
+  { V4L2_PIX_FMT_NV61M,   ENGINE_FOURCC('N','V','6','1'), 2, 2, 1, 2, 1, true },
+  { V4L2_PIX_FMT_YUV420M, ENGINE_FOURCC('Y','U','1','2'), 3, 3, 1, 2, 2, true },
+  { V4L2_PIX_FMT_YVU420M, ENGINE_FOURCC('Y','V','1','2'), 3, 3, 1, 2, 2, true },
+  { V4L2_PIX_FMT_XBGR32,  ENGINE_FOURCC('X','R','2','4'), 1, 1, 4, 1, 1, false },
+  { V4L2_PIX_FMT_ABGR32,  ENGINE_FOURCC('A','R','2','4'), 1, 1, 4, 1, 1, false },
+  { V4L2_PIX_FMT_RGB565,  ENGINE_FOURCC('R','G','1','6'), 1, 1, 2, 1, 1, false },
+};
+
+static const struct pixel_format* pixel_format_lookup(uint32_t v4l2){
+  for(size_t i=0; i<sizeof(pixel_format_list)/sizeof(*pixel_format_list); i++)
+    if(pixel_format_list[i].v4l2 == v4l2)
+      return &pixel_format_list[i];
+  return 0;
+}
+
+struct dma_plane {
+  unsigned buffer; // Which of the buffers exported for a V4L2 buffer this plane is in
+  uint32_t offset;
+  uint32_t pitch;
+};
+
+struct dma_buffers {
+  unsigned type; // V4L2_BUF_TYPE_VIDEO_CAPTURE or V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+  unsigned count;
+  unsigned mem_planes;
+  bool exported; // Whether VIDIOC_EXPBUF worked, the buffers can still be mapped otherwise
+  int fd[ENGINE_MAX_BUFFERS][VIDEO_MAX_PLANES];
+  uint32_t fourcc; // DRM fourcc
+  unsigned width, height;
+  unsigned planes;
+  struct dma_plane plane[3];
+  enum engine_yuv_color_space color_space;
+  enum engine_yuv_range range;
+  int32_t crop_default[4]; // See capture_stream
+};
+
+static void dma_buffers_close(struct dma_buffers* dma){
+  for(unsigned i=0; i<dma->count; i++)
+    for(unsigned j=0; j<dma->mem_planes; j++)
+      if(dma->fd[i][j] != -1)
+        close(dma->fd[i][j]);
+  dma->count = 0;
+}
+
+static void color_hints(struct dma_buffers* dma, const struct pixel_format* pf, unsigned colorspace, unsigned ycbcr_enc, unsigned quantization){
+  dma->color_space = ENGINE_YUV_COLOR_SPACE_DEFAULT;
+  dma->range = ENGINE_YUV_RANGE_DEFAULT;
+  if(!pf || !pf->yuv)
+    return;
+  if(ycbcr_enc == V4L2_YCBCR_ENC_DEFAULT)
+    ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(colorspace);
+  if(quantization == V4L2_QUANTIZATION_DEFAULT)
+    quantization = V4L2_MAP_QUANTIZATION_DEFAULT(false, colorspace, ycbcr_enc);
+  switch(ycbcr_enc){
+    case V4L2_YCBCR_ENC_709:
+    case V4L2_YCBCR_ENC_XV709:
+    case V4L2_YCBCR_ENC_SMPTE240M: dma->color_space = ENGINE_YUV_COLOR_SPACE_BT709; break;
+    case V4L2_YCBCR_ENC_BT2020:
+    case V4L2_YCBCR_ENC_BT2020_CONST_LUM: dma->color_space = ENGINE_YUV_COLOR_SPACE_BT2020; break;
+    default: dma->color_space = ENGINE_YUV_COLOR_SPACE_BT601; break;
+  }
+  dma->range = quantization == V4L2_QUANTIZATION_FULL_RANGE ? ENGINE_YUV_RANGE_FULL : ENGINE_YUV_RANGE_NARROW;
+}
+
+// Works out where each colour plane is, for both the single and multi planar API
+static int dma_buffers_layout(struct dma_buffers* dma, const struct v4l2_format* fmt){
+  const struct pixel_format* pf;
+  unsigned bytesperline[VIDEO_MAX_PLANES];
+  if(dma->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE){
+    const struct v4l2_pix_format_mplane* pix = &fmt->fmt.pix_mp;
+    pf = pixel_format_lookup(pix->pixelformat);
+    dma->width = pix->width;
+    dma->height = pix->height;
+    dma->mem_planes = pix->num_planes;
+    for(unsigned i=0; i<pix->num_planes && i<VIDEO_MAX_PLANES; i++)
+      bytesperline[i] = pix->plane_fmt[i].bytesperline;
+    dma->fourcc = pf ? pf->drm : pix->pixelformat;
+    color_hints(dma, pf, pix->colorspace, pix->ycbcr_enc, pix->quantization);
+  }else{
+    const struct v4l2_pix_format* pix = &fmt->fmt.pix;
+    pf = pixel_format_lookup(pix->pixelformat);
+    dma->width = pix->width;
+    dma->height = pix->height;
+    dma->mem_planes = 1;
+    bytesperline[0] = pix->bytesperline;
+    dma->fourcc = pf ? pf->drm : pix->pixelformat;
+    color_hints(dma, pf, pix->colorspace, pix->ycbcr_enc, pix->quantization);
+  }
+
+  if(!pf){ // Unknown format, assume a packed one with 2 bytes per pixel & the same fourcc as DRM
+    fprintf(stderr, "Unknown pixel format %.4s, assuming it's a packed one\n", (const char*)&dma->fourcc);
+    if(dma->mem_planes != 1){
+      fprintf(stderr, "Can't guess the layout of an unknown multi planar format\n");
+      return -1;
+    }
+    if(bytesperline[0] < dma->width * 2)
+      bytesperline[0] = dma->width * 2;
+    dma->planes = 1;
+    dma->plane[0] = (struct dma_plane){ .buffer = 0, .offset = 0, .pitch = bytesperline[0] };
+    return 0;
+  }
+
+  if(dma->mem_planes != pf->mem_planes){
+    fprintf(stderr, "Driver reported %u memory planes for %.4s, expected %u\n", dma->mem_planes, (const char*)&pf->v4l2, pf->mem_planes);
+    return -1;
+  }
+
+  if(bytesperline[0] < dma->width * pf->cpp)
+    bytesperline[0] = dma->width * pf->cpp;
+
+  dma->planes = pf->planes;
+  dma->plane[0] = (struct dma_plane){ .buffer = 0, .offset = 0, .pitch = bytesperline[0] };
+  uint32_t offset = bytesperline[0] * dma->height;
+  for(unsigned i=1; i<pf->planes; i++){
+    // Semi planar formats interleave both chroma components, so their lines are as long as the luma lines
+    uint32_t pitch = pf->planes == 2 ? bytesperline[0] : bytesperline[0] / pf->hsub;
+    if(pf->mem_planes > 1){
+      dma->plane[i] = (struct dma_plane){ .buffer = i, .offset = 0, .pitch = bytesperline[i] ? bytesperline[i] : pitch };
+    }else{
+      dma->plane[i] = (struct dma_plane){ .buffer = 0, .offset = offset, .pitch = pitch };
+      offset += pitch * (dma->height / pf->vsub);
+    }
+  }
+
+  return 0;
+}
+
+static void dma_buffers_describe(const struct dma_buffers* dma, unsigned index, struct engine_dmabuf* result){
+  memset(result, 0, sizeof(*result));
+  result->fourcc = dma->fourcc;
+  result->width = dma->width;
+  result->height = dma->height;
+  result->plane_count = dma->planes;
+  for(unsigned i=0; i<dma->planes; i++)
+    result->plane[i] = (struct engine_dmabuf_plane){
+      .fd = dma->fd[index][dma->plane[i].buffer],
+      .offset = dma->plane[i].offset,
+      .pitch = dma->plane[i].pitch
+    };
+  result->modifier = ENGINE_DRM_FORMAT_MOD_INVALID; // V4L2 doesn't tell us, it's usually linear
+  result->color_space = dma->color_space;
+  result->range = dma->range;
+}
+
+// A way the device can deliver frames, with the frame interval to ask for (0/0 to leave it alone)
+struct format_candidate {
+  const struct pixel_format* pf;
+  unsigned width, height;
+  struct v4l2_fract interval;
+  unsigned tier; // 0 if EGL can import it, 1 if it has to be converted on the CPU
+  uint64_t bandwidth; // Bytes per frame, times frames per second if a frame rate was asked for
+};
+
+static uint64_t frame_bytes(const struct pixel_format* pf, unsigned width, unsigned height){
+  uint64_t luma = (uint64_t)width * height * pf->cpp;
+  if(pf->planes == 1)
+    return luma;
+  return luma + (uint64_t)width * height * 2 / (pf->hsub * pf->vsub);
+}
+
+// The slowest frame interval which still reaches fps, false if none does
+static bool pick_interval(int fd, uint32_t pixelformat, unsigned width, unsigned height, float fps, struct v4l2_fract* result){
+  *result = (struct v4l2_fract){ 0, 0 };
+  if(fps <= 0)
+    return true;
+  struct v4l2_fract wanted = { 1000, fps * 1000 + 0.5f };
+  float best = 0;
+  for(unsigned i=0; ; i++){
+    struct v4l2_frmivalenum ival;
+    memset(&ival, 0, sizeof(ival));
+    ival.index = i;
+    ival.pixel_format = pixelformat;
+    ival.width = width;
+    ival.height = height;
+    if(ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == -1){
+      if(!i) // Can't tell, S_PARM will have to work it out
+        *result = wanted;
+      break;
+    }
+    if(ival.type != V4L2_FRMIVAL_TYPE_DISCRETE){
+      // Continuous or stepwise, the fastest interval is the minimum
+      if(ival.stepwise.min.numerator * fps <= ival.stepwise.min.denominator * 1.01f)
+        *result = wanted;
+      break;
+    }
+    float rate = (float)ival.discrete.denominator / ival.discrete.numerator;
+    if(rate * 1.01f >= fps && (!best || rate < best)){ // Some slack for 29.97 & the like
+      best = rate;
+      *result = ival.discrete;
+    }
+  }
+  return result->denominator != 0;
+}
+
+static void consider(
+  struct engine* engine, int fd, const struct pixel_format* pf,
+  unsigned width, unsigned height, const struct engine_v4l_texture_create_params* params, struct format_candidate* best
+){
+  struct format_candidate candidate = {
+    .pf = pf,
+    .width = width,
+    .height = height,
+    .tier = engine_dmabuf_format_supported(engine, pf->drm, ENGINE_DRM_FORMAT_MOD_INVALID) ? 0 : 1,
+    .bandwidth = frame_bytes(pf, width, height)
+  };
+  if(candidate.tier && !engine_i_convert_supported(pf->drm))
+    return;
+  if(!pick_interval(fd, pf->v4l2, width, height, params->fps, &candidate.interval))
+    return;
+  if(candidate.interval.denominator)
+    candidate.bandwidth = candidate.bandwidth * candidate.interval.denominator / candidate.interval.numerator;
+  if(best->pf && (best->tier < candidate.tier || (best->tier == candidate.tier && best->bandwidth <= candidate.bandwidth)))
+    return;
+  *best = candidate;
+}
+
+// Smallest multiple of step from min which is at least wanted, 0 if that's more than max
+static unsigned stepwise_size(unsigned wanted, unsigned min, unsigned max, unsigned step){
+  if(wanted <= min)
+    return min;
+  if(!step)
+    step = 1;
+  unsigned size = min + (wanted - min + step - 1) / step * step;
+  return size <= max ? size : 0;
+}
+
+/*
+ * Sets the cheapest format meeting the constraints in params, preferring ones EGL can import over ones which
+ * have to be converted on the CPU. Without a size constraint, frames have to be at least as big as the
+ * current format. fmt gets the format which is set, which is the current one if nothing matches.
+ */
+static int negotiate_format(struct engine* engine, int fd, unsigned type, const struct engine_v4l_texture_create_params* params, struct v4l2_format* fmt){
+  memset(fmt, 0, sizeof(*fmt));
+  fmt->type = type;
+  if(ioctl(fd, VIDIOC_G_FMT, fmt) == -1){
+    perror("VIDIOC_G_FMT");
+    return -1;
+  }
+  bool mplane = type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  unsigned width = params->width ? params->width : mplane ? fmt->fmt.pix_mp.width : fmt->fmt.pix.width;
+  unsigned height = params->height ? params->height : mplane ? fmt->fmt.pix_mp.height : fmt->fmt.pix.height;
+
+  struct format_candidate best = { .pf = 0 };
+  for(unsigned i=0; ; i++){
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.index = i;
+    desc.type = type;
+    if(ioctl(fd, VIDIOC_ENUM_FMT, &desc) == -1)
+      break;
+    const struct pixel_format* pf = pixel_format_lookup(desc.pixelformat);
+    if(!pf)
+      continue; // Compressed or a layout we can't describe
+    for(unsigned j=0; ; j++){
+      struct v4l2_frmsizeenum size;
+      memset(&size, 0, sizeof(size));
+      size.index = j;
+      size.pixel_format = pf->v4l2;
+      if(ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == -1){
+        if(!j) // Can't tell, S_FMT will adjust the size
+          consider(engine, fd, pf, width, height, params, &best);
+        break;
+      }
+      if(size.type == V4L2_FRMSIZE_TYPE_DISCRETE){
+        if(size.discrete.width >= width && size.discrete.height >= height)
+          consider(engine, fd, pf, size.discrete.width, size.discrete.height, params, &best);
+        continue;
+      }
+      const struct v4l2_frmsize_stepwise* sw = &size.stepwise;
+      unsigned w = stepwise_size(width, sw->min_width, sw->max_width, sw->step_width);
+      unsigned h = stepwise_size(height, sw->min_height, sw->max_height, sw->step_height);
+      if(w && h)
+        consider(engine, fd, pf, w, h, params, &best);
+      break;
+    }
+  }
+
+  if(!best.pf){
+    fprintf(stderr, "No format of the camera is at least %ux%u", width, height);
+    if(params->fps > 0)
+      fprintf(stderr, " at %.1f fps", params->fps);
+    fprintf(stderr, ", keeping the current one\n");
+    return 0;
+  }
+
+  struct v4l2_format want;
+  memset(&want, 0, sizeof(want));
+  want.type = type;
+  if(mplane){
+    want.fmt.pix_mp.width = best.width;
+    want.fmt.pix_mp.height = best.height;
+    want.fmt.pix_mp.pixelformat = best.pf->v4l2;
+    want.fmt.pix_mp.field = V4L2_FIELD_ANY;
+  }else{
+    want.fmt.pix.width = best.width;
+    want.fmt.pix.height = best.height;
+    want.fmt.pix.pixelformat = best.pf->v4l2;
+    want.fmt.pix.field = V4L2_FIELD_ANY;
+  }
+  if(ioctl(fd, VIDIOC_S_FMT, &want) == -1){
+    perror("VIDIOC_S_FMT");
+    return -1;
+  }
+  *fmt = want;
+  uint32_t pixelformat = mplane ? want.fmt.pix_mp.pixelformat : want.fmt.pix.pixelformat;
+  fprintf(stderr, "Negotiated %.4s %ux%u", (const char*)&pixelformat,
+    mplane ? want.fmt.pix_mp.width : want.fmt.pix.width, mplane ? want.fmt.pix_mp.height : want.fmt.pix.height);
+
+  if(best.interval.denominator){
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = type;
+    if(ioctl(fd, VIDIOC_G_PARM, &parm) == 0 && parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME){
+      parm.parm.capture.timeperframe = best.interval;
+      if(ioctl(fd, VIDIOC_S_PARM, &parm) == -1){
+        perror("VIDIOC_S_PARM");
+      }else if(parm.parm.capture.timeperframe.numerator){
+        fprintf(stderr, " at %.2f fps", (float)parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator);
+      }
+    }else{
+      fprintf(stderr, ", the frame rate can't be set");
+    }
+  }
+  fprintf(stderr, "\n");
+
+  return 0;
+}
+
+// The cropping ioctls take the single planar buffer type, also on multi-planar devices. Drivers from before
+// the kernel translated it want their own type though, that's tried if the other one is refused.
+static int crop_ioctl(int fd, unsigned long request, void* arg, uint32_t* type){
+  if(*type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE){
+    *type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int result = ioctl(fd, request, arg);
+    if(result == 0 || errno != EINVAL)
+      return result;
+    *type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  }
+  return ioctl(fd, request, arg);
+}
+
+// Resets cropping to the full frame & remembers it, for engine_dma_texture_set_roi
+static void crop_reset(int fd, struct dma_buffers* dma){
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof(sel));
+  sel.type = dma->type;
+  sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+  if(crop_ioctl(fd, VIDIOC_G_SELECTION, &sel, &sel.type) == 0){
+    sel.target = V4L2_SEL_TGT_CROP;
+    if(crop_ioctl(fd, VIDIOC_S_SELECTION, &sel, &sel.type) == -1)
+      return;
+  }else{ // Drivers predating the selection API
+    struct v4l2_cropcap cropcap;
+    memset(&cropcap, 0, sizeof(cropcap));
+    cropcap.type = dma->type;
+    if(crop_ioctl(fd, VIDIOC_CROPCAP, &cropcap, &cropcap.type) == -1)
+      return;
+    struct v4l2_crop crop;
+    memset(&crop, 0, sizeof(crop));
+    crop.type = dma->type;
+    crop.c = cropcap.defrect;
+    if(crop_ioctl(fd, VIDIOC_S_CROP, &crop, &crop.type) == -1)
+      return;
+    sel.r = cropcap.defrect;
+  }
+  dma->crop_default[0] = sel.r.left;
+  dma->crop_default[1] = sel.r.top;
+  dma->crop_default[2] = sel.r.width;
+  dma->crop_default[3] = sel.r.height;
+}
+
+static int device_init_get_dmabuf(struct engine* engine, int fd, struct dma_buffers* result, const struct engine_v4l_texture_create_params* params){
+
+  {
+    struct v4l2_capability cap;
+    memset(&cap, 0, sizeof(cap));
+    if( ioctl(fd, VIDIOC_QUERYCAP, &cap) == -1){
+      if(EINVAL == errno){
+        fprintf(stderr, "This isn't a V4L2 device\n");
+      }else{
+        perror("VIDIOC_QUERYCAP");
+      }
+      return -1;
+    }
+
+    uint32_t caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps : cap.capabilities;
+
+    if(caps & V4L2_CAP_VIDEO_CAPTURE){
+      result->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    }else if(caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE){
+      result->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    }else{
+      fprintf(stderr, "This is no video capture device\n");
+      return -1;
+    }
+
+    if(!(caps & V4L2_CAP_STREAMING)){
+      fprintf(stderr, "no streaming i/o support\n");
+      return -1;
+    }
+
+  }
+
+  crop_reset(fd, result);
+
+  struct v4l2_format fmt;
+  if(negotiate_format(engine, fd, result->type, params, &fmt) == -1)
+    return -1;
+
+  if(dma_buffers_layout(result, &fmt) == -1)
+    return -1;
+
+  unsigned buffer_count = params->buffer_count;
+  if(!buffer_count)
+    buffer_count = ENGINE_DEFAULT_BUFFER_COUNT;
+  if(buffer_count < 2)
+    buffer_count = 2;
+  if(buffer_count > ENGINE_MAX_BUFFERS)
+    buffer_count = ENGINE_MAX_BUFFERS;
+
+  unsigned count = 0;
+  {
+    struct v4l2_requestbuffers reqbuf;
+    memset(&reqbuf, 0, sizeof(reqbuf));
+    reqbuf.type = result->type;
+    reqbuf.memory = V4L2_MEMORY_MMAP;
+    reqbuf.count = buffer_count;
+    if(ioctl(fd, VIDIOC_REQBUFS, &reqbuf) == -1){
+      if(errno == EINVAL){
+        fprintf(stderr, "Video capturing or DMABUF streaming is not supported\n");
+      }else{
+        perror("VIDIOC_REQBUFS");
+      }
+      return -1;
+    }
+    count = reqbuf.count;
+  }
+  // With a single buffer, the driver has nothing to fill while it's shown, capturing would stall after the first frame
+  if(count < 2){
+    fprintf(stderr, "VIDIOC_REQBUFS allocated %u buffers, at least 2 are needed\n", count);
+    struct v4l2_requestbuffers reqbuf;
+    memset(&reqbuf, 0, sizeof(reqbuf));
+    reqbuf.type = result->type;
+    reqbuf.memory = V4L2_MEMORY_MMAP;
+    if(count && ioctl(fd, VIDIOC_REQBUFS, &reqbuf) == -1)
+      perror("VIDIOC_REQBUFS");
+    return -1;
+  }
+  if(count > ENGINE_MAX_BUFFERS)
+    count = ENGINE_MAX_BUFFERS; // The remaining ones are never queued, so they won't be used
+
+  result->exported = true;
+  for(unsigned i=0; i<count; i++){
+    for(unsigned j=0; j<result->mem_planes; j++)
+      result->fd[i][j] = -1;
+    result->count = i + 1;
+    for(unsigned j=0; j<result->mem_planes && result->exported; j++){
+      struct v4l2_exportbuffer expbuf;
+      memset(&expbuf, 0, sizeof(expbuf));
+      expbuf.type = result->type;
+      expbuf.index = i;
+      expbuf.plane = j;
+      expbuf.flags = O_RDONLY;
+      if(ioctl(fd, VIDIOC_EXPBUF, &expbuf) == -1){
+        perror("VIDIOC_EXPBUF"); // Not fatal, the buffers are converted on the CPU then
+        result->exported = false;
+        break;
+      }
+      result->fd[i][j] = expbuf.fd;
+    }
+  }
+
+  return 0;
+}
+
+static int open_device(const char* dev){
+
+  int fd = -1;
+  if(strncmp(dev,"fd:",3) == 0){
+    if(sscanf(dev+3,"%d",&fd) != 1){
+      fprintf(stderr, "Cannot parse fd '%s'\n", dev);
+      return -1;
+    }
+  }else{
+     fd = open(dev, O_RDWR | O_NONBLOCK);
+    if(fd == -1){
+      fprintf(stderr, "Cannot open '%s': %d, %s\n", dev, errno, strerror(errno));
+      return -1;
+    }
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) == -1){
+    fprintf(stderr, "Cannot identify '%s': %d, %s\n", dev, errno, strerror(errno));
+    return -1;
+  }
+
+  if(!S_ISCHR(st.st_mode)){
+    fprintf(stderr, "%s isn't a device file\n", dev);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Crops on the sensor, the frame size stays the same & the driver scales. Many drivers allow this while streaming.
+static void stream_set_roi(struct capture_stream* stream, const float roi[4], float done[4]){
+  const int32_t* full = stream->crop_default;
+  if(!full[2])
+    return;
+  // Rounded outwards, so all of roi stays visible
+  struct v4l2_rect r = {
+    .left = full[0] + (int32_t)(roi[0] * full[2]),
+    .top = full[1] + (int32_t)(roi[1] * full[3])
+  };
+  r.width = full[0] + (int32_t)ceilf((roi[0] + roi[2]) * full[2]) - r.left;
+  r.height = full[1] + (int32_t)ceilf((roi[1] + roi[3]) * full[3]) - r.top;
+
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof(sel));
+  sel.type = stream->type;
+  sel.target = V4L2_SEL_TGT_CROP;
+  sel.flags = V4L2_SEL_FLAG_GE;
+  sel.r = r;
+  if(crop_ioctl(stream->fd, VIDIOC_S_SELECTION, &sel, &sel.type) == -1){
+    struct v4l2_crop crop;
+    memset(&crop, 0, sizeof(crop));
+    crop.type = stream->type;
+    crop.c = r;
+    if(crop_ioctl(stream->fd, VIDIOC_S_CROP, &crop, &crop.type) == -1 && errno != EBUSY && errno != EINVAL)
+      perror("VIDIOC_S_CROP");
+  }
+
+  // Whatever happened, this is what the frames show now. Drivers may round or refuse while streaming.
+  memset(&sel, 0, sizeof(sel));
+  sel.type = stream->type;
+  sel.target = V4L2_SEL_TGT_CROP;
+  if(crop_ioctl(stream->fd, VIDIOC_G_SELECTION, &sel, &sel.type) == -1){
+    struct v4l2_crop crop;
+    memset(&crop, 0, sizeof(crop));
+    crop.type = stream->type;
+    if(crop_ioctl(stream->fd, VIDIOC_G_CROP, &crop, &crop.type) == -1)
+      return;
+    sel.r = crop.c;
+  }
+  float d[4] = {
+    (float)(sel.r.left - full[0]) / full[2],
+    (float)(sel.r.top - full[1]) / full[3],
+    (float)sel.r.width / full[2],
+    (float)sel.r.height / full[3]
+  };
+  if(d[2] <= 0 || d[3] <= 0)
+    return;
+  for(int i=0; i<4; i++)
+    done[i] = d[i];
+}
+
+
+// Fallback for GPUs which can't import the buffers: they are mapped, converted on the CPU & uploaded
+struct cpu_texture {
+  struct engine_upload* upload;
+  struct engine_upload* retired; // Of the previous format, holds the last frame until the first new one is uploaded
+  const struct engine_i_convert_kernel* kernel;
+  struct engine_i_convert_coefficients coefficients;
+  uint32_t fourcc;
+  unsigned planes;
+  struct dma_plane plane[3];
+  void* map[ENGINE_MAX_BUFFERS][VIDEO_MAX_PLANES]; // 0 if not mapped
+  size_t length[ENGINE_MAX_BUFFERS][VIDEO_MAX_PLANES];
+};
+
+// A camera texture, in update_param.vptr
+struct v4l_texture {
+  struct capture_stream* stream;
+  struct cpu_texture* cpu; // Only if the frames are converted on the CPU
+  struct engine_v4l_texture_create_params params; // For picking the format again, the strings aren't kept
+  char* broker; // Socket path the camera is shared on, 0 if it isn't
+  bool failed; // Setting up a new format failed, the stream is stopped
+};
+
+static void cpu_texture_unmap(struct cpu_texture* cpu){
+  for(unsigned i=0; i<ENGINE_MAX_BUFFERS; i++){
+    for(unsigned j=0; j<VIDEO_MAX_PLANES; j++){
+      if(cpu->map[i][j])
+        munmap(cpu->map[i][j], cpu->length[i][j]);
+      cpu->map[i][j] = 0;
+    }
+  }
+}
+
+static void cpu_texture_free(struct cpu_texture* cpu){
+  if(!cpu)
+    return;
+  cpu_texture_unmap(cpu);
+  engine_i_upload_destroy(cpu->retired);
+  engine_i_upload_destroy(cpu->upload);
+  free(cpu);
+}
+
+static int map_buffers(int fd, const struct dma_buffers* dma, struct cpu_texture* cpu){
+  for(unsigned i=0; i<dma->count; i++){
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    memset(&buf, 0, sizeof(buf));
+    memset(planes, 0, sizeof(planes));
+    buf.type = dma->type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    if(dma->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE){
+      buf.m.planes = planes;
+      buf.length = dma->mem_planes;
+    }
+    if(ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1){
+      perror("VIDIOC_QUERYBUF");
+      return -1;
+    }
+    for(unsigned j=0; j<dma->mem_planes; j++){
+      bool mplane = dma->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+      size_t length = mplane ? planes[j].length : buf.length;
+      off_t offset = mplane ? planes[j].m.mem_offset : buf.m.offset;
+      void* map = mmap(0, length, PROT_READ, MAP_SHARED, fd, offset);
+      if(map == MAP_FAILED){
+        perror("mmap V4L2 buffer");
+        return -1;
+      }
+      cpu->map[i][j] = map;
+      cpu->length[i][j] = length;
+    }
+    for(unsigned j=0; j<dma->planes; j++){
+      const struct dma_plane* plane = &dma->plane[j];
+      unsigned rows = j ? dma->height / 2 : dma->height; // Only NV12 has a second plane here
+      if(plane->offset + (size_t)plane->pitch * rows > cpu->length[i][plane->buffer]){
+        fprintf(stderr, "V4L2 buffer %u is too small for its format\n", i);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+static struct cpu_texture* cpu_texture_create(struct engine* engine, int dev, const struct dma_buffers* dma){
+  if(!engine_i_convert_supported(dma->fourcc)){
+    fprintf(stderr, "%.4s can't be converted on the CPU\n", (const char*)&dma->fourcc);
+    goto error;
+  }
+  struct cpu_texture* cpu = calloc(1, sizeof(*cpu));
+  if(!cpu){
+    perror("calloc failed");
+    goto error;
+  }
+  cpu->kernel = engine_i_convert_kernel();
+  engine_i_convert_coefficients(&cpu->coefficients, dma->color_space, dma->range);
+  cpu->fourcc = dma->fourcc;
+  cpu->planes = dma->planes;
+  memcpy(cpu->plane, dma->plane, sizeof(cpu->plane));
+  if(map_buffers(dev, dma, cpu) == -1)
+    goto error_after_calloc;
+  cpu->upload = engine_i_upload_create(engine, dma->width, dma->height);
+  if(!cpu->upload)
+    goto error_after_calloc;
+  fprintf(stderr, "Converting %.4s on the CPU (%s)\n", (const char*)&dma->fourcc, cpu->kernel->name);
+  return cpu;
+
+error_after_calloc:
+  cpu_texture_free(cpu);
+error:
+  return 0;
+}
+
+// The texture shows the uploads, it has no images
+static struct dma_gl_texture* cpu_texture_gl_create(struct engine* engine, const struct dma_buffers* dma){
+  struct dma_gl_texture* dgt = calloc(1, sizeof(*dgt));
+  if(!dgt){
+    perror("calloc failed");
+    return 0;
+  }
+  dgt->autoupdate = true;
+  dgt->current = -1;
+  dgt->target = GL_TEXTURE_2D;
+  dgt->retired = EGL_NO_IMAGE_KHR;
+  dgt->width = dma->width;
+  dgt->height = dma->height;
+  engine_i_dma_texture_register(engine, dgt);
+  return dgt;
+}
+
+static int cpu_texture_update(struct dma_gl_texture* dgt, struct v4l_texture* v4l){
+  struct cpu_texture* cpu = v4l->cpu;
+  int index = engine_i_capture_acquire(v4l->stream);
+  if(index == -1)
+    return 0;
+
+  int ret = 0;
+  size_t pitch;
+  uint8_t* dst = engine_i_upload_map(cpu->upload, &pitch);
+  if(dst){
+    const uint8_t* plane[3];
+    uint32_t plane_pitch[3];
+    for(unsigned i=0; i<cpu->planes; i++){
+      plane[i] = (const uint8_t*)cpu->map[index][cpu->plane[i].buffer] + cpu->plane[i].offset;
+      plane_pitch[i] = cpu->plane[i].pitch;
+    }
+    engine_i_convert_frame(cpu->kernel, &cpu->coefficients, cpu->fourcc, dgt->width, dgt->height, plane, plane_pitch, dst, pitch);
+    GLuint texture = engine_i_upload_unmap(cpu->upload);
+    if(texture){
+      dgt->texture = texture;
+      dgt->frame = v4l->stream->frame[index];
+      engine_i_upload_destroy(cpu->retired);
+      cpu->retired = 0;
+      ret = 1;
+    }
+  }
+
+  // The GPU never sees the V4L2 buffer, the camera can have it back right away
+  engine_i_capture_release_unfenced(dgt->engine, v4l->stream, index);
+
+  return ret;
+}
+
+// Stops streaming & lets go of the buffers. The texture keeps what it shows, broker clients stay connected.
+static void v4l_stop(struct dma_gl_texture* dgt, struct v4l_texture* v4l){
+  struct capture_stream* stream = v4l->stream;
+  engine_i_capture_remove(dgt->engine, stream);
+  for(unsigned i=0; i<stream->count; i++){
+    if(stream->dmabuf[i] != -1)
+      close(stream->dmabuf[i]);
+    stream->dmabuf[i] = -1;
+  }
+  stream->count = 0;
+  if(v4l->cpu){
+    cpu_texture_unmap(v4l->cpu);
+  }else{
+    engine_i_dma_texture_retire_images(dgt, true);
+  }
+}
+
+// Picks the format, allocates the buffers, imports or maps them & starts streaming.
+// Creates the texture if dgt is 0, otherwise it keeps the way it gets its frames.
+static struct dma_gl_texture* v4l_start(struct engine* engine, struct v4l_texture* v4l, struct dma_gl_texture* dgt){
+  struct capture_stream* stream = v4l->stream;
+  struct dma_gl_texture* result = dgt;
+  struct cpu_texture* cpu = 0;
+  struct dma_buffers dma = {
+    .count = 0
+  };
+  struct engine_dmabuf buffer[ENGINE_MAX_BUFFERS];
+
+  if(device_init_get_dmabuf(engine, stream->fd, &dma, &v4l->params) == -1){
+    fprintf(stderr,"device_init_get_dmabuf failed\n");
+    goto error;
+  }
+  if(dma.exported)
+    for(unsigned i=0; i<dma.count; i++)
+      dma_buffers_describe(&dma, i, &buffer[i]);
+
+  if(!dgt){
+    // Imported right away, so a failure can still fall back to the CPU
+    if(dma.exported)
+      result = engine_i_dma_texture_create(engine, dma.count, buffer, false);
+    if(!result){
+      fprintf(stderr,"failed to create texture from dma buffer, falling back to converting frames on the CPU\n");
+      cpu = cpu_texture_create(engine, stream->fd, &dma);
+      if(!cpu)
+        goto error;
+      result = cpu_texture_gl_create(engine, &dma);
+      if(!result)
+        goto error;
+    }
+  }else if(v4l->cpu){
+    cpu = cpu_texture_create(engine, stream->fd, &dma);
+    if(!cpu)
+      goto error;
+  }else if(!dma.exported || engine_i_dma_texture_import(dgt, dma.count, buffer) == -1){
+    fprintf(stderr,"failed to import the buffers of the new format\n");
+    goto error;
+  }
+
+  if(v4l->broker){
+    if(!dma.exported){
+      fprintf(stderr,"the camera can't be shared, its buffers can't be exported\n");
+      goto error;
+    }
+    if(stream->broker){ // A new format, the clients get its buffers
+      if(engine_i_broker_set_buffers(stream->broker, dma.count, buffer) == -1){
+        fprintf(stderr,"failed to share the new buffers on %s\n", v4l->broker);
+        goto error;
+      }
+    }else{
+      stream->broker = engine_i_broker_create(v4l->broker, dma.count, buffer);
+      if(!stream->broker){
+        fprintf(stderr,"failed to share the camera on %s\n", v4l->broker);
+        goto error;
+      }
+    }
+  }
+
+  stream->type = dma.type;
+  stream->mem_planes = dma.mem_planes;
+  stream->count = dma.count;
+  memcpy(stream->crop_default, dma.crop_default, sizeof(stream->crop_default));
+  // Kept for implicit sync, the first memory plane is enough to wait for the GPU. The CPU path doesn't need it.
+  for(unsigned i=0; i<dma.count; i++){
+    stream->dmabuf[i] = cpu ? -1 : dma.fd[i][0];
+    if(!cpu)
+      dma.fd[i][0] = -1;
+  }
+
+  stream->stats = result->stats;
+  if(engine_i_capture_add(engine, stream) == -1){
+    fprintf(stderr,"failed to start video capturing\n");
+    goto error;
+  }
+
+  if(cpu){
+    if(v4l->cpu){ // The last frame stays until the first one of the new format is uploaded
+      // If none of the old format was uploaded either, the texture still belongs to the one before
+      struct engine_upload** shown = v4l->cpu->retired ? &v4l->cpu->retired : &v4l->cpu->upload;
+      cpu->retired = *shown;
+      *shown = 0;
+      cpu_texture_free(v4l->cpu);
+    }
+    v4l->cpu = cpu;
+  }
+  result->width = dma.width;
+  result->height = dma.height;
+  // The sensor crop was reset along with the format
+  result->crop[0] = result->crop[1] = 0;
+  result->crop[2] = result->crop[3] = 1;
+
+  dma_buffers_close(&dma);
+
+  return result;
+
+error:
+  dma_buffers_close(&dma);
+  engine_i_broker_destroy(stream->broker);
+  stream->broker = 0;
+  for(unsigned i=0; i<stream->count; i++){
+    if(stream->dmabuf[i] != -1)
+      close(stream->dmabuf[i]);
+    stream->dmabuf[i] = -1;
+  }
+  stream->count = 0;
+  cpu_texture_free(cpu);
+  if(!dgt)
+    engine_dma_texture_destroy(result);
+  return 0;
+}
+
+// Sets the stream up again for another format, from the render thread. Until the first new frame arrives,
+// the texture shows the last one of the old format.
+static int v4l_reconfigure(struct dma_gl_texture* dgt){
+  struct v4l_texture* v4l = dgt->update_param.vptr;
+  struct capture_stream* stream = v4l->stream;
+  unsigned type = stream->type;
+  v4l_stop(dgt, v4l);
+
+  // The format can only change without buffers. Since Linux 5.0, drivers orphan the ones still in use,
+  // like the one the retired image shows. Older ones refuse, the last frame can't be kept then.
+  struct v4l2_requestbuffers reqbuf;
+  memset(&reqbuf, 0, sizeof(reqbuf));
+  reqbuf.type = type;
+  reqbuf.memory = V4L2_MEMORY_MMAP;
+  if(ioctl(stream->fd, VIDIOC_REQBUFS, &reqbuf) == -1 && errno == EBUSY && !v4l->cpu){
+    fprintf(stderr, "The driver can't orphan buffers, the last frame is dropped\n");
+    engine_i_dma_texture_retire_images(dgt, false);
+    memset(&reqbuf, 0, sizeof(reqbuf));
+    reqbuf.type = type;
+    reqbuf.memory = V4L2_MEMORY_MMAP;
+    if(ioctl(stream->fd, VIDIOC_REQBUFS, &reqbuf) == -1)
+      perror("VIDIOC_REQBUFS");
+  }
+
+  if(!v4l_start(dgt->engine, v4l, dgt)){
+    fprintf(stderr, "Setting up the new camera format failed, the camera is stopped\n");
+    v4l->failed = true;
+    return -1;
+  }
+  v4l->failed = false;
+  dgt->generation++;
+  dgt->engine->redraw_requested = true;
+  return 0;
+}
+
+static int v4l_texture_update(struct dma_gl_texture* dgt){
+  struct v4l_texture* v4l = dgt->update_param.vptr;
+  if(v4l->failed)
+    return 0;
+  if(atomic_exchange(&v4l->stream->source_changed, false)){
+    fprintf(stderr, "The camera switched formats, setting it up again\n");
+    v4l_reconfigure(dgt);
+    return 0;
+  }
+  if(v4l->cpu)
+    return cpu_texture_update(dgt, v4l);
+  return engine_i_capture_bind(dgt, v4l->stream);
+}
+
+// The compositor let go of a buffer it showed directly
+static void v4l_texture_release(struct dma_gl_texture* dgt, unsigned index){
+  struct v4l_texture* v4l = dgt->update_param.vptr;
+  engine_i_capture_release_unfenced(dgt->engine, v4l->stream, index);
+}
+
+static void v4l_set_roi(struct dma_gl_texture* dgt, const float roi[4], float done[4]){
+  struct v4l_texture* v4l = dgt->update_param.vptr;
+  if(!v4l->failed)
+    stream_set_roi(v4l->stream, roi, done);
+}
+
+static void v4l_texture_destroy(struct dma_gl_texture* dgt){
+  struct v4l_texture* v4l = dgt->update_param.vptr;
+  struct capture_stream* stream = v4l->stream;
+  engine_i_capture_remove(dgt->engine, stream);
+  engine_i_broker_destroy(stream->broker);
+  for(unsigned i=0; i<stream->count; i++)
+    if(stream->dmabuf[i] != -1)
+      close(stream->dmabuf[i]);
+  close(stream->fd);
+  free(stream);
+  if(v4l->cpu){
+    cpu_texture_free(v4l->cpu);
+    dgt->texture = 0; // Belonged to the upload
+  }
+  free(v4l->broker);
+  free(v4l);
+}
+
+int engine_v4l_texture_set_format(struct dma_gl_texture* dgt, unsigned width, unsigned height, float fps){
+  if(dgt->update_callback != v4l_texture_update){
+    fprintf(stderr, "engine_v4l_texture_set_format: not a camera texture\n");
+    return -1;
+  }
+  struct v4l_texture* v4l = dgt->update_param.vptr;
+  v4l->params.width = width;
+  v4l->params.height = height;
+  v4l->params.fps = fps;
+  return v4l_reconfigure(dgt);
+}
+
+struct dma_gl_texture* engine_v4l_texture_create(struct engine* engine, struct engine_v4l_texture_create_params params){
+  if(!strncmp(params.device, "broker:", 7))
+    return engine_i_broker_texture_create(engine, params.device + 7);
+
+  struct v4l_texture* v4l = calloc(1, sizeof(*v4l));
+  if(!v4l){
+    perror("calloc failed");
+    goto error;
+  }
+  v4l->params = params;
+  v4l->params.device = 0;
+  v4l->params.broker = 0;
+  if(params.broker){
+    v4l->broker = strdup(params.broker);
+    if(!v4l->broker){
+      perror("strdup failed");
+      goto error_after_calloc;
+    }
+  }
+
+  v4l->stream = calloc(1, sizeof(*v4l->stream));
+  if(!v4l->stream){
+    perror("calloc failed");
+    goto error_after_calloc;
+  }
+  struct capture_stream* stream = v4l->stream;
+
+  stream->fd = open_device(params.device);
+  if(stream->fd == -1){
+    fprintf(stderr,"failed to open v4l device\n");
+    goto error_after_calloc;
+  }
+
+  // Decoders & HDMI receivers switch formats on their own, the capture thread watches for it
+  struct v4l2_event_subscription sub;
+  memset(&sub, 0, sizeof(sub));
+  sub.type = V4L2_EVENT_SOURCE_CHANGE;
+  stream->events = ioctl(stream->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == 0;
+
+  struct dma_gl_texture* result = v4l_start(engine, v4l, 0);
+  if(!result)
+    goto error_after_open;
+
+  result->update_callback = v4l_texture_update;
+  result->destroy_callback = v4l_texture_destroy;
+  result->roi_callback = v4l_set_roi;
+  result->release_callback = v4l_texture_release;
+  result->update_param.vptr = v4l;
+
+  return result;
+
+error_after_open:
+  close(stream->fd);
+error_after_calloc:
+  free(v4l->stream);
+  free(v4l->broker);
+  free(v4l);
+error:
+  return 0;
+}
@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200809L
+#include <linux/dma-buf.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <export_protocol.h>
+#include <ipc.h>
+
+/*
+ * Test consumer for frames exported by the engine. Maps the dmabufs, waits for each frames fence, checks the
+ * frame is the solid colour tools/export_test.c draws & releases it again. Exits with 0 once enough frames passed.
+ * A new set of buffers, after the engine was resized, replaces the mapped ones.
+ *   bin/export_consumer <socket> --frames=60 --timeout=5
+ */
+
+#define FOURCC(A,B,C,D) ((uint32_t)(A) | ((uint32_t)(B) << 8) | ((uint32_t)(C) << 16) | ((uint32_t)(D) << 24))
+
+struct mapping {
+  void* mem;
+  size_t size;
+  int fd;
+};
+
+static int connect_socket(const char* path, unsigned timeout){
+  // The engine may not be up yet
+  for(unsigned i=0; i<timeout*10; i++){
+    int fd = engine_ipc_connect(path);
+    if(fd != -1)
+      return fd;
+    if(errno != ENOENT && errno != ECONNREFUSED)
+      break;
+    nanosleep(&(struct timespec){ .tv_nsec = 100000000 }, 0);
+  }
+  fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+  return -1;
+}
+
+// Returns the pixel as 0xRRGGBB, or -1 if the format isn't understood
+static long read_pixel(const struct engine_export_message* buffer, const struct mapping* map, unsigned x, unsigned y){
+  const uint8_t* p = (const uint8_t*)map->mem + buffer->offset[0] + (size_t)y * buffer->pitch[0] + x * 4;
+  switch(buffer->fourcc){
+    case FOURCC('A','B','2','4'): case FOURCC('X','B','2','4'): return (long)p[0] << 16 | p[1] << 8 | p[2];
+    case FOURCC('A','R','2','4'): case FOURCC('X','R','2','4'): return (long)p[2] << 16 | p[1] << 8 | p[0];
+  }
+  return -1;
+}
+
+static int check_frame(const struct engine_export_message* buffer, const struct mapping* map, long* last){
+  if(buffer->modifier != 0 && buffer->modifier != 0x00ffffffffffffffull)
+    return 0; // Tiled, can't look at the pixels from the CPU
+  struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+  ioctl(map->fd, DMA_BUF_IOCTL_SYNC, &sync);
+  long pixel[] = {
+    read_pixel(buffer, map, 0, 0),
+    read_pixel(buffer, map, buffer->width - 1, 0),
+    read_pixel(buffer, map, buffer->width / 2, buffer->height / 2),
+    read_pixel(buffer, map, buffer->width - 1, buffer->height - 1),
+  };
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+  ioctl(map->fd, DMA_BUF_IOCTL_SYNC, &sync);
+  if(pixel[0] == -1)
+    return 0; // Unknown format, only the protocol is checked
+  for(size_t i=1; i<sizeof(pixel)/sizeof(*pixel); i++){
+    if(pixel[i] != pixel[0]){
+      fprintf(stderr, "frame isn't a solid colour: %06lx != %06lx\n", pixel[i], pixel[0]);
+      return -1;
+    }
+  }
+  if((pixel[0] & 0xFF) != 0x80){
+    fprintf(stderr, "unexpected colour %06lx\n", pixel[0]);
+    return -1;
+  }
+  if(pixel[0] == *last){
+    fprintf(stderr, "frame didn't change: %06lx\n", pixel[0]);
+    return -1;
+  }
+  *last = pixel[0];
+  return 0;
+}
+
+int main(int argc, char* argv[]){
+  const char* path = 0;
+  unsigned frames = 60;
+  unsigned timeout = 5;
+  for(int i=1; i<argc; i++){
+    if(!strncmp(argv[i], "--frames=", 9)){
+      frames = atoi(argv[i] + 9);
+    }else if(!strncmp(argv[i], "--timeout=", 10)){
+      timeout = atoi(argv[i] + 10);
+    }else if(!path && argv[i][0] != '-'){
+      path = argv[i];
+    }else{
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if(!path){
+    fprintf(stderr, "usage: %s <socket> [--frames=60] [--timeout=5]\n", argv[0]);
+    return 1;
+  }
+
+  int fd = connect_socket(path, timeout);
+  if(fd == -1)
+    return 1;
+
+  int ret = 1;
+  unsigned count = 0, received = 0, sets = 0;
+  uint32_t generation = 0;
+  struct engine_export_message buffer[32];
+  struct mapping map[32];
+  long last = -1;
+  while(received < frames){
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if(poll(&pfd, 1, timeout * 1000) != 1){
+      fprintf(stderr, "timed out waiting for a frame\n");
+      goto done;
+    }
+    struct engine_export_message message;
+    int fds[ENGINE_IPC_MAX_FDS];
+    unsigned fd_count = ENGINE_IPC_MAX_FDS;
+    ssize_t size = engine_ipc_recv(fd, &message, sizeof(message), fds, &fd_count, 0);
+    if(size <= 0){
+      fprintf(stderr, "engine hung up\n");
+      goto done;
+    }
+    if((size_t)size != sizeof(message) || message.version != ENGINE_EXPORT_PROTOCOL_VERSION){
+      fprintf(stderr, "unexpected message\n");
+      goto done;
+    }
+
+    if(message.type == ENGINE_EXPORT_BUFFER){
+      if(count && message.generation != generation){
+        for(unsigned i=0; i<count; i++){
+          munmap(map[i].mem, map[i].size);
+          close(map[i].fd);
+        }
+        count = 0;
+      }
+      if(!count){
+        generation = message.generation;
+        sets++;
+      }
+      if(message.buffer != count || count >= sizeof(buffer)/sizeof(*buffer) || fd_count != message.plane_count || !fd_count){
+        fprintf(stderr, "invalid buffer description\n");
+        goto done;
+      }
+      for(unsigned i=1; i<fd_count; i++)
+        close(fds[i]);
+      buffer[count] = message;
+      map[count].fd = fds[0];
+      map[count].size = message.offset[0] + (size_t)message.pitch[0] * message.height;
+      map[count].mem = mmap(0, map[count].size, PROT_READ, MAP_SHARED, fds[0], 0);
+      if(map[count].mem == MAP_FAILED){
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        close(fds[0]);
+        goto done;
+      }
+      count++;
+      continue;
+    }
+
+    if(message.type != ENGINE_EXPORT_FRAME || message.buffer >= count || message.generation != generation){
+      fprintf(stderr, "unexpected message type %u for buffer %u of generation %u\n", message.type, message.buffer, (unsigned)message.generation);
+      goto done;
+    }
+    if(message.has_fence){
+      if(fd_count != 1){
+        fprintf(stderr, "fence missing\n");
+        goto done;
+      }
+      struct pollfd fence = { .fd = fds[0], .events = POLLIN };
+      poll(&fence, 1, -1);
+      close(fds[0]);
+    }
+    if(check_frame(&buffer[message.buffer], &map[message.buffer], &last) == -1)
+      goto done;
+    received++;
+    message.type = ENGINE_EXPORT_RELEASE;
+    if(engine_ipc_send(fd, &message, sizeof(message), 0, 0) == -1){
+      perror("sending release failed");
+      goto done;
+    }
+  }
+
+  printf("export-test: received %u frames in %u buffers, %u sets", received, count, sets);
+  if(count)
+    printf(", format %.4s, modifier 0x%016llx", (const char*)&buffer[0].fourcc, (unsigned long long)buffer[0].modifier);
+  printf("\n");
+  ret = 0;
+done:
+  for(unsigned i=0; i<count; i++){
+    munmap(map[i].mem, map[i].size);
+    close(map[i].fd);
+  }
+  close(fd);
+  return ret;
+}
@@ -0,0 +1,42 @@
+#include <engine.h>
+#include <internal/engine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Producer side of the export test. Fills every frame with a solid colour which changes each frame,
+ * the blue channel is always 0x80 so tools/export_consumer.c can recognise it.
+ *   ENGINE_EXPORT=<socket> bin/export_test --frames=1000
+ */
+
+#define EXPORT_TEST_SKIPPED 77
+
+static unsigned frames = 1000;
+static unsigned frame;
+
+int engine_init(struct engine* engine, int argc, char* argv[]){
+  for(int i=1; i<argc; i++){
+    if(!strncmp(argv[i], "--frames=", 9)){
+      frames = atoi(argv[i] + 9);
+    }else{
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if(!engine->export){
+    fprintf(stderr, "exporting isn't available\n");
+    exit(EXPORT_TEST_SKIPPED);
+  }
+  return 0;
+}
+
+bool engine_main_loop(struct engine* engine){
+  engine_gl_clear_color(engine, (frame * 37 % 256) / 255.0f, (frame * 101 % 256) / 255.0f, 0x80 / 255.0f, 1);
+  glClear(GL_COLOR_BUFFER_BIT);
+  return ++frame < frames;
+}
+
+void engine_cleanup(struct engine* engine){
+  (void)engine;
+}
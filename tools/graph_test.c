@@ -0,0 +1,156 @@
+#include <engine.h>
+#include <GLES3/gl3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Runs a render graph headless & checks it only renders what changed & what an output needs, and that
+ * render targets are shared within a run & reused across runs. Linked with --wrap for glGenFramebuffers
+ * & glDrawArrays, which are counted.
+ *   ENGINE_DISPLAY_DRIVER=headless bin/graph_test --runs=100
+ *
+ * fill -> half -> quarter -> output, each pass after fill halves its input. unused reads fill, but nothing reads it.
+ */
+
+#define SIZE 64
+
+void __real_glGenFramebuffers(GLsizei n, GLuint* framebuffers);
+void __real_glDrawArrays(GLenum mode, GLint first, GLsizei count);
+
+static unsigned framebuffers_created, draws, render_targets;
+
+void __wrap_glGenFramebuffers(GLsizei n, GLuint* framebuffers){
+  framebuffers_created += n;
+  __real_glGenFramebuffers(n, framebuffers);
+}
+
+void __wrap_glDrawArrays(GLenum mode, GLint first, GLsizei count){
+  draws++;
+  __real_glDrawArrays(mode, first, count);
+}
+
+static const GLfloat half[4] = { 0.5f, 0.5f, 0.5f, 1 };
+
+static struct engine* engine;
+static struct shader fill_shader, scale_shader;
+static struct engine_graph* graph;
+static struct engine_graph_pass* fill;
+static struct engine_graph_pass* output;
+static GLfloat color[4];
+static GLuint readback; // Framebuffer the output is read from
+static unsigned runs = 100, run;
+
+static void prepare_fill(struct engine_graph_pass* pass, void* param){
+  (void)pass;
+  (void)param;
+  engine_gl_uniform4fv(engine, glGetUniformLocation(fill_shader.program, "scale"), color);
+}
+
+static void prepare_half(struct engine_graph_pass* pass, void* param){
+  (void)pass;
+  (void)param;
+  engine_gl_uniform4fv(engine, glGetUniformLocation(scale_shader.program, "scale"), half);
+}
+
+static struct engine_graph_pass* scale_pass_add(struct engine_graph_pass* input, bool is_output){
+  struct engine_graph_pass* pass = engine_graph_pass_add(graph, .shader = &scale_shader, .output = is_output, .prepare = prepare_half);
+  if(!pass || engine_graph_pass_add_pass_input(pass, "source", input) == -1)
+    return 0;
+  return pass;
+}
+
+int engine_init(struct engine* e, int argc, char* argv[]){
+  engine = e;
+  for(int i=1; i<argc; i++){
+    if(!strncmp(argv[i], "--runs=", 7)){
+      runs = atoi(argv[i] + 7);
+    }else{
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if(engine_load_create_shader_program(&fill_shader,
+    .vertex_shader = "shader/graph_pass.vs",
+    .fragment_shader = "shader/graph_test.fs",
+    .defines = "#define FILL\n"
+  ) == -1 || engine_load_create_shader_program(&scale_shader,
+    .vertex_shader = "shader/graph_pass.vs",
+    .fragment_shader = "shader/graph_test.fs"
+  ) == -1){
+    fprintf(stderr, "engine_load_create_shader_program failed\n");
+    return -1;
+  }
+  graph = engine_graph_create(engine);
+  if(!graph)
+    return -1;
+  fill = engine_graph_pass_add(graph, .shader = &fill_shader, .width = SIZE, .height = SIZE, .prepare = prepare_fill);
+  if(!fill)
+    return -1;
+  struct engine_graph_pass* quarter = scale_pass_add(scale_pass_add(fill, false), false);
+  if(!quarter || !scale_pass_add(fill, false))
+    return -1;
+  output = scale_pass_add(quarter, true);
+  if(!output)
+    return -1;
+  __real_glGenFramebuffers(1, &readback);
+  return 0;
+}
+
+static void check(bool ok, const char* what){
+  if(ok)
+    return;
+  fprintf(stderr, "graph-test: run %u: %s\n", run, what);
+  exit(1);
+}
+
+// The output is the fill color divided by 8, within rounding
+static void check_output(void){
+  GLint framebuffer;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, readback);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, engine_graph_pass_get_texture(output), 0);
+  unsigned char pixel[4];
+  glReadPixels(SIZE / 2, SIZE / 2, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixel);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  for(int i=0; i<3; i++){
+    int expected = color[i] / 8 * 255 + 0.5f;
+    if(abs(pixel[i] - expected) > 2){
+      fprintf(stderr, "graph-test: run %u: channel %d is %u instead of %d\n", run, i, pixel[i], expected);
+      exit(1);
+    }
+  }
+}
+
+bool engine_main_loop(struct engine* e){
+  (void)e;
+  // Every other run changes the fill color, the others change nothing
+  bool change = !(run % 2);
+  if(change){
+    color[0] = (run % 7 + 1) / 8.0f;
+    color[1] = (run % 5 + 1) / 6.0f;
+    color[2] = (run % 3 + 1) / 4.0f;
+    color[3] = 1;
+    engine_graph_pass_invalidate(fill);
+  }
+  framebuffers_created = draws = 0;
+  check(engine_graph_run(graph) == 0, "engine_graph_run failed");
+  // At most 2 results are needed at once, fill's target is free again once half is rendered. The output keeps
+  // its target between runs though, so from the second change on, the passes before it need 2 others.
+  render_targets += framebuffers_created;
+  check(render_targets <= (run < 2 ? 2u : 3u), run < 2 ? "intermediate results didn't share render targets" : "render targets weren't reused");
+  check(draws == (change ? 4u : 0u), change ? "not just the passes leading to the output were rendered" : "unchanged passes were rendered");
+  check_output();
+  if(++run < runs)
+    return true;
+  printf("graph-test: %u runs ok\n", run);
+  return false;
+}
+
+void engine_cleanup(struct engine* e){
+  (void)e;
+  glDeleteFramebuffers(1, &readback);
+  engine_graph_destroy(graph);
+  engine_gl_delete_program(engine, fill_shader.program);
+  engine_gl_delete_program(engine, scale_shader.program);
+}
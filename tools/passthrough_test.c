@@ -0,0 +1,73 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <engine.h>
+#include <internal/engine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../bench/fake_producer.h"
+
+/*
+ * Shows a fake camera with engine_passthrough & checks the display driver showed the frames without drawing,
+ * and that the compositor gave the buffers back. Needs a compositor, see the wayland-test make target.
+ *   ENGINE_DISPLAY_DRIVER=wayland bin/passthrough_test --frames=300
+ */
+
+#define PASSTHROUGH_TEST_SKIPPED 77
+
+static unsigned frames = 300;
+static unsigned frame;
+static struct fake_producer producer;
+static struct dma_gl_texture* texture;
+
+int engine_init(struct engine* engine, int argc, char* argv[]){
+  for(int i=1; i<argc; i++){
+    if(!strncmp(argv[i], "--frames=", 9)){
+      frames = atoi(argv[i] + 9);
+    }else{
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if(!engine->driver->present){
+    fprintf(stderr, "the %s display driver can't show buffers directly\n", engine->driver->name);
+    exit(PASSTHROUGH_TEST_SKIPPED);
+  }
+  const char* reason = 0;
+  if(fake_producer_init(&producer, ENGINE_FOURCC('X','R','2','4'), 640, 480, 4, &reason) == -1){
+    fprintf(stderr, "no dmabufs: %s\n", reason);
+    exit(PASSTHROUGH_TEST_SKIPPED);
+  }
+  texture = fake_producer_texture_create(engine, &producer);
+  if(!texture){
+    fprintf(stderr, "fake_producer_texture_create failed\n");
+    return -1;
+  }
+  if(!texture->display_buffer[0]){
+    fprintf(stderr, "the compositor can't import XR24 dmabufs\n");
+    exit(PASSTHROUGH_TEST_SKIPPED);
+  }
+  engine_redraw_policy_set(engine, ENGINE_REDRAW_ON_CHANGE);
+  return 0;
+}
+
+bool engine_main_loop(struct engine* engine){
+  fake_producer_frame(&producer);
+  engine_passthrough(engine, texture, -1, -1, 2, 2);
+  nanosleep(&(struct timespec){ .tv_nsec = 2000000 }, 0); // Give the compositor time to let go of buffers, nothing else throttles the loop
+  if(++frame < frames)
+    return true;
+
+  // More frames than buffers means the held ones came back from the compositor
+  printf("%u frames, %u published, %llu shown directly\n", frame, producer.sequence, (unsigned long long)engine->direct_frames);
+  if(!engine->direct_frames || producer.sequence <= 2 * producer.count){
+    fprintf(stderr, "passthrough-test: failed\n");
+    exit(1);
+  }
+  return false;
+}
+
+void engine_cleanup(struct engine* engine){
+  (void)engine;
+  fake_producer_destroy(&producer);
+}
@@ -0,0 +1,146 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <engine.h>
+#include <GLES3/gl3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../bench/fake_v4l2.h"
+
+/*
+ * Sets a region of interest on an emulated camera & checks what's drawn is that part of the frame.
+ * The emulated camera can't crop, so the texture coordinates have to. Needs no camera & no display.
+ *   ENGINE_DISPLAY_DRIVER=headless bin/roi_test
+ */
+
+#define WIDTH 256
+#define HEIGHT 64
+#define TIMEOUT_NS 5000000000u
+
+static const float roi[4] = { 0.25f, 0.25f, 0.5f, 0.5f };
+
+static struct dma_gl_texture* camera;
+static struct engine_quad_batch* batch;
+static GLuint texture, framebuffer;
+static uint64_t start_ns;
+static unsigned char full[HEIGHT][WIDTH][4], cropped[HEIGHT][WIDTH][4];
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void fail(const char* what){
+  fprintf(stderr, "roi-test: %s\n", what);
+  exit(1);
+}
+
+int engine_init(struct engine* engine, int argc, char* argv[]){
+  (void)argv;
+  if(argc > 1){
+    fprintf(stderr, "roi_test takes no options\n");
+    return -1;
+  }
+  const char* reason = 0;
+  int fd = fake_v4l2_open(ENGINE_FOURCC('Y','U','Y','V'), WIDTH, HEIGHT, &reason);
+  if(fd == -1){
+    fprintf(stderr, "fake_v4l2_open failed: %s\n", reason);
+    return -1;
+  }
+  char device[32];
+  snprintf(device, sizeof(device), "fd:%d", fd);
+  camera = engine_v4l_texture_create(engine, .device = device);
+  if(!camera){
+    fprintf(stderr, "engine_v4l_texture_create failed\n");
+    return -1;
+  }
+  // Updated by hand, so the frame can't change between the draws which are compared
+  engine_dma_texture_pause(camera);
+  batch = engine_quad_batch_create(engine);
+  if(!batch){
+    fprintf(stderr, "engine_quad_batch_create failed\n");
+    return -1;
+  }
+  glGenTextures(1, &texture);
+  engine_gl_bind_texture(engine, 0, GL_TEXTURE_2D, texture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, WIDTH, HEIGHT);
+  engine_gl_bind_texture(engine, 0, GL_TEXTURE_2D, 0);
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if(status != GL_FRAMEBUFFER_COMPLETE){
+    fprintf(stderr, "Failed to create the render target\n");
+    return -1;
+  }
+  fake_v4l2_frame();
+  start_ns = now_ns();
+  return 0;
+}
+
+// Draws the camera over the whole render target, one texel per pixel without a region of interest
+static void draw(unsigned char pixels[HEIGHT][WIDTH][4]){
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glViewport(0, 0, WIDTH, HEIGHT);
+  engine_quad_batch_add(batch, .texture = camera, .x = -1, .y = -1, .width = 2, .height = 2);
+  engine_quad_batch_flush(batch);
+  glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// The region of interest is centered, so which way around the frame is drawn doesn't matter
+static void compare(void){
+  for(unsigned y=0; y<HEIGHT; y+=8){
+    for(unsigned x=0; x<WIDTH; x+=16){
+      const unsigned char* expected = full[HEIGHT / 4 + y / 2][WIDTH / 4 + x / 2];
+      for(int i=0; i<3; i++){
+        if(abs(cropped[y][x][i] - expected[i]) > 3){
+          fprintf(stderr, "roi-test: pixel %u,%u is %u instead of %u\n", x, y, cropped[y][x][i], expected[i]);
+          exit(1);
+        }
+      }
+    }
+  }
+}
+
+bool engine_main_loop(struct engine* engine){
+  (void)engine;
+  // The frame comes through the capture thread
+  if(engine_dma_texture_update(camera) <= 0){
+    if(now_ns() - start_ns > TIMEOUT_NS)
+      fail("no frame arrived");
+    return true;
+  }
+  draw(full);
+
+  if(engine_dma_texture_set_roi(camera, 0.8f, 0, 0.5f, 1) != -1)
+    fail("a region of interest outside the frame was accepted");
+  if(engine_dma_texture_set_roi(camera, roi[0], roi[1], roi[2], roi[3]) == -1)
+    fail("engine_dma_texture_set_roi failed");
+  float crop[4];
+  engine_dma_texture_get_crop(camera, crop);
+  for(int i=0; i<4; i++)
+    if(crop[i] < roi[i] - 1e-4f || crop[i] > roi[i] + 1e-4f)
+      fail("the texture coordinates don't crop to the region of interest");
+  draw(cropped);
+  compare();
+
+  if(engine_dma_texture_set_roi(camera, 0, 0, 1, 1) == -1)
+    fail("resetting the region of interest failed");
+  draw(cropped);
+  if(memcmp(full, cropped, sizeof(full)))
+    fail("the full frame isn't drawn the same after resetting the region of interest");
+  printf("roi-test: ok\n");
+  return false;
+}
+
+void engine_cleanup(struct engine* engine){
+  glDeleteFramebuffers(1, &framebuffer);
+  engine_gl_delete_textures(engine, 1, &texture);
+  engine_quad_batch_destroy(batch);
+  // Not left to the engine, the device has to outlive it
+  engine_dma_texture_destroy(camera);
+  fake_v4l2_destroy();
+}
@@ -0,0 +1,221 @@
+#define _POSIX_C_SOURCE 200809L
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <stats_protocol.h>
+#include <internal/histogram.h>
+
+/*
+ * Shows the statistics of an engine started with ENGINE_STATS=<name> live, once per interval.
+ * Rates & percentiles are over the last interval, totals since the texture was created.
+ *   bin/stats_reader <name> --interval=1 --count=0
+ */
+
+struct texture_copy {
+  uint32_t active, width, height;
+  uint64_t rebinds;
+  uint64_t frames, dropped, superseded, ioctls, ioctl_errors;
+};
+
+struct scope_copy {
+  char name[ENGINE_STATS_SCOPE_NAME];
+  uint64_t dropped;
+  struct histogram gpu_time;
+};
+
+struct copy {
+  uint64_t frames, direct_frames;
+  struct histogram frame_time, swap_time;
+  uint32_t gpu_timing;
+  uint64_t gl_calls, gl_calls_elided;
+  struct texture_copy texture[ENGINE_STATS_MAX_TEXTURES];
+  struct scope_copy scope[ENGINE_STATS_MAX_SCOPES];
+};
+
+// Waits for the writer to finish the block, returns the sequence number to check afterwards
+static uint32_t read_begin(_Atomic uint32_t* seq){
+  uint32_t value;
+  while((value = atomic_load_explicit(seq, memory_order_acquire)) & 1)
+    nanosleep(&(struct timespec){ .tv_nsec = 10000 }, 0);
+  return value;
+}
+
+static bool read_retry(_Atomic uint32_t* seq, uint32_t value){
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(seq, memory_order_relaxed) != value;
+}
+
+#define LOAD(X) atomic_load_explicit(&(X), memory_order_relaxed)
+
+static void read_histogram(struct engine_stats_histogram* from, struct histogram* to){
+  to->count = LOAD(from->count);
+  for(unsigned i=0; i<HISTOGRAM_BUCKETS; i++)
+    to->bucket[i] = LOAD(from->bucket[i]);
+}
+
+static void read_page(struct engine_stats_page* page, struct copy* copy){
+  uint32_t seq;
+  do {
+    seq = read_begin(&page->seq);
+    copy->frames = LOAD(page->frames);
+    copy->direct_frames = LOAD(page->direct_frames);
+    read_histogram(&page->frame_time, &copy->frame_time);
+    read_histogram(&page->swap_time, &copy->swap_time);
+    copy->gpu_timing = LOAD(page->gpu_timing);
+    copy->gl_calls = LOAD(page->gl_calls);
+    copy->gl_calls_elided = LOAD(page->gl_calls_elided);
+  } while(read_retry(&page->seq, seq));
+  for(unsigned i=0; i<ENGINE_STATS_MAX_TEXTURES; i++){
+    struct engine_stats_texture* from = &page->texture[i];
+    struct texture_copy* to = &copy->texture[i];
+    do {
+      seq = read_begin(&from->seq);
+      to->active = LOAD(from->active);
+      to->width = LOAD(from->width);
+      to->height = LOAD(from->height);
+      to->rebinds = LOAD(from->rebinds);
+    } while(read_retry(&from->seq, seq));
+    do {
+      seq = read_begin(&from->capture.seq);
+      to->frames = LOAD(from->capture.frames);
+      to->dropped = LOAD(from->capture.dropped);
+      to->superseded = LOAD(from->capture.superseded);
+      to->ioctls = LOAD(from->capture.ioctls);
+      to->ioctl_errors = LOAD(from->capture.ioctl_errors);
+    } while(read_retry(&from->capture.seq, seq));
+  }
+  for(unsigned i=0; i<ENGINE_STATS_MAX_SCOPES; i++){
+    struct engine_stats_scope* from = &page->scope[i];
+    struct scope_copy* to = &copy->scope[i];
+    do {
+      seq = read_begin(&from->seq);
+      memcpy(to->name, from->name, sizeof(to->name));
+      to->dropped = LOAD(from->dropped);
+      read_histogram(&from->gpu_time, &to->gpu_time);
+    } while(read_retry(&from->seq, seq));
+    to->name[sizeof(to->name) - 1] = 0;
+  }
+}
+
+static void print_histogram(const char* name, const struct histogram* now, const struct histogram* last){
+  uint32_t bucket[HISTOGRAM_BUCKETS];
+  for(unsigned i=0; i<HISTOGRAM_BUCKETS; i++)
+    bucket[i] = now->bucket[i] - last->bucket[i];
+  uint64_t count = now->count - last->count;
+  printf("  %s p50/p99 %.2f/%.2f ms", name,
+    histogram_percentile(bucket, count, 0.5) / 1000.0,
+    histogram_percentile(bucket, count, 0.99) / 1000.0
+  );
+}
+
+static void report(const struct copy* now, const struct copy* last, double seconds){
+  printf("frames %.1f/s  direct %.1f/s", (now->frames - last->frames) / seconds, (now->direct_frames - last->direct_frames) / seconds);
+  print_histogram("frame", &now->frame_time, &last->frame_time);
+  print_histogram("swap", &now->swap_time, &last->swap_time);
+  printf("  gl state changes %.1f/s  skipped %.1f/s", (now->gl_calls - last->gl_calls) / seconds,
+    (now->gl_calls_elided - last->gl_calls_elided) / seconds);
+  printf("\n");
+  static const struct texture_copy none;
+  for(unsigned i=0; i<ENGINE_STATS_MAX_TEXTURES; i++){
+    const struct texture_copy* t = &now->texture[i];
+    if(!(t->active & 1))
+      continue;
+    // A texture which took over the slot since the last report starts from 0
+    const struct texture_copy* l = last->texture[i].active == t->active ? &last->texture[i] : &none;
+    printf("  texture %u %ux%u: bound %.1f/s", i, t->width, t->height, (t->rebinds - l->rebinds) / seconds);
+    if(t->frames)
+      printf("  received %.1f/s  dropped %llu (%llu total)  superseded %.1f/s  ioctls %.1f/s  errors %llu",
+        (t->frames - l->frames) / seconds,
+        (unsigned long long)(t->dropped - l->dropped), (unsigned long long)t->dropped,
+        (t->superseded - l->superseded) / seconds,
+        (t->ioctls - l->ioctls) / seconds,
+        (unsigned long long)t->ioctl_errors
+      );
+    printf("\n");
+  }
+  static const char* const timing[] = {
+    [ENGINE_STATS_GPU_TIMING_NONE] = "not measured",
+    [ENGINE_STATS_GPU_TIMING_TIMER_QUERY] = "timer queries",
+    [ENGINE_STATS_GPU_TIMING_FENCE] = "fences",
+  };
+  for(unsigned i=0; i<ENGINE_STATS_MAX_SCOPES; i++){
+    const struct scope_copy* s = &now->scope[i];
+    if(!*s->name)
+      continue;
+    printf("  scope %s: measured %.1f/s", s->name, (s->gpu_time.count - last->scope[i].gpu_time.count) / seconds);
+    print_histogram("gpu", &s->gpu_time, &last->scope[i].gpu_time);
+    printf("  dropped %llu (%s)\n", (unsigned long long)(s->dropped - last->scope[i].dropped),
+      now->gpu_timing < sizeof(timing) / sizeof(*timing) ? timing[now->gpu_timing] : "unknown");
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]){
+  const char* name = 0;
+  double interval = 1;
+  unsigned count = 0;
+  for(int i=1; i<argc; i++){
+    if(!strncmp(argv[i], "--interval=", 11)){
+      interval = atof(argv[i] + 11);
+    }else if(!strncmp(argv[i], "--count=", 8)){
+      count = atoi(argv[i] + 8);
+    }else if(!name && argv[i][0] != '-'){
+      name = argv[i];
+    }else{
+      name = 0;
+      break;
+    }
+  }
+  if(!name || interval <= 0){
+    fprintf(stderr, "usage: %s <name> [--interval=<seconds>] [--count=<reports, 0 for no limit>]\n", argv[0]);
+    return 1;
+  }
+
+  char path[256];
+  snprintf(path, sizeof(path), "/%s", name + (*name == '/'));
+  int fd = shm_open(path, O_RDONLY, 0);
+  if(fd == -1){
+    fprintf(stderr, "Failed to open /dev/shm%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct engine_stats_page)){
+    fprintf(stderr, "/dev/shm%s isn't a statistics page\n", path);
+    close(fd);
+    return 1;
+  }
+  struct engine_stats_page* page = mmap(0, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(page == MAP_FAILED){
+    perror("mmap");
+    return 1;
+  }
+  if(atomic_load_explicit(&page->magic, memory_order_acquire) != ENGINE_STATS_MAGIC
+   || page->version != ENGINE_STATS_VERSION || page->size != sizeof(*page)){
+    fprintf(stderr, "/dev/shm%s has an unknown layout\n", path);
+    return 1;
+  }
+
+  static struct copy copy[2];
+  unsigned current = 0;
+  read_page(page, &copy[current]);
+  for(unsigned n=0; !count || n<count; n++){
+    nanosleep(&(struct timespec){ .tv_sec = interval, .tv_nsec = (interval - (time_t)interval) * 1e9 }, 0);
+    current ^= 1;
+    read_page(page, &copy[current]);
+    report(&copy[current], &copy[current ^ 1], interval);
+    if(kill(page->pid, 0) == -1 && errno == ESRCH){
+      printf("the engine exited\n");
+      break;
+    }
+  }
+  return 0;
+}